@@ -5,7 +5,11 @@
 
 #include "Engine/World.h"
 #include "EngineUtils.h"
+#include "Misc/CommandLine.h"
+#include "Misc/Parse.h"
+#include "Misc/Paths.h"
 #include "GlobalIncludes.h"
+#include "ReplayReport.h"
 
 // Sets default values
 ABall::ABall()
@@ -49,6 +53,22 @@ void ABall::BeginPlay()
 		}
 	}
 	
+	TagDetectionService::Shared().Start();
+	TagDetectionService::Shared().SetCpuBudget(tag_cpu_budget);
+
+	for (ATrackingCamera* camera : tracking_cameras)
+	{
+		if (camera && camera->ReplayPath() != "")
+		{
+			FString golden = replay_golden;
+			FParse::Value(FCommandLine::Get(), TEXT("ReplayGolden="), golden);
+
+			FString output = FPaths::ProjectSavedDir() / TEXT("Replay") / FDateTime::Now().ToString() + TEXT(".csv");
+			ReplayReport::Shared().Start(output, golden, replay_tolerance);
+			break;
+		}
+	}
+
 	manager = new CameraManager(this);
 }
 
@@ -59,8 +79,9 @@ void ABall::Tick(float DeltaTime)
 
 	if (!position_overridden)
 	{
-		if (!position.ContainsNaN())
-			SetActorLocation(position);
+		FVector current_position = position.load();
+		if (!current_position.ContainsNaN())
+			SetActorLocation(current_position);
 	}
 	else
 	{
@@ -69,6 +90,15 @@ void ABall::Tick(float DeltaTime)
 	}
 
 	manager->DrawBallHistory();
+
+	if (manager->ReplayFinished() && ReplayReport::Shared().IsActive())
+	{
+		bool passed = ReplayReport::Shared().Finish();
+
+		// started headless from the command line, the exit code tells whether the replay matched the golden output
+		if (ATrackingCamera::ReplayDirectory() != "")
+			FPlatformMisc::RequestExitWithStatus(false, passed ? 0 : 1);
+	}
 }
 
 void ABall::BeginDestroy()
@@ -78,6 +108,12 @@ void ABall::BeginDestroy()
 	if (manager)
 		delete manager;
 
+	// the camera threads are gone, finish the tag detections they left while the cameras are still around
+	TagDetectionService::Shared().Shutdown();
+
+	// a replay that was stopped early still reports what it got through
+	ReplayReport::Shared().Finish();
+
 	LogWarning(TEXT("Ball is done being destroyed"));
 
 	Super::BeginDestroy();
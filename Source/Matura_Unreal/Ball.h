@@ -9,6 +9,7 @@
 #include "GameFramework/Actor.h"
 
 #include "EventPasser.h"
+#include "SeqLock.h"
 
 #include "Ball.generated.h"
 
@@ -20,7 +21,7 @@ class MATURA_UNREAL_API ABall : public AActor
 public:	
 	// Sets default values for this actor's properties
 	ABall();
-	FVector position = FVector(0, 0, 0);
+	SeqLock<FVector> position{FVector(0, 0, 0)}; // written by the fusion thread
 	FVector overridden_position = FVector(0, 0, 0);
 	EventPasser<ParabPath> tracking_path = {false};
 	bool started = false;
@@ -61,4 +62,16 @@ public:
 	
 	UPROPERTY(EditAnywhere, meta=(EditCondition="!autodetect_cameras", EditConditionHides))
 	TArray<ATrackingCamera*> tracking_cameras;
+
+	// share of the cores the AprilTag detection of all cameras may use, the rest is kept for finding the ball
+	UPROPERTY(EditAnywhere, DisplayName="Tag Detection CPU Budget", meta=(UIMin = "0.05", UIMax = "1.0"))
+	double tag_cpu_budget = TagDetectionService::default_cpu_budget;
+
+	// when the cameras replay recordings, compare the paths with this output of an earlier replay from Saved/Replay
+	// (the intercepts are only reported), -ReplayGolden=<file> on the command line overrides it
+	UPROPERTY(EditAnywhere, Category = Replay)
+	FString replay_golden;
+
+	UPROPERTY(EditAnywhere, Category = Replay, DisplayName="Replay Tolerance (cm)")
+	double replay_tolerance = 1;
 };
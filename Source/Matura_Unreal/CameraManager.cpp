@@ -7,9 +7,9 @@
 #include <fstream>
 #include <chrono>
 #include <thread>
-#include <deque>
 
 #include "EventPasser.h"
+#include "ReplayReport.h"
 
 #include "GlobalIncludes.h"
 
@@ -39,35 +39,53 @@ void SwapRows(Mat& mat, int a, int b)
 	mat.row(b) = temp + 0;
 }
 
-Mat ConvertToCameraMatrix(FTransform transform)
+Matx34d ConvertToCameraMatrix(FTransform transform)
 {
 	const FVector translation = transform.GetTranslation();
 	auto rotation = transform.GetRotation().Euler();
 	rotation *= CV_PI / 180.; // convert to radians
 
-	Mat cv_translation = Mat(Vec3d(translation.Y, -translation.Z, translation.X));
+	Vec3d cv_translation(translation.Y, -translation.Z, translation.X);
 
-	Mat cv_rotation_matrix = Mat::eye(3, 3, CV_64F);
-	cv_rotation_matrix = (Mat_<double>(3, 3) << cos(rotation.X), -sin(rotation.X), 0, sin(rotation.X), cos(rotation.X),
+	Matx33d cv_rotation_matrix = Matx33d::eye();
+	cv_rotation_matrix = Matx33d(cos(rotation.X), -sin(rotation.X), 0, sin(rotation.X), cos(rotation.X),
 		0, 0, 0, 1) * cv_rotation_matrix;
-	cv_rotation_matrix = (Mat_<double>(3, 3) << 1, 0, 0, 0, cos(rotation.Y), -sin(rotation.Y), 0, sin(rotation.Y),
+	cv_rotation_matrix = Matx33d(1, 0, 0, 0, cos(rotation.Y), -sin(rotation.Y), 0, sin(rotation.Y),
 		cos(rotation.Y)) * cv_rotation_matrix;
-	cv_rotation_matrix = (Mat_<double>(3, 3) << cos(rotation.Z), 0, sin(rotation.Z), 0, 1, 0, -sin(rotation.Z), 0,
+	cv_rotation_matrix = Matx33d(cos(rotation.Z), 0, sin(rotation.Z), 0, 1, 0, -sin(rotation.Z), 0,
 		cos(rotation.Z)) * cv_rotation_matrix;
 
-	Mat RT;
-	hconcat(cv_rotation_matrix, cv_translation, RT);
+	// inverse of [R|t] is [R^T|-R^T t], R is a pure rotation
+	Matx33d inverse_rotation = cv_rotation_matrix.t();
+	Vec3d inverse_translation = -(inverse_rotation * cv_translation);
 
-	Mat floor = (Mat_<double>(1, 4) << 0, 0, 0, 1);
-	vconcat(RT, floor, RT);
-	RT = RT.inv();
+	return Matx34d(
+		inverse_rotation(0, 0), inverse_rotation(0, 1), inverse_rotation(0, 2), inverse_translation[0],
+		inverse_rotation(1, 0), inverse_rotation(1, 1), inverse_rotation(1, 2), inverse_translation[1],
+		inverse_rotation(2, 0), inverse_rotation(2, 1), inverse_rotation(2, 2), inverse_translation[2]);
+}
+
+// linear triangulation of one point seen by two cameras, same DLT system as cv::triangulatePoints but without any heap allocation
+Vec4d TriangulatePoint(const Matx34d& P1, const Matx34d& P2, Point2d a, Point2d b)
+{
+	Eigen::Matrix4d A;
+	for (int k = 0; k < 4; k++)
+	{
+		A(0, k) = a.x * P1(2, k) - P1(0, k);
+		A(1, k) = a.y * P1(2, k) - P1(1, k);
+		A(2, k) = b.x * P2(2, k) - P2(0, k);
+		A(3, k) = b.y * P2(2, k) - P2(1, k);
+	}
 
-	return RT.rowRange(0, 3);
+	Eigen::JacobiSVD<Eigen::Matrix4d> svd(A, Eigen::ComputeFullV);
+	Eigen::Vector4d X = svd.matrixV().col(3);
+
+	return {X[0], X[1], X[2], X[3]};
 }
 
 void CameraManager::CameraLoop(ATrackingCamera* camera, int camera_id)
 {
-	TFuture<std::pair<FTransform, std::map<ATag*, FMatrix>>> transform_future;
+	TFuture<TagDetectionService::Result> transform_future;
 	int64_t last_now = std::chrono::high_resolution_clock::now().time_since_epoch().count();
 
 
@@ -101,45 +119,68 @@ void CameraManager::CameraLoop(ATrackingCamera* camera, int camera_id)
 			return;
 		}
 
+		LatencyTrace trace;
+
 		double time = camera->SyncFrame() / 1000.;
+		if (camera->ReplayFinished())
+			break;
+		trace.Stamp(LatencyTrace::Grabbed);
+
 		camera->GetFrame();
+		trace.Stamp(LatencyTrace::Decoded);
 
 		Point2d ball_position = camera->FindBall();
+		trace.Stamp(LatencyTrace::Detected);
 
 		camera->last_frame_time = time;
 		
-		if (event_passer.push({ball_position, time, camera_id}))
+		// as fast as possible still means every frame reaches the fusion
+		if (camera->IsReplaying() && !camera->ReplayRealtime())
+			event_passer.wait_consumed(max_replay_wait);
+
+		if (event_passer.push({ball_position, time, camera_id, trace}))
 		{
 			LogWarning(TEXT("Dropped camera event on camera %s"), *camera->camera_path);
 		}
 
+		camera->RecordFrame(time);
+
 		camera->DrawDetectedTags();
 
 		if (transform_future.IsReady())
 		{
-			auto [camera_transform, local_tag_transforms] = transform_future.Get();
+			auto [camera_transform, static_tags, local_tag_transforms] = transform_future.Get();
 			if (!camera_transform.Equals(FTransform::Identity))
 			{
-				camera->next_update_time = last_now + static_cast<int64_t>(camera->UpdateTransform(camera_transform) * 1e9);
+				camera->next_update_time = last_now + static_cast<int64_t>(camera->UpdateTransform(camera_transform, static_tags) * 1e9);
+				camera->last_dynamic_tags.clear();
 				for (auto [tag, local_transform] : local_tag_transforms)
 				{
+					camera->last_dynamic_tags.push_back(tag);
 					FMatrix world_transform = (local_transform * FQuat::MakeFromEuler(FVector(0, 0, 90)).ToMatrix() *
 						FQuat::MakeFromEuler(FVector(0, 90, 0)).ToMatrix()) * camera->camera_transform.ToMatrixNoScale();
 					camera->next_update_time = min(camera->next_update_time,
-					                               last_now + static_cast<int64_t>(tag->UpdateTransform(FTransform(world_transform)) * tag->
-						                               update_rate * 1e9));
+					                               last_now + static_cast<int64_t>(tag->UpdateTransform(FTransform(world_transform)) * 1e9));
 				}
 			}
-			transform_future = TFuture<std::pair<FTransform, std::map<ATag*, FMatrix>>>();
+			transform_future = TFuture<TagDetectionService::Result>();
 		}
 
-		if (!transform_future.IsValid() && last_now >= camera->next_update_time)
-			transform_future = Async(EAsyncExecution::Thread, [camera] { return camera->UpdateTags(camera->cv_frame); });
+		if (!transform_future.IsValid() && last_now >= camera->next_update_time && (!camera->IsReplaying() || camera->replay_tags))
+			transform_future = camera->RequestTagUpdate();
 		last_now = std::chrono::high_resolution_clock::now().time_since_epoch().count();
 	}
 	if (transform_future.IsValid())
 		transform_future.Wait();
 
+	// the fusion is done once the last detection of the last recording went through it
+	if (camera->ReplayFinished() && ++finished_replays == num_replays)
+	{
+		LogDisplay(TEXT("Replay of %d cameras finished"), num_replays);
+		event_passer.wait_consumed(max_replay_wait);
+		event_passer.stop();
+	}
+
 	camera->in_use = false;
 
 	camera->destroy_lock.unlock();
@@ -157,7 +198,19 @@ uint32 CameraManager::Run()
 {
 	TArray<ATrackingCamera*> cameras = ball->tracking_cameras;
 
-	std::vector<std::deque<Detection>> ball_2d_detections(cameras.Num());
+	// everything the fusion needs is allocated up front, handling a detection doesn't touch the heap
+	std::vector<RingBuffer<Detection, max_detections>> ball_2d_detections(cameras.Num());
+	std::vector<Point2d> ball_points;
+	std::vector<Matx34d> projection_matrices(cameras.Num());
+	ball_points.reserve(cameras.Num());
+
+	bool replay_realtime = true;
+	for (ATrackingCamera* camera : cameras)
+		if (camera && camera->ReplayPath() != "")
+		{
+			num_replays++;
+			replay_realtime &= camera->ReplayRealtime();
+		}
 	
 	for (int i = 0; i < cameras.Num(); i++)
 		camera_threads.push_back(Async(EAsyncExecution::Thread, [&, i, cameras]
@@ -165,14 +218,26 @@ uint32 CameraManager::Run()
 			CameraLoop(cameras[i], i);
 		}));
 
+	ReplayReport& report = ReplayReport::Shared();
+
+	// a replay as fast as possible waits for the arm to plan from every path, in real time it keeps up like it does live
+	auto push_path = [&](const ParabPath& path)
+	{
+		if (num_replays > 0 && !replay_realtime && report.planner_running)
+			ball->tracking_path.wait_consumed(max_replay_wait);
+		ball->tracking_path.push(path);
+	};
+
 	Detection det;
 	while (event_passer.pop(&det))
 	{
 		auto time_before = std::chrono::high_resolution_clock::now();
 
+		report.AddStages(det.trace, LatencyTrace::Grabbed, LatencyTrace::Detected);
+
 		if (det.position == Point2d{-1, -1})
 		{
-			ball->tracking_path.push({});
+			push_path({});
 			ball->started = true;
 			continue;
 		}
@@ -183,7 +248,7 @@ uint32 CameraManager::Run()
 			ball_2d_detections[det.camera_id].front().time - ball_2d_detections[det.camera_id].back().time) > 0.1)
 			ball_2d_detections[det.camera_id].pop_front();
 
-		std::vector<Point2d> ball_points;
+		ball_points.clear();
 
 		double time = 1e20;
 
@@ -202,9 +267,8 @@ uint32 CameraManager::Run()
 				ball_points.push_back({-1, -1});
 			else
 			{
-				int j = 0;
-				while (j < ball_2d_detections[i].size() - 1 && ball_2d_detections[i][j].time <= time)
-					j++;
+				// first detection after time, or the newest one to extrapolate from
+				int j = min(ball_2d_detections[i].upper_bound(time), ball_2d_detections[i].size() - 1);
 
 				if (j == 0)
 				{
@@ -224,17 +288,9 @@ uint32 CameraManager::Run()
 			}
 		}
 		// compute triangulation of points
-		std::vector<Mat> projection_matrices;
-		for (ATrackingCamera* camera : cameras)
-		{
-			Mat RT = ConvertToCameraMatrix(camera->camera_transform);
-			Mat projection = camera->K() * RT;
-			projection_matrices.push_back(projection);
-		}
-
 		for (int i = 0; i < cameras.Num(); i++)
-			cameras[i]->used_ball = ball_points[i];
-		
+			projection_matrices[i] = cameras[i]->K() * ConvertToCameraMatrix(cameras[i]->camera_transform);
+
 		Vec4d average_position(0, 0, 0, 0);
 		double num = 0;
 
@@ -244,13 +300,10 @@ uint32 CameraManager::Run()
 				if (ball_points[i] == Point2d{-1, -1} || ball_points[j] == Point2d{-1, -1})
 					continue;
 
-				std::vector<Point2d> a{ball_points[i]}, b{ball_points[j]};
-				Vec4d position;
-				triangulatePoints(projection_matrices[i], projection_matrices[j], a, b, position);
+				Vec4d position = TriangulatePoint(projection_matrices[i], projection_matrices[j], ball_points[i], ball_points[j]);
 				position /= position[3];
 
-				Mat reprojection = projection_matrices[i] * position;
-				Vec3d reprojected_ball_point = Vec3d((double*)reprojection.data);
+				Vec3d reprojected_ball_point = projection_matrices[i] * position;
 				reprojected_ball_point /= reprojected_ball_point[2];
 
 				double error = pow(ball_points[i].x - reprojected_ball_point[0], 2) + pow(ball_points[i].y - reprojected_ball_point[1], 2);
@@ -266,7 +319,8 @@ uint32 CameraManager::Run()
 			average_position /= num;
 		else
 		{
-			ball->tracking_path.push({});
+			PublishSnapshot(ball_points);
+			push_path({});
 			ball->started = true;
 			continue;
 		}
@@ -282,13 +336,15 @@ uint32 CameraManager::Run()
 
 		if (num == 0)
 		{
-			ball->tracking_path.push({});
+			push_path({});
 			ball->started = true;
 			continue;
 		}
 
+		det.trace.Stamp(LatencyTrace::Fused);
+
 		FVector p(average_position.val[2], average_position.val[0], -average_position.val[1]);
-		ball->position = p;
+		ball->position.store(p);
 
 		ball_positions.push_back({p, time});
 
@@ -300,7 +356,7 @@ uint32 CameraManager::Run()
 			if (diff < 0.15)
 			{
 				ball_paths.push_back(tracking_path = ParabPath::fromNPoints(
-					std::vector(ball_positions.end() - min(++num_points_in_path, min(int(ball_positions.size()), 30)), ball_positions.end())));
+					ball_positions.last(min(++num_points_in_path, 30))));
 			}
 			else
 			{
@@ -366,7 +422,7 @@ uint32 CameraManager::Run()
 				}
 
 				ball_paths.clear();
-				ball_paths.push_back(tracking_path = ParabPath::fromNPoints({ball_positions.end() - 10, ball_positions.end()}));
+				ball_paths.push_back(tracking_path = ParabPath::fromNPoints(ball_positions.last(10)));
 
 				if (abs(tracking_path.derivative2() - ball->g) > 1500)
 					tracking_path = {};
@@ -379,7 +435,16 @@ uint32 CameraManager::Run()
 			tracking_path = {};
 		}
 
-		ball->tracking_path.push(tracking_path);
+		// the path is as old as the detection that completed it
+		tracking_path.trace = det.trace;
+		tracking_path.trace.Stamp(LatencyTrace::Fitted);
+
+		report.AddStages(tracking_path.trace, LatencyTrace::Fused, LatencyTrace::Fitted);
+		report.AddPath(tracking_path);
+
+		PublishSnapshot(ball_points);
+
+		push_path(tracking_path);
 		ball->started = true;
 
 		auto time_after = std::chrono::high_resolution_clock::now();
@@ -388,7 +453,11 @@ uint32 CameraManager::Run()
 	for (auto& f : camera_threads) // wait for all threads to stop
 		f.Wait();
 
+	if (num_replays > 0)
+		ball->tracking_path.wait_consumed(max_replay_wait);
 	ball->tracking_path.stop();
+
+	replay_finished = num_replays > 0 && finished_replays == num_replays;
 	
 	return 0;
 }
@@ -400,30 +469,52 @@ void CameraManager::Stop()
 	FRunnable::Stop();
 }
 
+void CameraManager::PublishSnapshot(const std::vector<Point2d>& used_balls)
+{
+	snapshot.write([&](TrackingSnapshot& s)
+	{
+		auto positions = ball_positions.last(TrackingSnapshot::max_positions);
+		s.num_positions = int(positions.size());
+		std::copy(positions.begin(), positions.end(), s.positions);
+
+		s.tracking_path = tracking_path;
+
+		s.num_cameras = min(int(used_balls.size()), TrackingSnapshot::max_cameras);
+		std::copy_n(used_balls.begin(), s.num_cameras, s.used_balls);
+	});
+}
+
 void CameraManager::DrawBallHistory()
 {
-	std::vector<ParabPath> paths;
+	// consistent copy of what the fusion thread published last, it never waits for us
+	snapshot.load(&draw_snapshot);
+
+	const TArray<ATrackingCamera*>& cameras = ball->tracking_cameras;
+	for (int i = 0; i < min(cameras.Num(), draw_snapshot.num_cameras); i++)
+		if (cameras[i])
+			cameras[i]->used_ball = draw_snapshot.used_balls[i];
 
-	auto positions = ball_positions; // make a copy of the data so the camera thread is not held up too much
+	const Position* positions = draw_snapshot.positions;
+	ParabPath& path = draw_snapshot.tracking_path;
 
-	if (positions.size() == 0)
+	if (draw_snapshot.num_positions == 0)
 		return;
 
 
-	for (int i = 0; i < int(positions.size()) - 1; i++)
+	for (int i = 0; i < draw_snapshot.num_positions - 1; i++)
 	{
 		DrawDebugLine(ball->GetWorld(), positions[i].position, positions[i + 1].position, FColor::Green, false, -1, 0, 10);
 	}
 
-	if (tracking_path.t0 != -1)
+	if (path.t0 != -1)
 	{
-		//tracking_path.Draw(ball->GetWorld(), color, 20, 1, -1);
+		//path.Draw(ball->GetWorld(), color, 20, 1, -1);
 
-		if (abs(tracking_path.derivative2() - ball->g) < 1500)
+		if (abs(path.derivative2() - ball->g) < 1500)
 		{
-			tracking_path.Draw(ball->GetWorld(), FColor::Blue, 20, 1, -1);
+			path.Draw(ball->GetWorld(), FColor::Blue, 20, 1, -1);
 
-			auto future_path = tracking_path + (tracking_path.t1 - tracking_path.t0);
+			auto future_path = path + (path.t1 - path.t0);
 			future_path.t1 = future_path.t0 + 1;
 
 			future_path.Draw(ball->GetWorld(), FColor::Red, 15, 1, -1);
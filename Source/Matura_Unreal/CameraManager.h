@@ -1,11 +1,14 @@
 // Fill out your copyright notice in the Description page of Project Settings.
 #pragma once
 
-#include <deque>
+#include <atomic>
 
 #include "Ball.h"
 #include "EventPasser.h"
+#include "LatencyTrace.h"
 #include "MatrixTypes.h"
+#include "RingBuffer.h"
+#include "SeqLock.h"
 #include "TrackingCamera.h"
 
 #include "ParabPath.h"
@@ -31,21 +34,50 @@ public:
 
 	void DrawBallHistory();
 
+	// all cameras replayed their recordings to the end and the fusion handled every detection of them
+	bool ReplayFinished() const
+	{
+		return replay_finished;
+	}
+
+	// Everything the game thread draws, published by the fusion thread after every detection
+	struct TrackingSnapshot
+	{
+		static constexpr int max_positions = 256;
+		static constexpr int max_cameras = 16;
+
+		Position positions[max_positions]; // the most recent positions, oldest first
+		int num_positions = 0;
+
+		ParabPath tracking_path;
+
+		Point2d used_balls[max_cameras]; // interpolated ball point used for triangulation per camera, {-1, -1} if none
+		int num_cameras = 0;
+	};
+
 	struct Detection
 	{
 		Point2d position;
 		double time;
 		int camera_id;
+		LatencyTrace trace;
 	};
 
 private:
 
 	EventPasser<Detection> event_passer;
 	
-	std::deque<Position> ball_positions;
-	std::deque<ParabPath> ball_paths;
+	static constexpr int max_detections = 32; // per camera, only 0.1s are kept
+	static constexpr int max_positions = 256; // only 1s is kept
+
+	RingBuffer<Position, max_positions> ball_positions;
+	RingBuffer<ParabPath, max_positions> ball_paths; // the fits of the current path, a path that goes on longer keeps the newest
 	ParabPath tracking_path = {};
 	int num_points_in_path;
+
+	SeqLock<TrackingSnapshot> snapshot;
+	TrackingSnapshot draw_snapshot; // only touched by the game thread
+	void PublishSnapshot(const std::vector<Point2d>& used_balls);
 	
 	void CameraLoop(ATrackingCamera* camera, int camera_id);
 	std::vector<TFuture<void>> camera_threads;
@@ -58,5 +90,12 @@ private:
 
 	class ABall* ball;
 
+	// cameras replaying a recording, see ATrackingCamera::ReplayPath
+	int num_replays = 0;
+	std::atomic<int> finished_replays = 0;
+	std::atomic<bool> replay_finished = false;
+	// how long a replay as fast as possible waits for the next stage to take what it passes on
+	static constexpr double max_replay_wait = 0.1;
+
 	void Stahp();
 };
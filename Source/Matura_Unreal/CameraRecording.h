@@ -0,0 +1,242 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "PreOpenCVHeaders.h"
+#include "opencv2/core.hpp"
+#include "PostOpenCVHeaders.h"
+
+// A recording of one camera is a header followed by every frame as the driver delivered it, in native byte order:
+//   header: magic "MJREC001", CameraCalibration
+//   frame:  double time grabbed (s), uint32 payload size, MJPEG payload
+// Replaying it runs the same decoding and detection as the live camera.
+struct CameraCalibration
+{
+	int32_t width, height;
+	double focal_length[2];
+	double k[2];
+	double p[2];
+	// camera_transform when the recording started, cm and a quaternion x, y, z, w
+	double translation[3];
+	double rotation[4];
+};
+
+static constexpr char camera_recording_magic[8] = {'M', 'J', 'R', 'E', 'C', '0', '0', '1'};
+
+// Writes a recording, only used by the camera's thread
+class CameraRecorder
+{
+public:
+	bool Open(const std::string& path, const CameraCalibration& calibration)
+	{
+		file.open(path, std::ios::binary | std::ios::trunc);
+		file.write(camera_recording_magic, sizeof(camera_recording_magic));
+		file.write(reinterpret_cast<const char*>(&calibration), sizeof(calibration));
+		return bool(file);
+	}
+
+	bool IsOpen() const
+	{
+		return file.is_open();
+	}
+
+	// payload is the frame retrieved with CAP_PROP_CONVERT_RGB off
+	void Write(double time, const cv::Mat& payload)
+	{
+		uint32_t size = uint32_t(payload.total() * payload.elemSize());
+		file.write(reinterpret_cast<const char*>(&time), sizeof(time));
+		file.write(reinterpret_cast<const char*>(&size), sizeof(size));
+		file.write(reinterpret_cast<const char*>(payload.data), size);
+	}
+
+	void Close()
+	{
+		file.close();
+	}
+
+private:
+	std::ofstream file;
+};
+
+// Hands out the frames of all playbacks in the order they were recorded in, so cameras replayed as fast as possible
+// still reach the fusion interleaved the way they did live. A camera only gets its next frame once every other one
+// asked for a newer frame, which makes the replay deterministic but handles one frame at a time across all cameras.
+// In real time it also waits until as much time has passed since the first frame as in the recording.
+class PlaybackClock
+{
+public:
+	// a playback that doesn't take its turn within this is skipped, so a stuck camera can't stall the others
+	static constexpr double max_wait = 1;
+
+	static PlaybackClock& Shared()
+	{
+		static PlaybackClock instance;
+		return instance;
+	}
+
+	int Add()
+	{
+		std::lock_guard l(mutex);
+		if (next_times.empty())
+			started = false;
+
+		int id = next_id++;
+		next_times[id] = -std::numeric_limits<double>::infinity(); // hasn't read its first frame yet
+		return id;
+	}
+
+	void Remove(int id)
+	{
+		std::unique_lock l(mutex);
+		next_times.erase(id);
+
+		l.unlock();
+		cv.notify_all();
+	}
+
+	// blocks until the frame of playback id grabbed at time is the oldest one not handed out yet
+	void WaitForTurn(int id, double time, bool realtime)
+	{
+		std::unique_lock l(mutex);
+		next_times[id] = time;
+		cv.notify_all();
+		cv.wait_for(l, std::chrono::duration<double>(max_wait), [&] { return IsNext(id, time); });
+
+		if (!realtime)
+			return;
+
+		if (!started)
+		{
+			started = true;
+			start_wall = clock::now();
+			start_time = time;
+		}
+		auto due = start_wall + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(time - start_time));
+
+		l.unlock();
+		std::this_thread::sleep_until(due);
+	}
+
+private:
+	typedef std::chrono::steady_clock clock;
+
+	// the playback that grabbed the oldest frame holds it until it reads its next one, ties go to the lower id
+	bool IsNext(int id, double time) const
+	{
+		for (auto [other, other_time] : next_times)
+			if (other_time < time || (other_time == time && other < id))
+				return false;
+		return true;
+	}
+
+	std::mutex mutex;
+	std::condition_variable cv;
+	std::map<int, double> next_times;
+	int next_id = 0;
+
+	bool started = false;
+	clock::time_point start_wall;
+	double start_time = 0;
+};
+
+// Reads a recording, Open is called from the game thread before the camera's thread reads the frames
+class CameraPlayback
+{
+public:
+	~CameraPlayback()
+	{
+		Close();
+	}
+
+	bool Open(const std::string& path, bool replay_realtime)
+	{
+		Close();
+
+		file.open(path, std::ios::binary);
+		char magic[sizeof(camera_recording_magic)];
+		if (!file.read(magic, sizeof(magic)) || memcmp(magic, camera_recording_magic, sizeof(magic)) != 0 ||
+			!file.read(reinterpret_cast<char*>(&calibration), sizeof(calibration)))
+		{
+			file.close();
+			return false;
+		}
+
+		realtime = replay_realtime;
+		finished = false;
+		frames = 0;
+		clock_id = PlaybackClock::Shared().Add();
+		return true;
+	}
+
+	bool IsOpen() const
+	{
+		return file.is_open();
+	}
+
+	const CameraCalibration& Calibration() const
+	{
+		return calibration;
+	}
+
+	// the next frame once it is its turn, see PlaybackClock. False at the end of the recording
+	bool Next(double& time, cv::Mat& payload)
+	{
+		if (!file.is_open() || finished)
+			return false;
+
+		uint32_t size;
+		if (file.read(reinterpret_cast<char*>(&time), sizeof(time)) && file.read(reinterpret_cast<char*>(&size), sizeof(size)))
+		{
+			payload.create(1, size, CV_8UC1);
+			if (file.read(reinterpret_cast<char*>(payload.data), size))
+			{
+				PlaybackClock::Shared().WaitForTurn(clock_id, time, realtime);
+				frames++;
+				return true;
+			}
+		}
+
+		finished = true;
+		PlaybackClock::Shared().Remove(clock_id);
+		return false;
+	}
+
+	bool Finished() const
+	{
+		return finished;
+	}
+
+	int Frames() const
+	{
+		return frames;
+	}
+
+	void Close()
+	{
+		if (!file.is_open())
+			return;
+
+		if (!finished)
+			PlaybackClock::Shared().Remove(clock_id);
+		file.close();
+		finished = true;
+	}
+
+private:
+	std::ifstream file;
+	CameraCalibration calibration = {};
+	bool realtime = false;
+	std::atomic<bool> finished = true;
+	int frames = 0;
+	int clock_id = -1;
+};
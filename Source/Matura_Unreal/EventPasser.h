@@ -1,5 +1,6 @@
 #pragma once
 
+#include <chrono>
 #include <condition_variable>
 #include <mutex>
 
@@ -44,8 +45,19 @@ public:
 		*r = std::move(val);
 		filled = false;
 
+		l.unlock();
+		cv.notify_all();
 		return true;
 	}
+
+	// waits until the last value pushed was popped, false if it still wasn't after timeout seconds
+	bool wait_consumed(double timeout) {
+		if (fake)
+			return true;
+
+		std::unique_lock l(mutex);
+		return cv.wait_for(l, std::chrono::duration<double>(timeout), [this] { return is_stopped || !filled; });
+	}
 	
 	template<class U = T>
 	bool push(U &&x) {
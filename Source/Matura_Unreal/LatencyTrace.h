@@ -0,0 +1,100 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+#include "CoreMinimal.h"
+
+#include "RollingPercentiles.h"
+
+// Monotonic timestamps of one ball measurement on its way from the camera to the servos, in seconds
+struct LatencyTrace
+{
+	enum Stage
+	{
+		Grabbed = 0, // frame handed over by the camera driver
+		Decoded,     // jpeg decompressed and undistorted
+		Detected,    // ball found in the frame
+		Fused,       // triangulated with the other cameras
+		Fitted,      // parabola fitted through the recent positions
+		Planned,     // arm position computed from the parabola
+		Sent,        // command written to the serial port
+		NumStages
+	};
+
+	static constexpr const TCHAR* stage_names[NumStages] = {
+		TEXT("grab"), TEXT("decode"), TEXT("detect"), TEXT("fuse"), TEXT("fit"), TEXT("plan"), TEXT("send")
+	};
+
+	double stamps[NumStages];
+
+	LatencyTrace()
+	{
+		std::fill(std::begin(stamps), std::end(stamps), nan(""));
+	}
+
+	static double Now()
+	{
+		return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	void Stamp(Stage stage)
+	{
+		stamps[stage] = Now();
+	}
+
+	// seconds since the frame this measurement came from was grabbed
+	double Age() const
+	{
+		return Now() - stamps[Grabbed];
+	}
+
+	bool IsValid() const
+	{
+		return !std::isnan(stamps[Grabbed]);
+	}
+};
+
+// Keeps the last few hundred complete traces to report percentiles of every stage, not thread safe
+class LatencyStats
+{
+public:
+	static constexpr int capacity = 512;
+
+	// slot 0 is the whole chain, slot i the time between stamp i-1 and stamp i
+	static constexpr int num_slots = LatencyTrace::NumStages;
+
+	void Add(const LatencyTrace& trace)
+	{
+		for (int i = 0; i < LatencyTrace::NumStages; i++)
+			if (std::isnan(trace.stamps[i]))
+				return;
+
+		double values[num_slots];
+		values[0] = trace.stamps[LatencyTrace::Sent] - trace.stamps[LatencyTrace::Grabbed];
+		for (int i = 1; i < num_slots; i++)
+			values[i] = trace.stamps[i] - trace.stamps[i - 1];
+
+		samples.Add(values);
+	}
+
+	// p in [0, 1], result in seconds
+	double Percentile(int slot, double p) const
+	{
+		return samples.Percentile(slot, p);
+	}
+
+	int Count() const
+	{
+		return samples.Count();
+	}
+
+	static const TCHAR* SlotName(int slot)
+	{
+		return slot == 0 ? TEXT("total") : LatencyTrace::stage_names[slot];
+	}
+
+private:
+	RollingPercentiles<num_slots, capacity> samples;
+};
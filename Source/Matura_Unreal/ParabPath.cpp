@@ -40,12 +40,12 @@ ParabPath ParabPath::from2Points(Position p1, Position p2, double a)
 	return ParabPath(a, B.X, B.Y, p1.position.X - p1.time * vx, p1.position.Y - p1.time * vy, vx, vy, t0, t1);
 }
 
-std::vector<double> ParabPath::LeastSquares(const Eigen::MatrixXd& data, int degree)
+Eigen::Vector3d ParabPath::LeastSquares(const FitData& data, int degree)
 {
 	// assert(data.rows() >= degree);
 
 	// https://www.reddit.com/r/cpp_questions/comments/v5oxql/polynomial_curve_fitting/
-	Eigen::MatrixXd powers(data.rows(), degree + 1);
+	Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, 0, max_fit_points, 3> powers(data.rows(), degree + 1);
 	powers.col(0).setOnes();
 
 	for (int i = 1; i <= degree; i++)
@@ -53,38 +53,32 @@ std::vector<double> ParabPath::LeastSquares(const Eigen::MatrixXd& data, int deg
 
 	auto decomposition = powers.householderQr();
 
-	std::vector<double> coeffs(degree + 1);
-	auto coeffs_map = Eigen::Map<Eigen::VectorXd>(coeffs.data(), coeffs.size());
-	coeffs_map = decomposition.solve(data.col(1));
+	Eigen::Vector3d coeffs = Eigen::Vector3d::Zero();
+	coeffs.head(degree + 1) = decomposition.solve(data.col(1));
 
 	return coeffs;
 }
 
-ParabPath ParabPath::fromNPoints(std::vector<Position> positions)
+ParabPath ParabPath::fromNPoints(std::span<const Position> positions)
 {
 	// assert(positions.size() >= 3);
 
+	if (positions.size() > max_fit_points)
+		positions = positions.last(max_fit_points);
+
 	double t0 = positions[0].time;
 	double t1 = positions.back().time;
 
-	for (auto& [p, t] : positions)
-		t -= t0;
-
-	Eigen::MatrixXd dataX(positions.size(), 2);
-	Eigen::MatrixXd dataY(positions.size(), 2);
-	Eigen::MatrixXd dataZ(positions.size(), 2);
+	FitData dataX(positions.size(), 2);
+	FitData dataY(positions.size(), 2);
+	FitData dataZ(positions.size(), 2);
 
 	for (int i = 0; i < positions.size(); i++)
 	{
-		Eigen::MatrixXd rowX, rowY, rowZ;
-		rowX = rowY = rowZ = Eigen::MatrixXd(1, 2);
-
-		rowX.data()[0] = rowY.data()[0] = rowZ.data()[0] = positions[i].time;
-		rowX.data()[1] = positions[i].position.X;
-		rowY.data()[1] = positions[i].position.Y;
-		rowZ.data()[1] = positions[i].position.Z;
-
-		dataX.row(i) = rowX, dataY.row(i) = rowY, dataZ.row(i) = rowZ;
+		dataX(i, 0) = dataY(i, 0) = dataZ(i, 0) = positions[i].time - t0;
+		dataX(i, 1) = positions[i].position.X;
+		dataY(i, 1) = positions[i].position.Y;
+		dataZ(i, 1) = positions[i].position.Z;
 	}
 
 	// fit the data points to a parabola/line
@@ -4,9 +4,11 @@
 
 #include <MatrixTypes.h>
 
+#include <span>
 #include <vector>
 
 #include "CoreMinimal.h"
+#include "LatencyTrace.h"
 
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wshadow"
@@ -27,15 +29,25 @@ public:
 	double vx, vy;
 	double t0, t1;
 
+	// stamps of the newest measurement that went into this path
+	LatencyTrace trace;
+
 	ParabPath(double a, double b, double c, double px, double py, double vx, double vy, double t0, double t1);
 
 	ParabPath();
 
 	static ParabPath from2Points(Position p1, Position p2, double a);
 
-	static std::vector<double> LeastSquares(const Eigen::MatrixXd& data, int degree);
+	// fits never use more points than this, so all the matrices involved can live on the stack
+	static constexpr int max_fit_points = 64;
+
+	using FitData = Eigen::Matrix<double, Eigen::Dynamic, 2, 0, max_fit_points, 2>;
+
+	// polynomial coefficients up to degree 2, lowest first, the ones above degree are zero
+	static Eigen::Vector3d LeastSquares(const FitData& data, int degree);
 
-	static ParabPath fromNPoints(std::vector<Position> positions);
+	// fits the newest max_fit_points positions if there are more
+	static ParabPath fromNPoints(std::span<const Position> positions);
 	
 	std::vector<double> IntersectSphere(FVector center, double radius) const;
 
@@ -0,0 +1,214 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "CoreMinimal.h"
+
+// Kalman filter of a pose that is expected to stay where it is up to a random walk, the error state is a rotation
+// vector and a translation with a diagonal covariance. O(1) per measurement, not thread safe.
+// Positions are in cm, angles in radians, times in seconds.
+class PoseFilter
+{
+public:
+	struct Noise
+	{
+		// standard deviation of one measurement
+		double position;
+		double rotation;
+		// standard deviation the pose drifts by in one second
+		double position_drift;
+		double rotation_drift;
+		// the pose is certain enough while the standard deviation is below these
+		double position_tolerance;
+		double rotation_tolerance;
+	};
+
+	// measurements further than this many standard deviations away (chi-square of 6 degrees of freedom, 99.9%) are
+	// outliers. If max_outliers of them in a row agree with each other the pose has jumped and the filter restarts,
+	// outliers scattered around it are only noise
+	static constexpr double outlier_gate = 22.5;
+	static constexpr int max_outliers = 3;
+
+	explicit PoseFilter(const Noise& noise) : noise(noise)
+	{
+	}
+
+	// returns false if the measurement was rejected as an outlier, noise_scale multiplies the standard deviations of
+	// this measurement
+	bool Update(const FTransform& measurement, double now, double noise_scale = 1)
+	{
+		FQuat measured_rotation = measurement.GetRotation().GetNormalized();
+		FVector measured_position = measurement.GetTranslation();
+
+		if (!initialized)
+		{
+			Reset(measured_rotation, measured_position, now, noise_scale);
+			return true;
+		}
+
+		double interval = std::max(now - last_time, 0.);
+		mean_interval = mean_interval > 0 ? mean_interval + 0.2 * (interval - mean_interval) : interval;
+
+		Predict(now);
+
+		FVector rotation_innovation = RotationDifference(measured_rotation, rotation);
+		FVector position_innovation = measured_position - position;
+
+		double r_rotation = noise.rotation * noise.rotation * noise_scale * noise_scale;
+		double r_position = noise.position * noise.position * noise_scale * noise_scale;
+
+		if (Mahalanobis(rotation_innovation, position_innovation, rotation_variance + FVector(r_rotation),
+		                position_variance + FVector(r_position)) > outlier_gate)
+		{
+			// the run starts over at a measurement that doesn't agree with its first one
+			if (outliers > 0 &&
+				Mahalanobis(RotationDifference(measured_rotation, outlier_rotation), measured_position - outlier_position,
+				            FVector(r_rotation + outlier_r_rotation), FVector(r_position + outlier_r_position)) > outlier_gate)
+				outliers = 0;
+
+			if (outliers == 0)
+			{
+				outlier_rotation = measured_rotation;
+				outlier_position = measured_position;
+				outlier_r_rotation = r_rotation;
+				outlier_r_position = r_position;
+			}
+
+			if (++outliers < max_outliers)
+				return false;
+
+			Reset(measured_rotation, measured_position, now, noise_scale);
+			return true;
+		}
+		outliers = 0;
+
+		FVector rotation_step, position_step;
+		for (int i = 0; i < 3; i++)
+		{
+			double rotation_gain = rotation_variance[i] / (rotation_variance[i] + r_rotation);
+			double position_gain = position_variance[i] / (position_variance[i] + r_position);
+
+			rotation_step[i] = rotation_gain * rotation_innovation[i];
+			position_step[i] = position_gain * position_innovation[i];
+
+			rotation_variance[i] *= 1 - rotation_gain;
+			position_variance[i] *= 1 - position_gain;
+		}
+
+		rotation = (FQuat::MakeFromRotationVector(rotation_step) * rotation).GetNormalized();
+		position += position_step;
+		return true;
+	}
+
+	FTransform Transform() const
+	{
+		return FTransform(rotation, position);
+	}
+
+	// largest standard deviation relative to its tolerance at now, 1 is just certain enough, infinite before the
+	// first measurement
+	double Uncertainty(double now) const
+	{
+		if (!initialized)
+			return std::numeric_limits<double>::infinity();
+
+		double dt = std::max(now - last_time, 0.);
+		double uncertainty = 0;
+		for (int i = 0; i < 3; i++)
+		{
+			double rotation_var = rotation_variance[i] + noise.rotation_drift * noise.rotation_drift * dt;
+			double position_var = position_variance[i] + noise.position_drift * noise.position_drift * dt;
+			uncertainty = std::max(uncertainty, sqrt(rotation_var) / noise.rotation_tolerance);
+			uncertainty = std::max(uncertainty, sqrt(position_var) / noise.position_tolerance);
+		}
+		return uncertainty;
+	}
+
+	// measurements per second, from a moving average of the intervals between them
+	double UpdateRate() const
+	{
+		return mean_interval > 0 ? 1 / mean_interval : 0;
+	}
+
+	// time from the last measurement until the drift makes the pose uncertain again, in [0, max_interval]
+	double TimeUntilUncertain(double max_interval) const
+	{
+		if (!initialized)
+			return 0;
+
+		double interval = max_interval;
+		for (int i = 0; i < 3; i++)
+		{
+			interval = std::min(interval, TimeUntil(rotation_variance[i], noise.rotation_tolerance, noise.rotation_drift));
+			interval = std::min(interval, TimeUntil(position_variance[i], noise.position_tolerance, noise.position_drift));
+		}
+		return std::max(interval, 0.);
+	}
+
+	Noise noise;
+
+private:
+	void Reset(const FQuat& new_rotation, const FVector& new_position, double now, double noise_scale)
+	{
+		rotation = new_rotation;
+		position = new_position;
+		rotation_variance = FVector(noise.rotation * noise.rotation * noise_scale * noise_scale);
+		position_variance = FVector(noise.position * noise.position * noise_scale * noise_scale);
+		last_time = now;
+		initialized = true;
+		outliers = 0;
+	}
+
+	void Predict(double now)
+	{
+		double dt = std::max(now - last_time, 0.);
+		rotation_variance += FVector(noise.rotation_drift * noise.rotation_drift * dt);
+		position_variance += FVector(noise.position_drift * noise.position_drift * dt);
+		last_time = now;
+	}
+
+	// the rotation vector from b to a
+	static FVector RotationDifference(const FQuat& a, const FQuat& b)
+	{
+		FQuat difference = a * b.Inverse();
+		if (difference.W < 0)
+			difference = FQuat(-difference.X, -difference.Y, -difference.Z, -difference.W);
+		return difference.ToRotationVector();
+	}
+
+	static double Mahalanobis(const FVector& rotation_difference, const FVector& position_difference,
+	                          const FVector& rotation_var, const FVector& position_var)
+	{
+		double distance = 0;
+		for (int i = 0; i < 3; i++)
+		{
+			distance += rotation_difference[i] * rotation_difference[i] / rotation_var[i];
+			distance += position_difference[i] * position_difference[i] / position_var[i];
+		}
+		return distance;
+	}
+
+	static double TimeUntil(double variance, double tolerance, double drift)
+	{
+		if (drift <= 0)
+			return std::numeric_limits<double>::infinity();
+		return (tolerance * tolerance - variance) / (drift * drift);
+	}
+
+	FQuat rotation = FQuat::Identity;
+	FVector position = FVector::ZeroVector;
+	FVector rotation_variance = FVector::ZeroVector;
+	FVector position_variance = FVector::ZeroVector;
+	double last_time = 0;
+	double mean_interval = 0;
+	bool initialized = false;
+
+	// the first measurement of the current run of outliers and its variances
+	int outliers = 0;
+	FQuat outlier_rotation = FQuat::Identity;
+	FVector outlier_position = FVector::ZeroVector;
+	double outlier_r_rotation = 0;
+	double outlier_r_position = 0;
+};
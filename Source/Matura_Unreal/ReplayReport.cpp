@@ -0,0 +1,228 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#include "ReplayReport.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "HAL/FileManager.h"
+#include "Misc/FileHelper.h"
+#include "Misc/Paths.h"
+
+#include "GlobalIncludes.h"
+
+// golden and output samples at most this far apart in time (s) are the same measurement
+static constexpr double match_window = 1e-3;
+
+ReplayReport& ReplayReport::Shared()
+{
+	static ReplayReport instance;
+	return instance;
+}
+
+void ReplayReport::Start(const FString& output, const FString& golden, double new_tolerance)
+{
+	std::lock_guard l(mutex);
+
+	output_path = output;
+	golden_path = golden;
+	tolerance = new_tolerance;
+
+	start_time = LatencyTrace::Now();
+	std::fill(std::begin(counts), std::end(counts), 0);
+	for (auto& stage_intervals : intervals)
+		stage_intervals = {};
+	totals = {};
+	samples.clear();
+
+	active = true;
+}
+
+void ReplayReport::AddStages(const LatencyTrace& trace, LatencyTrace::Stage first, LatencyTrace::Stage last)
+{
+	if (!active)
+		return;
+
+	std::lock_guard l(mutex);
+	for (int i = first; i <= last; i++)
+	{
+		if (std::isnan(trace.stamps[i]))
+			continue;
+
+		counts[i]++;
+		if (i > 0 && !std::isnan(trace.stamps[i - 1]))
+			intervals[i].Add({trace.stamps[i] - trace.stamps[i - 1]});
+	}
+
+	if (last >= LatencyTrace::Fitted && trace.IsValid() && !std::isnan(trace.stamps[last]))
+		totals.Add({trace.stamps[last] - trace.stamps[LatencyTrace::Grabbed]});
+}
+
+void ReplayReport::AddPath(const ParabPath& path)
+{
+	if (!active || !path.IsValid())
+		return;
+
+	std::lock_guard l(mutex);
+	samples.push_back({Path, path.t1, path(path.t1), FVector(path.vx, path.vy, path.derivative(path.t1))});
+}
+
+void ReplayReport::AddIntercept(double time, const FVector& target, const FVector& velocity)
+{
+	if (!active)
+		return;
+
+	std::lock_guard l(mutex);
+	samples.push_back({Intercept, time, target, velocity});
+}
+
+bool ReplayReport::Finish()
+{
+	if (!active)
+		return true;
+
+	std::lock_guard l(mutex);
+	active = false;
+
+	double duration = LatencyTrace::Now() - start_time;
+
+	FString report;
+	for (int i = 0; i < LatencyTrace::NumStages; i++)
+	{
+		if (counts[i] == 0)
+			continue;
+		report += FString::Printf(TEXT(" %s %.1f/s"), LatencyTrace::stage_names[i], counts[i] / duration);
+		if (intervals[i].Count())
+			report += FString::Printf(TEXT(" %.2f/%.2f ms"), intervals[i].Percentile(0, 0.5) * 1e3, intervals[i].Percentile(0, 0.99) * 1e3);
+	}
+	if (totals.Count())
+		report += FString::Printf(TEXT(" total %.2f/%.2f ms"), totals.Percentile(0, 0.5) * 1e3, totals.Percentile(0, 0.99) * 1e3);
+	LogDisplay(TEXT("Replay took %.2f s, throughput and latency p50/p99 per stage:%s"), duration, *report);
+
+	std::stable_sort(samples.begin(), samples.end(), [](const Sample& a, const Sample& b)
+	{
+		return a.kind != b.kind ? a.kind < b.kind : a.time < b.time;
+	});
+
+	FString csv = CsvHeader();
+	for (const Sample& sample : samples)
+		csv += CsvRow(sample);
+
+	IFileManager::Get().MakeDirectory(*FPaths::GetPath(output_path), true);
+	if (FFileHelper::SaveStringToFile(csv, *output_path))
+		LogDisplay(TEXT("Wrote %d replayed paths and intercepts to %s"), int(samples.size()), *output_path);
+	else
+		LogWarning(TEXT("Could not write the replay output to %s"), *output_path);
+
+	if (golden_path.IsEmpty() || !IFileManager::Get().FileExists(*golden_path))
+	{
+		LogDisplay(TEXT("No golden replay output to compare with"));
+		return true;
+	}
+
+	std::vector<Sample> golden;
+	if (!ReadCsv(golden_path, golden))
+	{
+		LogError(TEXT("Could not read the golden replay output %s"), *golden_path);
+		return false;
+	}
+	return Compare(golden);
+}
+
+bool ReplayReport::Compare(const std::vector<Sample>& golden) const
+{
+	static constexpr const TCHAR* kind_names[] = {TEXT("paths"), TEXT("intercepts")};
+
+	bool passed = true;
+	for (Kind kind : {Path, Intercept})
+	{
+		auto by_kind = [kind](const Sample& sample) { return sample.kind == kind; };
+		auto first = std::find_if(samples.begin(), samples.end(), by_kind);
+		auto last = std::find_if_not(first, samples.end(), by_kind);
+
+		int golden_count = 0, missing = 0;
+		double max_position = 0, max_velocity = 0;
+		for (const Sample& expected : golden)
+		{
+			if (expected.kind != kind)
+				continue;
+			golden_count++;
+
+			if (first == last)
+			{
+				missing++;
+				continue;
+			}
+
+			// nearest in time, the output is sorted
+			auto after = std::lower_bound(first, last, expected.time, [](const Sample& s, double t) { return s.time < t; });
+			auto nearest = after;
+			if (after == last || (after != first && expected.time - (after - 1)->time < after->time - expected.time))
+				nearest = after - 1;
+
+			if (std::abs(nearest->time - expected.time) > match_window)
+			{
+				missing++;
+				continue;
+			}
+
+			max_position = std::max(max_position, (nearest->position - expected.position).Size());
+			max_velocity = std::max(max_velocity, (nearest->velocity - expected.velocity).Size());
+		}
+
+		int extra = int(last - first) - (golden_count - missing);
+		bool kind_passed = missing == 0 && extra == 0 && max_position <= tolerance;
+
+		FString message = FString::Printf(TEXT("Replayed %s: %d golden, %d missing, %d extra, max deviation %.3f cm and %.3f cm/s"),
+		                                  kind_names[kind], golden_count, missing, extra, max_position, max_velocity);
+
+		// the arm plans with the latencies and its position at the time, which depend on how fast the replay runs
+		if (kind == Intercept)
+		{
+			LogDisplay(TEXT("%s (not compared)"), *message);
+			continue;
+		}
+
+		passed &= kind_passed;
+		if (kind_passed)
+			LogDisplay(TEXT("%s"), *message);
+		else
+			LogError(TEXT("%s, tolerance %.3f cm"), *message, tolerance);
+	}
+	return passed;
+}
+
+FString ReplayReport::CsvHeader()
+{
+	return TEXT("kind,time,x,y,z,vx,vy,vz\n");
+}
+
+FString ReplayReport::CsvRow(const Sample& sample)
+{
+	return FString::Printf(TEXT("%d,%.6f,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f\n"), int(sample.kind), sample.time,
+	                       sample.position.X, sample.position.Y, sample.position.Z,
+	                       sample.velocity.X, sample.velocity.Y, sample.velocity.Z);
+}
+
+bool ReplayReport::ReadCsv(const FString& path, std::vector<Sample>& read)
+{
+	TArray<FString> lines;
+	if (!FFileHelper::LoadFileToStringArray(lines, *path))
+		return false;
+
+	for (int i = 1; i < lines.Num(); i++) // skip the header
+	{
+		TArray<FString> fields;
+		lines[i].ParseIntoArray(fields, TEXT(","));
+		if (fields.Num() != 8)
+			continue;
+
+		double values[8];
+		for (int j = 0; j < 8; j++)
+			values[j] = FCString::Atod(*fields[j]);
+
+		read.push_back({values[0] == Intercept ? Intercept : Path, values[1],
+		                FVector(values[2], values[3], values[4]), FVector(values[5], values[6], values[7])});
+	}
+	return true;
+}
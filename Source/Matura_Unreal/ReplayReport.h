@@ -0,0 +1,83 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include "CoreMinimal.h"
+
+#include "LatencyTrace.h"
+#include "ParabPath.h"
+#include "RollingPercentiles.h"
+
+// Collects what the pipeline produces while cameras replay recordings (see CameraRecording.h): how many measurements
+// every stage handled per second and how long it took for them, the fitted paths and the intercepts the arm planned.
+// When the replay is over the paths and intercepts are written to a csv and compared with a golden one from an
+// earlier replay. Only the paths decide whether it matches, the intercepts depend on wall clock latencies and the arm's
+// position and are only reported. Thread safe, Add* do nothing unless a replay was started.
+class ReplayReport
+{
+public:
+	static constexpr int capacity = 4096;
+
+	// the instance all cameras, the fusion and the arm report to
+	static ReplayReport& Shared();
+
+	// output is written by Finish, golden is compared with if it exists. Paths match if they deviate less than
+	// tolerance (cm) from the golden ones
+	void Start(const FString& output, const FString& golden, double tolerance);
+
+	bool IsActive() const
+	{
+		return active;
+	}
+
+	// the interval before every stage from first to last that was stamped
+	void AddStages(const LatencyTrace& trace, LatencyTrace::Stage first, LatencyTrace::Stage last);
+	void AddPath(const ParabPath& path);
+	void AddIntercept(double time, const FVector& target, const FVector& velocity);
+
+	// logs the report and writes the output, returns false if it doesn't match the golden output
+	bool Finish();
+
+	// set while the arm plans from the fitted paths, a replay as fast as possible then waits for it to take every path
+	std::atomic<bool> planner_running = false;
+
+private:
+	enum Kind
+	{
+		Path = 0,
+		Intercept = 1,
+	};
+
+	// a path at the time of its newest measurement or where the arm intercepts the ball
+	struct Sample
+	{
+		Kind kind;
+		double time;
+		FVector position;
+		FVector velocity;
+	};
+
+	static FString CsvHeader();
+	static FString CsvRow(const Sample& sample);
+	static bool ReadCsv(const FString& path, std::vector<Sample>& samples);
+
+	// logs how far the output is from the golden one, false if a path is further than tolerance or paths are missing
+	bool Compare(const std::vector<Sample>& golden) const;
+
+	std::mutex mutex;
+	std::atomic<bool> active = false;
+
+	FString output_path;
+	FString golden_path;
+	double tolerance = 1;
+
+	double start_time = 0;
+	uint64 counts[LatencyTrace::NumStages] = {};
+	RollingPercentiles<1, capacity> intervals[LatencyTrace::NumStages];
+	RollingPercentiles<1, capacity> totals; // grab to the last stage of every trace that reached Fitted or Planned
+	std::vector<Sample> samples;
+};
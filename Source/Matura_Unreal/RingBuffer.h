@@ -0,0 +1,61 @@
+#pragma once
+
+#include <algorithm>
+#include <span>
+
+// Fixed capacity queue of timestamped samples (anything with a `double time` member) that never allocates.
+// Every element is stored twice, N slots apart, so the contents are always one contiguous range
+// starting at data() and windows of it can be handed out as spans without copying.
+// Pushing to a full buffer drops the oldest element.
+template<typename T, int N>
+class RingBuffer {
+
+public:
+	static constexpr int capacity = N;
+
+	void push_back(const T &x) {
+		if (count == N)
+			pop_front();
+
+		const int slot = (head + count) % N;
+		storage[slot] = x;
+		storage[slot + N] = x;
+		count++;
+	}
+
+	void pop_front() {
+		head = (head + 1) % N;
+		count--;
+	}
+
+	void clear() {
+		head = count = 0;
+	}
+
+	int size() const { return count; }
+	bool empty() const { return count == 0; }
+
+	const T *data() const { return storage + head; }
+	const T *begin() const { return data(); }
+	const T *end() const { return data() + count; }
+
+	const T &operator[](int i) const { return data()[i]; }
+	const T &front() const { return data()[0]; }
+	const T &back() const { return data()[count - 1]; }
+
+	// the newest n elements, oldest first
+	std::span<const T> last(int n) const {
+		n = std::clamp(n, 0, count);
+		return {end() - n, size_t(n)};
+	}
+
+	// index of the first element newer than time, size() if there is none, the samples have to be pushed in time order
+	int upper_bound(double time) const {
+		return int(std::upper_bound(begin(), end(), time, [](double t, const T &x) { return t < x.time; }) - begin());
+	}
+
+private:
+	T storage[2 * N];
+	int head = 0;
+	int count = 0;
+};
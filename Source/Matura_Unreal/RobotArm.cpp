@@ -12,6 +12,8 @@
 #include <fstream>
 #include <Components/SphereComponent.h>
 
+#include "ReplayReport.h"
+
 // #include "Core/Public/Misc/AssertionMacros.h"
 
 // Sets default values
@@ -57,6 +59,26 @@ void ARobotArm::SetupSerial()
 	{
 		LogError(TEXT("Could not open serial port: %s"), *FString(e.what()));
 	}
+
+#if PLATFORM_LINUX
+	if (async_serial && serial_port.isOpen())
+	{
+		try
+		{
+			async_serial_handle = AsyncIO::shared().add(serial_port, [this](const std::string& line)
+			{
+				if (debug_serial)
+					LogDisplay(TEXT("Serial port: %s Received: %s"), *FString(serial_port.getPort().c_str()), *FString(line.c_str()));
+			});
+		}
+		catch (std::exception& e)
+		{
+			LogError(TEXT("Could not register serial port for async io, falling back to blocking writes: %s"), *FString(e.what()));
+		}
+	}
+#endif
+
+	StartSerialLoop();
 }
 
 double CircularClamp(double& val, double low, double high, double step = 360)
@@ -127,9 +149,15 @@ void ARobotArm::GetAnimation(Position position)
 	CircularClamp(position.wrist_rotation, min_rotations[4], max_rotations[4]);
 }
 
-void ARobotArm::SendRotations()
+void ARobotArm::SendRotations(const LatencyTrace& trace)
+{
+	// only hands the position to the servo loop, the actual serial write happens there at a fixed rate
+	commanded_position.push({GetPosition(), trace});
+}
+
+void ARobotArm::WriteRotations(Position position)
 {
-	auto [base_servo, lower_arm_servo, upper_arm_servo, hand_servo, wrist_servo] = GetPosition().to_servo().to_angle().to_servo();
+	auto [base_servo, lower_arm_servo, upper_arm_servo, hand_servo, wrist_servo] = position.to_servo().to_angle().to_servo();
 
 	std::string msg = "> " + std::to_string(int(base_servo)) + " " + std::to_string(int(lower_arm_servo)) + " " +
 		std::to_string(int(upper_arm_servo)) + " " + std::to_string(int(hand_servo)) + " " + std::to_string(int(wrist_servo)) + "\n";
@@ -140,6 +168,16 @@ void ARobotArm::SendRotations()
 		LogDisplay(TEXT("Serial port: %s Message: %s"), *FString(serial_port.getPort().c_str()), *blub);
 	}
 
+#if PLATFORM_LINUX
+	if (async_serial_handle != -1)
+	{
+		// all servo messages share one key, so a command still waiting for the port gets replaced by the newer one
+		if (!AsyncIO::shared().write(async_serial_handle, msg, 0))
+			LogError(TEXT("Could not queue message for serial port %s"), *FString(serial_port.getPort().c_str()));
+		return;
+	}
+#endif
+
 	if (serial_port.isOpen())
 	{
 		try
@@ -154,6 +192,120 @@ void ARobotArm::SendRotations()
 	}
 }
 
+void ARobotArm::SerialLoop()
+{
+	LogDisplay(TEXT("Started servo output loop at %f Hz"), servo_rate);
+
+	using clock = std::chrono::steady_clock;
+	const auto period = std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(1. / max(servo_rate, 1.)));
+
+	int64 cycles = 0;
+	int deadline_misses = 0;
+	double jitter_sum = 0, max_jitter = 0;
+	measured_deadline_misses = 0;
+	measured_mean_jitter = measured_max_jitter = 0;
+	auto last_report = clock::now();
+
+	ServoCommand command;
+	auto deadline = clock::now() + period;
+
+	while (serial_loop_running)
+	{
+		// sleeping until an absolute deadline keeps the rate from drifting with the time spent writing
+		std::this_thread::sleep_until(deadline);
+		auto woken = clock::now();
+
+		bool fresh = commanded_position.pop(&command);
+		if (command.position.IsValid())
+			WriteRotations(command.position);
+
+		if (fresh && command.trace.IsValid())
+		{
+			command.trace.Stamp(LatencyTrace::Sent);
+			latency_stats.Add(command.trace);
+
+			double latency = command.trace.stamps[LatencyTrace::Sent] - command.trace.stamps[LatencyTrace::Planned];
+			double estimate = measured_output_latency;
+			measured_output_latency = estimate == 0 ? latency : estimate * 0.95 + latency * 0.05;
+		}
+
+		double jitter = std::chrono::duration<double, std::milli>(woken - deadline).count();
+		cycles++;
+		jitter_sum += jitter;
+		max_jitter = max(max_jitter, jitter);
+		measured_mean_jitter = jitter_sum / cycles;
+		measured_max_jitter = max_jitter;
+
+		deadline += period;
+
+		// if the write overran, skip the missed slots instead of sending a burst to catch up
+		auto now = clock::now();
+		if (now >= deadline)
+		{
+			int64 missed = (now - deadline) / period + 1;
+			deadline_misses += int(missed);
+			measured_deadline_misses = deadline_misses;
+			deadline += missed * period;
+		}
+
+		if (show_profiling && now - last_report > std::chrono::seconds(1))
+		{
+			LogDisplay(TEXT("Servo loop: %d missed deadlines, %f ms mean jitter, %f ms max jitter"), deadline_misses, jitter_sum / cycles, max_jitter);
+#if PLATFORM_LINUX
+			if (async_serial_handle != -1)
+			{
+				AsyncIOStats stats = AsyncIO::shared().getStats(async_serial_handle);
+				LogDisplay(TEXT("Async serial: %llu sent, %llu coalesced, %llu errors, %f ms mean latency, %f ms max latency"),
+					(uint64)stats.messages_sent, (uint64)stats.messages_coalesced, (uint64)stats.errors, stats.mean_latency_ms, stats.max_latency_ms);
+			}
+#endif
+			if (latency_stats.Count())
+			{
+				FString report;
+				for (int i = 0; i < LatencyStats::num_slots; i++)
+					report += FString::Printf(TEXT(" %s %.1f/%.1f"), LatencyStats::SlotName(i), latency_stats.Percentile(i, 0.5) * 1e3, latency_stats.Percentile(i, 0.99) * 1e3);
+				LogDisplay(TEXT("Latency p50/p99 in ms over %d commands:%s"), latency_stats.Count(), *report);
+			}
+			last_report = now;
+		}
+	}
+
+	LogDisplay(TEXT("Stopped servo output loop"));
+}
+
+void ARobotArm::StartSerialLoop()
+{
+	StopSerialLoop();
+
+	serial_loop_running = true;
+	serial_thread = Async(EAsyncExecution::Thread, [&]
+	{
+		SerialLoop();
+	});
+}
+
+void ARobotArm::StopSerialLoop()
+{
+	serial_loop_running = false;
+	if (serial_thread.IsValid())
+		serial_thread.Wait();
+}
+
+void ARobotArm::CloseSerial()
+{
+	StopSerialLoop();
+
+#if PLATFORM_LINUX
+	if (async_serial_handle != -1)
+	{
+		AsyncIO::shared().remove(async_serial_handle);
+		async_serial_handle = -1;
+	}
+#endif
+
+	serial_port.close();
+}
+
 bool ARobotArm::InverseKinematics(FVector target, Position& position)
 {
 	FVector relative_position = target - arm_origin;
@@ -269,6 +421,7 @@ bool ARobotArm::TrackParabola(Position& position, double DeltaTime)
 	
 	path_age += DeltaTime;
 	tracking_age += DeltaTime;
+	plan_trace = {};
 	
 	if (!ball || !tracking_path.IsValid())
 	{
@@ -282,8 +435,12 @@ bool ARobotArm::TrackParabola(Position& position, double DeltaTime)
 	{
 		last_path = tracking_path;
 		path_age = 0;
+		path_latency = tracking_path.trace.IsValid() ? tracking_path.trace.Age() : 0;
+		plan_trace = tracking_path.trace;
 	}
 
+	double path_time = PathTime();
+
 	double intersection_radius = arm_range * 100 * world_scale;
 
 	std::vector<double> intersections = last_path.IntersectSphere(arm_origin, intersection_radius);
@@ -292,7 +449,7 @@ bool ARobotArm::TrackParabola(Position& position, double DeltaTime)
 	intersections.erase(std::remove_if(intersections.begin(), intersections.end(),
 	                                   [&](double p)
 	                                   {
-		                                   return p <= last_path.t1 + path_age || isnan(p) || isnan(-p) || isinf(p);
+		                                   return p <= path_time || isnan(p) || isnan(-p) || isinf(p);
 	                                   }),
 	                    intersections.end());
 
@@ -355,7 +512,7 @@ bool ARobotArm::TrackParabola(Position& position, double DeltaTime)
 
 		double est_move_time = candidate.diff(GetActualPosition());
 
-		if (est_move_time * 1.5 > abs(target_time - (last_path.t1 + path_age)))
+		if (est_move_time * 1.5 > abs(target_time - path_time))
 			// discard paths that would take too long, mostly these are false detections
 			continue;
 
@@ -395,7 +552,7 @@ bool ARobotArm::TrackParabola(Position& position, double DeltaTime)
 		Position middle_position;
 		TrackBall(middle_target, -normal, middle_position);
 
-		if (abs(intercept_time - (last_path.t1 + path_age)) < timing)
+		if (abs(intercept_time - path_time) < timing)
 		{
 			Position start{NaN, NaN, NaN,  middle_position.hand_rotation - 15, NaN};
 			Position end{NaN, NaN, NaN,  middle_position.hand_rotation + 15, NaN};
@@ -410,9 +567,27 @@ bool ARobotArm::TrackParabola(Position& position, double DeltaTime)
 	{
 		TrackBall(target, impact_velocity, position);
 	}
+
+	if (plan_trace.IsValid())
+	{
+		plan_trace.Stamp(LatencyTrace::Planned);
+		ReplayReport::Shared().AddStages(plan_trace, LatencyTrace::Planned, LatencyTrace::Planned);
+		ReplayReport::Shared().AddIntercept(intercept_time, target, impact_velocity);
+	}
 	return true;
 }
 
+double ARobotArm::PathTime()
+{
+	double time = last_path.t1 + path_age;
+
+	// the path is already older than path_age when it arrives, and the servos only move some time after the command is planned
+	if (compensate_latency)
+		time += path_latency + measured_output_latency + servo_latency;
+
+	return time;
+}
+
 void ARobotArm::TrackBall(FVector target, FVector impact_velocity, Position& position, FVector2d paddle_offset)
 {
 	impact_velocity.Normalize();
@@ -635,7 +810,7 @@ void ARobotArm::BallLoop()
 		ApplyPosition(new_position);
 		if (is_update)
 		{
-			current_steps.push_back({new_position, ball->position, last_intercept, DeltaTime});
+			current_steps.push_back({new_position, ball->position.load(), last_intercept, DeltaTime});
 			move_home = false;
 		}
 		else
@@ -698,8 +873,9 @@ void ARobotArm::BallLoop()
 
 		if (!visual_only && !replay_last_path)
 		{
-			SendRotations();
+			SendRotations(is_update ? plan_trace : LatencyTrace());
 		}
+		plan_trace = {}; // following a path doesn't go through TrackParabola, don't report the same trace twice
 
 		if (show_profiling)
 			LogDisplay(TEXT("Ball Loop running at %f fps, %f ms between update"), 1. / DeltaTime, DeltaTime * 1000.);
@@ -853,6 +1029,7 @@ void ARobotArm::UpdateArmSyncronous(float DeltaTime)
 void ARobotArm::StopBallLoop()
 {
 	ball_loop_running = false;
+	ReplayReport::Shared().planner_running = false;
 	if (ball_thread.IsValid())
 		ball_thread.Wait();
 }
@@ -860,6 +1037,11 @@ void ARobotArm::StopBallLoop()
 // Called every frame
 void ARobotArm::Tick(float DeltaTime)
 {
+	output_latency = measured_output_latency;
+	servo_deadline_misses = measured_deadline_misses;
+	servo_mean_jitter = measured_mean_jitter;
+	servo_max_jitter = measured_max_jitter;
+
 	if (RobotArmValid())
 	{
 		arm_origin = FVector{
@@ -884,7 +1066,8 @@ void ARobotArm::Tick(float DeltaTime)
 					StopBallLoop();
 					LogDisplay(TEXT("Started robot arm loop"));
 					ball_loop_running = true;
-					Async(EAsyncExecution::Thread, [&]
+					ReplayReport::Shared().planner_running = true;
+					ball_thread = Async(EAsyncExecution::Thread, [&]
 					{
 						BallLoop();
 					});
@@ -934,7 +1117,7 @@ void ARobotArm::BeginDestroy()
 {
 	Super::BeginDestroy();
 
-	serial_port.close();
+	CloseSerial();
 
 	StopBallLoop();
 }
@@ -943,7 +1126,7 @@ void ARobotArm::EndPlay(const EEndPlayReason::Type EndPlayReason)
 {
 	Super::EndPlay(EndPlayReason);
 
-	serial_port.close();
+	CloseSerial();
 
 	StopBallLoop();
 }
@@ -2,11 +2,15 @@
 
 #pragma once
 
+#include <atomic>
 #include <filesystem>
 
 #include "GlobalIncludes.h"
+#include "LatencyTrace.h"
+#include "TripleBuffer.h"
 
 #include "serial/serial.h"
+#include "serial/async_io.h"
 
 #include "Math/Vector2D.h"
 #include "CoreMinimal.h"
@@ -179,6 +183,12 @@ protected:
 		}
 	};
 	const Position rest_position = {-90, -30, -200, 0, 90};
+
+	struct ServoCommand
+	{
+		Position position;
+		LatencyTrace trace; // only valid if the command was planned from a fresh ball measurement
+	};
 	
 	static double interpolate(double x, double a, double b, double c, double d)
 	{
@@ -288,19 +298,36 @@ protected:
 	virtual void BeginPlay() override;
 	void SetupSerial();
 	void GetAnimation(Position position);
-	void SendRotations();
+	void SendRotations(const LatencyTrace& trace = {});
+	void WriteRotations(Position position);
 
 	bool InverseKinematics(FVector target, Position& position);
 	bool TrackParabola(Position& position, double DeltaTime);
+	double PathTime();
 	void TrackBall(FVector target, FVector impact_velocity, Position& position, FVector2d paddle_offset = {0,0});
 	bool CheckCollision(Position position);
 
 	bool ApplyPosition(Position position);
 
-	bool serial_loop_running = true;
+	void SerialLoop();
+	void StartSerialLoop();
+	void StopSerialLoop();
+	void CloseSerial();
+
+	std::atomic<bool> serial_loop_running = false;
 	TFuture<void> serial_thread;
+	TripleBuffer<ServoCommand> commanded_position;
+	LatencyStats latency_stats; // only used by the servo loop
+	std::atomic<double> measured_output_latency = 0; // written by the servo loop, read by the ball loop
+	// written by the servo loop, copied to the servo properties every tick
+	std::atomic<int> measured_deadline_misses = 0;
+	std::atomic<double> measured_mean_jitter = 0;
+	std::atomic<double> measured_max_jitter = 0;
+	int async_serial_handle = -1;
 	double path_age = 10000000;
 	double tracking_age = 10000000;
+	double path_latency = 0; // seconds between grabbing the frame and the path reaching the arm
+	LatencyTrace plan_trace;
 	ParabPath last_path;
 	LinearMove path_to_follow;
 	FVector last_intercept;
@@ -324,7 +351,7 @@ protected:
 
 	TFuture<void> ball_thread;
 
-	bool ball_loop_running = false;
+	std::atomic<bool> ball_loop_running = false;
 	int missed_ticks = 0;
 
 	FVector arm_origin;
@@ -368,6 +395,23 @@ public:
 	UPROPERTY(EditAnywhere, Category = SerialSettings, meta = (EditCondition = "visual_only == false", EditConditionHides))
 	bool debug_serial = false;
 
+	// queue servo commands on the shared epoll I/O thread instead of blocking the servo loop on every write, Linux only
+	UPROPERTY(EditAnywhere, Category = SerialSettings, meta = (EditCondition = "visual_only == false", EditConditionHides))
+	bool async_serial = true;
+
+	UPROPERTY(EditAnywhere, Category = SerialSettings, DisplayName="Servo update rate (Hz)", meta = (ClampMin = "1.0", EditCondition = "visual_only == false", EditConditionHides))
+	double servo_rate = 200;
+
+	// copies of the servo loop's measurements for the editor, updated every tick
+	UPROPERTY(VisibleAnywhere, Category = SerialSettings, DisplayName="Missed servo deadlines", meta = (EditCondition = "visual_only == false", EditConditionHides))
+	int servo_deadline_misses = 0;
+
+	UPROPERTY(VisibleAnywhere, Category = SerialSettings, DisplayName="Mean servo jitter (ms)", meta = (EditCondition = "visual_only == false", EditConditionHides))
+	double servo_mean_jitter = 0;
+
+	UPROPERTY(VisibleAnywhere, Category = SerialSettings, DisplayName="Max servo jitter (ms)", meta = (EditCondition = "visual_only == false", EditConditionHides))
+	double servo_max_jitter = 0;
+
 	UPROPERTY(EditAnywhere, meta = (EditCondition = "update_type == UpdateType::Ball && tool == Tool::Bat", EditConditionHides))
 	float timing = 0.325;
 	
@@ -411,6 +455,19 @@ public:
 	UPROPERTY(EditAnywhere, Category = Motors, meta=(EditCondition = "update_type == UpdateType::Ball", EditConditionHides))
 	bool draw_debug = false;
 
+	// plan for where the ball will be once the command reaches the servos instead of where it was when the frame was taken,
+	// timing was tuned without it
+	UPROPERTY(EditAnywhere, Category = Motors, meta=(EditCondition = "update_type == UpdateType::Ball", EditConditionHides))
+	bool compensate_latency = false;
+
+	// mechanical and firmware delay after the command left the serial port, can't be measured from here
+	UPROPERTY(EditAnywhere, Category = Motors, DisplayName="Servo latency (s)", meta=(EditCondition = "update_type == UpdateType::Ball && compensate_latency", EditConditionHides))
+	double servo_latency = 0.02;
+
+	// copy of measured_output_latency for the editor, updated every tick
+	UPROPERTY(VisibleAnywhere, Category = Motors, DisplayName="Measured output latency (s)", meta=(EditCondition = "update_type == UpdateType::Ball", EditConditionHides))
+	double output_latency = 0;
+
 	UPROPERTY(EditAnywhere, Category = Dimensions, DisplayName="Lower arm length (m)")
 	double lower_arm_length = 0.35;
 	UPROPERTY(EditAnywhere, Category = Dimensions, DisplayName="Upper arm length (m)")
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+
+// The last Capacity samples of NumSlots quantities that are recorded together, to report percentiles of each.
+// Never allocates, not thread safe
+template<int NumSlots, int Capacity>
+class RollingPercentiles
+{
+public:
+	static constexpr int capacity = Capacity;
+	static constexpr int num_slots = NumSlots;
+
+	void Add(const double (&values)[NumSlots])
+	{
+		for (int i = 0; i < NumSlots; i++)
+			samples[i][next] = values[i];
+
+		next = (next + 1) % Capacity;
+		count = std::min(count + 1, Capacity);
+	}
+
+	// p in [0, 1], NaN while empty
+	double Percentile(int slot, double p) const
+	{
+		if (count == 0)
+			return nan("");
+
+		std::array<double, Capacity> sorted;
+		std::copy_n(samples[slot], count, sorted.begin());
+
+		int k = std::clamp(int(p * (count - 1) + 0.5), 0, count - 1);
+		std::nth_element(sorted.begin(), sorted.begin() + k, sorted.begin() + count);
+		return sorted[k];
+	}
+
+	int Count() const
+	{
+		return count;
+	}
+
+private:
+	double samples[NumSlots][Capacity] = {};
+	int next = 0;
+	int count = 0;
+};
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <thread>
+
+// Publishes a value from one writer thread to any number of reader threads without locks or allocation.
+// The writer never waits, readers copy the value and retry if the writer changed it in the meantime,
+// so T should be cheap to copy and must not own heap memory.
+template<typename T>
+class SeqLock {
+
+public:
+	SeqLock() = default;
+
+	explicit SeqLock(const T &initial) : value(initial) {}
+
+	// writer side, modifies the value in place, only one thread may write
+	template<typename F>
+	void write(F &&update) {
+		const uint32_t seq = sequence.load(std::memory_order_relaxed);
+		sequence.store(seq + 1, std::memory_order_relaxed); // odd while writing
+		std::atomic_thread_fence(std::memory_order_release);
+
+		update(value);
+
+		sequence.store(seq + 2, std::memory_order_release);
+	}
+
+	void store(const T &x) {
+		write([&](T &v) { v = x; });
+	}
+
+	// reader side, yields a consistent copy of the latest value
+	void load(T *const r) const {
+		while (true) {
+			const uint32_t before = sequence.load(std::memory_order_acquire);
+			if (before & 1) {
+				std::this_thread::yield();
+				continue;
+			}
+
+			*r = value;
+
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (sequence.load(std::memory_order_relaxed) == before)
+				return;
+		}
+	}
+
+	T load() const {
+		T r;
+		load(&r);
+		return r;
+	}
+
+private:
+	std::atomic<uint32_t> sequence = 0;
+	T value = {};
+
+	SeqLock(const SeqLock &other) = delete;
+	SeqLock &operator=(const SeqLock &) = delete;
+};
@@ -95,42 +95,32 @@ void ATag::BeginPlay()
 
 double ATag::UpdateTransform(FTransform update)
 {
-	april_transforms.push_back(update);
-	while (april_transforms.size() > 4)
-		april_transforms.pop_front();
-
-	
-	if (april_transforms.size() < 4)
+	transform_lock.lock();
+	pose_filter.noise = {
+		pose_position_noise, FMath::DegreesToRadians(pose_rotation_noise),
+		pose_position_drift, FMath::DegreesToRadians(pose_rotation_drift),
+		pose_position_tolerance, FMath::DegreesToRadians(pose_rotation_tolerance)
+	};
+
+	double interval = 0;
+	if (pose_filter.Update(update, FPlatformTime::Seconds()))
 	{
-		RecalculateAverageTransform();
-		return 0;
+		tag_transform = pose_filter.Transform();
+		interval = pose_filter.TimeUntilUncertain(update_rate);
 	}
+	achieved_update_rate = pose_filter.UpdateRate();
+	transform_lock.unlock();
 
-	auto new_position = update.GetTranslation();
-	auto average_position = tag_transform.GetTranslation();
-
-	auto relative_difference = ((new_position - average_position).GetAbs() / new_position.ComponentMax(average_position)).GetMax();
-
-	auto new_rotation = update.GetRotation().Rotator().Quaternion();
-	auto average_rotation = tag_transform.GetRotation().Rotator().Quaternion();
-	
-	relative_difference = max(relative_difference, new_rotation.AngularDistance(average_rotation));
-	
-	RecalculateAverageTransform();
-	
-	return pow(1. - min(relative_difference, 1.), 2.);
+	return interval;
 }
 
-void ATag::RecalculateAverageTransform()
+double ATag::Uncertainty(double now)
 {
-	FTransform average = FTransform::Identity;
+	transform_lock.lock();
+	double uncertainty = pose_filter.Uncertainty(now);
+	transform_lock.unlock();
 
-	for (int i = 0; i < april_transforms.size(); i++)
-	{
-		average.Blend(average, april_transforms[i], 1 / double(i + 1));
-	}
-
-	tag_transform = average;
+	return uncertainty;
 }
 
 // Called every frame
@@ -140,8 +130,11 @@ void ATag::Tick(float DeltaTime)
 
 	if (tag_type == Dynamic)
 	{
-		RecalculateAverageTransform();
-		SetActorTransform(tag_transform);
+		transform_lock.lock();
+		FTransform transform = tag_transform;
+		transform_lock.unlock();
+
+		SetActorTransform(transform);
 	}
 
 	UpdateScale();
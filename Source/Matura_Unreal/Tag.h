@@ -2,12 +2,13 @@
 
 #pragma once
 
-#include <deque>
 #include <mutex>
 
 #include "CoreMinimal.h"
 #include "GameFramework/Actor.h"
 
+#include "PoseFilter.h"
+
 #include "Tag.generated.h"
 
 UENUM()
@@ -41,16 +42,20 @@ public:
 	void UpdateScale();
 
 	FTransform tag_transform;
-	std::deque<FTransform> april_transforms;
+	// the noise is taken from the pose properties on every update, the cameras update tags from their own threads
+	PoseFilter pose_filter{{}};
+	// the cameras update the tag from their own threads
 	std::mutex transform_lock;
 
+	// returns the time in seconds until the tag should be updated again
 	double UpdateTransform(FTransform update);
+	// see PoseFilter::Uncertainty
+	double Uncertainty(double now);
 
 
 protected:
 	// Called when the game starts or when spawned
 	virtual void BeginPlay() override;
-	void RecalculateAverageTransform();
 	void UpdateTexture();
 
 public:
@@ -75,10 +80,34 @@ public:
 
 	UPROPERTY(EditAnywhere, Category = Tag, DisplayName="Minimum Update Rate (s)", meta=(EditCondition="tag_type == TagType::Dynamic", EditConditionHides))
 	double update_rate = 1;
+
+	UPROPERTY(VisibleAnywhere, Category = Tag, DisplayName="Achieved Update Rate (Hz)", meta=(EditCondition="tag_type == TagType::Dynamic", EditConditionHides))
+	double achieved_update_rate = 0;
 	
 	UPROPERTY(EditAnywhere, Category = Tag)
 	double tag_size;
 
+	// standard deviation of the pose of a dynamic tag seen by one camera, like a camera pose solved from one tag
+	UPROPERTY(EditAnywhere, Category = Pose, DisplayName="Position Noise (cm)", meta=(EditCondition="tag_type == TagType::Dynamic", EditConditionHides))
+	double pose_position_noise = 30;
+
+	UPROPERTY(EditAnywhere, Category = Pose, DisplayName="Rotation Noise (deg)", meta=(EditCondition="tag_type == TagType::Dynamic", EditConditionHides))
+	double pose_rotation_noise = 3;
+
+	// dynamic tags move, so they drift much faster than the cameras
+	UPROPERTY(EditAnywhere, Category = Pose, DisplayName="Position Drift (cm/s)", meta=(EditCondition="tag_type == TagType::Dynamic", EditConditionHides))
+	double pose_position_drift = 5;
+
+	UPROPERTY(EditAnywhere, Category = Pose, DisplayName="Rotation Drift (deg/s)", meta=(EditCondition="tag_type == TagType::Dynamic", EditConditionHides))
+	double pose_rotation_drift = 5;
+
+	// the tag is updated less often once its pose is this certain
+	UPROPERTY(EditAnywhere, Category = Pose, DisplayName="Position Tolerance (cm)", meta=(EditCondition="tag_type == TagType::Dynamic", EditConditionHides))
+	double pose_position_tolerance = 10;
+
+	UPROPERTY(EditAnywhere, Category = Pose, DisplayName="Rotation Tolerance (deg)", meta=(EditCondition="tag_type == TagType::Dynamic", EditConditionHides))
+	double pose_rotation_tolerance = 3;
+
 	UPROPERTY(EditAnywhere)
 	UStaticMeshComponent *mesh;
 	
@@ -0,0 +1,267 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#include "TagDetectionService.h"
+
+#include "HAL/FileManager.h"
+#include "Misc/Paths.h"
+
+#include "TrackingCamera.h"
+
+#include "GlobalIncludes.h"
+
+// indexed by TagFamily
+static apriltag_family_t* (*const family_create[TagDetectionService::num_families])() = {
+	tag16h5_create, tag25h9_create, tag36h11_create, tagCircle21h7_create, tagCircle49h12_create,
+	tagCustom48h12_create, tagStandard41h12_create, tagStandard52h13_create
+};
+
+static void (*const family_destroy[TagDetectionService::num_families])(apriltag_family_t*) = {
+	tag16h5_destroy, tag25h9_destroy, tag36h11_destroy, tagCircle21h7_destroy, tagCircle49h12_destroy,
+	tagCustom48h12_destroy, tagStandard41h12_destroy, tagStandard52h13_destroy
+};
+
+TagDetectionService::TagDetectionService(int num_workers, int max_queued) : num_workers(num_workers), max_queued(max_queued)
+{
+	// decode tables are shared by all detectors and mapped from here instead of rebuilt on the next start
+	FString decode_cache_dir = FPaths::ConvertRelativePathToFull(FPaths::ProjectSavedDir() / TEXT("AprilTag"));
+	if (IFileManager::Get().MakeDirectory(*decode_cache_dir, true))
+		apriltag_decode_cache_set_dir(TCHAR_TO_UTF8(*decode_cache_dir));
+
+	queue.reserve(max_queued + 1);
+
+	Start();
+}
+
+TagDetectionService::~TagDetectionService()
+{
+	Shutdown();
+}
+
+void TagDetectionService::Start()
+{
+	if (!workers.empty())
+		return;
+
+	for (int i = 0; i < num_workers; i++)
+	{
+		auto worker = std::make_unique<Worker>();
+
+		worker->detector = apriltag_detector_create();
+		worker->detector->quad_decimate = 1.0; // decimate factor
+		worker->detector->quad_sigma = 0.0; // apply this much low-pass blur to input
+		worker->detector->nthreads = 1; // split work this many ways, set from the CPU budget before every detection
+		worker->detector->debug = false; // print debug output
+		worker->detector->refine_edges = true; // refine tag edges
+
+		workers.push_back(std::move(worker));
+	}
+
+	{
+		std::unique_lock l(mutex);
+		running = true;
+	}
+	SetCpuBudget(default_cpu_budget);
+
+	for (auto& worker : workers)
+		worker->thread = std::thread(&TagDetectionService::Run, this, std::ref(*worker));
+}
+
+void TagDetectionService::Shutdown()
+{
+	if (workers.empty())
+		return;
+
+	std::vector<Request> rejected;
+	{
+		std::unique_lock l(mutex);
+		running = false;
+		std::swap(rejected, queue);
+		queue.reserve(max_queued + 1);
+		stats.rejected += rejected.size();
+		stats.queued = 0;
+	}
+	cv.notify_all();
+
+	for (Request& request : rejected)
+		Reject(request);
+
+	// a detection that already started finishes, UpdateTags needs its camera
+	for (auto& worker : workers)
+	{
+		worker->thread.join();
+
+		// the detector releases the decode tables of the families it decodes
+		uint32 created = 0;
+		for (int i = 0; i < num_families; i++)
+			if (worker->families[i])
+				created |= 1u << i;
+		UseFamilies(*worker, created);
+
+		apriltag_detector_destroy(worker->detector);
+		for (int i = 0; i < num_families; i++)
+			if (worker->families[i])
+				family_destroy[i](worker->families[i]);
+	}
+	workers.clear();
+
+	apriltag_decode_cache_clear();
+}
+
+TagDetectionService& TagDetectionService::Shared()
+{
+	// a detection is split over the cores of the CPU budget through the apriltag worker pool, the second thread only
+	// overlaps the serial parts of two detections
+	static TagDetectionService instance(2, 16);
+	return instance;
+}
+
+TFuture<TagDetectionService::Result> TagDetectionService::Submit(ATrackingCamera* camera, cv::Mat frame_gray,
+                                                                 uint32 families, double priority)
+{
+	Request request{camera, frame_gray, families, priority, 0, clock::now(), TPromise<Result>()};
+	TFuture<Result> future = request.promise.GetFuture();
+
+	std::unique_lock l(mutex);
+
+	if (!running)
+	{
+		stats.rejected++;
+		l.unlock();
+		Reject(request);
+		return future;
+	}
+
+	request.sequence = next_sequence++;
+	queue.push_back(std::move(request));
+
+	if ((int)queue.size() > max_queued)
+	{
+		// lowest priority, newest of those
+		auto dropped = queue.begin();
+		for (auto it = queue.begin(); it != queue.end(); ++it)
+			if (it->priority < dropped->priority || (it->priority == dropped->priority && it->sequence > dropped->sequence))
+				dropped = it;
+
+		Request rejected = std::move(*dropped);
+		queue.erase(dropped);
+		stats.rejected++;
+		stats.queued = queue.size();
+
+		l.unlock();
+		Reject(rejected);
+		cv.notify_one();
+		return future;
+	}
+
+	stats.queued = queue.size();
+
+	l.unlock();
+	cv.notify_one();
+	return future;
+}
+
+void TagDetectionService::SetCpuBudget(double fraction)
+{
+	int nprocs = workerpool_get_nprocs();
+	int cores = FMath::Clamp(FMath::RoundToInt(fraction * nprocs), 1, FMath::Max(nprocs - 1, 1));
+
+	std::unique_lock l(mutex);
+	// every active request runs on its own thread, overlapping the serial parts of two detections is worth more than
+	// splitting one detection further
+	max_active = FMath::Min(cores, (int)workers.size());
+	detector_threads = cores;
+	stats.cores = cores;
+	workerpool_set_shared_workers(cores - max_active);
+	l.unlock();
+
+	cv.notify_all();
+}
+
+TagDetectionService::Stats TagDetectionService::GetStats()
+{
+	std::unique_lock l(mutex);
+	return stats;
+}
+
+void TagDetectionService::Run(Worker& worker)
+{
+	while (true)
+	{
+		std::unique_lock l(mutex);
+		cv.wait(l, [this] { return !running || (!queue.empty() && active < max_active); });
+
+		if (!running)
+			return;
+
+		// highest priority, oldest of those
+		auto next = queue.begin();
+		for (auto it = queue.begin(); it != queue.end(); ++it)
+			if (it->priority > next->priority || (it->priority == next->priority && it->sequence < next->sequence))
+				next = it;
+
+		Request request = std::move(*next);
+		queue.erase(next);
+
+		double wait_ms = std::chrono::duration<double, std::milli>(clock::now() - request.queued).count();
+		total_wait_ms += wait_ms;
+		stats.queued = queue.size();
+		stats.max_wait_ms = FMath::Max(stats.max_wait_ms, wait_ms);
+
+		active++;
+		worker.detector->nthreads = detector_threads;
+
+		l.unlock();
+
+		UseFamilies(worker, request.families);
+		request.promise.SetValue(request.camera->UpdateTags(request.frame, worker.detector));
+
+		l.lock();
+		active--;
+		stats.completed++;
+		stats.mean_wait_ms = total_wait_ms / stats.completed;
+		l.unlock();
+
+		// a slot is free again
+		cv.notify_one();
+	}
+}
+
+void TagDetectionService::UseFamilies(Worker& worker, uint32 families)
+{
+	if (families == worker.used_families)
+		return;
+
+	// only detaches them, apriltag_detector_remove_family would release their decode tables
+	zarray_clear(worker.detector->tag_families);
+	worker.used_families = families;
+
+	for (int i = 0; i < num_families; i++)
+	{
+		if (!(families & (1u << i)))
+			continue;
+
+		if (worker.families[i])
+		{
+			// its decode table is still initialized, so this only attaches it
+			apriltag_detector_add_family(worker.detector, worker.families[i]);
+			continue;
+		}
+
+		apriltag_family_t* fam = family_create[i]();
+		apriltag_detector_add_family(worker.detector, fam);
+		worker.families[i] = fam;
+
+		apriltag_decode_stats stats;
+		if (apriltag_family_decode_stats(fam, &stats) == 0)
+		{
+			LogDisplay(TEXT("Decode table of %s: %llu KiB, %s in %f ms, %f ns per lookup"), *FString(fam->name),
+			           (uint64)stats.table_bytes / 1024, stats.from_cache ? TEXT("mapped") : TEXT("built"), stats.build_ms,
+			           stats.lookup_ns);
+		}
+	}
+}
+
+void TagDetectionService::Reject(Request& request)
+{
+	request.promise.SetValue({});
+}
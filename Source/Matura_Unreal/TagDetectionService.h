@@ -0,0 +1,135 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "CoreMinimal.h"
+#include "Async/Future.h"
+
+#include "PreOpenCVHeaders.h"
+#include "opencv2/core.hpp"
+#include "PostOpenCVHeaders.h"
+
+#include "apriltag/apriltag.h"
+
+class ATag;
+class ATrackingCamera;
+
+// Finds the AprilTags of all cameras on a fixed number of threads. Every thread owns one detector (and with it the
+// scratch memory and tag families), so neither threads nor memory grow with the number of cameras. Cameras queue a
+// grayscale frame and get the result back through a future; the queue is bounded and served by priority.
+// All tag detection together never uses more cores than the CPU budget allows, the rest is left to ball detection.
+class TagDetectionService
+{
+public:
+	struct Result
+	{
+		// identity if no static tag was found
+		FTransform camera_transform = FTransform::Identity;
+		// how many static tags camera_transform was solved from
+		int static_tags = 0;
+		std::map<ATag*, FMatrix> local_tag_transforms;
+	};
+
+	// one per TagFamily
+	static constexpr int num_families = 8;
+
+	struct Stats
+	{
+		uint64 completed = 0;
+		// requests dropped because the queue was full, or the service shut down
+		uint64 rejected = 0;
+		int queued = 0;
+		// time between a request being queued and a thread picking it up
+		double mean_wait_ms = 0;
+		double max_wait_ms = 0;
+		// cores tag detection may use at once
+		int cores = 0;
+	};
+
+	// share of the cores tag detection may use by default
+	static constexpr double default_cpu_budget = 0.2;
+
+	TagDetectionService(int num_workers, int max_queued);
+	~TagDetectionService();
+
+	// the instance all cameras share
+	static TagDetectionService& Shared();
+
+	// creates the detection threads again after a Shutdown, does nothing while they run
+	void Start();
+
+	// Rejects what is still queued, waits for the running detections and frees the threads and detectors. Must be
+	// called while the cameras and the engine are still alive, the destructor only runs during static destruction.
+	void Shutdown();
+
+	// Queues a frame of the camera, families is a bit mask of the TagFamily values to look for. Higher priorities are
+	// served first, equal ones in order. If the queue is full the request with the lowest priority (the newest of
+	// those, possibly this one) is dropped: its future is resolved with an identity transform, which means "no update".
+	// The camera must stay alive until the future is ready.
+	TFuture<Result> Submit(ATrackingCamera* camera, cv::Mat frame_gray, uint32 families, double priority);
+
+	// fraction of the processors tag detection may keep busy, at least one core and never all of them. Limits how many
+	// requests run at once and how many of the shared apriltag worker threads they use.
+	void SetCpuBudget(double fraction);
+
+	Stats GetStats();
+
+private:
+	TagDetectionService(const TagDetectionService&) = delete;
+	TagDetectionService& operator=(const TagDetectionService&) = delete;
+
+	typedef std::chrono::steady_clock clock;
+
+	struct Request
+	{
+		ATrackingCamera* camera;
+		cv::Mat frame;
+		uint32 families;
+		double priority;
+		uint64 sequence;
+		clock::time_point queued;
+		TPromise<Result> promise;
+	};
+
+	struct Worker
+	{
+		apriltag_detector_t* detector = nullptr;
+		apriltag_family_t* families[num_families] = {}; // created on first use, indexed by TagFamily
+		uint32 used_families = 0; // the mask of the families the detector decodes
+		std::thread thread;
+	};
+
+	void Run(Worker& worker);
+
+	// makes the worker's detector decode only the families of the mask. Families are created on first use and kept
+	// with their decode tables for later requests
+	static void UseFamilies(Worker& worker, uint32 families);
+
+	static void Reject(Request& request);
+
+	int num_workers;
+	int max_queued;
+	// only changed by Start and Shutdown, on the game thread
+	std::vector<std::unique_ptr<Worker>> workers;
+
+	// guards everything below
+	std::mutex mutex;
+	std::condition_variable cv;
+	bool running = false;
+	std::vector<Request> queue;
+	uint64 next_sequence = 0;
+	// requests being detected and how many may be at once, the cores of the budget left over go to the shared workers
+	int active = 0;
+	int max_active = 1;
+	int detector_threads = 1;
+	Stats stats;
+	double total_wait_ms = 0;
+};
@@ -0,0 +1,126 @@
+#pragma once
+
+#include "CoreMinimal.h"
+
+#include "RollingPercentiles.h"
+
+#include "apriltag/apriltag.h"
+
+// Keeps the stage times and item counts of a camera's last few hundred tag detections to report percentiles of
+// them, not thread safe
+class TagDetectionStats
+{
+public:
+	static constexpr int capacity = 512;
+
+	enum Slot
+	{
+		// in ms
+		Decimate = 0,
+		Blur,
+		Threshold,
+		Segment,
+		Fit,
+		Decode,
+		Reconcile,
+		Total,
+		// counts
+		Clusters,
+		Quads,
+		Rejected,
+		Decodes,
+		DecodeHits,
+		Duplicates,
+		Detections,
+		NumSlots
+	};
+
+	static constexpr int first_count = Clusters;
+
+	static constexpr const TCHAR* slot_names[NumSlots] = {
+		TEXT("decimate"), TEXT("blur"), TEXT("threshold"), TEXT("segment"), TEXT("fit"), TEXT("decode"),
+		TEXT("reconcile"), TEXT("total"), TEXT("clusters"), TEXT("quads"), TEXT("rejected"), TEXT("decodes"),
+		TEXT("decode_hits"), TEXT("duplicates"), TEXT("detections")
+	};
+
+	void Add(const apriltag_frame_stats& stats)
+	{
+		double values[NumSlots];
+		Values(stats, values);
+		samples.Add(values);
+	}
+
+	// p in [0, 1]
+	double Percentile(int slot, double p) const
+	{
+		return samples.Percentile(slot, p);
+	}
+
+	int Count() const
+	{
+		return samples.Count();
+	}
+
+	// p50/p95/p99 of every slot, one per line
+	FString Report() const
+	{
+		FString report = FString::Printf(TEXT("p50 / p95 / p99 over %d detections"), Count());
+		for (int i = 0; i < NumSlots; i++)
+		{
+			if (i < first_count)
+				report += FString::Printf(TEXT("\n%s %.2f / %.2f / %.2f ms"), slot_names[i], Percentile(i, 0.5),
+				                          Percentile(i, 0.95), Percentile(i, 0.99));
+			else
+				report += FString::Printf(TEXT("\n%s %.0f / %.0f / %.0f"), slot_names[i], Percentile(i, 0.5),
+				                          Percentile(i, 0.95), Percentile(i, 0.99));
+		}
+		return report;
+	}
+
+	static FString CsvHeader()
+	{
+		FString header = TEXT("time,tracked");
+		for (int i = 0; i < NumSlots; i++)
+			header += FString(TEXT(",")) + slot_names[i] + (i < first_count ? TEXT("_ms") : TEXT(""));
+		return header + TEXT("\n");
+	}
+
+	// time in seconds
+	static FString CsvRow(double time, const apriltag_frame_stats& stats)
+	{
+		double values[NumSlots];
+		Values(stats, values);
+
+		FString row = FString::Printf(TEXT("%.6f,%d"), time, stats.tracked ? 1 : 0);
+		for (int i = 0; i < NumSlots; i++)
+		{
+			if (i < first_count)
+				row += FString::Printf(TEXT(",%.4f"), values[i]);
+			else
+				row += FString::Printf(TEXT(",%.0f"), values[i]);
+		}
+		return row + TEXT("\n");
+	}
+
+private:
+	static void Values(const apriltag_frame_stats& stats, double (&values)[NumSlots])
+	{
+		values[Decimate] = stats.decimate_ms;
+		values[Blur] = stats.blur_ms;
+		values[Threshold] = stats.threshold_ms;
+		values[Segment] = stats.segment_ms;
+		values[Fit] = stats.fit_ms;
+		values[Decode] = stats.decode_ms;
+		values[Reconcile] = stats.reconcile_ms;
+		values[Total] = stats.total_ms;
+		values[Clusters] = stats.nclusters;
+		values[Quads] = stats.nquads;
+		values[Rejected] = stats.nrejected;
+		values[Decodes] = stats.ndecodes;
+		values[DecodeHits] = stats.ndecode_hits;
+		values[Duplicates] = stats.nduplicates;
+		values[Detections] = stats.ndetections;
+	}
+
+	RollingPercentiles<NumSlots, capacity> samples;
+};
@@ -4,10 +4,13 @@
 
 #include "Engine/World.h"
 #include "EngineUtils.h"
+#include "HAL/FileManager.h"
+#include "Misc/CommandLine.h"
+#include "Misc/FileHelper.h"
+#include "Misc/Parse.h"
+#include "Misc/Paths.h"
 
 #include <string>
-#include <functional>
-#include <set>
 #include <map>
 #include <thread>
 
@@ -56,12 +59,30 @@ void ATrackingCamera::InitCamera()
 {
 	loaded = false;
 
-	if (camera_path != "")
+	FString recording = ReplayPath();
+	if (recording != "")
+		playback.Open(TCHAR_TO_UTF8(*recording), ReplayRealtime());
+	else if (camera_path != "")
 		cv_cap.open(TCHAR_TO_UTF8(*camera_path));
 	else
 		LogError(TEXT("Invalid cmaera path!"));
 
-	if (cv_cap.isOpened())
+	if (playback.IsOpen())
+	{
+		const CameraCalibration& calibration = playback.Calibration();
+		cv_size = Size(calibration.width, calibration.height);
+		resolution = FVector2D(calibration.width, calibration.height);
+		focal_length = FVector2D(calibration.focal_length[0], calibration.focal_length[1]);
+		k_twins = FVector2D(calibration.k[0], calibration.k[1]);
+		p_twins = FVector2D(calibration.p[0], calibration.p[1]);
+
+		const double* r = calibration.rotation;
+		const double* t = calibration.translation;
+		camera_transform = FTransform(FQuat(r[0], r[1], r[2], r[3]), FVector(t[0], t[1], t[2]));
+
+		LogWarning(TEXT("Replaying %s with %dx%d"), *recording, cv_size.width, cv_size.height);
+	}
+	else if (cv_cap.isOpened())
 	{
 		if (!cv_cap.set(CAP_PROP_FOURCC, VideoWriter::fourcc('M', 'J', 'P', 'G')))
 			LogWarning(TEXT("Could not set MJPG format"));
@@ -96,30 +117,29 @@ void ATrackingCamera::InitCamera()
 		       int(cv_cap.get(CAP_PROP_FPS)));
 
 		LogDisplay(TEXT("Camera GUID: %d"), int(cv_cap.get(CAP_PROP_GUID)));
+	}
+	else
+	{
+		LogError(TEXT("Could not open camera at path: %s"), recording != "" ? *recording : *camera_path);
+		return;
+	}
 
-		camera_texture_2d = UTexture2D::CreateTransient(cv_size.width, cv_size.height, PF_R8G8B8A8);
+	camera_texture_2d = UTexture2D::CreateTransient(cv_size.width, cv_size.height, PF_R8G8B8A8);
 #if WITH_EDITORONLY_DATA
-		camera_texture_2d->MipGenSettings = TMGS_NoMipmaps;
+	camera_texture_2d->MipGenSettings = TMGS_NoMipmaps;
 #endif
 
-		auto plate_config = image_plate->GetPlate();
-		{
-			if (plate_config.Material)
-				plate_config.DynamicMaterial = UMaterialInstanceDynamic::Create(plate_config.Material, this);
-
-			if (plate_config.DynamicMaterial)
-				plate_config.DynamicMaterial->SetScalarParameterValue(FName("Opacity"), plate_opacity);
+	auto plate_config = image_plate->GetPlate();
+	{
+		if (plate_config.Material)
+			plate_config.DynamicMaterial = UMaterialInstanceDynamic::Create(plate_config.Material, this);
 
-			plate_config.RenderTexture = camera_texture_2d;
-		}
-		image_plate->SetImagePlate(plate_config);
+		if (plate_config.DynamicMaterial)
+			plate_config.DynamicMaterial->SetScalarParameterValue(FName("Opacity"), plate_opacity);
 
+		plate_config.RenderTexture = camera_texture_2d;
 	}
-	else
-	{
-		LogError(TEXT("Could not open camera at path: %s"), *camera_path);
-		return;
-	}
+	image_plate->SetImagePlate(plate_config);
 	
 	initUndistortRectifyMap(K(), p(), {}, {}, cv_size, CV_32FC1, cv_undistort_map1,
 	                        cv_undistort_map2);
@@ -155,41 +175,22 @@ void ATrackingCamera::InitCamera()
 
 void ATrackingCamera::CreateTagDetector()
 {
-	if (at_td)
-		return;
-	
-	at_td = apriltag_detector_create();
-
-	at_td->quad_decimate = 1.0; // decimate factor
-	at_td->quad_sigma = 0.0; // apply this much low-pass blur to input
-	at_td->nthreads = 8; // use this many cpu threads
-	at_td->debug = false; // print debug output
-	at_td->refine_edges = true; // refine tag edges
-
-
-	static const std::function<apriltag_family_t *()> family_functions[] = {
-		tag16h5_create, tag25h9_create, tag36h11_create, tagCircle21h7_create, tagCircle49h12_create,
-		tagCustom48h12_create, tagStandard41h12_create, tagStandard52h13_create
-	};
-
-	std::set<int> families;
+	// the detectors and tag families live in the TagDetectionService, only remember which families to look for
+	tag_families = 0;
 	for (ATag* tag : april_tags)
 		if (tag)
-			families.insert(tag->tag_family);
+			tag_families |= 1u << tag->tag_family;
 
-	for (int family : families)
-	{
-		apriltag_family_t* fam = family_functions[family]();
-		apriltag_detector_add_family(at_td, fam);
-		created_families.Append({fam});
-	}
+	last_tags_mut.lock();
+	tracked_updates = 0;
+	last_tags_mut.unlock();
 
 	loaded = true;
 }
 
-Mat ATrackingCamera::K() const
+Matx33d ATrackingCamera::K() const
 {
-	return (cv::Mat_<double>(3, 3) <<
+	return Matx33d(
 		focal_length.X, 0, cv_size.width / 2,
 		0, focal_length.Y, cv_size.height / 2,
 		0, 0, 1);
@@ -203,11 +204,21 @@ Mat ATrackingCamera::p() const
 
 double ATrackingCamera::SyncFrame()
 {
-	if (!cv_cap.isOpened() || !loaded)
+	if (!IsOpened() || !loaded)
 		return 0;
 
-	cv_cap.grab();
-	double time_captured = cv_cap.get(CAP_PROP_POS_MSEC);
+	double time_captured;
+	if (playback.IsOpen())
+	{
+		if (!playback.Next(time_captured, cv_frame_raw))
+			return 0;
+		time_captured *= 1000;
+	}
+	else
+	{
+		cv_cap.grab();
+		time_captured = cv_cap.get(CAP_PROP_POS_MSEC);
+	}
 
 	if (debug_output)
 		LogDisplay(TEXT("Camera %s grabbed frame at %f ms"), *camera_path, time_captured);
@@ -217,11 +228,12 @@ double ATrackingCamera::SyncFrame()
 
 void ATrackingCamera::GetFrame()
 {
-	if (!cv_cap.isOpened() || !loaded || camera_path == "")
+	if (!IsOpened() || !loaded)
 		return;
 	
-	Mat cv_frame_raw, cv_frame_distorted;
-	cv_cap.retrieve(cv_frame_raw);
+	Mat cv_frame_distorted;
+	if (!playback.IsOpen())
+		cv_cap.retrieve(cv_frame_raw);
 	
 	auto time_start = std::chrono::high_resolution_clock::now().time_since_epoch();
 
@@ -290,7 +302,7 @@ void ATrackingCamera::GetFrame()
 
 Point2d ATrackingCamera::FindBall()
 {
-	if (!cv_cap.isOpened() || !loaded)
+	if (!IsOpened() || !loaded)
 		return {};
 
 	if (cv_frame.empty())
@@ -512,44 +524,16 @@ Point2d ATrackingCamera::FindBall()
 	return ball = det;
 }
 
-void ATrackingCamera::RecalculateAverageTransform()
+double ATrackingCamera::UpdateTransform(FTransform update, int static_tags)
 {
-	FTransform average = FTransform::Identity;
-
-	for (int i = 0; i < april_transforms.size(); i++)
-	{
-		average.Blend(average, april_transforms[i], 1 / double(i + 1));
-	}
-
-	camera_transform = average;
-}
-
-double ATrackingCamera::UpdateTransform(FTransform update)
-{
-	april_transforms.push_back(update);
-	while (april_transforms.size() > 10)
-		april_transforms.pop_front();
-
-
-	if (april_transforms.size() < 10)
-	{
-		RecalculateAverageTransform();
+	last_tag_update_time = FPlatformTime::Seconds();
+	bool accepted = pose_filter.Update(update, last_tag_update_time, 1 / FMath::Sqrt(double(FMath::Max(static_tags, 1))));
+	achieved_update_rate = pose_filter.UpdateRate();
+	if (!accepted)
 		return 0;
-	}
-
-	auto new_position = update.GetTranslation();
-	auto average_position = camera_transform.GetTranslation();
-
-	auto relative_difference = ((new_position - average_position).GetAbs() / new_position.ComponentMax(average_position)).GetMax();
-
-	auto new_rotation = update.GetRotation().Rotator().Quaternion();
-	auto average_rotation = camera_transform.GetRotation().Rotator().Quaternion();
-
-	relative_difference = max(relative_difference, new_rotation.AngularDistance(average_rotation));
-
-	RecalculateAverageTransform();
 
-	return pow(1. - min(relative_difference, 1.), 2.) * update_rate;
+	camera_transform = pose_filter.Transform();
+	return pose_filter.TimeUntilUncertain(update_rate);
 }
 
 void ATrackingCamera::DrawDetectedTags()
@@ -582,64 +566,165 @@ void ATrackingCamera::DrawDetectedTags()
 	last_tags_mut.unlock();
 }
 
-std::pair<FTransform, std::map<ATag*, FMatrix>> ATrackingCamera::UpdateTags(Mat frame)
+TFuture<TagDetectionService::Result> ATrackingCamera::RequestTagUpdate()
+{
+	Mat cv_frame_gray;
+
+	if (!cv_frame.empty())
+		cvtColor(cv_frame, cv_frame_gray, COLOR_RGB2GRAY);
+
+	return TagDetectionService::Shared().Submit(this, cv_frame_gray, tag_families, TagPriority());
+}
+
+double ATrackingCamera::TagPriority() const
+{
+	double now = FPlatformTime::Seconds();
+
+	double uncertainty = pose_filter.Uncertainty(now);
+	for (ATag* tag : last_dynamic_tags)
+		uncertainty = FMath::Max(uncertainty, tag->Uncertainty(now));
+
+	double overdue = last_tag_update_time > 0 ? (now - last_tag_update_time) / update_rate : 0;
+	return FMath::Min(uncertainty, 10.) + FMath::Min(overdue, 1.);
+}
+
+// the transform of a tag in the camera frame from its apriltag pose, the camera looks along -z
+static FMatrix TagPoseToLocalTransform(const double* R, const double* t)
+{
+	FMatrix rotation_matrix(FVector(R[0], R[3], R[6]),
+	                        FVector(R[1], R[4], R[7]),
+	                        FVector(R[2], R[5], R[8]),
+	                        FVector(0));
+
+	FMatrix local_tag_transform = FQuat::MakeFromEuler(rotation_matrix.ToQuat().Euler() * FVector(-1, -1, 1)).ToMatrix();
+	local_tag_transform.SetOrigin(FVector(t[0], t[1], -t[2]));
+	return local_tag_transform;
+}
+
+// inverse of TagPoseToLocalTransform, negating roll and pitch is the same as mirroring z on both sides of the rotation
+static void LocalTransformToTagPose(const FMatrix& local_transform, double* R, double* t)
+{
+	static const double mirror[3] = {1, 1, -1};
+	for (int i = 0; i < 3; i++)
+	{
+		for (int j = 0; j < 3; j++)
+			R[3 * i + j] = mirror[i] * mirror[j] * local_transform.M[j][i];
+		t[i] = mirror[i] * local_transform.M[3][i];
+	}
+}
+
+// the camera transform from the corners of all static tags, solved together in the world frame (mirrored in z like
+// the camera frame), the static tags are the last tags of poses from first on
+static FMatrix StaticTagsCameraTransform(apriltag_pose_batch_t* poses, int first,
+                                         const std::vector<std::pair<apriltag_detection_t*, ATag*>>& static_tags)
+{
+	static const double corners[4][2] = {{-1, 1}, {1, 1}, {1, -1}, {-1, -1}};
+
+	int n = (int)static_tags.size();
+	std::vector<double> points(n * 4 * 3);
+	// the world to camera rotation every tag gives alone, the one fitting all corners best is the starting point
+	std::vector<double> single_rotations(n * 9);
+
+	for (int i = 0; i < n; i++)
+	{
+		ATag* tag = static_tags[i].second;
+		FMatrix tag_transform = tag->mesh->GetComponentTransform().ToMatrixNoScale();
+		double scale = tag->tag_size * 100 / 2;
+
+		for (int j = 0; j < 4; j++)
+		{
+			FVector corner = tag_transform.TransformPosition(FVector(corners[j][0] * scale, corners[j][1] * scale, 0));
+			double* point = &points[(i * 4 + j) * 3];
+			point[0] = corner.X;
+			point[1] = corner.Y;
+			point[2] = -corner.Z;
+		}
+
+		double single_translation[3];
+		LocalTransformToTagPose(tag_transform.Inverse() * TagPoseToLocalTransform(poses->R[first + i], poses->t[first + i]),
+		                        &single_rotations[i * 9], single_translation);
+	}
+
+	double R[9], t[3];
+	estimate_multi_tag_pose(poses->v[first], reinterpret_cast<const double(*)[3]>(points.data()), n * 4,
+	                        reinterpret_cast<const double(*)[9]>(single_rotations.data()), n, R, t, 50);
+
+	return FQuat::MakeFromEuler(FVector(0, -90, -90)).ToMatrix() * TagPoseToLocalTransform(R, t).Inverse();
+}
+
+TagDetectionService::Result ATrackingCamera::UpdateTags(Mat frame_gray, apriltag_detector_t* detector)
 {
-	if (frame.empty())
+	if (frame_gray.empty())
 	{
 		LogWarning(TEXT("cv_frame is empty, cannot localize camera"));
-		return {FTransform::Identity, {}};
+		return {};
 	}
 
-	if (!at_td)
+	if (!detector)
 	{
 		LogWarning(TEXT("Tag detector is null, cannot detect"));
-		return {FTransform::Identity, {}};
+		return {};
 	}
 
 	auto time_before = std::chrono::high_resolution_clock::now();
 
-	Mat cv_frame_gray;
-
-	cvtColor(frame, cv_frame_gray, COLOR_RGB2GRAY);
-
 	// Make an image_u8_t header for the Mat data
 	image_u8_t im {
-		cv_frame_gray.cols,
-		cv_frame_gray.rows,
-		cv_frame_gray.cols,
-		cv_frame_gray.data};
+		frame_gray.cols,
+		frame_gray.rows,
+		(int32_t)frame_gray.step,
+		frame_gray.data};
+
+	detector->quad_decimate = quad_decimate;
+	detector->quad_sigma = quad_sigma;
+	detector->pyramid_levels = pyramid_levels;
 
-	if (cv_frame_gray.empty())
+	zarray_t* detections;
+	if (track_tags)
 	{
-		LogWarning(TEXT("cv_frame is empty, cannot localize camera"));
-		return {FTransform::Identity, {}};
+		last_tags_mut.lock();
+		std::vector<apriltag_detection_t> previous_tags = last_tags;
+		detector->track_frames = tracked_updates;
+		last_tags_mut.unlock();
+
+		detector->track_full_interval = full_detect_interval;
+		detections = apriltag_detector_track(detector, &im, previous_tags.data(), (int)previous_tags.size());
+
+		last_tags_mut.lock();
+		tracked_updates = detector->track_frames;
+		last_tags_mut.unlock();
+	}
+	else
+	{
+		detections = apriltag_detector_detect(detector, &im);
 	}
 
-	zarray_t* detections = apriltag_detector_detect(at_td, &im);
+	apriltag_frame_stats frame_stats;
+	apriltag_detector_frame_stats(detector, &frame_stats);
 
-	FTransform average_transform = FTransform::Identity;
-	float total_transformations = 0;
+	detection_stats_mut.lock();
+	detection_stats.Add(frame_stats);
+	if (write_detection_stats)
+		detection_stats_csv_rows += TagDetectionStats::CsvRow(FPlatformTime::Seconds(), frame_stats);
+	detection_stats_mut.unlock();
+
+	std::map<std::string, int> family_names = {
+		{"tag16h5", 0}, {"tag25h9", 1}, {"tag36h11", 2}, {"tagCircle21h7", 3}, {"tagCircle49h12", 4},
+		{"tagCustom48h12", 5}, {"tagStandard41h12", 6}, {"tagStandard52h13", 7}
+	};
+
+	std::vector<std::pair<apriltag_detection_t*, ATag*>> dynamic_tags, static_tags;
 
 	last_tags_mut.lock();
 	last_tags.clear();
 
-	std::map<ATag*, FMatrix> local_tag_transforms;
-
-	// Draw detection outlines
 	for (int i = 0; i < zarray_size(detections); i++)
 	{
-		std::map<std::string, int> family_names = {
-			{"tag16h5", 0}, {"tag25h9", 1}, {"tag36h11", 2}, {"tagCircle21h7", 3}, {"tagCircle49h12", 4},
-			{"tagCustom48h12", 5}, {"tagStandard41h12", 6}, {"tagStandard52h13", 7}
-		};
-
 		apriltag_detection_t* det;
 		zarray_get(detections, i, &det);
 
 		last_tags.push_back(*det);
 
-		FString name = det->family->name;
-
 		ATag* det_tag = NULL;
 		for (ATag* tag : april_tags)
 		{
@@ -648,112 +733,90 @@ std::pair<FTransform, std::map<ATag*, FMatrix>> ATrackingCamera::UpdateTags(Mat
 		}
 
 		if (det_tag)
-		{
-			apriltag_detection_info_t info;
-			info.det = det;
-			info.tagsize = det_tag->tag_size * 100;
-			info.fx = focal_length.X;
-			info.fy = focal_length.Y;
-			info.cx = cv_size.width / 2; // using half the resolution for now
-			info.cy = cv_size.height / 2;
-
-			apriltag_pose_t pose;
-			estimate_tag_pose(&info, &pose);
-
-			FMatrix rotation_matrix(FVector(pose.R->data[0], pose.R->data[3], pose.R->data[6]),
-			                        FVector(pose.R->data[1], pose.R->data[4], pose.R->data[7]),
-			                        FVector(pose.R->data[2], pose.R->data[5], pose.R->data[8]),
-			                        FVector(0));
-
-			FMatrix local_tag_transform = FQuat::MakeFromEuler(
-					rotation_matrix.ToQuat().Euler() * FVector(-1, -1, 1)).
-				ToMatrix();
-			local_tag_transform.SetOrigin(FVector(pose.t->data[0], pose.t->data[1], -pose.t->data[2]));
-
-			if (det_tag->tag_type == TagType::Static)
-			{
-				FMatrix tag_transform = det_tag->mesh->GetComponentTransform().ToMatrixNoScale();
-
-				FMatrix camera_world_transform = FQuat::MakeFromEuler(FVector(0, -90, -90)).ToMatrix() *
-					local_tag_transform.Inverse() * tag_transform;
-
-				average_transform.Blend(average_transform, FTransform(camera_world_transform),
-				                        1 / (total_transformations + 1));
-				total_transformations++;
-			}
-			else
-			{
-				local_tag_transforms[det_tag] = local_tag_transform;
-			}
-		}
+			(det_tag->tag_type == TagType::Static ? static_tags : dynamic_tags).push_back({det, det_tag});
 	}
 	last_tags_mut.unlock();
 
+	// all tags of the frame share the intrinsics, the static ones come last so their corners are contiguous
+	apriltag_pose_batch_t* poses = apriltag_pose_batch_create(focal_length.X, focal_length.Y,
+	                                                          cv_size.width / 2, // using half the resolution for now
+	                                                          cv_size.height / 2,
+	                                                          int(dynamic_tags.size() + static_tags.size()));
+	for (auto [det, tag] : dynamic_tags)
+		apriltag_pose_batch_add(poses, det, tag->tag_size * 100);
+	for (auto [det, tag] : static_tags)
+		apriltag_pose_batch_add(poses, det, tag->tag_size * 100);
+
+	estimate_tag_poses(poses, 0, poses->size, 50);
+
+	std::map<ATag*, FMatrix> local_tag_transforms;
+	for (int i = 0; i < dynamic_tags.size(); i++)
+		local_tag_transforms[dynamic_tags[i].second] = TagPoseToLocalTransform(poses->R[i], poses->t[i]);
+
+	FTransform camera_world_transform = FTransform::Identity;
+	if (!static_tags.empty())
+		camera_world_transform = FTransform(StaticTagsCameraTransform(poses, int(dynamic_tags.size()), static_tags));
+
+	apriltag_pose_batch_destroy(poses);
 	apriltag_detections_destroy(detections);
 
 	auto time_after = std::chrono::high_resolution_clock::now();
 
 	if (debug_output)
-		LogDisplay(TEXT("Took camera %s %f ms to find apriltag"), *camera_path, (time_after - time_before).count() / 1e6);
+	{
+		LogDisplay(TEXT("Took camera %s %f ms to find apriltag (%s)"), *camera_path, (time_after - time_before).count() / 1e6,
+		           detector->tracked ? TEXT("tracked") : TEXT("full frame"));
+		LogDisplay(TEXT("AprilTag scratch memory of camera %s: %u allocations this frame, %llu KiB"), *camera_path,
+		           detector->scratch_mallocs, (uint64)detector->scratch_bytes / 1024);
+		LogDisplay(TEXT("AprilTag quads of camera %s: %u found, %u rejected by geometry, %u by border, %u by precheck, %u decoded"),
+		           *camera_path, detector->nquads, detector->nrejected_geometry, detector->nrejected_border,
+		           detector->nrejected_precheck, detector->ndecoded);
+
+		TagDetectionService::Stats stats = TagDetectionService::Shared().GetStats();
+		LogDisplay(TEXT("Tag detection service: %llu completed, %llu rejected, %d queued, %f ms mean wait, %f ms max wait, %d cores"),
+		           stats.completed, stats.rejected, stats.queued, stats.mean_wait_ms, stats.max_wait_ms, stats.cores);
+		LogDisplay(TEXT("Tag updates of camera %s: %f Hz"), *camera_path, achieved_update_rate);
+	}
 
-	return {average_transform, local_tag_transforms};
+	return {camera_world_transform, int(static_tags.size()), local_tag_transforms};
 }
 
-void ATrackingCamera::ReleaseTagDetector()
+void ATrackingCamera::PublishDetectionStats()
 {
-	if (at_td)
-	{
-		apriltag_detector_destroy(at_td);
-	}
+	double now = FPlatformTime::Seconds();
+	if (now - last_stats_publish < 1)
+		return;
+	last_stats_publish = now;
 
-	// destroy tag families
-	for (apriltag_family_t* tf : created_families)
-	{
-		if (!tf)
-		{
-			LogWarning(TEXT("Could not destroy tag family"));
-			continue;
-		}
+	detection_stats_mut.lock();
+	FString report = show_detection_stats && detection_stats.Count() ? detection_stats.Report() : FString();
+	FString csv_rows = MoveTemp(detection_stats_csv_rows);
+	detection_stats_csv_rows.Reset();
+	detection_stats_mut.unlock();
 
-		LogDisplay(TEXT("Deleted %s"), *FString(tf->name));
+	if (!report.IsEmpty() && GEngine)
+		GEngine->AddOnScreenDebugMessage((uint64)GetUniqueID(), 1.5f, FColor::Cyan,
+		                                 FString::Printf(TEXT("AprilTag %s: %s"), *GetName(), *report));
 
-		if (!strcmp(tf->name, "tag36h11"))
-		{
-			tag36h11_destroy(tf);
-		}
-		else if (!strcmp(tf->name, "tag25h9"))
-		{
-			tag25h9_destroy(tf);
-		}
-		else if (!strcmp(tf->name, "tag16h5"))
-		{
-			tag16h5_destroy(tf);
-		}
-		else if (!strcmp(tf->name, "tagCircle21h7"))
-		{
-			tagCircle21h7_destroy(tf);
-		}
-		else if (!strcmp(tf->name, "tagCircle49h12"))
-		{
-			tagCircle49h12_destroy(tf);
-		}
-		else if (!strcmp(tf->name, "tagStandard41h12"))
-		{
-			tagStandard41h12_destroy(tf);
-		}
-		else if (!strcmp(tf->name, "tagStandard52h13"))
-		{
-			tagStandard52h13_destroy(tf);
-		}
-		else if (!strcmp(tf->name, "tagCustom48h12"))
-		{
-			tagCustom48h12_destroy(tf);
-		}
+	if (!csv_rows.IsEmpty())
+	{
+		FString path = FPaths::ProjectSavedDir() / TEXT("AprilTagStats") / GetName() + TEXT(".csv");
+		if (!IFileManager::Get().FileExists(*path))
+			csv_rows = TagDetectionStats::CsvHeader() + csv_rows;
+
+		if (!FFileHelper::SaveStringToFile(csv_rows, *path, FFileHelper::EEncodingOptions::AutoDetect,
+		                                   &IFileManager::Get(), FILEWRITE_Append))
+			LogWarning(TEXT("Could not write AprilTag stats to %s"), *path);
 	}
+}
 
-	created_families.Empty();
+void ATrackingCamera::ReleaseTagDetector()
+{
+	tag_families = 0;
 
-	at_td = nullptr;
+	last_tags_mut.lock();
+	tracked_updates = 0;
+	last_tags_mut.unlock();
 }
 
 void ATrackingCamera::FindTags()
@@ -780,16 +843,80 @@ void ATrackingCamera::ReleaseCamera()
 	destroy_lock.lock();
 
 	cv_cap.release();
+	playback.Close();
+	recorder.Close();
 	
 	ReleaseTagDetector();
 }
 
+bool ATrackingCamera::IsOpened() const
+{
+	return playback.IsOpen() || cv_cap.isOpened();
+}
+
+void ATrackingCamera::RecordFrame(double time)
+{
+	if (!record || playback.IsOpen() || cv_frame_raw.empty())
+		return;
+
+	if (!recorder.IsOpen())
+	{
+		// the fusion needs the pose, a recording started before it is known couldn't be replayed without its tags
+		if (pose_filter.Uncertainty(FPlatformTime::Seconds()) > 1)
+			return;
+
+		FString path = FPaths::ProjectSavedDir() / TEXT("Recordings") / GetName() + TEXT(".mjrec");
+		IFileManager::Get().MakeDirectory(*FPaths::GetPath(path), true);
+
+		FQuat rotation = camera_transform.GetRotation();
+		FVector translation = camera_transform.GetTranslation();
+		CameraCalibration calibration = {
+			cv_size.width, cv_size.height,
+			{focal_length.X, focal_length.Y},
+			{k_twins.X, k_twins.Y},
+			{p_twins.X, p_twins.Y},
+			{translation.X, translation.Y, translation.Z},
+			{rotation.X, rotation.Y, rotation.Z, rotation.W}
+		};
+
+		if (!recorder.Open(TCHAR_TO_UTF8(*path), calibration))
+		{
+			LogError(TEXT("Could not record camera %s to %s"), *camera_path, *path);
+			record = false;
+			return;
+		}
+		LogDisplay(TEXT("Recording camera %s to %s"), *camera_path, *path);
+	}
+
+	recorder.Write(time, cv_frame_raw);
+}
+
+FString ATrackingCamera::ReplayDirectory()
+{
+	FString directory;
+	FParse::Value(FCommandLine::Get(), TEXT("TrackingReplay="), directory);
+	return directory;
+}
+
+FString ATrackingCamera::ReplayPath() const
+{
+	FString directory = ReplayDirectory();
+	if (directory != "")
+		return directory / GetName() + TEXT(".mjrec");
+	return replay_path;
+}
+
+bool ATrackingCamera::ReplayRealtime() const
+{
+	return replay_realtime || FParse::Param(FCommandLine::Get(), TEXT("ReplayRealtime"));
+}
+
 void ATrackingCamera::UpdateDebugTexture()
 {
 	if (!update_texture)
 		return;
 
-	if (!cv_cap.isOpened() || !loaded)
+	if (!IsOpened() || !loaded)
 		return;
 
 	if (!loaded || !in_use)
@@ -830,6 +957,12 @@ void ATrackingCamera::SetupPlayerInputComponent(UInputComponent* PlayerInputComp
 void ATrackingCamera::BeginPlay()
 {
 	Super::BeginPlay();
+
+	pose_filter.noise = {
+		pose_position_noise, FMath::DegreesToRadians(pose_rotation_noise),
+		pose_position_drift, FMath::DegreesToRadians(pose_rotation_drift),
+		pose_position_tolerance, FMath::DegreesToRadians(pose_rotation_tolerance)
+	};
 	InitCamera();
 }
 
@@ -861,6 +994,7 @@ void ATrackingCamera::Tick(float DeltaTime)
 	}
 
 	UpdateDebugTexture();
+	PublishDetectionStats();
 
 	if (used_ball != Point2d{-1, -1} && in_use)
 	{
@@ -893,7 +1027,7 @@ void ATrackingCamera::Tick(float DeltaTime)
 	SetActorRelativeTransform(camera_transform);
 
 	camera_mesh->SetVisibility(!IsPlayerControlled() && in_use);
-	image_plate->SetVisibility(IsPlayerControlled() && cv_cap.isOpened() && in_use);
+	image_plate->SetVisibility(IsPlayerControlled() && IsOpened() && in_use);
 }
 
 void ATrackingCamera::BeginDestroy()
@@ -20,7 +20,11 @@
 #include "IImageWrapperModule.h"
 
 
+#include "CameraRecording.h"
+#include "PoseFilter.h"
 #include "Tag.h"
+#include "TagDetectionService.h"
+#include "TagDetectionStats.h"
 
 #include "PreOpenCVHeaders.h"
 #include "opencv2/core.hpp"
@@ -89,19 +93,34 @@ public:
 	double SyncFrame();
 	void GetFrame();
 	Point2d FindBall();
-	double UpdateTransform(FTransform update);
+	double UpdateTransform(FTransform update, int static_tags);
 	void DrawDetectedTags();
-	std::pair<UE::Math::TTransform<double>, std::map<ATag*, UE::Math::TMatrix<double>>> UpdateTags(Mat frame);
+	TagDetectionService::Result UpdateTags(Mat frame_gray, apriltag_detector_t* detector);
+	// queues the current frame with the tag detection service, the camera must outlive the future
+	TFuture<TagDetectionService::Result> RequestTagUpdate();
+	// the camera and the dynamic tags it sees with the most uncertain pose are served first, see PoseFilter::Uncertainty,
+	// the time since the last update breaks ties between certain ones
+	double TagPriority() const;
 	void ReleaseTagDetector();
 	void FindTags();
 
 	void ReleaseCamera();
 
+	// appends the frame GetFrame decoded last to the recording, see record
+	void RecordFrame(double time);
+	// the recording this camera replays instead of opening camera_path, empty if it is live
+	FString ReplayPath() const;
+	// the directory given with -TrackingReplay=<dir>, every camera then replays <dir>/<camera name>.mjrec headlessly
+	static FString ReplayDirectory();
+	bool ReplayRealtime() const;
+	bool IsReplaying() const { return playback.IsOpen(); }
+	bool ReplayFinished() const { return playback.IsOpen() && playback.Finished(); }
+
 	void UpdateDebugTexture();
 	
 	Size cv_size;
 
-	Mat K() const;
+	Matx33d K() const;
 	Mat p() const;
 	Mutex destroy_lock;
 	bool loaded = false;
@@ -111,8 +130,14 @@ public:
 	Point2d used_ball = {-1, -1};
 
 	FTransform camera_transform;
-	std::deque<FTransform> april_transforms;
+	// the camera is expected to stay put, a bump shows up as a run of outliers and restarts the filter. The noise is
+	// set from the pose properties in BeginPlay
+	PoseFilter pose_filter{{}};
 	int64_t next_update_time = 0;
+	double last_tag_update_time = 0;
+	// the dynamic tags found by the last tag update. Written when the camera's thread takes the result of an update and
+	// read by TagPriority on that thread, UpdateTags runs on the detection service and never touches it
+	std::vector<ATag*> last_dynamic_tags;
 
 	Mat cv_frame;
 
@@ -124,15 +149,24 @@ public:
 protected:
 	// Called when the game starts or when spawned
 	virtual void BeginPlay() override;
-	void RecalculateAverageTransform();
 
 	VideoCapture cv_cap;
+	CameraPlayback playback;
+	CameraRecorder recorder;
+
+	bool IsOpened() const;
+
+	// the MJPEG payload of the last frame, as the driver delivered it or as it was recorded
+	Mat cv_frame_raw;
 	
 	Mat cv_debug_frame;
 	Ptr<BackgroundSubtractor> cv_bg_subtractor;
 	Ptr<SimpleBlobDetector> cv_blob_detector;
-	apriltag_detector* at_td = nullptr;
-	TArray<apriltag_family_t*> created_families;
+	// bit mask of the TagFamily values of april_tags
+	uint32 tag_families = 0;
+	// the detectors are shared, so the count of tracked updates since the last full detection is kept per camera.
+	// Guarded by last_tags_mut, UpdateTags runs on the detection service
+	int tracked_updates = 0;
 
 	IImageWrapperModule& ImageWrapperModule = FModuleManager::LoadModuleChecked<IImageWrapperModule>(FName("ImageWrapper"));
 	TSharedPtr<IImageWrapper> ImageWrapper;
@@ -145,6 +179,14 @@ protected:
 	Mutex last_tags_mut;
 	std::vector<apriltag_detection_t> last_tags;
 
+	// filled by the detection threads, published from Tick
+	Mutex detection_stats_mut;
+	TagDetectionStats detection_stats;
+	FString detection_stats_csv_rows;
+	double last_stats_publish = 0;
+
+	void PublishDetectionStats();
+
 
 	
 public:
@@ -182,6 +224,22 @@ public:
 	UPROPERTY(EditAnywhere, meta = (UIMin = "0.0", UIMax = "1.0"))
 	float plate_opacity;
 
+	// write the raw frames to Saved/Recordings/<camera>.mjrec, starting once the pose of the camera is certain
+	UPROPERTY(EditAnywhere, Category = Recording)
+	bool record = false;
+
+	// replay this recording instead of opening camera_path, the calibration and pose come from the recording
+	UPROPERTY(EditAnywhere, Category = Recording)
+	FString replay_path;
+
+	// replay at the recorded frame rate instead of as fast as the tracking takes the frames
+	UPROPERTY(EditAnywhere, Category = Recording)
+	bool replay_realtime = false;
+
+	// find the tags in the replayed frames instead of keeping the pose the recording started with
+	UPROPERTY(EditAnywhere, Category = Recording)
+	bool replay_tags = false;
+
 	UPROPERTY(EditAnywhere, Category=AprilTag)
 	bool autodetect_tags;
 	
@@ -190,6 +248,58 @@ public:
 
 	UPROPERTY(EditAnywhere, Category = AprilTag, DisplayName="Minimum Update Rate (s)")
 	double update_rate = 1; // 100ms
+
+	// only search around the tags found in the last update, see apriltag_detector_track
+	UPROPERTY(EditAnywhere, Category = AprilTag)
+	bool track_tags = true;
+
+	UPROPERTY(EditAnywhere, Category = AprilTag, DisplayName="Full Detect Interval (updates)", meta=(EditCondition="track_tags", EditConditionHides, UIMin = "0", UIMax = "100"))
+	int full_detect_interval = 10;
+
+	// quads are searched in an image decimated by this factor (1.5, 2, 3, ...), the edges are refined at full resolution
+	UPROPERTY(EditAnywhere, Category = AprilTag, meta=(UIMin = "1.0", UIMax = "4.0"))
+	float quad_decimate = 1.0;
+
+	// blur (positive) or sharpen (negative) the image the quads are searched in
+	UPROPERTY(EditAnywhere, Category = AprilTag, meta=(UIMin = "-2.0", UIMax = "2.0"))
+	float quad_sigma = 0.0;
+
+	// search near tags on quad_decimate * 2^(levels - 1) and far ones only around what was too small for the coarser
+	// levels, 1 to search once at quad_decimate
+	UPROPERTY(EditAnywhere, Category = AprilTag, meta=(UIMin = "1", UIMax = "4"))
+	int pyramid_levels = 1;
+
+	UPROPERTY(VisibleAnywhere, Category = AprilTag, DisplayName="Achieved Update Rate (Hz)")
+	double achieved_update_rate = 0;
+
+	// standard deviation of the camera pose solved from one static tag, n tags divide it by sqrt(n)
+	UPROPERTY(EditAnywhere, Category = Pose, DisplayName="Position Noise (cm)")
+	double pose_position_noise = 30;
+
+	UPROPERTY(EditAnywhere, Category = Pose, DisplayName="Rotation Noise (deg)")
+	double pose_rotation_noise = 3;
+
+	// how much the camera is expected to move per second while it stands still
+	UPROPERTY(EditAnywhere, Category = Pose, DisplayName="Position Drift (cm/s)")
+	double pose_position_drift = 0.2;
+
+	UPROPERTY(EditAnywhere, Category = Pose, DisplayName="Rotation Drift (deg/s)")
+	double pose_rotation_drift = 0.2;
+
+	// tags are searched less often once the pose is this certain
+	UPROPERTY(EditAnywhere, Category = Pose, DisplayName="Position Tolerance (cm)")
+	double pose_position_tolerance = 3;
+
+	UPROPERTY(EditAnywhere, Category = Pose, DisplayName="Rotation Tolerance (deg)")
+	double pose_rotation_tolerance = 0.5;
+
+	// p50/p95/p99 of the detection stages and counts on screen, over the last 512 detections of this camera
+	UPROPERTY(EditAnywhere, Category = AprilTag)
+	bool show_detection_stats = false;
+
+	// append the stats of every detection to Saved/AprilTagStats/<camera>.csv
+	UPROPERTY(EditAnywhere, Category = AprilTag)
+	bool write_detection_stats = false;
 	
 	UPROPERTY(EditAnywhere, Category = CameraParams)
 	FVector2D resolution;
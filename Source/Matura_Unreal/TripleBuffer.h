@@ -0,0 +1,50 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+// Lock-free mailbox for exactly one writer thread and one reader thread that always hands the reader the most recent value.
+// The three slots rotate between the writer, the reader and a shared middle slot, so neither side ever waits on the other.
+template<typename T>
+class TripleBuffer {
+
+public:
+	TripleBuffer() = default;
+
+	explicit TripleBuffer(const T &initial) {
+		slots[0] = slots[1] = slots[2] = initial;
+	}
+
+	// writer side, publishes a value and replaces any value the reader has not picked up yet
+	void push(const T &x) {
+		slots[back] = x;
+		const uint8_t previous = middle.exchange(back | fresh_bit, std::memory_order_acq_rel);
+		back = previous & index_mask;
+	}
+
+	// reader side, always yields the latest published value, returns whether it is new since the last pop
+	bool pop(T *const r) {
+		bool fresh = false;
+		if (middle.load(std::memory_order_relaxed) & fresh_bit) {
+			const uint8_t previous = middle.exchange(front, std::memory_order_acq_rel);
+			front = previous & index_mask;
+			fresh = true;
+		}
+
+		*r = slots[front];
+		return fresh;
+	}
+
+private:
+	static constexpr uint8_t index_mask = 0b011;
+	static constexpr uint8_t fresh_bit = 0b100;
+
+	T slots[3] = {};
+
+	uint8_t back = 0; // only touched by the writer
+	std::atomic<uint8_t> middle = 1; // index of the shared slot, plus fresh_bit if the writer put something there
+	uint8_t front = 2; // only touched by the reader
+
+	TripleBuffer(const TripleBuffer &other) = delete;
+	TripleBuffer &operator=(const TripleBuffer &) = delete;
+};
@@ -45,6 +45,9 @@ either expressed or implied, of the Regents of The University of Michigan.
 #include "common/matd.h"
 #include "common/homography.h"
 #include "common/timeprofile.h"
+#include "common/time_util.h"
+#include "common/atomic_util.h"
+#include "common/mmap_file.h"
 #include "common/math_util.h"
 #include "common/g2d.h"
 #include "common/debug_print.h"
@@ -119,6 +122,210 @@ static double graymodel_interpolate(struct graymodel *gm, double x, double y)
 	return gm->C[0] * x + gm->C[1] * y + gm->C[2];
 }
 
+// Where quad_decode samples a quad, in tag coordinates ([-1, 1] at the
+// black corners). The grid only depends on the layout of a family, so
+// it's made with the decode table and shared by all families with the
+// same layout, which then also share the samples taken of each quad.
+#define SAMPLE_GRID_MAX_WIDTH 32
+#define SAMPLE_GRID_MAX_BORDER (4 * SAMPLE_GRID_MAX_WIDTH)
+#define SAMPLE_GRID_MAX_BITS 64
+#define SAMPLE_GRID_PROBES 8
+
+struct sample_grid
+{
+	// the layout.
+	int width_at_border, total_width;
+	bool reversed_border;
+	uint32_t nbits;
+	uint32_t *bit_x, *bit_y;
+
+	// samples of the black [0] and white [1] border, each in the order
+	// its gray model is fit in.
+	int nborder[2];
+	double border_x[2][SAMPLE_GRID_MAX_BORDER], border_y[2][SAMPLE_GRID_MAX_BORDER];
+
+	// J'J of both gray models over all of their samples, which is what
+	// it is unless part of the border is outside the image.
+	double A[2][3][3];
+
+	// a few samples of each border, spread evenly around it, for the
+	// quick contrast test.
+	double probe_x[2][SAMPLE_GRID_PROBES], probe_y[2][SAMPLE_GRID_PROBES];
+
+	// the center of every bit cell, in bit order.
+	double bit_tagx[SAMPLE_GRID_MAX_BITS], bit_tagy[SAMPLE_GRID_MAX_BITS];
+
+	// the bits above, left, right and below each bit, in the order the
+	// sharpening kernel visits them. -1 for cells that aren't bits.
+	int8_t neighbors[SAMPLE_GRID_MAX_BITS][4];
+
+	// quick_decode tables using the grid.
+	int refcount;
+};
+
+static struct sample_grid *sample_grid_create(const apriltag_family_t *family)
+{
+	if (family->width_at_border > SAMPLE_GRID_MAX_WIDTH || family->nbits > SAMPLE_GRID_MAX_BITS)
+	{
+		debug_print("Tag family %s is too large to be decoded\n", family->name);
+		return NULL;
+	}
+
+	struct sample_grid *grid = calloc(1, sizeof(struct sample_grid));
+	grid->width_at_border = family->width_at_border;
+	grid->total_width = family->total_width;
+	grid->reversed_border = family->reversed_border;
+	grid->nbits = family->nbits;
+	grid->bit_x = malloc(sizeof(uint32_t) * family->nbits);
+	grid->bit_y = malloc(sizeof(uint32_t) * family->nbits);
+	memcpy(grid->bit_x, family->bit_x, sizeof(uint32_t) * family->nbits);
+	memcpy(grid->bit_y, family->bit_y, sizeof(uint32_t) * family->nbits);
+
+	// We will compute a threshold by sampling known white/black cells around this tag.
+	// This sampling is achieved by considering a set of samples along lines.
+	//
+	// coordinates are given in bit coordinates. ([0, fam->border_width]).
+	//
+	// { initial x, initial y, delta x, delta y, WHITE=1 }
+	float patterns[] = {
+		// left white column
+		-0.5, 0.5,
+		0, 1,
+		1,
+
+		// left black column
+		0.5, 0.5,
+		0, 1,
+		0,
+
+		// right white column
+		family->width_at_border + 0.5, .5,
+		0, 1,
+		1,
+
+		// right black column
+		family->width_at_border - 0.5, .5,
+		0, 1,
+		0,
+
+		// top white row
+		0.5, -0.5,
+		1, 0,
+		1,
+
+		// top black row
+		0.5, 0.5,
+		1, 0,
+		0,
+
+		// bottom white row
+		0.5, family->width_at_border + 0.5,
+		1, 0,
+		1,
+
+		// bottom black row
+		0.5, family->width_at_border - 0.5,
+		1, 0,
+		0
+
+		// XXX double-counts the corners.
+	};
+
+	struct graymodel models[2];
+	graymodel_init(&models[0]);
+	graymodel_init(&models[1]);
+
+	for (int pattern_idx = 0; pattern_idx < sizeof(patterns) / (5 * sizeof(float)); pattern_idx++)
+	{
+		float *pattern = &patterns[pattern_idx * 5];
+
+		int is_white = pattern[4];
+
+		for (int i = 0; i < family->width_at_border; i++)
+		{
+			double tagx01 = (pattern[0] + i * pattern[2]) / (family->width_at_border);
+			double tagy01 = (pattern[1] + i * pattern[3]) / (family->width_at_border);
+
+			double tagx = 2 * (tagx01 - 0.5);
+			double tagy = 2 * (tagy01 - 0.5);
+
+			int n = grid->nborder[is_white]++;
+			grid->border_x[is_white][n] = tagx;
+			grid->border_y[is_white][n] = tagy;
+
+			graymodel_add(&models[is_white], tagx, tagy, 0);
+		}
+	}
+
+	for (int color = 0; color < 2; color++)
+	{
+		memcpy(grid->A[color], models[color].A, sizeof(models[color].A));
+
+		for (int i = 0; i < SAMPLE_GRID_PROBES; i++)
+		{
+			int j = i * grid->nborder[color] / SAMPLE_GRID_PROBES;
+			grid->probe_x[color][i] = grid->border_x[color][j];
+			grid->probe_y[color][i] = grid->border_y[color][j];
+		}
+	}
+
+	// bit index of each cell of the total_width x total_width grid.
+	int min_coord = (family->width_at_border - family->total_width) / 2;
+	int8_t *cell_bit = malloc(family->total_width * family->total_width);
+	memset(cell_bit, -1, family->total_width * family->total_width);
+
+	for (uint32_t i = 0; i < family->nbits; i++)
+	{
+		int bitx = family->bit_x[i];
+		int bity = family->bit_y[i];
+
+		double tagx01 = (bitx + 0.5) / (family->width_at_border);
+		double tagy01 = (bity + 0.5) / (family->width_at_border);
+
+		// scale to [-1, 1]
+		grid->bit_tagx[i] = 2 * (tagx01 - 0.5);
+		grid->bit_tagy[i] = 2 * (tagy01 - 0.5);
+
+		cell_bit[family->total_width * (bity - min_coord) + bitx - min_coord] = i;
+	}
+
+	static const int offsets[4][2] = {{0, -1}, {-1, 0}, {1, 0}, {0, 1}};
+	for (uint32_t i = 0; i < family->nbits; i++)
+	{
+		for (int k = 0; k < 4; k++)
+		{
+			int x = family->bit_x[i] - min_coord + offsets[k][0];
+			int y = family->bit_y[i] - min_coord + offsets[k][1];
+
+			if (x < 0 || y < 0 || x >= family->total_width || y >= family->total_width)
+				grid->neighbors[i][k] = -1;
+			else
+				grid->neighbors[i][k] = cell_bit[y * family->total_width + x];
+		}
+	}
+
+	free(cell_bit);
+	return grid;
+}
+
+static int sample_grid_matches(const struct sample_grid *grid, const apriltag_family_t *family)
+{
+	return grid->width_at_border == family->width_at_border && grid->total_width == family->total_width &&
+		   grid->reversed_border == family->reversed_border && grid->nbits == family->nbits &&
+		   memcmp(grid->bit_x, family->bit_x, sizeof(uint32_t) * family->nbits) == 0 &&
+		   memcmp(grid->bit_y, family->bit_y, sizeof(uint32_t) * family->nbits) == 0;
+}
+
+static void sample_grid_release(struct sample_grid *grid)
+{
+	if (--grid->refcount > 0)
+		return;
+
+	free(grid->bit_x);
+	free(grid->bit_y);
+	free(grid);
+}
+
 struct quick_decode_entry
 {
 	uint64_t rcode;	  // the queried code
@@ -127,12 +334,104 @@ struct quick_decode_entry
 	uint8_t rotation; // number of rotations [0, 3]
 };
 
+// The decode table maps every codeword within maxhamming bits of a
+// tag to that tag. It is open addressed with linear probing, its size
+// a power of two indexed by a multiplicative hash of the codeword.
+//
+// An entry is packed into 32 bits: the tag id, the number of corrected
+// bits and a fingerprint of the hash. The codeword itself isn't
+// stored; a hit is confirmed by checking that the query really is
+// within that many bits of the tag's code, which makes it a correct
+// decode even if it isn't the exact codeword the entry was made for.
+#define QD_ID_BITS 16
+#define QD_HAMMING_BITS 2
+#define QD_FINGERPRINT_BITS (32 - QD_ID_BITS - QD_HAMMING_BITS)
+#define QD_EMPTY UINT32_MAX
+
+// the table is kept at most half full.
+#define QD_MAX_LOAD_INV 2
+
+// how many random codewords the lookup time is measured with.
+#define QD_BENCHMARK_LOOKUPS 65536
+
+// Tables only depend on the codes and maxhamming, so every family
+// instance with the same codes shares one table, whichever detector
+// (camera) it was added to. Tables are kept in a process-wide registry
+// and stay there when their last family is removed, so detectors that
+// are torn down and recreated don't rebuild them; see
+// apriltag_decode_cache_clear.
 struct quick_decode
 {
-	int nentries;
-	struct quick_decode_entry *entries;
+	int log2_nentries;
+
+	// read-only once built. Points into mapped if the table was loaded
+	// from the cache directory.
+	uint32_t *entries;
+	mmap_file_t *mapped;
+
+	struct apriltag_decode_stats stats;
+
+	// where quads are sampled to get codewords to look up.
+	struct sample_grid *grid;
+
+	// what the table was built for.
+	char *name;
+	uint32_t nbits, ncodes;
+	uint64_t codes_hash;
+	int maxhamming;
+
+	// families currently using the table.
+	int refcount;
+
+	struct quick_decode *next;
+};
+
+// Layout of a cache file: this header, then the entries. Only ever
+// read back on the machine that wrote it.
+#define QD_FILE_MAGIC 0x44515441 // "ATQD"
+#define QD_FILE_VERSION 1
+
+struct quick_decode_file_header
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t nbits, ncodes;
+	uint64_t codes_hash;
+	uint32_t maxhamming;
+	uint32_t log2_nentries;
 };
 
+// the registry, guarded by registry_lock. Building a table happens
+// under the lock too, so concurrent detectors build each only once.
+static struct quick_decode *registry;
+static char *registry_cache_dir;
+static atomic_counter_t registry_lock;
+
+static inline uint64_t quick_decode_hash(uint64_t code)
+{
+	// Fibonacci hashing: the top bits of the product depend on all of
+	// the code's bits.
+	return code * 0x9e3779b97f4a7c15ULL;
+}
+
+static inline uint32_t quick_decode_bucket(const struct quick_decode *qd, uint64_t hash)
+{
+	return (uint32_t)(hash >> (64 - qd->log2_nentries));
+}
+
+static inline uint32_t quick_decode_fingerprint(const struct quick_decode *qd, uint64_t hash)
+{
+	return (uint32_t)(hash >> (64 - qd->log2_nentries - QD_FINGERPRINT_BITS)) & ((1u << QD_FINGERPRINT_BITS) - 1);
+}
+
+static inline int popcount64(uint64_t x)
+{
+	x = x - ((x >> 1) & 0x5555555555555555ULL);
+	x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+	x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+	return (int)((x * 0x0101010101010101ULL) >> 56);
+}
+
 /**
  * Assuming we are drawing the image one quadrant at a time, what would the rotated image look like?
  * Special care is taken to handle the case where there is a middle pixel of the image.
@@ -151,58 +450,160 @@ static uint64_t rotate90(uint64_t w, int numBits)
 	return w;
 }
 
-static void quad_destroy(struct quad *quad)
+static void quick_decode_add(struct quick_decode *qd, uint64_t code, int id, int hamming)
 {
-	if (!quad)
-		return;
+	uint64_t hash = quick_decode_hash(code);
+	uint32_t mask = (1u << qd->log2_nentries) - 1;
+	uint32_t bucket = quick_decode_bucket(qd, hash);
 
-	matd_destroy(quad->H);
-	matd_destroy(quad->Hinv);
-	free(quad);
-}
+	while (qd->entries[bucket] != QD_EMPTY)
+	{
+		bucket = (bucket + 1) & mask;
+	}
 
-static struct quad *quad_copy(struct quad *quad)
-{
-	struct quad *q = calloc(1, sizeof(struct quad));
-	memcpy(q, quad, sizeof(struct quad));
-	if (quad->H)
-		q->H = matd_copy(quad->H);
-	if (quad->Hinv)
-		q->Hinv = matd_copy(quad->Hinv);
-	return q;
+	qd->entries[bucket] = (uint32_t)id |
+						  ((uint32_t)hamming << QD_ID_BITS) |
+						  (quick_decode_fingerprint(qd, hash) << (QD_ID_BITS + QD_HAMMING_BITS));
 }
 
-static void quick_decode_add(struct quick_decode *qd, uint64_t code, int id, int hamming)
+// returns an entry with hamming set to 255 if no decode was found.
+//
+// All four rotations are probed together: their chains are walked in
+// lockstep, so the four (likely) cache misses are in flight at once
+// rather than one after the other. As before, the lowest rotation that
+// decodes wins.
+static void quick_decode_lookup(const struct quick_decode *qd, const apriltag_family_t *tf, uint64_t rcode,
+								struct quick_decode_entry *entry)
 {
-	uint32_t bucket = code % qd->nentries;
+	entry->rcode = 0;
+	entry->id = 65535;
+	entry->hamming = 255;
+	entry->rotation = 0;
+
+	uint32_t mask = (1u << qd->log2_nentries) - 1;
 
-	while (qd->entries[bucket].rcode != UINT64_MAX)
+	uint64_t codes[4];
+	uint32_t buckets[4], fingerprints[4];
+
+	for (int ridx = 0; ridx < 4; ridx++)
 	{
-		bucket = (bucket + 1) % qd->nentries;
+		uint64_t hash = quick_decode_hash(rcode);
+
+		codes[ridx] = rcode;
+		buckets[ridx] = quick_decode_bucket(qd, hash);
+		fingerprints[ridx] = quick_decode_fingerprint(qd, hash);
+
+		rcode = rotate90(rcode, tf->nbits);
 	}
 
-	qd->entries[bucket].rcode = code;
-	qd->entries[bucket].id = id;
-	qd->entries[bucket].hamming = hamming;
+	// one bit per rotation whose chain hasn't ended yet.
+	int active = 0xf;
+
+	while (active)
+	{
+		for (int ridx = 0; ridx < 4; ridx++)
+		{
+			if (!(active & (1 << ridx)))
+				continue;
+
+			uint32_t e = qd->entries[buckets[ridx]];
+
+			if (e == QD_EMPTY)
+			{
+				active &= ~(1 << ridx);
+				continue;
+			}
+
+			buckets[ridx] = (buckets[ridx] + 1) & mask;
+
+			if ((e >> (QD_ID_BITS + QD_HAMMING_BITS)) != fingerprints[ridx])
+				continue;
+
+			int id = e & ((1u << QD_ID_BITS) - 1);
+			int hamming = (e >> QD_ID_BITS) & ((1u << QD_HAMMING_BITS) - 1);
+
+			if (popcount64(codes[ridx] ^ tf->codes[id]) != hamming)
+				continue;
+
+			entry->rcode = codes[ridx];
+			entry->id = id;
+			entry->hamming = hamming;
+			entry->rotation = ridx;
+
+			// higher rotations can't win anymore, lower ones still can.
+			active &= (1 << ridx) - 1;
+			break;
+		}
+	}
 }
 
-static void quick_decode_uninit(apriltag_family_t *fam)
+static void quick_decode_codeword(apriltag_family_t *tf, uint64_t rcode,
+								  struct quick_decode_entry *entry)
 {
-	if (!fam->impl)
+	struct quick_decode *qd = (struct quick_decode *)tf->impl;
+
+	// qd might be null if detector_add_family_bits() failed
+	if (qd == NULL)
+	{
+		entry->rcode = 0;
+		entry->id = 65535;
+		entry->hamming = 255;
+		entry->rotation = 0;
 		return;
+	}
 
-	struct quick_decode *qd = (struct quick_decode *)fam->impl;
-	free(qd->entries);
+	quick_decode_lookup(qd, tf, rcode, entry);
+}
+
+static void quick_decode_destroy(struct quick_decode *qd)
+{
+	if (qd->grid)
+		sample_grid_release(qd->grid);
+	if (qd->mapped)
+		mmap_file_close(qd->mapped);
+	else
+		free(qd->entries);
+	free(qd->name);
 	free(qd);
-	fam->impl = NULL;
 }
 
-static void quick_decode_init(apriltag_family_t *family, int maxhamming)
+// FNV-1a over the codes, telling apart families that share a name.
+static uint64_t quick_decode_codes_hash(const apriltag_family_t *family)
 {
-	assert(family->impl == NULL);
-	assert(family->ncodes < 65536);
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (uint32_t i = 0; i < family->ncodes; i++)
+	{
+		for (int b = 0; b < 64; b += 8)
+		{
+			hash ^= (family->codes[i] >> b) & 0xff;
+			hash *= 0x100000001b3ULL;
+		}
+	}
+	return hash;
+}
+
+static int quick_decode_matches(const struct quick_decode *qd, const apriltag_family_t *family,
+								uint64_t codes_hash, int maxhamming)
+{
+	return qd->nbits == family->nbits && qd->ncodes == family->ncodes &&
+		   qd->codes_hash == codes_hash && qd->maxhamming == maxhamming &&
+		   strcmp(qd->name, family->name) == 0;
+}
 
+static struct quick_decode *quick_decode_create(const apriltag_family_t *family, uint64_t codes_hash, int maxhamming)
+{
 	struct quick_decode *qd = calloc(1, sizeof(struct quick_decode));
+	qd->name = strdup(family->name);
+	qd->nbits = family->nbits;
+	qd->ncodes = family->ncodes;
+	qd->codes_hash = codes_hash;
+	qd->maxhamming = maxhamming;
+	return qd;
+}
+
+static struct quick_decode *quick_decode_build(const apriltag_family_t *family, uint64_t codes_hash, int maxhamming)
+{
+	struct quick_decode *qd = quick_decode_create(family, codes_hash, maxhamming);
 	int capacity = family->ncodes;
 
 	int nbits = family->nbits;
@@ -216,21 +617,22 @@ static void quick_decode_init(apriltag_family_t *family, int maxhamming)
 	if (maxhamming >= 3)
 		capacity += family->ncodes * nbits * (nbits - 1) * (nbits - 2);
 
-	qd->nentries = capacity * 3;
+	qd->log2_nentries = 1;
+	while ((1u << qd->log2_nentries) < (uint32_t)capacity * QD_MAX_LOAD_INV)
+		qd->log2_nentries++;
 
-	//    debug_print("capacity %d, size: %.0f kB\n",
-	//           capacity, qd->nentries * sizeof(struct quick_decode_entry) / 1024.0);
+	int nentries = 1 << qd->log2_nentries;
 
-	qd->entries = calloc(qd->nentries, sizeof(struct quick_decode_entry));
+	qd->entries = malloc(nentries * sizeof(uint32_t));
 	if (qd->entries == NULL)
 	{
 		debug_print("Failed to allocate hamming decode table\n");
-		// errno already set to ENOMEM (Error No MEMory) by calloc() failure
-		return;
+		// errno already set to ENOMEM (Error No MEMory) by malloc() failure
+		quick_decode_destroy(qd);
+		return NULL;
 	}
 
-	for (int i = 0; i < qd->nentries; i++)
-		qd->entries[i].rcode = UINT64_MAX;
+	memset(qd->entries, 0xff, nentries * sizeof(uint32_t));
 
 	errno = 0;
 
@@ -264,100 +666,267 @@ static void quick_decode_init(apriltag_family_t *family, int maxhamming)
 					for (int m = 0; m < k; m++)
 						quick_decode_add(qd, code ^ (APRILTAG_U64_ONE << j) ^ (APRILTAG_U64_ONE << k) ^ (APRILTAG_U64_ONE << m), i, 3);
 		}
+	}
 
-		if (maxhamming > 3)
-		{
-			debug_print("\"maxhamming\" beyond 3 not supported\n");
-			// set errno to Error INvalid VALue
-			errno = EINVAL;
-			return;
-		}
+	return qd;
+}
+
+static char *quick_decode_cache_path(const char *dir, const apriltag_family_t *family, int maxhamming)
+{
+	size_t len = strlen(dir) + strlen(family->name) + 32;
+	char *path = malloc(len);
+	snprintf(path, len, "%s/%s_%d.qd", dir, family->name, maxhamming);
+	return path;
+}
+
+// maps a table written by quick_decode_save. Returns NULL if there is
+// none, or it was made for other codes or by another version.
+static struct quick_decode *quick_decode_load(const char *path, const apriltag_family_t *family,
+											  uint64_t codes_hash, int maxhamming)
+{
+	mmap_file_t *mf = mmap_file_open(path);
+	if (mf == NULL)
+		return NULL;
+
+	const struct quick_decode_file_header *header = mf->data;
+
+	if (mf->size < sizeof(*header) ||
+		header->magic != QD_FILE_MAGIC || header->version != QD_FILE_VERSION ||
+		header->nbits != family->nbits || header->ncodes != family->ncodes ||
+		header->codes_hash != codes_hash || header->maxhamming != (uint32_t)maxhamming ||
+		header->log2_nentries >= 32 ||
+		mf->size != sizeof(*header) + ((size_t)1 << header->log2_nentries) * sizeof(uint32_t))
+	{
+		debug_print("Ignoring stale decode table %s\n", path);
+		mmap_file_close(mf);
+		return NULL;
 	}
 
-	family->impl = qd;
-
-#if 0
-        int longest_run = 0;
-        int run = 0;
-        int run_sum = 0;
-        int run_count = 0;
-
-        // This accounting code doesn't check the last possible run that
-        // occurs at the wrap-around. That's pretty insignificant.
-        for (int i = 0; i < qd->nentries; i++) {
-            if (qd->entries[i].rcode == UINT64_MAX) {
-                if (run > 0) {
-                    run_sum += run;
-                    run_count ++;
-                }
-                run = 0;
-            } else {
-                run ++;
-                longest_run = imax(longest_run, run);
-            }
-        }
-
-        printf("quick decode: longest run: %d, average run %.3f\n", longest_run, 1.0 * run_sum / run_count);
-#endif
+	struct quick_decode *qd = quick_decode_create(family, codes_hash, maxhamming);
+	qd->log2_nentries = header->log2_nentries;
+	qd->entries = (uint32_t *)(header + 1);
+	qd->mapped = mf;
+	return qd;
 }
 
-// returns an entry with hamming set to 255 if no decode was found.
-static void quick_decode_codeword(apriltag_family_t *tf, uint64_t rcode,
-								  struct quick_decode_entry *entry)
+// writes to a temporary file first, so a concurrent or interrupted
+// write never leaves a partial table behind under the real name.
+static void quick_decode_save(const struct quick_decode *qd, const char *path)
 {
-	struct quick_decode *qd = (struct quick_decode *)tf->impl;
+	size_t len = strlen(path) + 8;
+	char *tmp_path = malloc(len);
+	snprintf(tmp_path, len, "%s.tmp", path);
 
-	// qd might be null if detector_add_family_bits() failed
-	for (int ridx = 0; qd != NULL && ridx < 4; ridx++)
+	FILE *f = fopen(tmp_path, "wb");
+	if (f == NULL)
 	{
+		debug_print("Could not write decode table %s\n", tmp_path);
+		free(tmp_path);
+		return;
+	}
 
-		for (int bucket = rcode % qd->nentries;
-			 qd->entries[bucket].rcode != UINT64_MAX;
-			 bucket = (bucket + 1) % qd->nentries)
-		{
+	struct quick_decode_file_header header = {
+		.magic = QD_FILE_MAGIC,
+		.version = QD_FILE_VERSION,
+		.nbits = qd->nbits,
+		.ncodes = qd->ncodes,
+		.codes_hash = qd->codes_hash,
+		.maxhamming = qd->maxhamming,
+		.log2_nentries = qd->log2_nentries,
+	};
 
-			if (qd->entries[bucket].rcode == rcode)
-			{
-				*entry = qd->entries[bucket];
-				entry->rotation = ridx;
-				return;
-			}
-		}
+	size_t nentries = (size_t)1 << qd->log2_nentries;
+	int ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+			 fwrite(qd->entries, sizeof(uint32_t), nentries, f) == nentries;
+	ok &= fclose(f) == 0;
 
-		rcode = rotate90(rcode, tf->nbits);
+	remove(path);
+	if (!ok || rename(tmp_path, path) != 0)
+	{
+		debug_print("Could not write decode table %s\n", path);
+		remove(tmp_path);
 	}
 
-	entry->rcode = 0;
-	entry->id = 65535;
-	entry->hamming = 255;
-	entry->rotation = 0;
+	free(tmp_path);
 }
 
-static inline int detection_compare_function(const void *_a, const void *_b)
+// mean lookup time. Most quads in an image aren't tags, so it's timed
+// with random codewords, nearly all of which miss.
+static double quick_decode_benchmark(const struct quick_decode *qd, const apriltag_family_t *family)
 {
-	apriltag_detection_t *a = *(apriltag_detection_t **)_a;
-	apriltag_detection_t *b = *(apriltag_detection_t **)_b;
+	uint64_t state = 0x2545f4914f6cdd1dULL ^ family->codes[0];
+	uint64_t mask = family->nbits == 64 ? UINT64_MAX : (APRILTAG_U64_ONE << family->nbits) - 1;
+	volatile int hits = 0; // keeps the lookups from being optimized away
 
-	return a->id - b->id;
+	int64_t start = utime_now();
+	for (int i = 0; i < QD_BENCHMARK_LOOKUPS; i++)
+	{
+		// xorshift64
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+
+		struct quick_decode_entry entry;
+		quick_decode_lookup(qd, family, state & mask, &entry);
+		hits += entry.hamming != 255;
+	}
+	return (utime_now() - start) * 1e3 / QD_BENCHMARK_LOOKUPS;
 }
 
-void apriltag_detector_remove_family(apriltag_detector_t *td, apriltag_family_t *fam)
+static void quick_decode_uninit(apriltag_family_t *fam)
 {
-	quick_decode_uninit(fam);
-	zarray_remove_value(td->tag_families, &fam, 0);
-}
+	if (!fam->impl)
+		return;
 
-void apriltag_detector_add_family_bits(apriltag_detector_t *td, apriltag_family_t *fam, int bits_corrected)
-{
-	zarray_add(td->tag_families, &fam);
+	struct quick_decode *qd = (struct quick_decode *)fam->impl;
 
-	if (!fam->impl)
-		quick_decode_init(fam, bits_corrected);
+	atomic_lock(&registry_lock);
+	qd->refcount--;
+	atomic_unlock(&registry_lock);
+
+	fam->impl = NULL;
 }
 
-void apriltag_detector_clear_families(apriltag_detector_t *td)
+static void quick_decode_init(apriltag_family_t *family, int maxhamming)
 {
-	for (int i = 0; i < zarray_size(td->tag_families); i++)
+	assert(family->impl == NULL);
+	assert(family->ncodes < (1u << QD_ID_BITS) - 1);
+
+	if (maxhamming > 3)
+	{
+		debug_print("\"maxhamming\" beyond 3 not supported\n");
+		// set errno to Error INvalid VALue
+		errno = EINVAL;
+		return;
+	}
+
+	uint64_t codes_hash = quick_decode_codes_hash(family);
+
+	atomic_lock(&registry_lock);
+
+	struct quick_decode *qd = registry;
+	while (qd != NULL && !quick_decode_matches(qd, family, codes_hash, maxhamming))
+		qd = qd->next;
+
+	if (qd == NULL)
+	{
+		int64_t start = utime_now();
+
+		char *path = registry_cache_dir ? quick_decode_cache_path(registry_cache_dir, family, maxhamming) : NULL;
+
+		if (path)
+			qd = quick_decode_load(path, family, codes_hash, maxhamming);
+
+		if (qd == NULL)
+		{
+			qd = quick_decode_build(family, codes_hash, maxhamming);
+
+			if (qd && path)
+				quick_decode_save(qd, path);
+		}
+
+		free(path);
+
+		if (qd)
+		{
+			int nentries = 1 << qd->log2_nentries;
+			qd->stats.table_bytes = nentries * sizeof(uint32_t);
+			qd->stats.nentries = nentries;
+			qd->stats.build_ms = (utime_now() - start) / 1e3;
+			qd->stats.from_cache = qd->mapped != NULL;
+			qd->stats.lookup_ns = quick_decode_benchmark(qd, family);
+
+			for (struct quick_decode *other = registry; other != NULL && qd->grid == NULL; other = other->next)
+			{
+				if (other->grid && sample_grid_matches(other->grid, family))
+				{
+					qd->grid = other->grid;
+					qd->grid->refcount++;
+				}
+			}
+
+			if (qd->grid == NULL && (qd->grid = sample_grid_create(family)) != NULL)
+				qd->grid->refcount = 1;
+
+			qd->next = registry;
+			registry = qd;
+		}
+	}
+
+	if (qd)
+	{
+		qd->refcount++;
+		family->impl = qd;
+	}
+
+	atomic_unlock(&registry_lock);
+}
+
+int apriltag_family_decode_stats(const apriltag_family_t *fam, struct apriltag_decode_stats *stats)
+{
+	const struct quick_decode *qd = (const struct quick_decode *)fam->impl;
+	if (qd == NULL)
+		return -1;
+
+	*stats = qd->stats;
+	return 0;
+}
+
+void apriltag_decode_cache_set_dir(const char *dir)
+{
+	atomic_lock(&registry_lock);
+	free(registry_cache_dir);
+	registry_cache_dir = dir ? strdup(dir) : NULL;
+	atomic_unlock(&registry_lock);
+}
+
+void apriltag_decode_cache_clear(void)
+{
+	atomic_lock(&registry_lock);
+
+	struct quick_decode **link = &registry;
+	while (*link)
+	{
+		struct quick_decode *qd = *link;
+		if (qd->refcount == 0)
+		{
+			*link = qd->next;
+			quick_decode_destroy(qd);
+		}
+		else
+		{
+			link = &qd->next;
+		}
+	}
+
+	atomic_unlock(&registry_lock);
+}
+
+static inline int detection_compare_function(const void *_a, const void *_b)
+{
+	apriltag_detection_t *a = *(apriltag_detection_t **)_a;
+	apriltag_detection_t *b = *(apriltag_detection_t **)_b;
+
+	return a->id - b->id;
+}
+
+void apriltag_detector_remove_family(apriltag_detector_t *td, apriltag_family_t *fam)
+{
+	quick_decode_uninit(fam);
+	zarray_remove_value(td->tag_families, &fam, 0);
+}
+
+void apriltag_detector_add_family_bits(apriltag_detector_t *td, apriltag_family_t *fam, int bits_corrected)
+{
+	zarray_add(td->tag_families, &fam);
+
+	if (!fam->impl)
+		quick_decode_init(fam, bits_corrected);
+}
+
+void apriltag_detector_clear_families(apriltag_detector_t *td)
+{
+	for (int i = 0; i < zarray_size(td->tag_families); i++)
 	{
 		apriltag_family_t *fam;
 		zarray_get(td->tag_families, i, &fam);
@@ -387,12 +956,24 @@ apriltag_detector_t *apriltag_detector_create()
 	pthread_mutex_init(&td->mutex, NULL);
 
 	td->tp = timeprofile_create();
+	td->scratch = arena_create(0);
 
 	td->refine_edges = true;
 	td->decode_sharpening = 0.25;
 
 	td->debug = false;
 
+	td->pyramid_levels = 1;
+
+	td->track_full_interval = 10;
+	td->track_margin = 0.5;
+
+	td->quad_min_area = 0;
+	td->quad_max_area = 0;
+	td->quad_max_aspect = 10;
+	td->quad_min_border_contrast = 5;
+	td->quad_precheck = true;
+
 	// NB: defer initialization of td->wp so that the user can
 	// override td->nthreads.
 
@@ -407,12 +988,12 @@ void apriltag_detector_destroy(apriltag_detector_t *td)
 	apriltag_detector_clear_families(td);
 
 	zarray_destroy(td->tag_families);
+	arena_destroy(td->scratch);
 	free(td);
 }
 
 struct quad_decode_task
 {
-	int i0, i1;
 	zarray_t *quads;
 	apriltag_detector_t *td;
 
@@ -432,7 +1013,9 @@ struct evaluate_quad_ret
 	struct quick_decode_entry e;
 };
 
-static matd_t *homography_compute2(double c[4][4])
+// solves for the homography mapping (c[i][0], c[i][1]) to (c[i][2],
+// c[i][3]) into H. Returns non-zero if the points are degenerate.
+static int homography_compute2(double c[4][4], double H[9])
 {
 	double A[] = {
 		c[0][0],
@@ -530,7 +1113,7 @@ static matd_t *homography_compute2(double c[4][4])
 		if (max_val < epsilon)
 		{
 			debug_print("WRN: Matrix is singular.\n");
-			return NULL;
+			return -1;
 		}
 
 		// Swap to get best row.
@@ -566,7 +1149,10 @@ static matd_t *homography_compute2(double c[4][4])
 		}
 		A[col * 9 + 8] = (A[col * 9 + 8] - sum) / A[col * 9 + col];
 	}
-	return matd_create_data(3, 3, (double[]){A[8], A[17], A[26], A[35], A[44], A[53], A[62], A[71], 1});
+	for (int i = 0; i < 8; i++)
+		H[i] = A[i * 9 + 8];
+	H[8] = 1;
+	return 0;
 }
 
 // returns non-zero if an error occurs (i.e., H has no inverse)
@@ -584,25 +1170,63 @@ static int quad_update_homographies(struct quad *quad)
 		corr_arr[i][3] = quad->p[i][1];
 	}
 
-	if (quad->H)
-		matd_destroy(quad->H);
-	if (quad->Hinv)
-		matd_destroy(quad->Hinv);
-
 	// XXX Tunable
-	quad->H = homography_compute2(corr_arr);
-	if (quad->H != NULL)
+	if (homography_compute2(corr_arr, quad->H) != 0)
+		return -1;
+
+	return mat33_inv(quad->H, quad->Hinv);
+}
+
+// Vector helpers for sampling the quads, picked at compile time like
+// the ones in apriltag_quad_thresh.c. They do the same floating point
+// operations in the same order as mat33_project and value_for_pixel,
+// so the samples are exactly the same.
+#if defined(__SSE2__) || defined(_M_X64)
+#define DECODE_SSE2
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#define DECODE_NEON
+#include <arm_neon.h>
+#endif
+
+// (px[i], py[i]) = H (x[i], y[i]) for i in [0, n)
+static void project_points(const double *H, const double *x, const double *y, int n, double *px, double *py)
+{
+	int i = 0;
+
+#if defined(DECODE_SSE2)
+	__m128d h[9];
+	for (int j = 0; j < 9; j++)
+		h[j] = _mm_set1_pd(H[j]);
+
+	for (; i + 2 <= n; i += 2)
 	{
-		quad->Hinv = matd_inverse(quad->H);
-		if (quad->Hinv != NULL)
-		{
-			// Success!
-			return 0;
-		}
-		matd_destroy(quad->H);
-		quad->H = NULL;
+		__m128d vx = _mm_loadu_pd(x + i), vy = _mm_loadu_pd(y + i);
+		__m128d xx = _mm_add_pd(_mm_add_pd(_mm_mul_pd(h[0], vx), _mm_mul_pd(h[1], vy)), h[2]);
+		__m128d yy = _mm_add_pd(_mm_add_pd(_mm_mul_pd(h[3], vx), _mm_mul_pd(h[4], vy)), h[5]);
+		__m128d zz = _mm_add_pd(_mm_add_pd(_mm_mul_pd(h[6], vx), _mm_mul_pd(h[7], vy)), h[8]);
+		_mm_storeu_pd(px + i, _mm_div_pd(xx, zz));
+		_mm_storeu_pd(py + i, _mm_div_pd(yy, zz));
+	}
+#elif defined(DECODE_NEON)
+	float64x2_t h[9];
+	for (int j = 0; j < 9; j++)
+		h[j] = vdupq_n_f64(H[j]);
+
+	// no fused multiply-adds, they would round differently.
+	for (; i + 2 <= n; i += 2)
+	{
+		float64x2_t vx = vld1q_f64(x + i), vy = vld1q_f64(y + i);
+		float64x2_t xx = vaddq_f64(vaddq_f64(vmulq_f64(h[0], vx), vmulq_f64(h[1], vy)), h[2]);
+		float64x2_t yy = vaddq_f64(vaddq_f64(vmulq_f64(h[3], vx), vmulq_f64(h[4], vy)), h[5]);
+		float64x2_t zz = vaddq_f64(vaddq_f64(vmulq_f64(h[6], vx), vmulq_f64(h[7], vy)), h[8]);
+		vst1q_f64(px + i, vdivq_f64(xx, zz));
+		vst1q_f64(py + i, vdivq_f64(yy, zz));
 	}
-	return -1;
+#endif
+
+	for (; i < n; i++)
+		mat33_project(H, x[i], y[i], &px[i], &py[i]);
 }
 
 static double value_for_pixel(image_u8_t *im, double px, double py)
@@ -623,156 +1247,137 @@ static double value_for_pixel(image_u8_t *im, double px, double py)
 		   im->buf[y2 * im->stride + x2] * x * y;
 }
 
-static void sharpen(apriltag_detector_t *td, double *values, int size)
+// v[i] = value_for_pixel(im, px[i], py[i]) for i in [0, n)
+static void values_for_pixels(image_u8_t *im, const double *px, const double *py, int n, double *v)
 {
-	double *sharpened = malloc(sizeof(double) * size * size);
-	double kernel[9] = {
-		0, -1, 0,
-		-1, 4, -1,
-		0, -1, 0};
+	int i = 0;
 
-	for (int y = 0; y < size; y++)
+#if defined(DECODE_SSE2)
+	const __m128d half = _mm_set1_pd(0.5), one = _mm_set1_pd(1);
+
+	for (; i + 2 <= n; i += 2)
 	{
-		for (int x = 0; x < size; x++)
+		__m128d fx = _mm_sub_pd(_mm_loadu_pd(px + i), half);
+		__m128d fy = _mm_sub_pd(_mm_loadu_pd(py + i), half);
+
+		// floor and ceil without SSE4.1: truncate, then step down
+		// (up) where that rounded the other way. Values out of the int
+		// range truncate to INT_MIN, like the scalar conversion, and
+		// end up outside the image.
+		__m128d tx = _mm_cvtepi32_pd(_mm_cvttpd_epi32(fx));
+		__m128d ty = _mm_cvtepi32_pd(_mm_cvttpd_epi32(fy));
+		__m128d x1 = _mm_sub_pd(tx, _mm_and_pd(_mm_cmpgt_pd(tx, fx), one));
+		__m128d x2 = _mm_add_pd(tx, _mm_and_pd(_mm_cmplt_pd(tx, fx), one));
+		__m128d y1 = _mm_sub_pd(ty, _mm_and_pd(_mm_cmpgt_pd(ty, fy), one));
+		__m128d y2 = _mm_add_pd(ty, _mm_and_pd(_mm_cmplt_pd(ty, fy), one));
+
+		int32_t ix1[4], ix2[4], iy1[4], iy2[4];
+		_mm_storeu_si128((__m128i *)ix1, _mm_cvttpd_epi32(x1));
+		_mm_storeu_si128((__m128i *)ix2, _mm_cvttpd_epi32(x2));
+		_mm_storeu_si128((__m128i *)iy1, _mm_cvttpd_epi32(y1));
+		_mm_storeu_si128((__m128i *)iy2, _mm_cvttpd_epi32(y2));
+
+		// no gather in SSE2, the four pixels of each lane are loaded
+		// one by one.
+		double p[4][2];
+		int inside[2];
+		for (int l = 0; l < 2; l++)
 		{
-			sharpened[y * size + x] = 0;
-			for (int i = 0; i < 3; i++)
+			inside[l] = ix1[l] >= 0 && ix2[l] < im->width && iy1[l] >= 0 && iy2[l] < im->height;
+			if (inside[l])
 			{
-				for (int j = 0; j < 3; j++)
-				{
-					if ((y + i - 1) < 0 || (y + i - 1) > size - 1 || (x + j - 1) < 0 || (x + j - 1) > size - 1)
-					{
-						continue;
-					}
-					sharpened[y * size + x] += values[(y + i - 1) * size + (x + j - 1)] * kernel[i * 3 + j];
-				}
+				p[0][l] = im->buf[iy1[l] * im->stride + ix1[l]];
+				p[1][l] = im->buf[iy1[l] * im->stride + ix2[l]];
+				p[2][l] = im->buf[iy2[l] * im->stride + ix1[l]];
+				p[3][l] = im->buf[iy2[l] * im->stride + ix2[l]];
+			}
+			else
+			{
+				p[0][l] = p[1][l] = p[2][l] = p[3][l] = 0;
 			}
 		}
-	}
 
-	for (int y = 0; y < size; y++)
-	{
-		for (int x = 0; x < size; x++)
-		{
-			values[y * size + x] = values[y * size + x] + td->decode_sharpening * sharpened[y * size + x];
-		}
+		__m128d x = _mm_sub_pd(fx, x1), y = _mm_sub_pd(fy, y1);
+		__m128d nx = _mm_sub_pd(one, x), ny = _mm_sub_pd(one, y);
+
+		__m128d r = _mm_mul_pd(_mm_mul_pd(_mm_loadu_pd(p[0]), nx), ny);
+		r = _mm_add_pd(r, _mm_mul_pd(_mm_mul_pd(_mm_loadu_pd(p[1]), x), ny));
+		r = _mm_add_pd(r, _mm_mul_pd(_mm_mul_pd(_mm_loadu_pd(p[2]), nx), y));
+		r = _mm_add_pd(r, _mm_mul_pd(_mm_mul_pd(_mm_loadu_pd(p[3]), x), y));
+		_mm_storeu_pd(v + i, r);
+
+		for (int l = 0; l < 2; l++)
+			if (!inside[l])
+				v[i + l] = -1;
 	}
+#endif
 
-	free(sharpened);
+	for (; i < n; i++)
+		v[i] = value_for_pixel(im, px[i], py[i]);
 }
 
-// returns the decision margin. Return < 0 if the detection should be rejected.
-static float quad_decode(apriltag_detector_t *td, apriltag_family_t *family, image_u8_t *im, struct quad *quad, struct quick_decode_entry *entry, image_u8_t *im_samples)
+// Samples the quad at the points of the grid. Returns the decision
+// margin, < 0 if the detection should be rejected, and the code read
+// from the quad in rcode.
+static float quad_decode(apriltag_detector_t *td, const struct sample_grid *grid, image_u8_t *im, struct quad *quad, uint64_t *rcode, image_u8_t *im_samples)
 {
-	// decode the tag binary contents by sampling the pixel
-	// closest to the center of each bit cell.
-
-	// We will compute a threshold by sampling known white/black cells around this tag.
-	// This sampling is achieved by considering a set of samples along lines.
-	//
-	// coordinates are given in bit coordinates. ([0, fam->border_width]).
-	//
-	// { initial x, initial y, delta x, delta y, WHITE=1 }
-	float patterns[] = {
-		// left white column
-		-0.5, 0.5,
-		0, 1,
-		1,
-
-		// left black column
-		0.5, 0.5,
-		0, 1,
-		0,
-
-		// right white column
-		family->width_at_border + 0.5, .5,
-		0, 1,
-		1,
-
-		// right black column
-		family->width_at_border - 0.5, .5,
-		0, 1,
-		0,
-
-		// top white row
-		0.5, -0.5,
-		1, 0,
-		1,
-
-		// top black row
-		0.5, 0.5,
-		1, 0,
-		0,
-
-		// bottom white row
-		0.5, family->width_at_border + 0.5,
-		1, 0,
-		1,
-
-		// bottom black row
-		0.5, family->width_at_border - 0.5,
-		1, 0,
-		0
+	double px[SAMPLE_GRID_MAX_BORDER], py[SAMPLE_GRID_MAX_BORDER];
 
-		// XXX double-counts the corners.
-	};
+	// black [0] and white [1]
+	struct graymodel models[2];
 
-	struct graymodel whitemodel, blackmodel;
-	graymodel_init(&whitemodel);
-	graymodel_init(&blackmodel);
-
-	for (int pattern_idx = 0; pattern_idx < sizeof(patterns) / (5 * sizeof(float)); pattern_idx++)
+	for (int color = 0; color < 2; color++)
 	{
-		float *pattern = &patterns[pattern_idx * 5];
+		struct graymodel *gm = &models[color];
+		graymodel_init(gm);
 
-		int is_white = pattern[4];
+		int n = grid->nborder[color];
+		const double *tagx = grid->border_x[color], *tagy = grid->border_y[color];
+		project_points(quad->H, tagx, tagy, n, px, py);
 
-		for (int i = 0; i < family->width_at_border; i++)
+		int all_inside = 1;
+		for (int i = 0; i < n; i++)
 		{
-			double tagx01 = (pattern[0] + i * pattern[2]) / (family->width_at_border);
-			double tagy01 = (pattern[1] + i * pattern[3]) / (family->width_at_border);
-
-			double tagx = 2 * (tagx01 - 0.5);
-			double tagy = 2 * (tagy01 - 0.5);
-
-			double px, py;
-			homography_project(quad->H, tagx, tagy, &px, &py);
-
 			// don't round
-			int ix = px;
-			int iy = py;
+			int ix = px[i];
+			int iy = py[i];
 			if (ix < 0 || iy < 0 || ix >= im->width || iy >= im->height)
+			{
+				all_inside = 0;
 				continue;
+			}
 
 			int v = im->buf[iy * im->stride + ix];
 
 			if (im_samples)
 			{
-				im_samples->buf[iy * im_samples->stride + ix] = (1 - is_white) * 255;
+				im_samples->buf[iy * im_samples->stride + ix] = (1 - color) * 255;
 			}
 
-			if (is_white)
-				graymodel_add(&whitemodel, tagx, tagy, v);
-			else
-				graymodel_add(&blackmodel, tagx, tagy, v);
+			graymodel_add(gm, tagx[i], tagy[i], v);
 		}
+
+		if (all_inside)
+			memcpy(gm->A, grid->A[color], sizeof(gm->A));
 	}
 
-	if (family->width_at_border > 1)
+	struct graymodel *whitemodel = &models[1], *blackmodel = &models[0];
+
+	if (grid->width_at_border > 1)
 	{
-		graymodel_solve(&whitemodel);
-		graymodel_solve(&blackmodel);
+		graymodel_solve(whitemodel);
+		graymodel_solve(blackmodel);
 	}
 	else
 	{
-		graymodel_solve(&whitemodel);
-		blackmodel.C[0] = 0;
-		blackmodel.C[1] = 0;
-		blackmodel.C[2] = blackmodel.B[2] / 4;
+		graymodel_solve(whitemodel);
+		blackmodel->C[0] = 0;
+		blackmodel->C[1] = 0;
+		blackmodel->C[2] = blackmodel->B[2] / 4;
 	}
 
 	// XXX Tunable
-	if ((graymodel_interpolate(&whitemodel, 0, 0) - graymodel_interpolate(&blackmodel, 0, 0) < 0) != family->reversed_border)
+	if ((graymodel_interpolate(whitemodel, 0, 0) - graymodel_interpolate(blackmodel, 0, 0) < 0) != grid->reversed_border)
 	{
 		return -1;
 	}
@@ -786,57 +1391,67 @@ static float quad_decode(apriltag_detector_t *td, apriltag_family_t *family, ima
 	float black_score = 0, white_score = 0;
 	float black_score_count = 1, white_score_count = 1;
 
-	double *values = calloc(family->total_width * family->total_width, sizeof(double));
-
-	int min_coord = (family->width_at_border - family->total_width) / 2;
-	for (int i = 0; i < family->nbits; i++)
-	{
-		int bity = family->bit_y[i];
-		int bitx = family->bit_x[i];
-
-		double tagx01 = (bitx + 0.5) / (family->width_at_border);
-		double tagy01 = (bity + 0.5) / (family->width_at_border);
-
-		// scale to [-1, 1]
-		double tagx = 2 * (tagx01 - 0.5);
-		double tagy = 2 * (tagy01 - 0.5);
+	int nbits = grid->nbits;
+	double samples[SAMPLE_GRID_MAX_BITS], values[SAMPLE_GRID_MAX_BITS];
 
-		double px, py;
-		homography_project(quad->H, tagx, tagy, &px, &py);
+	project_points(quad->H, grid->bit_tagx, grid->bit_tagy, nbits, px, py);
+	values_for_pixels(im, px, py, nbits, samples);
 
-		double v = value_for_pixel(im, px, py);
+	for (int i = 0; i < nbits; i++)
+	{
+		double v = samples[i];
 
 		if (v == -1)
 		{
+			values[i] = 0;
 			continue;
 		}
 
-		double thresh = (graymodel_interpolate(&blackmodel, tagx, tagy) + graymodel_interpolate(&whitemodel, tagx, tagy)) / 2.0;
-		values[family->total_width * (bity - min_coord) + bitx - min_coord] = v - thresh;
+		double tagx = grid->bit_tagx[i], tagy = grid->bit_tagy[i];
+		double thresh = (graymodel_interpolate(blackmodel, tagx, tagy) + graymodel_interpolate(whitemodel, tagx, tagy)) / 2.0;
+		values[i] = v - thresh;
 
 		if (im_samples)
 		{
-			int ix = px;
-			int iy = py;
+			int ix = px[i];
+			int iy = py[i];
 			im_samples->buf[iy * im_samples->stride + ix] = (v < thresh) * 255;
 		}
 	}
 
-	sharpen(td, values, family->total_width);
+	// sharpen with the kernel
+	//  0 -1  0
+	// -1  4 -1
+	//  0 -1  0
+	// only the bit cells are needed; all other cells are 0.
+	double sharpened[SAMPLE_GRID_MAX_BITS];
+	for (int i = 0; i < nbits; i++)
+	{
+		const int8_t *nb = grid->neighbors[i];
+		double s = 0;
+		if (nb[0] >= 0)
+			s -= values[nb[0]];
+		if (nb[1] >= 0)
+			s -= values[nb[1]];
+		s += values[i] * 4;
+		if (nb[2] >= 0)
+			s -= values[nb[2]];
+		if (nb[3] >= 0)
+			s -= values[nb[3]];
+		sharpened[i] = s;
+	}
 
-	uint64_t rcode = 0;
-	for (int i = 0; i < family->nbits; i++)
+	*rcode = 0;
+	for (int i = 0; i < nbits; i++)
 	{
-		int bity = family->bit_y[i];
-		int bitx = family->bit_x[i];
-		rcode = (rcode << 1);
-		double v = values[(bity - min_coord) * family->total_width + bitx - min_coord];
+		*rcode = (*rcode << 1);
+		double v = values[i] + td->decode_sharpening * sharpened[i];
 
 		if (v > 0)
 		{
 			white_score += v;
 			white_score_count++;
-			rcode |= 1;
+			*rcode |= 1;
 		}
 		else
 		{
@@ -845,8 +1460,6 @@ static float quad_decode(apriltag_detector_t *td, apriltag_family_t *family, ima
 		}
 	}
 
-	quick_decode_codeword(family, rcode, entry);
-	free(values);
 	return fmin(white_score / white_score_count, black_score / black_score_count);
 }
 
@@ -1007,246 +1620,1073 @@ static void refine_edges(apriltag_detector_t *td, image_u8_t *im_orig, struct qu
 	}
 }
 
-static void quad_decode_task(void *_u)
+// how many different layouts quad_decode_task remembers the samples of
+// per quad.
+#define APRILTAG_DECODE_SHARED_GRIDS 8
+
+// Whether the area and aspect of the quad are within the bounds of the
+// detector. Convexity and the minimum size of a tag were already
+// checked when the quad was fit.
+static int quad_geometry_ok(const apriltag_detector_t *td, const struct quad *quad)
 {
-	struct quad_decode_task *task = (struct quad_decode_task *)_u;
-	apriltag_detector_t *td = task->td;
-	image_u8_t *im = task->im;
+	double area = 0;
+	double min_side = HUGE_VAL, max_side = 0;
 
-	for (int quadidx = task->i0; quadidx < task->i1; quadidx++)
+	for (int i = 0; i < 4; i++)
 	{
-		struct quad *quad_original;
-		zarray_get_volatile(task->quads, quadidx, &quad_original);
+		const float *a = quad->p[i], *b = quad->p[(i + 1) & 3];
 
-		// refine edges is not dependent upon the tag family, thus
-		// apply this optimization BEFORE the other work.
-		// if (td->quad_decimate > 1 && td->refine_edges) {
-		if (td->refine_edges)
+		area += a[0] * b[1] - b[0] * a[1];
+
+		double side = sqrt(sq(b[0] - a[0]) + sq(b[1] - a[1]));
+		min_side = fmin(min_side, side);
+		max_side = fmax(max_side, side);
+	}
+
+	area = fabs(area) / 2;
+
+	if (td->quad_min_area > 0 && area < td->quad_min_area)
+		return 0;
+	if (td->quad_max_area > 0 && area > td->quad_max_area)
+		return 0;
+	if (td->quad_max_aspect > 0 && max_side > td->quad_max_aspect * min_side)
+		return 0;
+
+	return 1;
+}
+
+// Whether the white border of the quad is at least
+// quad_min_border_contrast brighter than the black one, judged by the
+// probes of the grid. Quads with too little of their border inside the
+// image to tell pass.
+static int quad_border_ok(const apriltag_detector_t *td, const struct sample_grid *grid, const image_u8_t *im, const struct quad *quad)
+{
+	int sum[2] = {0, 0}, count[2] = {0, 0};
+
+	for (int color = 0; color < 2; color++)
+	{
+		double px[SAMPLE_GRID_PROBES], py[SAMPLE_GRID_PROBES];
+		project_points(quad->H, grid->probe_x[color], grid->probe_y[color], SAMPLE_GRID_PROBES, px, py);
+
+		for (int i = 0; i < SAMPLE_GRID_PROBES; i++)
 		{
-			refine_edges(td, im, quad_original);
+			int ix = px[i];
+			int iy = py[i];
+			if (ix < 0 || iy < 0 || ix >= im->width || iy >= im->height)
+				continue;
+
+			sum[color] += im->buf[iy * im->stride + ix];
+			count[color]++;
 		}
+	}
 
-		// make sure the homographies are computed...
-		if (quad_update_homographies(quad_original) != 0)
-			continue;
+	if (count[0] < 2 || count[1] < 2)
+		return 1;
 
-		for (int famidx = 0; famidx < zarray_size(td->tag_families); famidx++)
-		{
-			apriltag_family_t *family;
-			zarray_get(td->tag_families, famidx, &family);
+	int contrast = sum[1] / count[1] - sum[0] / count[0];
+	if (grid->reversed_border)
+		contrast = -contrast;
 
-			if (family->reversed_border != quad_original->reversed_border)
-			{
-				continue;
-			}
+	return contrast >= td->quad_min_border_contrast;
+}
 
-			// since the geometry of tag families can vary, start any
-			// optimization process over with the original quad.
-			struct quad *quad = quad_copy(quad_original);
+// Whether rcode is at most one bit further from a tag of the family
+// than its decode table corrects.
+static int quick_decode_near(apriltag_family_t *family, uint64_t rcode)
+{
+	struct quick_decode_entry entry;
 
-			struct quick_decode_entry entry;
+	quick_decode_codeword(family, rcode, &entry);
+	if (entry.hamming < 255)
+		return 1;
 
-			float decision_margin = quad_decode(td, family, im, quad, &entry, task->im_samples);
+	for (uint32_t b = 0; b < family->nbits; b++)
+	{
+		quick_decode_codeword(family, rcode ^ (UINT64_C(1) << b), &entry);
+		if (entry.hamming < 255)
+			return 1;
+	}
 
-			if (decision_margin >= 0 && entry.hamming < 255)
-			{
-				apriltag_detection_t *det = calloc(1, sizeof(apriltag_detection_t));
+	return 0;
+}
 
-				det->family = family;
-				det->id = entry.id;
-				det->hamming = entry.hamming;
-				det->decision_margin = decision_margin;
+enum
+{
+	QUAD_PASSED,
+	QUAD_REJECTED_BORDER,
+	QUAD_REJECTED_PRECHECK
+};
 
-				double theta = entry.rotation * M_PI / 2.0;
-				double c = cos(theta), s = sin(theta);
+// Runs the border test and, if decode is set and the quad is going to
+// be refined, the decode precheck on the quad as it is, for every
+// family until one of them passes. The homographies of the quad must
+// be up to date.
+static int quad_precheck(apriltag_detector_t *td, image_u8_t *im, struct quad *quad, bool decode)
+{
+	bool precheck = decode && td->refine_edges && td->quad_precheck;
+	bool border_passed = false;
 
-				// Fix the rotation of our homography to properly orient the tag
-				matd_t *R = matd_create(3, 3);
-				MATD_EL(R, 0, 0) = c;
-				MATD_EL(R, 0, 1) = -s;
-				MATD_EL(R, 1, 0) = s;
-				MATD_EL(R, 1, 1) = c;
-				MATD_EL(R, 2, 2) = 1;
+	// the outcome for each layout tried so far.
+	struct
+	{
+		const struct sample_grid *grid;
+		bool border_ok, decoded;
+		float decision_margin;
+		uint64_t rcode;
+	} checked[APRILTAG_DECODE_SHARED_GRIDS];
+	int nchecked = 0;
+
+	for (int famidx = 0; famidx < zarray_size(td->tag_families); famidx++)
+	{
+		apriltag_family_t *family;
+		zarray_get(td->tag_families, famidx, &family);
+
+		if (family->reversed_border != quad->reversed_border)
+			continue;
+
+		const struct quick_decode *qd = (const struct quick_decode *)family->impl;
+		if (qd == NULL || qd->grid == NULL)
+			continue;
+
+		int c = 0;
+		while (c < nchecked && checked[c].grid != qd->grid)
+			c++;
+
+		if (c == nchecked)
+		{
+			// once all slots are taken the last one is reused.
+			if (nchecked < APRILTAG_DECODE_SHARED_GRIDS)
+				nchecked++;
+			else
+				c = nchecked - 1;
+
+			checked[c].grid = qd->grid;
+			checked[c].border_ok = td->quad_min_border_contrast < 0 || quad_border_ok(td, qd->grid, im, quad);
+			checked[c].decoded = false;
+		}
+
+		if (!checked[c].border_ok)
+			continue;
+
+		border_passed = true;
+		if (!precheck)
+			return QUAD_PASSED;
+
+		if (!checked[c].decoded)
+		{
+			checked[c].decision_margin = quad_decode(td, qd->grid, im, quad, &checked[c].rcode, NULL);
+			checked[c].decoded = true;
+		}
+
+		if (checked[c].decision_margin >= 0 && quick_decode_near(family, checked[c].rcode))
+			return QUAD_PASSED;
+	}
+
+	return border_passed ? QUAD_REJECTED_PRECHECK : QUAD_REJECTED_BORDER;
+}
+
+static void quad_decode_task(void *_u, int i0, int i1)
+{
+	struct quad_decode_task *task = (struct quad_decode_task *)_u;
+	apriltag_detector_t *td = task->td;
+	image_u8_t *im = task->im;
+
+	uint32_t nrejected_geometry = 0, nrejected_border = 0, nrejected_precheck = 0, ndecoded = 0;
+
+	for (int quadidx = i0; quadidx < i1; quadidx++)
+	{
+		struct quad *quad_original;
+		zarray_get_volatile(task->quads, quadidx, &quad_original);
+
+		// rejection cascade, cheapest test first.
+		if (!quad_geometry_ok(td, quad_original) || quad_update_homographies(quad_original) != 0)
+		{
+			nrejected_geometry++;
+			continue;
+		}
+
+		// the corners of a quad found in a decimated image can be off by
+		// a pixel or more, enough for the border and bit samples of a
+		// small tag to miss. Those quads are refined before they are
+		// tested, which leaves nothing for the precheck to save.
+		bool refine_first = td->refine_edges && td->quad_decimate > 1;
+		if (refine_first)
+		{
+			refine_edges(td, im, quad_original);
+
+			if (quad_update_homographies(quad_original) != 0)
+				continue;
+		}
+
+		int precheck = quad_precheck(td, im, quad_original, !refine_first);
+		if (precheck == QUAD_REJECTED_BORDER)
+		{
+			nrejected_border++;
+			continue;
+		}
+		if (precheck == QUAD_REJECTED_PRECHECK)
+		{
+			nrejected_precheck++;
+			continue;
+		}
+
+		// refine edges is not dependent upon the tag family, thus
+		// apply this optimization BEFORE the other work.
+		// if (td->quad_decimate > 1 && td->refine_edges) {
+		if (td->refine_edges && !refine_first)
+		{
+			refine_edges(td, im, quad_original);
+
+			if (quad_update_homographies(quad_original) != 0)
+				continue;
+		}
+
+		ndecoded++;
+
+		// families with the same layout read the same code from the
+		// quad, it's only looked up in each of their tables.
+		struct
+		{
+			const struct sample_grid *grid;
+			float decision_margin;
+			uint64_t rcode;
+		} decoded[APRILTAG_DECODE_SHARED_GRIDS];
+		int ndecoded = 0;
+
+		for (int famidx = 0; famidx < zarray_size(td->tag_families); famidx++)
+		{
+			apriltag_family_t *family;
+			zarray_get(td->tag_families, famidx, &family);
+
+			if (family->reversed_border != quad_original->reversed_border)
+			{
+				continue;
+			}
+
+			// without a decode table nothing could be found.
+			const struct quick_decode *qd = (const struct quick_decode *)family->impl;
+			if (qd == NULL || qd->grid == NULL)
+			{
+				continue;
+			}
+
+			// since the geometry of tag families can vary, start any
+			// optimization process over with the original quad.
+			struct quad quad_copy = *quad_original;
+			struct quad *quad = &quad_copy;
+
+			float decision_margin = -1;
+			uint64_t rcode = 0;
+
+			int d = 0;
+			while (d < ndecoded && decoded[d].grid != qd->grid)
+				d++;
+
+			if (d < ndecoded)
+			{
+				decision_margin = decoded[d].decision_margin;
+				rcode = decoded[d].rcode;
+			}
+			else
+			{
+				decision_margin = quad_decode(td, qd->grid, im, quad, &rcode, task->im_samples);
+
+				if (ndecoded < APRILTAG_DECODE_SHARED_GRIDS)
+				{
+					decoded[ndecoded].grid = qd->grid;
+					decoded[ndecoded].decision_margin = decision_margin;
+					decoded[ndecoded].rcode = rcode;
+					ndecoded++;
+				}
+			}
+
+			if (decision_margin < 0)
+				continue;
+
+			struct quick_decode_entry entry;
+			quick_decode_codeword(family, rcode, &entry);
+
+			if (entry.hamming < 255)
+			{
+				apriltag_detection_t *det = calloc(1, sizeof(apriltag_detection_t));
+
+				det->family = family;
+				det->id = entry.id;
+				det->hamming = entry.hamming;
+				det->decision_margin = decision_margin;
+
+				double theta = entry.rotation * M_PI / 2.0;
+				double c = cos(theta), s = sin(theta);
+
+				// Fix the rotation of our homography to properly orient the tag
+				double R[9] = {c, -s, 0, s, c, 0, 0, 0, 1};
+
+				det->H = matd_create(3, 3);
+				mat33_mul(quad->H, R, det->H->data);
+
+				homography_project(det->H, 0, 0, &det->c[0], &det->c[1]);
+
+				// [-1, -1], [1, -1], [1, 1], [-1, 1], Desired points
+				// [-1, 1], [1, 1], [1, -1], [-1, -1], FLIP Y
+				// adjust the points in det->p so that they correspond to
+				// counter-clockwise around the quad, starting at -1,-1.
+				for (int i = 0; i < 4; i++)
+				{
+					int tcx = (i == 1 || i == 2) ? 1 : -1;
+					int tcy = (i < 2) ? 1 : -1;
+
+					double p[2];
+
+					homography_project(det->H, tcx, tcy, &p[0], &p[1]);
+
+					det->p[i][0] = p[0];
+					det->p[i][1] = p[1];
+				}
+
+				pthread_mutex_lock(&td->mutex);
+				zarray_add(task->detections, &det);
+				pthread_mutex_unlock(&td->mutex);
+			}
+		}
+	}
+
+	pthread_mutex_lock(&td->mutex);
+	td->nrejected_geometry += nrejected_geometry;
+	td->nrejected_border += nrejected_border;
+	td->nrejected_precheck += nrejected_precheck;
+	td->ndecoded += ndecoded;
+	pthread_mutex_unlock(&td->mutex);
+}
+
+void apriltag_detection_destroy(apriltag_detection_t *det)
+{
+	if (det == NULL)
+		return;
+
+	matd_destroy(det->H);
+	free(det);
+}
+
+static int prefer_smaller(int pref, double q0, double q1)
+{
+	if (pref) // already prefer something? exit.
+		return pref;
+
+	if (q0 < q1)
+		return -1; // we now prefer q0
+	if (q1 < q0)
+		return 1; // we now prefer q1
+
+	// no preference
+	return 0;
+}
+
+// Makes sure the worker pool matches td->nthreads and starts a new
+// frame: clears the time profile and releases last frame's scratch
+// memory. Returns non-zero if the worker pool could not be created.
+static int detector_begin_frame(apriltag_detector_t *td)
+{
+	if (td->wp == NULL || td->nthreads != workerpool_get_nthreads(td->wp))
+	{
+		// create the new pool first, so the shared worker threads
+		// aren't torn down and restarted in between.
+		workerpool_t *wp = workerpool_create(td->nthreads);
+		if (wp == NULL)
+			return -1;
+		workerpool_destroy(td->wp);
+		td->wp = wp;
+	}
+
+	timeprofile_clear(td->tp);
+	td->nclusters = 0;
+	td->nrejected_geometry = 0;
+	td->nrejected_border = 0;
+	td->nrejected_precheck = 0;
+	td->ndecoded = 0;
+	td->ndecode_hits = 0;
+
+	// nothing allocated from the scratch arena survives the frame
+	arena_reset(td->scratch);
+
+	timeprofile_stamp(td->tp, "init");
+
+	return 0;
+}
+
+// Finds the quads of an image, in the image's full-resolution pixel
+// coordinates. The image may be a view into a larger one.
+static zarray_t *detect_quads(apriltag_detector_t *td, image_u8_t *im_orig)
+{
+	///////////////////////////////////////////////////////////
+	// Step 1. Detect quads according to requested image decimation
+	// and blurring parameters.
+	image_u8_t *quad_im = im_orig;
+
+	// compute a reasonable kernel width by figuring that the
+	// kernel should go out 2 std devs.
+	//
+	// max sigma          ksz
+	// 0.499              1  (disabled)
+	// 0.999              3
+	// 1.499              5
+	// 1.999              7
+
+	float sigma = fabsf((float)td->quad_sigma);
+
+	int ksz = 4 * sigma; // 2 std devs in each direction
+	if ((ksz & 1) == 0)
+		ksz++;
+
+	if (td->quad_decimate > 1 && td->quad_decimate != 1.5 && td->quad_sigma != 0 && ksz > 1)
+	{
+		// decimate and blur/sharpen in one pass
+		quad_im = image_u8_decimate_gaussian(im_orig, (int)td->quad_decimate, td->quad_sigma > 0 ? sigma : -sigma, ksz);
+
+		timeprofile_stamp(td->tp, "decimate");
+	}
+	else
+	{
+		if (td->quad_decimate > 1)
+		{
+			quad_im = image_u8_decimate(im_orig, td->quad_decimate);
+
+			timeprofile_stamp(td->tp, "decimate");
+		}
+
+		if (td->quad_sigma != 0 && ksz > 1)
+		{
+			if (td->quad_sigma > 0)
+			{
+				// Apply a blur
+				image_u8_gaussian_blur(quad_im, sigma, ksz);
+			}
+			else
+			{
+				// SHARPEN the image by subtracting the low frequency components.
+				image_u8_gaussian_sharpen(quad_im, sigma, ksz);
+			}
+		}
+	}
+
+	timeprofile_stamp(td->tp, "blur/sharp");
+
+	if (td->debug)
+		image_u8_write_pnm(quad_im, "debug_preprocess.pnm");
+
+	int nsmall = td->small_clusters ? zarray_size(td->small_clusters) : 0;
+
+	zarray_t *quads = apriltag_quad_thresh(td, quad_im);
+
+	// adjust centers of pixels so that they correspond to the
+	// original full-resolution image.
+	if (td->quad_decimate > 1)
+	{
+		for (int i = 0; i < zarray_size(quads); i++)
+		{
+			struct quad *q;
+			zarray_get_volatile(quads, i, &q);
+
+			for (int j = 0; j < 4; j++)
+			{
+				if (td->quad_decimate == 1.5)
+				{
+					q->p[j][0] *= td->quad_decimate;
+					q->p[j][1] *= td->quad_decimate;
+				}
+				else
+				{
+					q->p[j][0] = (q->p[j][0] - 0.5) * td->quad_decimate + 0.5;
+					q->p[j][1] = (q->p[j][1] - 0.5) * td->quad_decimate + 0.5;
+				}
+			}
+		}
+
+		for (int i = nsmall; td->small_clusters && i < zarray_size(td->small_clusters); i++)
+		{
+			float *box;
+			zarray_get_volatile(td->small_clusters, i, &box);
+
+			for (int j = 0; j < 4; j++)
+			{
+				if (td->quad_decimate == 1.5)
+					box[j] *= td->quad_decimate;
+				else
+					box[j] = (box[j] - 0.5) * td->quad_decimate + 0.5;
+			}
+		}
+	}
+
+	if (quad_im != im_orig)
+		image_u8_destroy(quad_im);
+
+	return quads;
+}
+
+// Finds the quads in [x0, x1) x [y0, y1) of the image and appends them
+// to quads, in coordinates of the whole image.
+static void detect_region_quads(apriltag_detector_t *td, image_u8_t *im_orig, int x0, int y0, int x1, int y1, zarray_t *quads)
+{
+	// const initializer
+	image_u8_t roi = {.width = x1 - x0, .height = y1 - y0, .stride = im_orig->stride,
+					  .buf = im_orig->buf + (size_t)y0 * im_orig->stride + x0};
+
+	// blurring works in place, and regions may overlap: give it a copy
+	// rather than blurring twice.
+	image_u8_t *roi_im = &roi;
+	if (td->quad_sigma != 0 && td->quad_decimate <= 1)
+	{
+		roi_im = image_u8_create(roi.width, roi.height);
+		for (int y = 0; y < roi.height; y++)
+			memcpy(&roi_im->buf[y * roi_im->stride], &roi.buf[y * roi.stride], roi.width);
+	}
+
+	int nsmall = td->small_clusters ? zarray_size(td->small_clusters) : 0;
+
+	zarray_t *roi_quads = detect_quads(td, roi_im);
+
+	for (int j = 0; j < zarray_size(roi_quads); j++)
+	{
+		struct quad *q;
+		zarray_get_volatile(roi_quads, j, &q);
+
+		for (int k = 0; k < 4; k++)
+		{
+			q->p[k][0] += x0;
+			q->p[k][1] += y0;
+		}
+		zarray_add(quads, q);
+	}
+
+	for (int j = nsmall; td->small_clusters && j < zarray_size(td->small_clusters); j++)
+	{
+		float *box;
+		zarray_get_volatile(td->small_clusters, j, &box);
+
+		box[0] += x0;
+		box[1] += y0;
+		box[2] += x0;
+		box[3] += y0;
+	}
+
+	zarray_destroy(roi_quads);
+	if (roi_im != &roi)
+		image_u8_destroy(roi_im);
+}
+
+// Decodes every quad against every family and appends the results to
+// detections.
+static void decode_quads(apriltag_detector_t *td, image_u8_t *im_orig, zarray_t *quads, zarray_t *detections)
+{
+	image_u8_t *im_samples = td->debug ? image_u8_copy(im_orig) : NULL;
+
+	int chunksize = 1 + zarray_size(quads) / (APRILTAG_TASKS_PER_THREAD_TARGET * td->nthreads);
+
+	struct quad_decode_task task;
+	task.quads = quads;
+	task.td = td;
+	task.im = im_orig;
+	task.detections = detections;
+	task.im_samples = im_samples;
+
+	int ndetections = zarray_size(detections);
+
+	workerpool_parallel_for(td->wp, zarray_size(quads), chunksize, quad_decode_task, &task);
+
+	td->ndecode_hits += zarray_size(detections) - ndetections;
+
+	if (im_samples != NULL)
+	{
+		image_u8_write_pnm(im_samples, "debug_samples.pnm");
+		image_u8_destroy(im_samples);
+	}
+}
+
+// < 0 if det0 should be kept over det1, > 0 for det1.
+static int detection_preference(const apriltag_detection_t *det0, const apriltag_detection_t *det1)
+{
+	int pref = 0;																 // 0 means undecided which one we'll keep.
+	pref = prefer_smaller(pref, det0->hamming, det1->hamming);					 // want small hamming
+	pref = prefer_smaller(pref, -det0->decision_margin, -det1->decision_margin); // want bigger margins
+
+	// if we STILL don't prefer one detection over the other, then pick
+	// any deterministic criterion.
+	for (int i = 0; i < 4; i++)
+	{
+		pref = prefer_smaller(pref, det0->p[i][0], det1->p[i][0]);
+		pref = prefer_smaller(pref, det0->p[i][1], det1->p[i][1]);
+	}
+
+	if (pref == 0)
+	{
+		// at this point, we should only be undecided if the tag detections
+		// are *exactly* the same. How would that happen?
+		debug_print("uh oh, no preference for overlappingdetection\n");
+	}
+
+	return pref;
+}
+
+// whether the corners turn the same way all around (in either
+// direction).
+static bool quad_is_convex(const double p[4][2])
+{
+	int turns = 0;
+	for (int i = 0; i < 4; i++)
+	{
+		const double *a = p[i], *b = p[(i + 1) & 3], *c = p[(i + 2) & 3];
+		double cross = (b[0] - a[0]) * (c[1] - b[1]) - (b[1] - a[1]) * (c[0] - b[0]);
+		turns += (cross > 0) - (cross < 0);
+	}
+	return turns == 4 || turns == -4;
+}
+
+// Separating axis test: two convex quads are disjoint iff their
+// projections onto the normal of one of their edges are.
+static bool convex_quads_overlap(const double a[4][2], const double b[4][2])
+{
+	const double(*quads[2])[2] = {a, b};
+
+	for (int q = 0; q < 2; q++)
+	{
+		for (int i = 0; i < 4; i++)
+		{
+			const double *p0 = quads[q][i], *p1 = quads[q][(i + 1) & 3];
+			double nx = p0[1] - p1[1], ny = p1[0] - p0[0];
+
+			double mina = HUGE_VAL, maxa = -HUGE_VAL, minb = HUGE_VAL, maxb = -HUGE_VAL;
+			for (int k = 0; k < 4; k++)
+			{
+				double da = a[k][0] * nx + a[k][1] * ny;
+				double db = b[k][0] * nx + b[k][1] * ny;
+				mina = fmin(mina, da);
+				maxa = fmax(maxa, da);
+				minb = fmin(minb, db);
+				maxb = fmax(maxb, db);
+			}
+
+			if (maxa < minb || maxb < mina)
+				return false;
+		}
+	}
+
+	return true;
+}
+
+static bool detections_overlap(const apriltag_detection_t *det0, const apriltag_detection_t *det1)
+{
+	double min0[2] = {HUGE_VAL, HUGE_VAL}, max0[2] = {-HUGE_VAL, -HUGE_VAL};
+	double min1[2] = {HUGE_VAL, HUGE_VAL}, max1[2] = {-HUGE_VAL, -HUGE_VAL};
+
+	for (int k = 0; k < 4; k++)
+	{
+		for (int d = 0; d < 2; d++)
+		{
+			min0[d] = fmin(min0[d], det0->p[k][d]);
+			max0[d] = fmax(max0[d], det0->p[k][d]);
+			min1[d] = fmin(min1[d], det1->p[k][d]);
+			max1[d] = fmax(max1[d], det1->p[k][d]);
+		}
+	}
+
+	if (max0[0] < min1[0] || max1[0] < min0[0] || max0[1] < min1[1] || max1[1] < min0[1])
+		return false;
+
+	if (quad_is_convex(det0->p) && quad_is_convex(det1->p))
+		return convex_quads_overlap(det0->p, det1->p);
+
+	// a tag seen from behind the camera's plane, or some other
+	// degenerate homography. Not worth a fast path.
+	zarray_t *poly0 = g2d_polygon_create_data((double(*)[2])det0->p, 4);
+	zarray_t *poly1 = g2d_polygon_create_data((double(*)[2])det1->p, 4);
+	bool overlap = g2d_polygon_overlaps_polygon(poly0, poly1);
+	zarray_destroy(poly0);
+	zarray_destroy(poly1);
+
+	return overlap;
+}
+
+struct reconcile_entry
+{
+	const apriltag_family_t *family;
+	int id;
+	int index;
+};
+
+static int reconcile_entry_compare(const void *_a, const void *_b)
+{
+	const struct reconcile_entry *a = _a, *b = _b;
+
+	if (a->family != b->family)
+		return (uintptr_t)a->family < (uintptr_t)b->family ? -1 : 1;
+	if (a->id != b->id)
+		return a->id < b->id ? -1 : 1;
+	return a->index - b->index;
+}
+
+// Reports the same tag only once, keeping the better of any two
+// overlapping detections with the same id. (Allows non-overlapping
+// duplicate detections.) Returns how many detections were removed.
+//
+// Only detections of the same tag are compared, so they are sorted
+// into groups first. Within a group they are compared in the order
+// they were found, each survivor against all later ones until it
+// loses, which removes exactly what comparing all pairs in the list
+// would.
+static int reconcile_detections(apriltag_detector_t *td, zarray_t *detections)
+{
+	int ndetections = zarray_size(detections);
+	if (ndetections < 2)
+		return 0;
+
+	struct reconcile_entry *entries = arena_alloc(td->scratch, ndetections * sizeof(struct reconcile_entry));
+	bool *removed = arena_calloc(td->scratch, ndetections, sizeof(bool));
+
+	for (int i = 0; i < ndetections; i++)
+	{
+		apriltag_detection_t *det;
+		zarray_get(detections, i, &det);
+
+		entries[i].family = det->family;
+		entries[i].id = det->id;
+		entries[i].index = i;
+	}
+
+	qsort(entries, ndetections, sizeof(struct reconcile_entry), reconcile_entry_compare);
+
+	for (int begin = 0, end; begin < ndetections; begin = end)
+	{
+		end = begin + 1;
+		while (end < ndetections && entries[end].family == entries[begin].family && entries[end].id == entries[begin].id)
+			end++;
+
+		for (int i0 = begin; i0 < end; i0++)
+		{
+			if (removed[entries[i0].index])
+				continue;
+
+			apriltag_detection_t *det0;
+			zarray_get(detections, entries[i0].index, &det0);
+
+			for (int i1 = i0 + 1; i1 < end; i1++)
+			{
+				if (removed[entries[i1].index])
+					continue;
+
+				apriltag_detection_t *det1;
+				zarray_get(detections, entries[i1].index, &det1);
+
+				if (!detections_overlap(det0, det1))
+					continue;
+
+				// the tags overlap. Delete one, keep the other.
+				if (detection_preference(det0, det1) < 0)
+				{
+					removed[entries[i1].index] = true;
+				}
+				else
+				{
+					removed[entries[i0].index] = true;
+					break;
+				}
+			}
+		}
+	}
 
-				det->H = matd_op("M*M", quad->H, R);
+	int nkept = 0;
+	for (int i = 0; i < ndetections; i++)
+	{
+		apriltag_detection_t *det;
+		zarray_get(detections, i, &det);
 
-				matd_destroy(R);
+		if (removed[i])
+			apriltag_detection_destroy(det);
+		else
+			zarray_set(detections, nkept++, &det, NULL);
+	}
+	zarray_truncate(detections, nkept);
 
-				homography_project(det->H, 0, 0, &det->c[0], &det->c[1]);
+	return ndetections - nkept;
+}
 
-				// [-1, -1], [1, -1], [1, 1], [-1, 1], Desired points
-				// [-1, 1], [1, 1], [1, -1], [-1, -1], FLIP Y
-				// adjust the points in det->p so that they correspond to
-				// counter-clockwise around the quad, starting at -1,-1.
-				for (int i = 0; i < 4; i++)
-				{
-					int tcx = (i == 1 || i == 2) ? 1 : -1;
-					int tcy = (i < 2) ? 1 : -1;
+// smallest region around a previous detection worth searching, in
+// pixels. Also the least it is grown by, so that a tag that is only a
+// few pixels large still gets its white border into the region.
+#define APRILTAG_TRACK_MIN_PAD 8
 
-					double p[2];
+// pyramid levels below the first search whole blocks of this many
+// pixels squared, so that what many small clusters close together
+// leave to search is one region rather than many.
+#define APRILTAG_PYRAMID_BLOCK 32
 
-					homography_project(det->H, tcx, tcy, &p[0], &p[1]);
+// a pyramid level with more regions to search than this, or with
+// regions covering more than 3/4 of the image, searches all of it
+// instead: past that, the regions cost more than they save.
+#define APRILTAG_PYRAMID_MAX_REGIONS 64
 
-					det->p[i][0] = p[0];
-					det->p[i][1] = p[1];
-				}
+static bool detections_cover(zarray_t *detections, double x, double y)
+{
+	for (int i = 0; i < zarray_size(detections); i++)
+	{
+		apriltag_detection_t *det;
+		zarray_get(detections, i, &det);
 
-				pthread_mutex_lock(&td->mutex);
-				zarray_add(task->detections, &det);
-				pthread_mutex_unlock(&td->mutex);
-			}
+		int sign = 0;
+		bool inside = true;
+		for (int k = 0; k < 4 && inside; k++)
+		{
+			const double *a = det->p[k], *b = det->p[(k + 1) & 3];
+			double cross = (b[0] - a[0]) * (y - a[1]) - (b[1] - a[1]) * (x - a[0]);
 
-			quad_destroy(quad);
+			int s = (cross > 0) - (cross < 0);
+			inside = s == 0 || sign == 0 || s == sign;
+			if (s != 0)
+				sign = s;
 		}
+
+		if (inside)
+			return true;
 	}
+	return false;
 }
 
-void apriltag_detection_destroy(apriltag_detection_t *det)
+// Marks the blocks around something the level above saw, unless it is
+// part of a tag that has already been found.
+static void pyramid_mark(uint8_t *blocks, int bw, const image_u8_t *im, zarray_t *detections, double xmin, double ymin, double xmax, double ymax)
 {
-	if (det == NULL)
+	if (detections_cover(detections, (xmin + xmax) / 2, (ymin + ymax) / 2))
 		return;
 
-	matd_destroy(det->H);
-	free(det);
-}
-
-static int prefer_smaller(int pref, double q0, double q1)
-{
-	if (pref) // already prefer something? exit.
-		return pref;
+	// room for the white border, and for it having been only part of
+	// the tag.
+	double pad = fmax(xmax - xmin, ymax - ymin) + APRILTAG_TRACK_MIN_PAD;
 
-	if (q0 < q1)
-		return -1; // we now prefer q0
-	if (q1 < q0)
-		return 1; // we now prefer q1
+	int x0 = iclamp((int)floor(xmin - pad), 0, im->width - 1) / APRILTAG_PYRAMID_BLOCK;
+	int y0 = iclamp((int)floor(ymin - pad), 0, im->height - 1) / APRILTAG_PYRAMID_BLOCK;
+	int x1 = iclamp((int)ceil(xmax + pad), 0, im->width - 1) / APRILTAG_PYRAMID_BLOCK;
+	int y1 = iclamp((int)ceil(ymax + pad), 0, im->height - 1) / APRILTAG_PYRAMID_BLOCK;
 
-	// no preference
-	return 0;
+	for (int y = y0; y <= y1; y++)
+		memset(&blocks[y * bw + x0], 1, x1 - x0 + 1);
 }
 
-zarray_t *apriltag_detector_detect(apriltag_detector_t *td, image_u8_t *im_orig)
+// The regions the next pyramid level searches, as int[4] {x0, y0, x1,
+// y1}: around the small clusters and the quads of the level above that
+// no tag was found in. Returns false if the whole image should be
+// searched instead.
+static bool pyramid_regions(apriltag_detector_t *td, const image_u8_t *im, zarray_t *detections, zarray_t *small_clusters, zarray_t *quads, int first_quad, double max_quad, zarray_t *regions)
 {
-	if (zarray_size(td->tag_families) == 0)
+	int bw = (im->width + APRILTAG_PYRAMID_BLOCK - 1) / APRILTAG_PYRAMID_BLOCK;
+	int bh = (im->height + APRILTAG_PYRAMID_BLOCK - 1) / APRILTAG_PYRAMID_BLOCK;
+
+	uint8_t *blocks = arena_calloc(td->scratch, bw * bh, 1);
+
+	for (int i = 0; i < zarray_size(small_clusters); i++)
 	{
-		zarray_t *s = zarray_create(sizeof(apriltag_detection_t *));
-		debug_print("No tag families enabled\n");
-		return s;
+		float *box;
+		zarray_get_volatile(small_clusters, i, &box);
+		pyramid_mark(blocks, bw, im, detections, box[0], box[1], box[2], box[3]);
 	}
 
-	if (td->wp == NULL || td->nthreads != workerpool_get_nthreads(td->wp))
+	for (int i = first_quad; i < zarray_size(quads); i++)
 	{
-		workerpool_destroy(td->wp);
-		td->wp = workerpool_create(td->nthreads);
-		if (td->wp == NULL)
+		struct quad *q;
+		zarray_get_volatile(quads, i, &q);
+
+		double xmin = q->p[0][0], xmax = xmin, ymin = q->p[0][1], ymax = ymin;
+		for (int j = 1; j < 4; j++)
 		{
-			// creating workerpool failed - return empty zarray
-			return zarray_create(sizeof(apriltag_detection_t *));
+			xmin = fmin(xmin, q->p[j][0]);
+			xmax = fmax(xmax, q->p[j][0]);
+			ymin = fmin(ymin, q->p[j][1]);
+			ymax = fmax(ymax, q->p[j][1]);
 		}
-	}
-
-	timeprofile_clear(td->tp);
-	timeprofile_stamp(td->tp, "init");
 
-	///////////////////////////////////////////////////////////
-	// Step 1. Detect quads according to requested image decimation
-	// and blurring parameters.
-	image_u8_t *quad_im = im_orig;
-	if (td->quad_decimate > 1)
-	{
-		quad_im = image_u8_decimate(im_orig, td->quad_decimate);
+		// a larger quad had pixels enough to decode on the level above.
+		if (fmax(xmax - xmin, ymax - ymin) > max_quad)
+			continue;
 
-		timeprofile_stamp(td->tp, "decimate");
+		pyramid_mark(blocks, bw, im, detections, xmin, ymin, xmax, ymax);
 	}
 
-	if (td->quad_sigma != 0)
+	// every group of touching blocks is searched as the rectangle
+	// around it.
+	int *stack = arena_alloc(td->scratch, bw * bh * sizeof(int));
+	bool split = true;
+
+	for (int i = 0; i < bw * bh && split; i++)
 	{
-		// compute a reasonable kernel width by figuring that the
-		// kernel should go out 2 std devs.
-		//
-		// max sigma          ksz
-		// 0.499              1  (disabled)
-		// 0.999              3
-		// 1.499              5
-		// 1.999              7
+		if (blocks[i] != 1)
+			continue;
 
-		float sigma = fabsf((float)td->quad_sigma);
+		int r[4] = {bw, bh, 0, 0};
+		int nstack = 0;
 
-		int ksz = 4 * sigma; // 2 std devs in each direction
-		if ((ksz & 1) == 0)
-			ksz++;
+		blocks[i] = 2;
+		stack[nstack++] = i;
 
-		if (ksz > 1)
+		while (nstack > 0)
 		{
+			int b = stack[--nstack];
+			int bx = b % bw, by = b / bw;
 
-			if (td->quad_sigma > 0)
-			{
-				// Apply a blur
-				image_u8_gaussian_blur(quad_im, sigma, ksz);
-			}
-			else
-			{
-				// SHARPEN the image by subtracting the low frequency components.
-				image_u8_t *orig = image_u8_copy(quad_im);
-				image_u8_gaussian_blur(quad_im, sigma, ksz);
+			r[0] = imin(r[0], bx);
+			r[1] = imin(r[1], by);
+			r[2] = imax(r[2], bx + 1);
+			r[3] = imax(r[3], by + 1);
 
-				for (int y = 0; y < orig->height; y++)
+			int next[4] = {bx > 0 ? b - 1 : -1, bx < bw - 1 ? b + 1 : -1, by > 0 ? b - bw : -1, by < bh - 1 ? b + bw : -1};
+			for (int k = 0; k < 4; k++)
+			{
+				if (next[k] >= 0 && blocks[next[k]] == 1)
 				{
-					for (int x = 0; x < orig->width; x++)
-					{
-						int vorig = orig->buf[y * orig->stride + x];
-						int vblur = quad_im->buf[y * quad_im->stride + x];
-
-						int v = 2 * vorig - vblur;
-						if (v < 0)
-							v = 0;
-						if (v > 255)
-							v = 255;
-
-						quad_im->buf[y * quad_im->stride + x] = (uint8_t)v;
-					}
+					blocks[next[k]] = 2;
+					stack[nstack++] = next[k];
 				}
-				image_u8_destroy(orig);
 			}
 		}
+
+		for (int k = 0; k < 4; k++)
+			r[k] *= APRILTAG_PYRAMID_BLOCK;
+		r[2] = imin(r[2], im->width);
+		r[3] = imin(r[3], im->height);
+
+		if (r[2] - r[0] < APRILTAG_TRACK_MIN_PAD || r[3] - r[1] < APRILTAG_TRACK_MIN_PAD)
+			continue;
+
+		// the rectangles of groups around each other overlap, and a
+		// quad in both would be found twice: merge them.
+		for (int j = 0; j < zarray_size(regions); j++)
+		{
+			int *o;
+			zarray_get_volatile(regions, j, &o);
+
+			if (o[0] >= r[2] || r[0] >= o[2] || o[1] >= r[3] || r[1] >= o[3])
+				continue;
+
+			r[0] = imin(r[0], o[0]);
+			r[1] = imin(r[1], o[1]);
+			r[2] = imax(r[2], o[2]);
+			r[3] = imax(r[3], o[3]);
+
+			zarray_remove_index(regions, j, true);
+			j = -1;
+		}
+
+		zarray_add(regions, r);
+
+		split = zarray_size(regions) <= APRILTAG_PYRAMID_MAX_REGIONS;
 	}
 
-	timeprofile_stamp(td->tp, "blur/sharp");
+	int64_t area = 0;
+	for (int i = 0; i < zarray_size(regions); i++)
+	{
+		int *r;
+		zarray_get_volatile(regions, i, &r);
+		area += (int64_t)(r[2] - r[0]) * (r[3] - r[1]);
+	}
 
-	if (td->debug)
-		image_u8_write_pnm(quad_im, "debug_preprocess.pnm");
+	return split && 4 * area <= 3 * (int64_t)im->width * im->height;
+}
 
-	zarray_t *quads = apriltag_quad_thresh(td, quad_im);
+// Pyramid mode: finds the near tags on a coarse level, then searches
+// each finer level only where the level above saw something it found
+// no tag in. Appends the decoded tags to detections and returns the
+// quads of all levels.
+static zarray_t *detect_pyramid(apriltag_detector_t *td, image_u8_t *im_orig, zarray_t *detections)
+{
+	float base_decimate = td->quad_decimate;
 
-	// adjust centers of pixels so that they correspond to the
-	// original full-resolution image.
-	if (td->quad_decimate > 1)
+	zarray_t *quads = zarray_create(sizeof(struct quad));
+	zarray_t *small_clusters = zarray_create(4 * sizeof(float));
+	zarray_t *regions = zarray_create(4 * sizeof(int));
+	int first_quad = 0;
+
+	for (int level = td->pyramid_levels - 1; level >= 0; level--)
 	{
-		for (int i = 0; i < zarray_size(quads); i++)
+		bool whole_image = level == td->pyramid_levels - 1;
+		if (!whole_image)
 		{
-			struct quad *q;
-			zarray_get_volatile(quads, i, &q);
+			zarray_clear(regions);
+			// quads with bits of two pixels at most on the level above.
+			double max_quad = 2 * APRILTAG_TRACK_MIN_PAD * td->quad_decimate;
+			whole_image = !pyramid_regions(td, im_orig, detections, small_clusters, quads, first_quad, max_quad, regions);
+		}
 
-			for (int j = 0; j < 4; j++)
+		zarray_clear(small_clusters);
+		td->small_clusters = level > 0 ? small_clusters : NULL;
+		td->quad_decimate = base_decimate * (1 << level);
+
+		zarray_t *level_quads;
+		if (whole_image)
+		{
+			level_quads = detect_quads(td, im_orig);
+		}
+		else
+		{
+			level_quads = zarray_create(sizeof(struct quad));
+			for (int i = 0; i < zarray_size(regions); i++)
 			{
-				if (td->quad_decimate == 1.5)
-				{
-					q->p[j][0] *= td->quad_decimate;
-					q->p[j][1] *= td->quad_decimate;
-				}
-				else
-				{
-					q->p[j][0] = (q->p[j][0] - 0.5) * td->quad_decimate + 0.5;
-					q->p[j][1] = (q->p[j][1] - 0.5) * td->quad_decimate + 0.5;
-				}
+				int *r;
+				zarray_get_volatile(regions, i, &r);
+				detect_region_quads(td, im_orig, r[0], r[1], r[2], r[3], level_quads);
 			}
 		}
+
+		td->small_clusters = NULL;
+
+		timeprofile_stamp(td->tp, "quads");
+
+		// refine_edges searches as far as the decimation of the level
+		// the quad was found on.
+		decode_quads(td, im_orig, level_quads, detections);
+
+		timeprofile_stamp(td->tp, "decode+refinement");
+
+		first_quad = zarray_size(quads);
+		zarray_add_all(quads, level_quads);
+		zarray_destroy(level_quads);
 	}
 
-	if (quad_im != im_orig)
-		image_u8_destroy(quad_im);
+	td->quad_decimate = base_decimate;
+
+	zarray_destroy(regions);
+	zarray_destroy(small_clusters);
+
+	return quads;
+}
+
+zarray_t *apriltag_detector_detect(apriltag_detector_t *td, image_u8_t *im_orig)
+{
+	if (zarray_size(td->tag_families) == 0)
+	{
+		zarray_t *s = zarray_create(sizeof(apriltag_detection_t *));
+		debug_print("No tag families enabled\n");
+		return s;
+	}
+
+	uint64_t scratch_mallocs = td->scratch->nmallocs;
+
+	if (detector_begin_frame(td) != 0)
+	{
+		// creating workerpool failed - return empty zarray
+		return zarray_create(sizeof(apriltag_detection_t *));
+	}
+
+	td->tracked = false;
+	td->track_frames = 0;
 
 	zarray_t *detections = zarray_create(sizeof(apriltag_detection_t *));
 
+	///////////////////////////////////////////////////////////
+	// Step 1. Detect quads according to requested image decimation
+	// and blurring parameters. The pyramid decodes every level's
+	// quads right away, the finer levels depend on what it found.
+	zarray_t *quads;
+	if (td->pyramid_levels > 1)
+		quads = detect_pyramid(td, im_orig, detections);
+	else
+		quads = detect_quads(td, im_orig);
+
 	td->nquads = zarray_size(quads);
 
 	timeprofile_stamp(td->tp, "quads");
@@ -1279,40 +2719,8 @@ zarray_t *apriltag_detector_detect(apriltag_detector_t *td, image_u8_t *im_orig)
 
 	////////////////////////////////////////////////////////////////
 	// Step 2. Decode tags from each quad.
-	if (1)
-	{
-		image_u8_t *im_samples = td->debug ? image_u8_copy(im_orig) : NULL;
-
-		int chunksize = 1 + zarray_size(quads) / (APRILTAG_TASKS_PER_THREAD_TARGET * td->nthreads);
-
-		struct quad_decode_task *tasks = malloc(sizeof(struct quad_decode_task) * (zarray_size(quads) / chunksize + 1));
-
-		int ntasks = 0;
-		for (int i = 0; i < zarray_size(quads); i += chunksize)
-		{
-			tasks[ntasks].i0 = i;
-			tasks[ntasks].i1 = imin(zarray_size(quads), i + chunksize);
-			tasks[ntasks].quads = quads;
-			tasks[ntasks].td = td;
-			tasks[ntasks].im = im_orig;
-			tasks[ntasks].detections = detections;
-
-			tasks[ntasks].im_samples = im_samples;
-
-			workerpool_add_task(td->wp, quad_decode_task, &tasks[ntasks]);
-			ntasks++;
-		}
-
-		workerpool_run(td->wp);
-
-		free(tasks);
-
-		if (im_samples != NULL)
-		{
-			image_u8_write_pnm(im_samples, "debug_samples.pnm");
-			image_u8_destroy(im_samples);
-		}
-	}
+	if (td->pyramid_levels <= 1)
+		decode_quads(td, im_orig, quads, detections);
 
 	if (td->debug)
 	{
@@ -1345,82 +2753,7 @@ zarray_t *apriltag_detector_detect(apriltag_detector_t *td, image_u8_t *im_orig)
 	////////////////////////////////////////////////////////////////
 	// Step 3. Reconcile detections--- don't report the same tag more
 	// than once. (Allow non-overlapping duplicate detections.)
-	if (1)
-	{
-		zarray_t *poly0 = g2d_polygon_create_zeros(4);
-		zarray_t *poly1 = g2d_polygon_create_zeros(4);
-
-		for (int i0 = 0; i0 < zarray_size(detections); i0++)
-		{
-
-			apriltag_detection_t *det0;
-			zarray_get(detections, i0, &det0);
-
-			for (int k = 0; k < 4; k++)
-				zarray_set(poly0, k, det0->p[k], NULL);
-
-			for (int i1 = i0 + 1; i1 < zarray_size(detections); i1++)
-			{
-
-				apriltag_detection_t *det1;
-				zarray_get(detections, i1, &det1);
-
-				if (det0->id != det1->id || det0->family != det1->family)
-					continue;
-
-				for (int k = 0; k < 4; k++)
-					zarray_set(poly1, k, det1->p[k], NULL);
-
-				if (g2d_polygon_overlaps_polygon(poly0, poly1))
-				{
-					// the tags overlap. Delete one, keep the other.
-
-					int pref = 0;																 // 0 means undecided which one we'll keep.
-					pref = prefer_smaller(pref, det0->hamming, det1->hamming);					 // want small hamming
-					pref = prefer_smaller(pref, -det0->decision_margin, -det1->decision_margin); // want bigger margins
-
-					// if we STILL don't prefer one detection over the other, then pick
-					// any deterministic criterion.
-					for (int i = 0; i < 4; i++)
-					{
-						pref = prefer_smaller(pref, det0->p[i][0], det1->p[i][0]);
-						pref = prefer_smaller(pref, det0->p[i][1], det1->p[i][1]);
-					}
-
-					if (pref == 0)
-					{
-						// at this point, we should only be undecided if the tag detections
-						// are *exactly* the same. How would that happen?
-						debug_print("uh oh, no preference for overlappingdetection\n");
-					}
-
-					if (pref < 0)
-					{
-						// keep det0, destroy det1
-						apriltag_detection_destroy(det1);
-						zarray_remove_index(detections, i1, 1);
-						i1--; // retry the same index
-						goto retry1;
-					}
-					else
-					{
-						// keep det1, destroy det0
-						apriltag_detection_destroy(det0);
-						zarray_remove_index(detections, i0, 1);
-						i0--; // retry the same index.
-						goto retry0;
-					}
-				}
-
-			retry1:;
-			}
-
-		retry0:;
-		}
-
-		zarray_destroy(poly0);
-		zarray_destroy(poly1);
-	}
+	td->nduplicates = reconcile_detections(td, detections);
 
 	timeprofile_stamp(td->tp, "reconcile");
 
@@ -1564,22 +2897,164 @@ zarray_t *apriltag_detector_detect(apriltag_detector_t *td, image_u8_t *im_orig)
 
 	timeprofile_stamp(td->tp, "debug output");
 
-	for (int i = 0; i < zarray_size(quads); i++)
+	zarray_destroy(quads);
+
+	zarray_sort(detections, detection_compare_function);
+
+	td->scratch_mallocs = td->scratch->nmallocs - scratch_mallocs;
+	td->scratch_bytes = td->scratch->high_water;
+
+	timeprofile_stamp(td->tp, "cleanup");
+
+	return detections;
+}
+
+static bool detections_contain(zarray_t *detections, const apriltag_detection_t *tag)
+{
+	for (int i = 0; i < zarray_size(detections); i++)
+	{
+		apriltag_detection_t *det;
+		zarray_get(detections, i, &det);
+
+		// by name, prev may come from another detector with its own
+		// instance of the family.
+		if (det->id == tag->id && !strcmp(det->family->name, tag->family->name))
+			return true;
+	}
+	return false;
+}
+
+zarray_t *apriltag_detector_track(apriltag_detector_t *td, image_u8_t *im_orig, const apriltag_detection_t *prev, int nprev)
+{
+	if (nprev <= 0 || td->track_frames >= td->track_full_interval || zarray_size(td->tag_families) == 0)
+		return apriltag_detector_detect(td, im_orig);
+
+	uint64_t scratch_mallocs = td->scratch->nmallocs;
+
+	if (detector_begin_frame(td) != 0)
+		return zarray_create(sizeof(apriltag_detection_t *));
+
+	////////////////////////////////////////////////////////////////
+	// Step 1. Look for quads only in a region around every previous
+	// detection. The tag is predicted to still be where it was; the
+	// margin covers how far it may have moved since.
+	zarray_t *quads = zarray_create(sizeof(struct quad));
+
+	for (int i = 0; i < nprev; i++)
 	{
-		struct quad *quad;
-		zarray_get_volatile(quads, i, &quad);
-		matd_destroy(quad->H);
-		matd_destroy(quad->Hinv);
+		const apriltag_detection_t *tag = &prev[i];
+
+		double xmin = tag->p[0][0], xmax = xmin, ymin = tag->p[0][1], ymax = ymin;
+		for (int j = 1; j < 4; j++)
+		{
+			xmin = fmin(xmin, tag->p[j][0]);
+			xmax = fmax(xmax, tag->p[j][0]);
+			ymin = fmin(ymin, tag->p[j][1]);
+			ymax = fmax(ymax, tag->p[j][1]);
+		}
+
+		double pad = td->track_margin * fmax(xmax - xmin, ymax - ymin) + APRILTAG_TRACK_MIN_PAD;
+
+		int x0 = imax(0, (int)floor(xmin - pad));
+		int y0 = imax(0, (int)floor(ymin - pad));
+		int x1 = imin(im_orig->width, (int)ceil(xmax + pad));
+		int y1 = imin(im_orig->height, (int)ceil(ymax + pad));
+
+		// the tag left the image; it will be reported as lost.
+		if (x1 - x0 < APRILTAG_TRACK_MIN_PAD || y1 - y0 < APRILTAG_TRACK_MIN_PAD)
+			continue;
+
+		detect_region_quads(td, im_orig, x0, y0, x1, y1, quads);
 	}
 
+	td->nquads = zarray_size(quads);
+
+	timeprofile_stamp(td->tp, "tracked quads");
+
+	////////////////////////////////////////////////////////////////
+	// Step 2. Refine and decode them on the full image, exactly like a
+	// full detect does.
+	zarray_t *detections = zarray_create(sizeof(apriltag_detection_t *));
+
+	decode_quads(td, im_orig, quads, detections);
 	zarray_destroy(quads);
 
+	timeprofile_stamp(td->tp, "decode+refinement");
+
+	// regions overlap, so a tag may have been found twice.
+	td->nduplicates = reconcile_detections(td, detections);
+
+	timeprofile_stamp(td->tp, "reconcile");
+
+	////////////////////////////////////////////////////////////////
+	// Step 3. A tag that wasn't found again may have moved further than
+	// the margin: search the whole frame for it instead.
+	for (int i = 0; i < nprev; i++)
+	{
+		if (!detections_contain(detections, &prev[i]))
+		{
+			apriltag_detections_destroy(detections);
+			return apriltag_detector_detect(td, im_orig);
+		}
+	}
+
 	zarray_sort(detections, detection_compare_function);
+
+	td->tracked = true;
+	td->track_frames++;
+
+	td->scratch_mallocs = td->scratch->nmallocs - scratch_mallocs;
+	td->scratch_bytes = td->scratch->high_water;
+
 	timeprofile_stamp(td->tp, "cleanup");
 
 	return detections;
 }
 
+// milliseconds between the stamps with the given name and the ones
+// before them, or between the start and the last stamp for NULL.
+static double frame_stage_ms(const timeprofile_t *tp, const char *name)
+{
+	int64_t utime = 0;
+	int64_t last = tp->utime;
+
+	for (int i = 0; i < zarray_size(tp->stamps); i++)
+	{
+		struct timeprofile_entry *stamp;
+		zarray_get_volatile(tp->stamps, i, &stamp);
+
+		if (name == NULL || !strcmp(stamp->name, name))
+			utime += stamp->utime - last;
+		last = stamp->utime;
+	}
+
+	return utime / 1000.0;
+}
+
+void apriltag_detector_frame_stats(const apriltag_detector_t *td, struct apriltag_frame_stats *stats)
+{
+	const timeprofile_t *tp = td->tp;
+
+	stats->decimate_ms = frame_stage_ms(tp, "decimate");
+	stats->blur_ms = frame_stage_ms(tp, "blur/sharp");
+	stats->threshold_ms = frame_stage_ms(tp, "threshold");
+	stats->segment_ms = frame_stage_ms(tp, "unionfind") + frame_stage_ms(tp, "make clusters");
+	stats->fit_ms = frame_stage_ms(tp, "fit quads to clusters");
+	stats->decode_ms = frame_stage_ms(tp, "decode+refinement");
+	stats->reconcile_ms = frame_stage_ms(tp, "reconcile");
+	stats->total_ms = frame_stage_ms(tp, NULL);
+
+	stats->nclusters = td->nclusters;
+	stats->nquads = td->nquads;
+	stats->nrejected = td->nrejected_geometry + td->nrejected_border + td->nrejected_precheck;
+	stats->ndecodes = td->ndecoded;
+	stats->ndecode_hits = td->ndecode_hits;
+	stats->nduplicates = td->nduplicates;
+	stats->ndetections = td->ndecode_hits - td->nduplicates;
+
+	stats->tracked = td->tracked;
+}
+
 // Call this method on each of the tags returned by apriltag_detector_detect
 void apriltag_detections_destroy(zarray_t *detections)
 {
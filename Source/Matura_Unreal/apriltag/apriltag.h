@@ -40,6 +40,7 @@ extern "C"
 #include "common/workerpool.h"
 #include "common/timeprofile.h"
 #include "common/pthreads_cross.h"
+#include "common/arena.h"
 
 #define APRILTAG_TASKS_PER_THREAD_TARGET 10
 
@@ -51,7 +52,8 @@ extern "C"
 
 		// H: tag coordinates ([-1,1] at the black corners) to pixels
 		// Hinv: pixels to tag
-		matd_t *H, *Hinv;
+		// both row-major 3x3, valid once the quad is being decoded.
+		double H[9], Hinv[9];
 	};
 
 	// Represents a tag family. Every tag belongs to a tag family. Tag
@@ -88,6 +90,49 @@ extern "C"
 		void *impl;
 	};
 
+	// Size and speed of the table a family is decoded with, built when
+	// the family is added to a detector.
+	struct apriltag_decode_stats
+	{
+		size_t table_bytes;
+		uint32_t nentries;
+
+		// time it took to build the table, or to map it if it was
+		// loaded from the cache directory.
+		double build_ms;
+		bool from_cache;
+
+		// mean time to look up one codeword in all four rotations,
+		// measured on random codewords right after building.
+		double lookup_ns;
+	};
+
+	// Where the time of the last detect or track went, and how many
+	// items each stage handled. Stages that didn't run take 0 ms.
+	struct apriltag_frame_stats
+	{
+		// in milliseconds. threshold, segment and fit are summed over
+		// the regions a track searches.
+		double decimate_ms;
+		double blur_ms;
+		double threshold_ms;
+		double segment_ms; // union find and clusters
+		double fit_ms;
+		double decode_ms; // rejection cascade, refinement and decoding
+		double reconcile_ms;
+		double total_ms;
+
+		uint32_t nclusters;
+		uint32_t nquads;
+		uint32_t nrejected; // by any stage of the rejection cascade
+		uint32_t ndecodes;	// quads decoded in full
+		uint32_t ndecode_hits; // tags found by those, per family
+		uint32_t nduplicates; // overlapping detections of the same tag
+		uint32_t ndetections;
+
+		bool tracked;
+	};
+
 	struct apriltag_quad_thresh_params
 	{
 		// reject quads containing too few pixels
@@ -129,7 +174,9 @@ extern "C"
 		///////////////////////////////////////////////////////////////
 		// User-configurable parameters.
 
-		// How many threads should be used?
+		// How many threads should be used? Any value above 1 runs on
+		// the worker threads shared by all detectors, and only sets how
+		// many pieces the work is split into.
 		int nthreads;
 
 		// detection of quads can be done on a lower-resolution image,
@@ -153,6 +200,16 @@ extern "C"
 		// quad_decimate = 1.
 		bool refine_edges;
 
+		// Pyramid mode: when above 1, apriltag_detector_detect searches
+		// for quads on this many levels, from quad_decimate *
+		// 2^(pyramid_levels - 1) down to quad_decimate. Only the
+		// coarsest level searches the whole image; every finer one only
+		// searches around what the level above saw but found no tag in:
+		// clusters too small to fit a quad to and quads that didn't
+		// decode. Tags too small to leave even that on the level above
+		// are missed, so this trades the smallest tags for time.
+		int pyramid_levels;
+
 		// How much sharpening should be done to decoded images? This
 		// can help decode small tags but may or may not help in odd
 		// lighting conditions or low light conditions.
@@ -167,6 +224,36 @@ extern "C"
 
 		struct apriltag_quad_thresh_params qtp;
 
+		// apriltag_detector_track: how many frames in a row may be
+		// searched only around the previous detections before a full
+		// detect is forced (0 always detects the full frame), and how
+		// far that search extends past a previous tag, as a fraction of
+		// its size in pixels.
+		int track_full_interval;
+		float track_margin;
+
+		// Cheap tests a quad has to pass before it is refined and
+		// decoded, which most false quads of a cluttered scene don't.
+		//
+		// quad_min_area and quad_max_area bound the area of a quad in
+		// pixels of the input image, to the sizes the tags are expected
+		// to appear at (0 leaves a bound open). quad_max_aspect is the
+		// most the longest side may be longer than the shortest one (0
+		// disables it).
+		float quad_min_area, quad_max_area;
+		float quad_max_aspect;
+
+		// How much brighter (in pixel values) the white border must be
+		// than the black one, compared over a few samples of each.
+		// Negative disables the test.
+		int quad_min_border_contrast;
+
+		// When refining edges, decode the unrefined quad first and only
+		// refine it if the code is at most one bit further from a tag
+		// than the decode tables correct. With quad_decimate > 1 quads
+		// are refined before the border test and this is skipped.
+		bool quad_precheck;
+
 		///////////////////////////////////////////////////////////////
 		// Statistics relating to last processed frame
 		timeprofile_t *tp;
@@ -175,6 +262,30 @@ extern "C"
 		uint32_t nsegments;
 		uint32_t nquads;
 
+		// How many of the quads the geometry, border and decode
+		// prechecks rejected, and how many were decoded in full.
+		uint32_t nrejected_geometry;
+		uint32_t nrejected_border;
+		uint32_t nrejected_precheck;
+		uint32_t ndecoded;
+
+		uint32_t nclusters;
+
+		// Tags the decoded quads were read as, and how many of them
+		// were dropped as overlapping detections of the same tag.
+		uint32_t ndecode_hits;
+		uint32_t nduplicates;
+
+		// Heap allocations the scratch arena had to make during the
+		// frame (0 once it has grown large enough), and the most
+		// scratch memory a single frame has used so far.
+		uint32_t scratch_mallocs;
+		size_t scratch_bytes;
+
+		// Whether apriltag_detector_track only searched around the
+		// previous detections, rather than the full frame.
+		bool tracked;
+
 		///////////////////////////////////////////////////////////////
 		// Internal variables below
 
@@ -188,6 +299,20 @@ extern "C"
 
 		// Used for thread safety.
 		pthread_mutex_t mutex;
+
+		// Scratch memory of a single detection, reset at the start of
+		// every frame. Sized by the first frames and then reused.
+		arena_t *scratch;
+
+		// Frames tracked since the last full detect. When one detector
+		// serves several streams, save and restore it per stream around
+		// apriltag_detector_track.
+		int track_frames;
+
+		// while searching a pyramid level other than the finest, the
+		// boxes of the clusters too small to fit a quad to, as float[4]
+		// {xmin, ymin, xmax, ymax}. NULL otherwise.
+		zarray_t *small_clusters;
 	};
 
 	// Represents the detection of a tag. These are returned to the user
@@ -248,6 +373,22 @@ extern "C"
 	// does not deallocate the family.
 	void apriltag_detector_remove_family(apriltag_detector_t *td, apriltag_family_t *fam);
 
+	// fills in stats for a family that was added to a detector. Returns
+	// non-zero if the family has no decode table (yet).
+	int apriltag_family_decode_stats(const apriltag_family_t *fam, struct apriltag_decode_stats *stats);
+
+	// Decode tables are built once per process and shared by every
+	// family instance with the same codes, across detectors. When a
+	// cache directory is set, tables are also written there and later
+	// memory-mapped from there instead of being rebuilt. NULL (the
+	// default) disables the cache. The directory must exist.
+	void apriltag_decode_cache_set_dir(const char *dir);
+
+	// frees the decode tables no family uses anymore. Tables otherwise
+	// stay around until the process exits, so that recreated detectors
+	// don't have to rebuild them.
+	void apriltag_decode_cache_clear(void);
+
 	// unregister all families, but does not deallocate the underlying tag family objects.
 	void apriltag_detector_clear_families(apriltag_detector_t *td);
 
@@ -261,6 +402,21 @@ extern "C"
 	// _detection_destroy and zarray_destroy yourself.
 	zarray_t *apriltag_detector_detect(apriltag_detector_t *td, image_u8_t *im_orig);
 
+	// Like apriltag_detector_detect, but given the detections of the
+	// previous frame only searches small regions around them, so the
+	// cost depends on the number and size of the tags rather than the
+	// image. Falls back to a full detect if there are no previous
+	// detections, one of them isn't found again, or
+	// td->track_full_interval frames were tracked in a row (which is
+	// also when new tags are picked up). prev may be copies of
+	// detections that were already destroyed, or made by another
+	// detector; only family name, id and p are used.
+	zarray_t *apriltag_detector_track(apriltag_detector_t *td, image_u8_t *im_orig, const apriltag_detection_t *prev, int nprev);
+
+	// fills in stats for the last apriltag_detector_detect or
+	// apriltag_detector_track of the detector.
+	void apriltag_detector_frame_stats(const apriltag_detector_t *td, struct apriltag_frame_stats *stats);
+
 	// Call this method on each of the tags returned by apriltag_detector_detect
 	void apriltag_detection_destroy(apriltag_detection_t *det);
 
@@ -99,3 +99,88 @@ static inline void mat33_sym_solve(const double *A,
     R[1] = M[4]*tmp[1] + M[7]*tmp[2];
     R[2] = M[8]*tmp[2];
 }
+
+// R = A*B. R may not alias A or B.
+static inline void mat33_mul(const double *A,
+                             const double *B,
+                             double *R)
+{
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            R[3*i + j] = A[3*i]*B[j] + A[3*i + 1]*B[3 + j] + A[3*i + 2]*B[6 + j];
+        }
+    }
+}
+
+// R = A*B'. R may not alias A or B.
+static inline void mat33_mul_transpose(const double *A,
+                                       const double *B,
+                                       double *R)
+{
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            R[3*i + j] = A[3*i]*B[3*j] + A[3*i + 1]*B[3*j + 1] + A[3*i + 2]*B[3*j + 2];
+        }
+    }
+}
+
+// R = A'. R may not alias A.
+static inline void mat33_transpose(const double *A,
+                                   double *R)
+{
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            R[3*i + j] = A[3*j + i];
+        }
+    }
+}
+
+// r = A*x. r may not alias x.
+static inline void mat33_mulv(const double *A,
+                              const double *x,
+                              double *r)
+{
+    r[0] = A[0]*x[0] + A[1]*x[1] + A[2]*x[2];
+    r[1] = A[3]*x[0] + A[4]*x[1] + A[5]*x[2];
+    r[2] = A[6]*x[0] + A[7]*x[1] + A[8]*x[2];
+}
+
+static inline double mat33_det(const double *A)
+{
+    return A[0]*A[4]*A[8] - A[0]*A[5]*A[7] + A[1]*A[5]*A[6] -
+           A[1]*A[3]*A[8] + A[2]*A[3]*A[7] - A[2]*A[4]*A[6];
+}
+
+// R = inverse(A) by the adjugate. Returns non-zero if A is singular.
+static inline int mat33_inv(const double *A,
+                            double *R)
+{
+    double det = mat33_det(A);
+    if (det == 0)
+        return -1;
+
+    double invdet = 1.0 / det;
+    R[0] = (A[4]*A[8] - A[5]*A[7]) * invdet;
+    R[1] = (A[2]*A[7] - A[1]*A[8]) * invdet;
+    R[2] = (A[1]*A[5] - A[2]*A[4]) * invdet;
+    R[3] = (A[5]*A[6] - A[3]*A[8]) * invdet;
+    R[4] = (A[0]*A[8] - A[2]*A[6]) * invdet;
+    R[5] = (A[2]*A[3] - A[0]*A[5]) * invdet;
+    R[6] = (A[3]*A[7] - A[4]*A[6]) * invdet;
+    R[7] = (A[1]*A[6] - A[0]*A[7]) * invdet;
+    R[8] = (A[0]*A[4] - A[1]*A[3]) * invdet;
+    return 0;
+}
+
+// applies the homography H to the point (x, y).
+static inline void mat33_project(const double *H,
+                                 double x, double y,
+                                 double *ox, double *oy)
+{
+    double xx = H[0]*x + H[1]*y + H[2];
+    double yy = H[3]*x + H[4]*y + H[5];
+    double zz = H[6]*x + H[7]*y + H[8];
+
+    *ox = xx / zz;
+    *oy = yy / zz;
+}
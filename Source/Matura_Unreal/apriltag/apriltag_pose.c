@@ -1,151 +1,191 @@
+#include <assert.h>
 #include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "common/debug_print.h"
 #include "apriltag_pose.h"
+#include "apriltag_math.h"
 #include "common/homography.h"
+#include "common/svd33.h"
+
+// The pose code works on fixed size, row-major arrays on the stack:
+// 3x3 matrices are double[9], vectors double[3]. Only the results are
+// copied into matd_t. The multi tag pose is the exception, its point
+// count is only known at runtime.
+
+// tags have four corners.
+#define POSE_MAX_POINTS 4
+
+// solve_poly_approx is only used for the quartic error polynomial.
+#define POSE_MAX_DEGREE 4
+
+static const double I3[9] = {1, 0, 0, 0, 1, 0, 0, 0, 1};
+
+static inline double vec3_dot(const double *a, const double *b)
+{
+	return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
 
 /**
  * Calculate projection operator from image points.
  */
-matd_t *calculate_F(matd_t *v)
+static void calculate_F(const double *v, double *F)
 {
-	matd_t *outer_product = matd_op("MM'", v, v, v, v);
-	matd_t *inner_product = matd_op("M'M", v, v);
-	matd_scale_inplace(outer_product, 1.0 / inner_product->data[0]);
-	matd_destroy(inner_product);
-	return outer_product;
+	double inner_product = vec3_dot(v, v);
+	for (int i = 0; i < 3; i++)
+	{
+		for (int j = 0; j < 3; j++)
+		{
+			F[3 * i + j] = v[i] * v[j] / inner_product;
+		}
+	}
 }
 
-/**
- * Returns the value of the supplied scalar matrix 'a' and destroys the matrix.
- */
-double matd_to_double(matd_t *a)
+// r = (I - F)*x
+static inline void reject(const double *F, const double *x, double *r)
 {
-	assert(matd_is_scalar(a));
-	double d = a->data[0];
-	matd_destroy(a);
-	return d;
+	double Fx[3];
+	mat33_mulv(F, x, Fx);
+	for (int i = 0; i < 3; i++)
+		r[i] = x[i] - Fx[i];
 }
 
+// The parts of orthogonal iteration that only depend on the points, shared by
+// the iterations from the two minima of a tag.
+typedef struct
+{
+	int n_points;
+	double (*F)[9];		// projection operator of every image point
+	double (*p_res)[3]; // object points minus their mean
+	double (*q)[3];		// scratch of the rotation step
+	double M1_inv[9];
+} oi_problem_t;
+
 /**
  * @param v Image points on the image plane.
  * @param p Object points in object space.
- * @outparam t Optimal translation.
- * @param R In/Outparam. Should be set to initial guess at R. Will be modified to be the optimal translation.
- * @param n_points Number of points.
- * @param n_steps Number of iterations.
- *
- * @return Object-space error after iteration.
- *
- * Implementation of Orthogonal Iteration from Lu, 2000.
+ * @param n_points Number of points, the arrays of problem must hold as many.
  */
-double orthogonal_iteration(matd_t **v, matd_t **p, matd_t **t, matd_t **R, int n_points, int n_steps)
+static void orthogonal_iteration_setup(const double v[][3], const double p[][3], int n_points, oi_problem_t *problem)
 {
-	matd_t *p_mean = matd_create(3, 1);
+	problem->n_points = n_points;
+
+	double p_mean[3] = {0, 0, 0};
 	for (int i = 0; i < n_points; i++)
 	{
-		matd_add_inplace(p_mean, p[i]);
+		for (int k = 0; k < 3; k++)
+			p_mean[k] += p[i][k];
 	}
-	matd_scale_inplace(p_mean, 1.0 / n_points);
+	for (int k = 0; k < 3; k++)
+		p_mean[k] /= n_points;
 
-	matd_t **p_res = malloc(sizeof(matd_t *) * n_points);
 	for (int i = 0; i < n_points; i++)
 	{
-		p_res[i] = matd_op("M-M", p[i], p_mean);
+		for (int k = 0; k < 3; k++)
+			problem->p_res[i][k] = p[i][k] - p_mean[k];
 	}
 
 	// Compute M1_inv.
-	matd_t **F = malloc(sizeof(matd_t *) * n_points);
-	matd_t *avg_F = matd_create(3, 3);
+	double avg_F[9] = {0};
 	for (int i = 0; i < n_points; i++)
 	{
-		F[i] = calculate_F(v[i]);
-		matd_add_inplace(avg_F, F[i]);
+		calculate_F(v[i], problem->F[i]);
+		for (int k = 0; k < 9; k++)
+			avg_F[k] += problem->F[i][k];
 	}
-	matd_scale_inplace(avg_F, 1.0 / n_points);
-	matd_t *I3 = matd_identity(3);
-	matd_t *M1 = matd_subtract(I3, avg_F);
-	matd_t *M1_inv = matd_inverse(M1);
-	matd_destroy(avg_F);
-	matd_destroy(M1);
+	double M1[9];
+	for (int k = 0; k < 9; k++)
+		M1[k] = I3[k] - avg_F[k] / n_points;
+	mat33_inv(M1, problem->M1_inv);
+}
+
+/**
+ * @param problem Set up by orthogonal_iteration_setup for p.
+ * @param p Object points in object space.
+ * @outparam t Optimal translation.
+ * @param R In/Outparam. Should be set to initial guess at R. Will be modified to be the optimal translation.
+ * @param n_steps Number of iterations.
+ *
+ * @return Object-space error after iteration.
+ *
+ * Implementation of Orthogonal Iteration from Lu, 2000.
+ */
+static double orthogonal_iteration(oi_problem_t *problem, const double p[][3], double *t, double *R, int n_steps)
+{
+	int n_points = problem->n_points;
+	double (*F)[9] = problem->F;
+	double (*q)[3] = problem->q;
 
 	double prev_error = HUGE_VAL;
 	// Iterate.
 	for (int i = 0; i < n_steps; i++)
 	{
 		// Calculate translation.
-		matd_t *M2 = matd_create(3, 1);
+		double M2[3] = {0, 0, 0};
 		for (int j = 0; j < n_points; j++)
 		{
-			matd_t *M2_update = matd_op("(M - M)*M*M", F[j], I3, *R, p[j]);
-			matd_add_inplace(M2, M2_update);
-			matd_destroy(M2_update);
+			double Rp[3], update[3];
+			mat33_mulv(R, p[j], Rp);
+			reject(F[j], Rp, update);
+			for (int k = 0; k < 3; k++)
+				M2[k] -= update[k];
 		}
-		matd_scale_inplace(M2, 1.0 / n_points);
-		matd_destroy(*t);
-		*t = matd_multiply(M1_inv, M2);
-		matd_destroy(M2);
+		for (int k = 0; k < 3; k++)
+			M2[k] /= n_points;
+		mat33_mulv(problem->M1_inv, M2, t);
 
 		// Calculate rotation.
-		matd_t **q = malloc(sizeof(matd_t *) * n_points);
-		matd_t *q_mean = matd_create(3, 1);
+		double q_mean[3] = {0, 0, 0};
 		for (int j = 0; j < n_points; j++)
 		{
-			q[j] = matd_op("M*(M*M+M)", F[j], *R, p[j], *t);
-			matd_add_inplace(q_mean, q[j]);
+			double Rpt[3];
+			mat33_mulv(R, p[j], Rpt);
+			for (int k = 0; k < 3; k++)
+				Rpt[k] += t[k];
+			mat33_mulv(F[j], Rpt, q[j]);
+			for (int k = 0; k < 3; k++)
+				q_mean[k] += q[j][k];
 		}
-		matd_scale_inplace(q_mean, 1.0 / n_points);
+		for (int k = 0; k < 3; k++)
+			q_mean[k] /= n_points;
 
-		matd_t *M3 = matd_create(3, 3);
+		double M3[9] = {0};
 		for (int j = 0; j < n_points; j++)
 		{
-			matd_t *M3_update = matd_op("(M-M)*M'", q[j], q_mean, p_res[j]);
-			matd_add_inplace(M3, M3_update);
-			matd_destroy(M3_update);
-		}
-		matd_svd_t M3_svd = matd_svd(M3);
-		matd_destroy(M3);
-		matd_destroy(*R);
-		*R = matd_op("M*M'", M3_svd.U, M3_svd.V);
-		double R_det = matd_det(*R);
-		if (R_det < 0)
-		{
-			matd_put(*R, 0, 2, -matd_get(*R, 0, 2));
-			matd_put(*R, 1, 2, -matd_get(*R, 1, 2));
-			matd_put(*R, 2, 2, -matd_get(*R, 2, 2));
+			for (int a = 0; a < 3; a++)
+			{
+				for (int b = 0; b < 3; b++)
+				{
+					M3[3 * a + b] += (q[j][a] - q_mean[a]) * problem->p_res[j][b];
+				}
+			}
 		}
-		matd_destroy(M3_svd.U);
-		matd_destroy(M3_svd.S);
-		matd_destroy(M3_svd.V);
-		matd_destroy(q_mean);
-		for (int j = 0; j < n_points; j++)
+
+		double U[9], S[3], V[9];
+		svd33(M3, U, S, V);
+		mat33_mul_transpose(U, V, R);
+		if (mat33_det(R) < 0)
 		{
-			matd_destroy(q[j]);
+			R[2] = -R[2];
+			R[5] = -R[5];
+			R[8] = -R[8];
 		}
 
 		double error = 0;
-		for (int j = 0; j < 4; j++)
+		for (int j = 0; j < n_points; j++)
 		{
-			matd_t *err_vec = matd_op("(M-M)(MM+M)", I3, F[j], *R, p[j], *t);
-			error += matd_to_double(matd_op("M'M", err_vec, err_vec));
-			matd_destroy(err_vec);
+			double Rpt[3], err_vec[3];
+			mat33_mulv(R, p[j], Rpt);
+			for (int k = 0; k < 3; k++)
+				Rpt[k] += t[k];
+			reject(F[j], Rpt, err_vec);
+			error += vec3_dot(err_vec, err_vec);
 		}
 		prev_error = error;
-
-		free(q);
 	}
 
-	matd_destroy(I3);
-	matd_destroy(M1_inv);
-	for (int i = 0; i < n_points; i++)
-	{
-		matd_destroy(p_res[i]);
-		matd_destroy(F[i]);
-	}
-	free(p_res);
-	free(F);
-	matd_destroy(p_mean);
 	return prev_error;
 }
 
@@ -189,13 +229,14 @@ void solve_poly_approx(double *p, int degree, double *roots, int *n_roots)
 	}
 
 	// Calculate roots of derivative.
-	double *p_der = malloc(sizeof(double) * degree);
+	assert(degree <= POSE_MAX_DEGREE);
+	double p_der[POSE_MAX_DEGREE];
 	for (int i = 0; i < degree; i++)
 	{
 		p_der[i] = (i + 1) * p[i + 1];
 	}
 
-	double *der_roots = malloc(sizeof(double) * (degree - 1));
+	double der_roots[POSE_MAX_DEGREE];
 	int n_der_roots;
 	solve_poly_approx(p_der, degree - 1, der_roots, &n_der_roots);
 
@@ -288,38 +329,39 @@ void solve_poly_approx(double *p, int degree, double *roots, int *n_roots)
 		}
 	}
 
-	free(der_roots);
-	free(p_der);
 }
 
 /**
  * Given a local minima of the pose error tries to find the other minima.
+ * Returns non-zero and writes the rotation of the other minima to R_out
+ * if there is exactly one.
  */
-matd_t *fix_pose_ambiguities(matd_t **v, matd_t **p, matd_t *t, matd_t *R, int n_points)
+static int fix_pose_ambiguities(const double v[][3], const double p[][3], const double *t, const double *R, int n_points, double *R_out)
 {
-	matd_t *I3 = matd_identity(3);
+	assert(n_points <= POSE_MAX_POINTS);
 
 	// 1. Find R_t
-	matd_t *R_t_3 = matd_vec_normalize(t);
+	double t_norm = sqrt(vec3_dot(t, t));
+	double R_t_3[3] = {t[0] / t_norm, t[1] / t_norm, t[2] / t_norm};
 
-	matd_t *e_x = matd_create(3, 1);
-	MATD_EL(e_x, 0, 0) = 1;
-	matd_t *R_t_1_tmp = matd_op("M-(M'*M)*M", e_x, e_x, R_t_3, R_t_3);
-	matd_t *R_t_1 = matd_vec_normalize(R_t_1_tmp);
-	matd_destroy(e_x);
-	matd_destroy(R_t_1_tmp);
+	// e_x - (e_x'*R_t_3)*R_t_3
+	double R_t_1[3] = {1 - R_t_3[0] * R_t_3[0], -R_t_3[0] * R_t_3[1], -R_t_3[0] * R_t_3[2]};
+	double R_t_1_norm = sqrt(vec3_dot(R_t_1, R_t_1));
+	for (int k = 0; k < 3; k++)
+		R_t_1[k] /= R_t_1_norm;
 
-	matd_t *R_t_2 = matd_crossproduct(R_t_3, R_t_1);
+	double R_t_2[3] = {
+		R_t_3[1] * R_t_1[2] - R_t_3[2] * R_t_1[1],
+		R_t_3[2] * R_t_1[0] - R_t_3[0] * R_t_1[2],
+		R_t_3[0] * R_t_1[1] - R_t_3[1] * R_t_1[0]};
 
-	matd_t *R_t = matd_create_data(3, 3, (double[]){MATD_EL(R_t_1, 0, 0), MATD_EL(R_t_1, 0, 1), MATD_EL(R_t_1, 0, 2), MATD_EL(R_t_2, 0, 0), MATD_EL(R_t_2, 0, 1), MATD_EL(R_t_2, 0, 2), MATD_EL(R_t_3, 0, 0), MATD_EL(R_t_3, 0, 1), MATD_EL(R_t_3, 0, 2)});
-	matd_destroy(R_t_1);
-	matd_destroy(R_t_2);
-	matd_destroy(R_t_3);
+	double R_t[9] = {R_t_1[0], R_t_1[1], R_t_1[2], R_t_2[0], R_t_2[1], R_t_2[2], R_t_3[0], R_t_3[1], R_t_3[2]};
 
 	// 2. Find R_z
-	matd_t *R_1_prime = matd_multiply(R_t, R);
-	double r31 = MATD_EL(R_1_prime, 2, 0);
-	double r32 = MATD_EL(R_1_prime, 2, 1);
+	double R_1_prime[9];
+	mat33_mul(R_t, R, R_1_prime);
+	double r31 = R_1_prime[6];
+	double r32 = R_1_prime[7];
 	double hypotenuse = sqrt(r31 * r31 + r32 * r32);
 	if (hypotenuse < 1e-100)
 	{
@@ -327,58 +369,69 @@ matd_t *fix_pose_ambiguities(matd_t **v, matd_t **p, matd_t *t, matd_t *R, int n
 		r32 = 0;
 		hypotenuse = 1;
 	}
-	matd_t *R_z = matd_create_data(3, 3, (double[]){r31 / hypotenuse, -r32 / hypotenuse, 0, r32 / hypotenuse, r31 / hypotenuse, 0, 0, 0, 1});
+	double R_z[9] = {r31 / hypotenuse, -r32 / hypotenuse, 0, r32 / hypotenuse, r31 / hypotenuse, 0, 0, 0, 1};
 
 	// 3. Calculate parameters of Eos
-	matd_t *R_trans = matd_multiply(R_1_prime, R_z);
-	double sin_gamma = -MATD_EL(R_trans, 0, 1);
-	double cos_gamma = MATD_EL(R_trans, 1, 1);
-	matd_t *R_gamma = matd_create_data(3, 3, (double[]){cos_gamma, -sin_gamma, 0, sin_gamma, cos_gamma, 0, 0, 0, 1});
-
-	double sin_beta = -MATD_EL(R_trans, 2, 0);
-	double cos_beta = MATD_EL(R_trans, 2, 2);
+	double R_trans[9];
+	mat33_mul(R_1_prime, R_z, R_trans);
+	double sin_gamma = -R_trans[1];
+	double cos_gamma = R_trans[4];
+	double R_gamma[9] = {cos_gamma, -sin_gamma, 0, sin_gamma, cos_gamma, 0, 0, 0, 1};
+
+	double sin_beta = -R_trans[6];
+	double cos_beta = R_trans[8];
 	double t_initial = atan2(sin_beta, cos_beta);
-	matd_destroy(R_trans);
 
-	matd_t **v_trans = malloc(sizeof(matd_t *) * n_points);
-	matd_t **p_trans = malloc(sizeof(matd_t *) * n_points);
-	matd_t **F_trans = malloc(sizeof(matd_t *) * n_points);
-	matd_t *avg_F_trans = matd_create(3, 3);
+	double R_z_t[9];
+	mat33_transpose(R_z, R_z_t);
+
+	double p_trans[POSE_MAX_POINTS][3];
+	double F_trans[POSE_MAX_POINTS][9];
+	double avg_F_trans[9] = {0};
 	for (int i = 0; i < n_points; i++)
 	{
-		p_trans[i] = matd_op("M'*M", R_z, p[i]);
-		v_trans[i] = matd_op("M*M", R_t, v[i]);
-		F_trans[i] = calculate_F(v_trans[i]);
-		matd_add_inplace(avg_F_trans, F_trans[i]);
+		double v_trans[3];
+		mat33_mulv(R_z_t, p[i], p_trans[i]);
+		mat33_mulv(R_t, v[i], v_trans);
+		calculate_F(v_trans, F_trans[i]);
+		for (int k = 0; k < 9; k++)
+			avg_F_trans[k] += F_trans[i][k];
 	}
-	matd_scale_inplace(avg_F_trans, 1.0 / n_points);
-
-	matd_t *G = matd_op("(M-M)^-1", I3, avg_F_trans);
-	matd_scale_inplace(G, 1.0 / n_points);
 
-	matd_t *M1 = matd_create_data(3, 3, (double[]){0, 0, 2, 0, 0, 0, -2, 0, 0});
-	matd_t *M2 = matd_create_data(3, 3, (double[]){-1, 0, 0, 0, 1, 0, 0, 0, -1});
-
-	matd_t *b0 = matd_create(3, 1);
-	matd_t *b1 = matd_create(3, 1);
-	matd_t *b2 = matd_create(3, 1);
+	double I_minus_avg[9];
+	for (int k = 0; k < 9; k++)
+		I_minus_avg[k] = I3[k] - avg_F_trans[k] / n_points;
+	double G[9];
+	mat33_inv(I_minus_avg, G);
+	for (int k = 0; k < 9; k++)
+		G[k] /= n_points;
+
+	static const double M1[9] = {0, 0, 2, 0, 0, 0, -2, 0, 0};
+	static const double M2[9] = {-1, 0, 0, 0, 1, 0, 0, 0, -1};
+
+	// R_gamma*p, R_gamma*M1*p and R_gamma*M2*p of every point.
+	double RM[3][9];
+	memcpy(RM[0], R_gamma, sizeof(R_gamma));
+	mat33_mul(R_gamma, M1, RM[1]);
+	mat33_mul(R_gamma, M2, RM[2]);
+
+	double Rp[POSE_MAX_POINTS][3][3];
+	double b[3][3] = {{0}};
 	for (int i = 0; i < n_points; i++)
 	{
-		matd_t *op_tmp1 = matd_op("(M-M)MM", F_trans[i], I3, R_gamma, p_trans[i]);
-		matd_t *op_tmp2 = matd_op("(M-M)MMM", F_trans[i], I3, R_gamma, M1, p_trans[i]);
-		matd_t *op_tmp3 = matd_op("(M-M)MMM", F_trans[i], I3, R_gamma, M2, p_trans[i]);
-
-		matd_add_inplace(b0, op_tmp1);
-		matd_add_inplace(b1, op_tmp2);
-		matd_add_inplace(b2, op_tmp3);
-
-		matd_destroy(op_tmp1);
-		matd_destroy(op_tmp2);
-		matd_destroy(op_tmp3);
+		for (int m = 0; m < 3; m++)
+		{
+			double r[3];
+			mat33_mulv(RM[m], p_trans[i], Rp[i][m]);
+			reject(F_trans[i], Rp[i][m], r);
+			for (int k = 0; k < 3; k++)
+				b[m][k] -= r[k];
+		}
 	}
-	matd_t *b0_ = matd_multiply(G, b0);
-	matd_t *b1_ = matd_multiply(G, b1);
-	matd_t *b2_ = matd_multiply(G, b2);
+
+	double b_[3][3];
+	for (int m = 0; m < 3; m++)
+		mat33_mulv(G, b[m], b_[m]);
 
 	double a0 = 0;
 	double a1 = 0;
@@ -387,39 +440,21 @@ matd_t *fix_pose_ambiguities(matd_t **v, matd_t **p, matd_t *t, matd_t *R, int n
 	double a4 = 0;
 	for (int i = 0; i < n_points; i++)
 	{
-		matd_t *c0 = matd_op("(M-M)(MM+M)", I3, F_trans[i], R_gamma, p_trans[i], b0_);
-		matd_t *c1 = matd_op("(M-M)(MMM+M)", I3, F_trans[i], R_gamma, M1, p_trans[i], b1_);
-		matd_t *c2 = matd_op("(M-M)(MMM+M)", I3, F_trans[i], R_gamma, M2, p_trans[i], b2_);
-
-		a0 += matd_to_double(matd_op("M'M", c0, c0));
-		a1 += matd_to_double(matd_op("2M'M", c0, c1));
-		a2 += matd_to_double(matd_op("M'M+2M'M", c1, c1, c0, c2));
-		a3 += matd_to_double(matd_op("2M'M", c1, c2));
-		a4 += matd_to_double(matd_op("M'M", c2, c2));
-
-		matd_destroy(c0);
-		matd_destroy(c1);
-		matd_destroy(c2);
-	}
-
-	matd_destroy(b0);
-	matd_destroy(b1);
-	matd_destroy(b2);
-	matd_destroy(b0_);
-	matd_destroy(b1_);
-	matd_destroy(b2_);
+		double c[3][3];
+		for (int m = 0; m < 3; m++)
+		{
+			double x[3];
+			for (int k = 0; k < 3; k++)
+				x[k] = Rp[i][m][k] + b_[m][k];
+			reject(F_trans[i], x, c[m]);
+		}
 
-	for (int i = 0; i < n_points; i++)
-	{
-		matd_destroy(p_trans[i]);
-		matd_destroy(v_trans[i]);
-		matd_destroy(F_trans[i]);
+		a0 += vec3_dot(c[0], c[0]);
+		a1 += 2 * vec3_dot(c[0], c[1]);
+		a2 += vec3_dot(c[1], c[1]) + 2 * vec3_dot(c[0], c[2]);
+		a3 += 2 * vec3_dot(c[1], c[2]);
+		a4 += vec3_dot(c[2], c[2]);
 	}
-	free(p_trans);
-	free(v_trans);
-	free(F_trans);
-	matd_destroy(avg_F_trans);
-	matd_destroy(G);
 
 	// 4. Solve for minima of Eos.
 	double p0 = a1;
@@ -456,71 +491,109 @@ matd_t *fix_pose_ambiguities(matd_t **v, matd_t **p, matd_t *t, matd_t *R, int n
 	}
 
 	// 5. Get poses for minima.
-	matd_t *ret = NULL;
 	if (n_minima == 1)
 	{
 		double t_cur = minima[0];
-		matd_t *R_beta = matd_copy(M2);
-		matd_scale_inplace(R_beta, t_cur);
-		matd_add_inplace(R_beta, M1);
-		matd_scale_inplace(R_beta, t_cur);
-		matd_add_inplace(R_beta, I3);
-		matd_scale_inplace(R_beta, 1 / (1 + t_cur * t_cur));
-		ret = matd_op("M'MMM'", R_t, R_gamma, R_beta, R_z);
-		matd_destroy(R_beta);
+		double R_beta[9];
+		for (int k = 0; k < 9; k++)
+			R_beta[k] = ((M2[k] * t_cur + M1[k]) * t_cur + I3[k]) / (1 + t_cur * t_cur);
+
+		// R_t'*R_gamma*R_beta*R_z'
+		double R_t_t[9], tmp1[9], tmp2[9];
+		mat33_transpose(R_t, R_t_t);
+		mat33_mul(R_t_t, R_gamma, tmp1);
+		mat33_mul(tmp1, R_beta, tmp2);
+		mat33_mul(tmp2, R_z_t, R_out);
+		return 1;
 	}
 	else if (n_minima > 1)
 	{
 		// This can happen if our prior pose estimate was not very good.
 		debug_print("Error, more than one new minimum found.\n");
 	}
-	matd_destroy(I3);
-	matd_destroy(M1);
-	matd_destroy(M2);
-	matd_destroy(R_t);
-	matd_destroy(R_gamma);
-	matd_destroy(R_z);
-	matd_destroy(R_1_prime);
-	return ret;
+	return 0;
 }
 
-/**
- * Estimate pose of the tag using the homography method.
- */
-void estimate_pose_for_tag_homography(apriltag_detection_info_t *info, apriltag_pose_t *solution)
+// Corners of a tag of the given size in its own frame, in the order of
+// apriltag_detection_t.p.
+static void tag_object_points(double tagsize, double p[4][3])
 {
-	double scale = info->tagsize / 2.0;
+	double scale = tagsize / 2.0;
+	const double corners[4][2] = {{-1, 1}, {1, 1}, {1, -1}, {-1, -1}};
+	for (int i = 0; i < 4; i++)
+	{
+		p[i][0] = corners[i][0] * scale;
+		p[i][1] = corners[i][1] * scale;
+		p[i][2] = 0;
+	}
+}
 
-	matd_t *M_H = homography_to_pose(info->det->H, -info->fx, info->fy, info->cx, info->cy);
-	MATD_EL(M_H, 0, 3) *= scale;
-	MATD_EL(M_H, 1, 3) *= scale;
-	MATD_EL(M_H, 2, 3) *= scale;
+static void tag_image_rays(const apriltag_detection_t *det, double fx, double fy, double cx, double cy, double v[4][3])
+{
+	for (int i = 0; i < 4; i++)
+	{
+		v[i][0] = (det->p[i][0] - cx) / fx;
+		v[i][1] = (det->p[i][1] - cy) / fy;
+		v[i][2] = 1;
+	}
+}
 
-	matd_t *fix = matd_create(4, 4);
-	MATD_EL(fix, 0, 0) = 1;
-	MATD_EL(fix, 1, 1) = -1;
-	MATD_EL(fix, 2, 2) = -1;
-	MATD_EL(fix, 3, 3) = 1;
+static void tag_pose_homography(const apriltag_detection_t *det, double tagsize, double fx, double fy, double cx, double cy,
+								double *R, double *t)
+{
+	double scale = tagsize / 2.0;
 
-	matd_t *initial_pose = matd_multiply(fix, M_H);
-	matd_destroy(M_H);
-	matd_destroy(fix);
+	double R_h[9], T[3];
+	homography_to_pose_rt(det->H, -fx, fy, cx, cy, R_h, T);
+
+	// flip y and z, the camera looks down +z.
+	static const double fix[3] = {1, -1, -1};
 
-	solution->R = matd_create(3, 3);
 	for (int i = 0; i < 3; i++)
 	{
 		for (int j = 0; j < 3; j++)
 		{
-			MATD_EL(solution->R, i, j) = MATD_EL(initial_pose, i, j);
+			R[3 * i + j] = fix[i] * R_h[3 * i + j];
 		}
+		t[i] = fix[i] * T[i] * scale;
 	}
+}
 
-	solution->t = matd_create(3, 1);
-	for (int i = 0; i < 3; i++)
+/**
+ * Refines the initial estimate in R1, t1 and looks for the second minimum.
+ * The image point setup is shared by both iterations.
+ *
+ * @return Non-zero if R2, t2 and err2 hold a second minimum.
+ */
+static int tag_pose_minima(const double v[4][3], const double p[4][3], double *R1, double *t1, double *err1,
+						   double *R2, double *t2, double *err2, int nIters)
+{
+	double F[POSE_MAX_POINTS][9], p_res[POSE_MAX_POINTS][3], q[POSE_MAX_POINTS][3];
+	oi_problem_t problem = {.F = F, .p_res = p_res, .q = q};
+	orthogonal_iteration_setup(v, p, 4, &problem);
+
+	*err1 = orthogonal_iteration(&problem, p, t1, R1, nIters);
+
+	if (fix_pose_ambiguities(v, p, t1, R1, 4, R2))
 	{
-		MATD_EL(solution->t, i, 0) = MATD_EL(initial_pose, i, 3);
+		t2[0] = t2[1] = t2[2] = 0;
+		*err2 = orthogonal_iteration(&problem, p, t2, R2, nIters);
+		return 1;
 	}
-	matd_destroy(initial_pose);
+
+	*err2 = HUGE_VAL;
+	return 0;
+}
+
+/**
+ * Estimate pose of the tag using the homography method.
+ */
+void estimate_pose_for_tag_homography(apriltag_detection_info_t *info, apriltag_pose_t *solution)
+{
+	solution->R = matd_create(3, 3);
+	solution->t = matd_create(3, 1);
+	tag_pose_homography(info->det, info->tagsize, info->fx, info->fy, info->cx, info->cy, solution->R->data,
+						solution->t->data);
 }
 
 /**
@@ -534,35 +607,29 @@ void estimate_tag_pose_orthogonal_iteration(
 	apriltag_pose_t *solution2,
 	int nIters)
 {
-	double scale = info->tagsize / 2.0;
-	matd_t *p[4] = {
-		matd_create_data(3, 1, (double[]){-scale, scale, 0}),
-		matd_create_data(3, 1, (double[]){scale, scale, 0}),
-		matd_create_data(3, 1, (double[]){scale, -scale, 0}),
-		matd_create_data(3, 1, (double[]){-scale, -scale, 0})};
-	matd_t *v[4];
-	for (int i = 0; i < 4; i++)
-	{
-		v[i] = matd_create_data(3, 1, (double[]){(info->det->p[i][0] - info->cx) / info->fx, (info->det->p[i][1] - info->cy) / info->fy, 1});
-	}
+	double p[4][3], v[4][3];
+	tag_object_points(info->tagsize, p);
+	tag_image_rays(info->det, info->fx, info->fy, info->cx, info->cy, v);
 
 	estimate_pose_for_tag_homography(info, solution1);
-	*err1 = orthogonal_iteration(v, p, &solution1->t, &solution1->R, 4, nIters);
-	solution2->R = fix_pose_ambiguities(v, p, solution1->t, solution1->R, 4);
-	if (solution2->R)
+
+	double R1[9], t1[3];
+	memcpy(R1, solution1->R->data, sizeof(R1));
+	memcpy(t1, solution1->t->data, sizeof(t1));
+
+	double R2[9], t2[3];
+	int second = tag_pose_minima(v, p, R1, t1, err1, R2, t2, err2, nIters);
+	memcpy(solution1->R->data, R1, sizeof(R1));
+	memcpy(solution1->t->data, t1, sizeof(t1));
+
+	if (second)
 	{
-		solution2->t = matd_create(3, 1);
-		*err2 = orthogonal_iteration(v, p, &solution2->t, &solution2->R, 4, nIters);
+		solution2->R = matd_create_data(3, 3, R2);
+		solution2->t = matd_create_data(3, 1, t2);
 	}
 	else
 	{
-		*err2 = HUGE_VAL;
-	}
-
-	for (int i = 0; i < 4; i++)
-	{
-		matd_destroy(p[i]);
-		matd_destroy(v[i]);
+		solution2->R = NULL;
 	}
 }
 
@@ -594,3 +661,148 @@ double estimate_tag_pose(apriltag_detection_info_t *info, apriltag_pose_t *pose)
 		return err2;
 	}
 }
+
+apriltag_pose_batch_t *apriltag_pose_batch_create(double fx, double fy, double cx, double cy, int capacity)
+{
+	apriltag_pose_batch_t *batch = calloc(1, sizeof(apriltag_pose_batch_t));
+	batch->fx = fx;
+	batch->fy = fy;
+	batch->cx = cx;
+	batch->cy = cy;
+	batch->capacity = capacity > 0 ? capacity : 1;
+
+	batch->det = calloc(batch->capacity, sizeof(*batch->det));
+	batch->tagsize = calloc(batch->capacity, sizeof(*batch->tagsize));
+	batch->v = calloc(batch->capacity, sizeof(*batch->v));
+	batch->R = calloc(batch->capacity, sizeof(*batch->R));
+	batch->t = calloc(batch->capacity, sizeof(*batch->t));
+	batch->err = calloc(batch->capacity, sizeof(*batch->err));
+	return batch;
+}
+
+void apriltag_pose_batch_destroy(apriltag_pose_batch_t *batch)
+{
+	if (!batch)
+		return;
+
+	free(batch->det);
+	free(batch->tagsize);
+	free(batch->v);
+	free(batch->R);
+	free(batch->t);
+	free(batch->err);
+	free(batch);
+}
+
+int apriltag_pose_batch_add(apriltag_pose_batch_t *batch, apriltag_detection_t *det, double tagsize)
+{
+	assert(batch->size < batch->capacity);
+
+	int i = batch->size++;
+	batch->det[i] = det;
+	batch->tagsize[i] = tagsize;
+	tag_image_rays(det, batch->fx, batch->fy, batch->cx, batch->cy, batch->v[i]);
+	batch->err[i] = HUGE_VAL;
+	return i;
+}
+
+/**
+ * Estimate the poses of a range of tags in the batch.
+ */
+void estimate_tag_poses(apriltag_pose_batch_t *batch, int first, int count, int nIters)
+{
+	assert(first >= 0 && first + count <= batch->size);
+
+	for (int i = first; i < first + count; i++)
+	{
+		double p[4][3];
+		tag_object_points(batch->tagsize[i], p);
+
+		double R1[9], t1[3], err1, R2[9], t2[3], err2;
+		tag_pose_homography(batch->det[i], batch->tagsize[i], batch->fx, batch->fy, batch->cx, batch->cy, R1, t1);
+		tag_pose_minima(batch->v[i], p, R1, t1, &err1, R2, t2, &err2, nIters);
+
+		if (err1 <= err2)
+		{
+			memcpy(batch->R[i], R1, sizeof(R1));
+			memcpy(batch->t[i], t1, sizeof(t1));
+			batch->err[i] = err1;
+		}
+		else
+		{
+			memcpy(batch->R[i], R2, sizeof(R2));
+			memcpy(batch->t[i], t2, sizeof(t2));
+			batch->err[i] = err2;
+		}
+	}
+}
+
+/**
+ * Object-space error of R with the optimal translation for it, written to t.
+ */
+static double orthogonal_iteration_error(oi_problem_t *problem, const double p[][3], const double *R, double *t)
+{
+	int n_points = problem->n_points;
+	double M2[3] = {0, 0, 0};
+	for (int j = 0; j < n_points; j++)
+	{
+		double Rp[3], update[3];
+		mat33_mulv(R, p[j], Rp);
+		reject(problem->F[j], Rp, update);
+		for (int k = 0; k < 3; k++)
+			M2[k] -= update[k];
+	}
+	for (int k = 0; k < 3; k++)
+		M2[k] /= n_points;
+	mat33_mulv(problem->M1_inv, M2, t);
+
+	double error = 0;
+	for (int j = 0; j < n_points; j++)
+	{
+		double Rpt[3], err_vec[3];
+		mat33_mulv(R, p[j], Rpt);
+		for (int k = 0; k < 3; k++)
+			Rpt[k] += t[k];
+		reject(problem->F[j], Rpt, err_vec);
+		error += vec3_dot(err_vec, err_vec);
+	}
+	return error;
+}
+
+/**
+ * Estimate one pose from the corners of several tags.
+ */
+double estimate_multi_tag_pose(const double v[][3], const double p[][3], int n_points, const double R_init[][9], int n_init,
+							   double *R, double *t, int nIters)
+{
+	if (n_points < 4 || n_init < 1)
+		return HUGE_VAL;
+
+	oi_problem_t problem;
+	problem.F = malloc(n_points * sizeof(*problem.F));
+	problem.p_res = malloc(n_points * sizeof(*problem.p_res));
+	problem.q = malloc(n_points * sizeof(*problem.q));
+
+	orthogonal_iteration_setup(v, p, n_points, &problem);
+
+	// A single tag can pick the wrong one of its two minima, iterating from it
+	// would end in a wrong minimum of all points as well.
+	memcpy(R, R_init[0], 9 * sizeof(double));
+	double best_error = HUGE_VAL;
+	for (int i = 0; i < n_init; i++)
+	{
+		double error = orthogonal_iteration_error(&problem, p, R_init[i], t);
+		if (error < best_error)
+		{
+			best_error = error;
+			memcpy(R, R_init[i], 9 * sizeof(double));
+		}
+	}
+
+	double err = orthogonal_iteration(&problem, p, t, R, nIters);
+
+	free(problem.F);
+	free(problem.p_res);
+	free(problem.q);
+	return err;
+}
@@ -71,6 +71,56 @@ extern "C"
 	 */
 	double estimate_tag_pose(apriltag_detection_info_t *info, apriltag_pose_t *pose);
 
+	/**
+	 * The tags of one frame, structure of arrays. The intrinsics are shared and
+	 * the image rays of the corners are computed once when a tag is added, they
+	 * feed both estimate_tag_poses and estimate_multi_tag_pose.
+	 */
+	typedef struct
+	{
+		double fx, fy, cx, cy; // In pixels.
+		int size, capacity;
+
+		apriltag_detection_t **det;
+		double *tagsize;	// In the unit of the poses.
+		double (*v)[4][3];	// ((x - cx) / fx, (y - cy) / fy, 1) of every corner.
+
+		// Written by estimate_tag_poses, rotations row-major.
+		double (*R)[9];
+		double (*t)[3];
+		double *err; // Object-space error, HUGE_VAL until estimated.
+	} apriltag_pose_batch_t;
+
+	apriltag_pose_batch_t *apriltag_pose_batch_create(double fx, double fy, double cx, double cy, int capacity);
+	void apriltag_pose_batch_destroy(apriltag_pose_batch_t *batch);
+
+	/**
+	 * @return Index of the tag in the batch.
+	 */
+	int apriltag_pose_batch_add(apriltag_pose_batch_t *batch, apriltag_detection_t *det, double tagsize);
+
+	/**
+	 * Estimate the poses of the tags first .. first + count - 1 of the batch, the
+	 * same as estimate_tag_pose with nIters iterations, without the matd_t
+	 * allocations.
+	 */
+	void estimate_tag_poses(apriltag_pose_batch_t *batch, int first, int count, int nIters);
+
+	/**
+	 * Estimate one pose from the corners of several tags, e.g. the camera pose
+	 * from all tags with a known place in the world. Orthogonal Iteration [2]
+	 * over all points, which unlike a single tag are usually not ambiguous.
+	 * It starts from the initial rotation with the lowest error over all points,
+	 * e.g. the ones of the single tags.
+	 *
+	 * @param v Image rays of the points, see apriltag_pose_batch_t.
+	 * @param p The points in the frame of the pose.
+	 * @outparam R, t
+	 * @return Object-space error of all points.
+	 */
+	double estimate_multi_tag_pose(const double v[][3], const double p[][3], int n_points, const double R_init[][9], int n_init,
+								   double *R, double *t, int nIters);
+
 #ifdef __cplusplus
 }
 #endif
@@ -50,18 +50,6 @@ static inline long int random(void)
 }
 #endif
 
-static inline uint32_t u64hash_2(uint64_t x) {
-    return (2654435761 * x) >> 32;
-}
-
-struct uint64_zarray_entry
-{
-    uint64_t id;
-    zarray_t *cluster;
-
-    struct uint64_zarray_entry *next;
-};
-
 #ifndef M_PI
 # define M_PI 3.141592653589793238462643383279502884196
 #endif
@@ -75,18 +63,34 @@ struct pt
     float slope;
 };
 
+// A horizontal run of equal pixels in the thresholded image.
+struct run
+{
+    uint16_t x0, x1; // inclusive
+    uint8_t v;
+};
+
+// The thresholded image as runs, row by row, and its connected
+// components as a union-find over the run indices. The size of a set is
+// its number of pixels.
+struct run_segmentation
+{
+    // the runs of row y are [row_start[y], row_start[y+1])
+    uint32_t *row_start;
+    struct run *runs;
+    unionfind_t uf;
+};
+
 struct unionfind_task
 {
-    int y0, y1;
     int w, h, s;
-    unionfind_t *uf;
+    struct run_segmentation *seg;
     image_u8_t *im;
 };
 
 struct quad_task
 {
     zarray_t *clusters;
-    int cidx0, cidx1; // [cidx0, cidx1)
     zarray_t *quads;
     apriltag_detector_t *td;
     int w, h;
@@ -98,18 +102,127 @@ struct quad_task
 };
 
 
+// A boundary point together with the pair of regions it separates.
+// Same as struct pt without the slope, which isn't known yet, so that
+// it packs into 16 bytes.
+struct cluster_point
+{
+    uint64_t id;
+    uint16_t x, y;
+    int16_t gx, gy;
+};
+
+// The points found by one cluster task, in order, as a list of blocks.
+struct cluster_block
+{
+    struct cluster_block *next;
+    int n;
+    struct cluster_point pts[1024];
+};
+
 struct cluster_task
 {
     int y0;
     int y1;
     int w;
     int s;
-    int nclustermap;
-    unionfind_t* uf;
+    struct run_segmentation* seg;
     image_u8_t* im;
-    zarray_t* clusters;
+    arena_t* scratch;
+
+    // dense number of every region large enough to take part, in the
+    // same order as the run index of its root.
+    const uint32_t *label;
+    int label_bits;
+
+    struct cluster_block *first;
+    int npoints;
 };
 
+#define RADIX_BITS 12
+#define RADIX_BUCKETS (1 << RADIX_BITS)
+
+// One slice of a radix sort pass. The first pass reads the block list
+// of a cluster task, the others a range of the previous pass' output.
+// The last pass splits the points from their ids.
+struct radix_task
+{
+    const struct cluster_block *blocks;
+    const struct cluster_point *in;
+    int i0, i1; // [i0, i1)
+
+    struct cluster_point *out;
+    struct pt *out_pts;
+    uint64_t *out_ids;
+
+    int shift, bits;
+    uint32_t *counts; // RADIX_BUCKETS entries
+};
+
+// Vector helpers for thresholding and run extraction, picked at compile
+// time: AVX2 when the compiler targets it, SSE2 on any x86-64, NEON on
+// ARM and plain C otherwise. Every path produces exactly the same output.
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define THRESH_VEC 32
+typedef __m256i tvec_t;
+static inline tvec_t tvec_load(const uint8_t *p) { return _mm256_loadu_si256((const __m256i *) p); }
+static inline void tvec_store(uint8_t *p, tvec_t v) { _mm256_storeu_si256((__m256i *) p, v); }
+static inline tvec_t tvec_set1(uint8_t v) { return _mm256_set1_epi8((char) v); }
+static inline tvec_t tvec_max(tvec_t a, tvec_t b) { return _mm256_max_epu8(a, b); }
+static inline tvec_t tvec_min(tvec_t a, tvec_t b) { return _mm256_min_epu8(a, b); }
+static inline tvec_t tvec_eq(tvec_t a, tvec_t b) { return _mm256_cmpeq_epi8(a, b); }
+static inline tvec_t tvec_and(tvec_t a, tvec_t b) { return _mm256_and_si256(a, b); }
+static inline tvec_t tvec_or(tvec_t a, tvec_t b) { return _mm256_or_si256(a, b); }
+static inline tvec_t tvec_xor(tvec_t a, tvec_t b) { return _mm256_xor_si256(a, b); }
+static inline tvec_t tvec_srl32_8(tvec_t v) { return _mm256_srli_epi32(v, 8); }
+static inline tvec_t tvec_srl32_16(tvec_t v) { return _mm256_srli_epi32(v, 16); }
+static inline int tvec_all(tvec_t v) { return _mm256_movemask_epi8(v) == -1; }
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define THRESH_VEC 16
+typedef __m128i tvec_t;
+static inline tvec_t tvec_load(const uint8_t *p) { return _mm_loadu_si128((const __m128i *) p); }
+static inline void tvec_store(uint8_t *p, tvec_t v) { _mm_storeu_si128((__m128i *) p, v); }
+static inline tvec_t tvec_set1(uint8_t v) { return _mm_set1_epi8((char) v); }
+static inline tvec_t tvec_max(tvec_t a, tvec_t b) { return _mm_max_epu8(a, b); }
+static inline tvec_t tvec_min(tvec_t a, tvec_t b) { return _mm_min_epu8(a, b); }
+static inline tvec_t tvec_eq(tvec_t a, tvec_t b) { return _mm_cmpeq_epi8(a, b); }
+static inline tvec_t tvec_and(tvec_t a, tvec_t b) { return _mm_and_si128(a, b); }
+static inline tvec_t tvec_or(tvec_t a, tvec_t b) { return _mm_or_si128(a, b); }
+static inline tvec_t tvec_xor(tvec_t a, tvec_t b) { return _mm_xor_si128(a, b); }
+static inline tvec_t tvec_srl32_8(tvec_t v) { return _mm_srli_epi32(v, 8); }
+static inline tvec_t tvec_srl32_16(tvec_t v) { return _mm_srli_epi32(v, 16); }
+static inline int tvec_all(tvec_t v) { return _mm_movemask_epi8(v) == 0xffff; }
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define THRESH_VEC 16
+typedef uint8x16_t tvec_t;
+static inline tvec_t tvec_load(const uint8_t *p) { return vld1q_u8(p); }
+static inline void tvec_store(uint8_t *p, tvec_t v) { vst1q_u8(p, v); }
+static inline tvec_t tvec_set1(uint8_t v) { return vdupq_n_u8(v); }
+static inline tvec_t tvec_max(tvec_t a, tvec_t b) { return vmaxq_u8(a, b); }
+static inline tvec_t tvec_min(tvec_t a, tvec_t b) { return vminq_u8(a, b); }
+static inline tvec_t tvec_eq(tvec_t a, tvec_t b) { return vceqq_u8(a, b); }
+static inline tvec_t tvec_and(tvec_t a, tvec_t b) { return vandq_u8(a, b); }
+static inline tvec_t tvec_or(tvec_t a, tvec_t b) { return vorrq_u8(a, b); }
+static inline tvec_t tvec_xor(tvec_t a, tvec_t b) { return veorq_u8(a, b); }
+static inline tvec_t tvec_srl32_8(tvec_t v) { return vreinterpretq_u8_u32(vshrq_n_u32(vreinterpretq_u32_u8(v), 8)); }
+static inline tvec_t tvec_srl32_16(tvec_t v) { return vreinterpretq_u8_u32(vshrq_n_u32(vreinterpretq_u32_u8(v), 16)); }
+#if defined(__aarch64__)
+static inline int tvec_all(tvec_t v) { return vminvq_u8(v) == 255; }
+#else
+static inline int tvec_all(tvec_t v)
+{
+    uint8x8_t m = vpmin_u8(vget_low_u8(v), vget_high_u8(v));
+    m = vpmin_u8(m, m);
+    m = vpmin_u8(m, m);
+    m = vpmin_u8(m, m);
+    return vget_lane_u8(m, 0) == 255;
+}
+#endif
+#endif
+
 struct remove_vertex
 {
     int i;           // which vertex to remove?
@@ -134,13 +247,6 @@ struct line_fit_pt
     double W; // total weight
 };
 
-struct cluster_hash
-{
-    uint32_t hash;
-    uint64_t id;
-    zarray_t* data;
-};
-
 
 // lfps contains *cumulative* moments for N points, with
 // index j reflecting points [0,j] (inclusive).
@@ -311,7 +417,7 @@ int quad_segment_maxima(apriltag_detector_t *td, zarray_t *cluster, struct line_
     if (ksz < 2)
         return 0;
 
-    double *errs = malloc(sizeof(double)*sz);
+    double *errs = arena_alloc(td->scratch, sizeof(double)*sz);
 
     for (int i = 0; i < sz; i++) {
         fit_line(lfps, sz, (i + sz - ksz) % sz, (i + ksz) % sz, NULL, &errs[i], NULL);
@@ -319,7 +425,7 @@ int quad_segment_maxima(apriltag_detector_t *td, zarray_t *cluster, struct line_
 
     // apply a low-pass filter to errs
     if (1) {
-        double *y = malloc(sizeof(double)*sz);
+        double *y = arena_alloc(td->scratch, sizeof(double)*sz);
 
         // how much filter to apply?
 
@@ -341,7 +447,7 @@ int quad_segment_maxima(apriltag_detector_t *td, zarray_t *cluster, struct line_
 
         // For default values of cutoff = 0.05, sigma = 3,
         // we have fsz = 17.
-        float *f = malloc(sizeof(float)*fsz);
+        float *f = arena_alloc(td->scratch, sizeof(float)*fsz);
 
         for (int i = 0; i < fsz; i++) {
             int j = i - fsz / 2;
@@ -358,12 +464,10 @@ int quad_segment_maxima(apriltag_detector_t *td, zarray_t *cluster, struct line_
         }
 
         memcpy(errs, y, sizeof(double)*sz);
-        free(y);
-        free(f);
     }
 
-    int *maxima = malloc(sizeof(int)*sz);
-    double *maxima_errs = malloc(sizeof(double)*sz);
+    int *maxima = arena_alloc(td->scratch, sizeof(int)*sz);
+    double *maxima_errs = arena_alloc(td->scratch, sizeof(double)*sz);
     int nmaxima = 0;
 
     for (int i = 0; i < sz; i++) {
@@ -373,12 +477,9 @@ int quad_segment_maxima(apriltag_detector_t *td, zarray_t *cluster, struct line_
             nmaxima++;
         }
     }
-    free(errs);
 
     // if we didn't get at least 4 maxima, we can't fit a quad.
     if (nmaxima < 4){
-        free(maxima);
-        free(maxima_errs);
         return 0;
     }
 
@@ -386,7 +487,7 @@ int quad_segment_maxima(apriltag_detector_t *td, zarray_t *cluster, struct line_
     int max_nmaxima = td->qtp.max_nmaxima;
 
     if (nmaxima > max_nmaxima) {
-        double *maxima_errs_copy = malloc(sizeof(double)*nmaxima);
+        double *maxima_errs_copy = arena_alloc(td->scratch, sizeof(double)*nmaxima);
         memcpy(maxima_errs_copy, maxima_errs, sizeof(double)*nmaxima);
 
         // throw out all but the best handful of maxima. Sorts descending.
@@ -400,9 +501,7 @@ int quad_segment_maxima(apriltag_detector_t *td, zarray_t *cluster, struct line_
             maxima[out++] = maxima[in];
         }
         nmaxima = out;
-        free(maxima_errs_copy);
     }
-    free(maxima_errs);
 
     int best_indices[4];
     double best_error = HUGE_VALF;
@@ -460,8 +559,6 @@ int quad_segment_maxima(apriltag_detector_t *td, zarray_t *cluster, struct line_
         }
     }
 
-    free(maxima);
-
     if (best_error == HUGE_VALF)
         return 0;
 
@@ -488,9 +585,9 @@ int quad_segment_agg(apriltag_detector_t *td, zarray_t *cluster, struct line_fit
 
     int rvalloc_pos = 0;
     int rvalloc_size = 3*sz;
-    struct remove_vertex *rvalloc = calloc(rvalloc_size, sizeof(struct remove_vertex));
+    struct remove_vertex *rvalloc = arena_calloc(td->scratch, rvalloc_size, sizeof(struct remove_vertex));
 
-    struct segment *segs = calloc(sz, sizeof(struct segment));
+    struct segment *segs = arena_calloc(td->scratch, sz, sizeof(struct segment));
 
     // populate with initial entries
     for (int i = 0; i < sz; i++) {
@@ -569,7 +666,6 @@ int quad_segment_agg(apriltag_detector_t *td, zarray_t *cluster, struct line_fit
         nvertices--;
     }
 
-    free(rvalloc);
     zmaxheap_destroy(heap);
 
     int idx = 0;
@@ -579,8 +675,6 @@ int quad_segment_agg(apriltag_detector_t *td, zarray_t *cluster, struct line_fit
         }
     }
 
-    free(segs);
-
     return 1;
 }
 
@@ -588,8 +682,8 @@ int quad_segment_agg(apriltag_detector_t *td, zarray_t *cluster, struct line_fit
  * Compute statistics that allow line fit queries to be
  * efficiently computed for any contiguous range of indices.
  */
-struct line_fit_pt* compute_lfps(int sz, zarray_t* cluster, image_u8_t* im) {
-    struct line_fit_pt *lfps = calloc(sz, sizeof(struct line_fit_pt));
+struct line_fit_pt* compute_lfps(int sz, zarray_t* cluster, image_u8_t* im, arena_t *scratch) {
+    struct line_fit_pt *lfps = arena_calloc(scratch, sz, sizeof(struct line_fit_pt));
 
     for (int i = 0; i < sz; i++) {
         struct pt *p;
@@ -630,7 +724,8 @@ struct line_fit_pt* compute_lfps(int sz, zarray_t* cluster, image_u8_t* im) {
     return lfps;
 }
 
-static inline void ptsort(struct pt *pts, int sz)
+// tmp must have room for sz points, its contents are overwritten.
+static inline void ptsort(struct pt *pts, int sz, struct pt *tmp_pts)
 {
 #define MAYBE_SWAP(arr,apos,bpos)                                   \
     if (pt_compare_angle(&(arr[apos]), &(arr[bpos])) > 0) {                        \
@@ -683,9 +778,10 @@ static inline void ptsort(struct pt *pts, int sz)
 
 #undef MAYBE_SWAP
 
-    // a merge sort with temp storage.
+    // a merge sort with temp storage. Once pts has been copied out, its
+    // halves serve as the temp storage of the two recursive sorts.
 
-    struct pt *tmp = malloc(sizeof(struct pt) * sz);
+    struct pt *tmp = tmp_pts;
 
     memcpy(tmp, pts, sizeof(struct pt) * sz);
 
@@ -695,8 +791,8 @@ static inline void ptsort(struct pt *pts, int sz)
     struct pt *as = &tmp[0];
     struct pt *bs = &tmp[asz];
 
-    ptsort(as, asz);
-    ptsort(bs, bsz);
+    ptsort(as, asz, &pts[0]);
+    ptsort(bs, bsz, &pts[asz]);
 
     #define MERGE(apos,bpos)                        \
     if (pt_compare_angle(&(as[apos]), &(bs[bpos])) < 0)        \
@@ -719,8 +815,6 @@ static inline void ptsort(struct pt *pts, int sz)
     if (bpos < bsz)
         memcpy(&pts[outpos], &bs[bpos], (bsz-bpos)*sizeof(struct pt));
 
-    free(tmp);
-
 #undef MERGE
 }
 
@@ -820,7 +914,8 @@ int fit_quad(
     // we now sort the points according to theta. This is a prepatory
     // step for segmenting them into four lines.
     if (1) {
-        ptsort((struct pt*) cluster->data, zarray_size(cluster));
+        ptsort((struct pt*) cluster->data, zarray_size(cluster),
+               arena_alloc(td->scratch, sizeof(struct pt) * zarray_size(cluster)));
 
         // remove duplicate points. (A byproduct of our segmentation system.)
         if (1) {
@@ -858,7 +953,7 @@ int fit_quad(
         return 0;
 
 
-    struct line_fit_pt *lfps = compute_lfps(sz, cluster, im);
+    struct line_fit_pt *lfps = compute_lfps(sz, cluster, im, td->scratch);
 
     int indices[4];
     if (1) {
@@ -979,79 +1074,176 @@ int fit_quad(
 
   finish:
 
-    free(lfps);
-
     return res;
 }
 
-#define DO_UNIONFIND2(dx, dy) if (im->buf[(y + dy)*s + x + dx] == v) unionfind_connect(uf, y*w + x, (y + dy)*w + x + dx);
+// The segmentation works on runs of equal pixels instead of single
+// pixels, but keeps the connectivity of the per-pixel version: every
+// pixel x in [1, w-2] of a row is joined with its left and upper
+// neighbours of the same value, white pixels also with the two upper
+// diagonal ones. Pixels at x = w-1 are never joined to their left
+// neighbour, so the last column always forms runs of its own.
 
-static void do_unionfind_first_line(unionfind_t *uf, image_u8_t *im, int h, int w, int s)
+// first x in [x, end) that differs from its left neighbour, end if none.
+static inline int next_change(const uint8_t *row, int x, int end)
 {
-    int y = 0;
-    uint8_t v;
+#ifdef THRESH_VEC
+    for (; x + THRESH_VEC <= end; x += THRESH_VEC) {
+        if (!tvec_all(tvec_eq(tvec_load(&row[x]), tvec_load(&row[x-1]))))
+            break;
+    }
+#endif
+    for (; x < end; x++) {
+        if (row[x] != row[x-1])
+            return x;
+    }
+    return end;
+}
+
+static int count_row_runs(const uint8_t *row, int w)
+{
+    if (w < 2)
+        return 1;
 
-    for (int x = 1; x < w - 1; x++) {
-        v = im->buf[y*s + x];
+    int n = 1;
+    for (int x = next_change(row, 1, w - 1); x < w - 1; x = next_change(row, x + 1, w - 1))
+        n++;
 
-        if (v == 127)
-            continue;
+    return n + 1; // the last column
+}
 
-        DO_UNIONFIND2(-1, 0);
+// writes the runs of one row and initializes their union-find records.
+static void fill_row_runs(const uint8_t *row, int w, struct run *runs, struct ufrec *recs, uint32_t first)
+{
+    int n = 0;
+
+#define ADD_RUN(a, b)                                   \
+    do {                                                \
+        runs[n].x0 = (a);                               \
+        runs[n].x1 = (b);                               \
+        runs[n].v = row[a];                             \
+        recs[n].parent = first + n;                     \
+        recs[n].size = (b) - (a) + 1;                   \
+        n++;                                            \
+    } while (0)
+
+    if (w < 2) {
+        ADD_RUN(0, 0);
+        return;
     }
+
+    int x0 = 0;
+    while (1) {
+        int x1 = next_change(row, x0 + 1, w - 1);
+        ADD_RUN(x0, x1 - 1);
+        if (x1 >= w - 1)
+            break;
+        x0 = x1;
+    }
+
+    ADD_RUN(w - 1, w - 1);
+
+#undef ADD_RUN
 }
 
-static void do_unionfind_line2(unionfind_t *uf, image_u8_t *im, int h, int w, int s, int y)
+// joins the runs of row y with the touching runs of row y-1.
+static void do_unionfind_runs(struct run_segmentation *seg, int w, int y)
 {
     assert(y > 0);
 
-    uint8_t v_m1_m1;
-    uint8_t v_0_m1 = im->buf[(y - 1)*s];
-    uint8_t v_1_m1 = im->buf[(y - 1)*s + 1];
-    uint8_t v_m1_0;
-    uint8_t v = im->buf[y*s];
+    uint32_t above0 = seg->row_start[y-1];
+    const struct run *above = &seg->runs[above0];
+    int nabove = seg->row_start[y] - above0;
 
-    for (int x = 1; x < w - 1; x++) {
-        v_m1_m1 = v_0_m1;
-        v_0_m1 = v_1_m1;
-        v_1_m1 = im->buf[(y - 1)*s + x + 1];
-        v_m1_0 = v;
-        v = im->buf[y*s + x];
-
-        if (v == 127)
+    int j = 0;
+    for (uint32_t r = seg->row_start[y]; r < seg->row_start[y+1]; r++) {
+        const struct run *run = &seg->runs[r];
+        if (run->v == 127)
             continue;
 
-        // (dx,dy) pairs for 8 connectivity:
-        // (-1, -1)    (0, -1)    (1, -1)
-        // (-1, 0)    (REFERENCE)
-        DO_UNIONFIND2(-1, 0);
+        int c0 = imax(run->x0, 1);
+        int c1 = imin(run->x1, w - 2);
+        if (c0 > c1)
+            continue;
 
-        if (x == 1 || !((v_m1_0 == v_m1_m1) && (v_m1_m1 == v_0_m1))) {
-            DO_UNIONFIND2(0, -1);
+        // white is 8-connected, black only 4-connected. The per-pixel
+        // version skipped the diagonal into the last column when the two
+        // pixels above were equal, assuming they were already joined.
+        // They never are, but keep the segmentation the same.
+        if (run->v == 255) {
+            c0--;
+            if (c1 < w - 2 || above[nabove-2].v != above[nabove-1].v)
+                c1++;
         }
 
-        if (v == 255) {
-            if (x == 1 || !(v_m1_0 == v_m1_m1 || v_0_m1 == v_m1_m1) ) {
-                DO_UNIONFIND2(-1, -1);
-            }
-            if (!(v_0_m1 == v_1_m1)) {
-                DO_UNIONFIND2(1, -1);
-            }
+        while (above[j].x1 < c0)
+            j++;
+
+        for (int k = j; k < nabove && above[k].x0 <= c1; k++) {
+            if (above[k].v == run->v)
+                unionfind_connect(&seg->uf, above0 + k, r);
         }
     }
 }
-#undef DO_UNIONFIND2
 
-static void do_unionfind_task2(void *p)
+static void do_count_runs_task(void *p, int y0, int y1)
+{
+    struct unionfind_task *task = (struct unionfind_task*) p;
+
+    for (int y = y0; y < y1; y++) {
+        task->seg->row_start[y+1] = count_row_runs(&task->im->buf[y*task->s], task->w);
+    }
+}
+
+static void do_fill_runs_task(void *p, int y0, int y1)
 {
     struct unionfind_task *task = (struct unionfind_task*) p;
+    struct run_segmentation *seg = task->seg;
 
-    for (int y = task->y0; y < task->y1; y++) {
-        do_unionfind_line2(task->uf, task->im, task->h, task->w, task->s, y);
+    for (int y = y0; y < y1; y++) {
+        uint32_t first = seg->row_start[y];
+        fill_row_runs(&task->im->buf[y*task->s], task->w, &seg->runs[first], &seg->uf.data[first], first);
+    }
+}
+
+// joins the rows of [y0, y1) with the row above, except for the first.
+static void do_unionfind_task2(void *p, int y0, int y1)
+{
+    struct unionfind_task *task = (struct unionfind_task*) p;
+
+    for (int y = y0 + 1; y < y1; y++) {
+        do_unionfind_runs(task->seg, task->w, y);
+    }
+}
+
+// Remembers the box of a cluster no quad could be fit to, if it is
+// small enough to be a tag too small for this pyramid level.
+static void add_small_cluster(apriltag_detector_t *td, zarray_t *cluster, int tag_width)
+{
+    struct pt *p;
+    zarray_get_volatile(cluster, 0, &p);
+
+    int xmin = p->x, xmax = p->x, ymin = p->y, ymax = p->y;
+    for (int i = 1; i < zarray_size(cluster); i++) {
+        zarray_get_volatile(cluster, i, &p);
+        xmin = imin(xmin, p->x);
+        xmax = imax(xmax, p->x);
+        ymin = imin(ymin, p->y);
+        ymax = imax(ymax, p->y);
     }
+
+    // points are at twice their coordinates.
+    if (xmax - xmin > 6*tag_width || ymax - ymin > 6*tag_width)
+        return;
+
+    float box[4] = { xmin / 2.0f, ymin / 2.0f, xmax / 2.0f, ymax / 2.0f };
+
+    pthread_mutex_lock(&td->mutex);
+    zarray_add(td->small_clusters, box);
+    pthread_mutex_unlock(&td->mutex);
 }
 
-static void do_quad_task(void *p)
+static void do_quad_task(void *p, int cidx0, int cidx1)
 {
     struct quad_task *task = (struct quad_task*) p;
 
@@ -1060,7 +1252,7 @@ static void do_quad_task(void *p)
     apriltag_detector_t *td = task->td;
     int w = task->w, h = task->h;
 
-    for (int cidx = task->cidx0; cidx < task->cidx1; cidx++) {
+    for (int cidx = cidx0; cidx < cidx1; cidx++) {
 
         zarray_t *cluster;
         zarray_get(clusters, cidx, &cluster);
@@ -1085,18 +1277,175 @@ static void do_quad_task(void *p)
             pthread_mutex_lock(&td->mutex);
             zarray_add(quads, &quad);
             pthread_mutex_unlock(&td->mutex);
+        } else if (td->small_clusters) {
+            add_small_cluster(td, cluster, task->tag_width);
+        }
+    }
+}
+
+// min and max of every 4x4 tile in a row of tiles starting at row.
+static void tile_minmax_row(const uint8_t *row, int s, int tw, uint8_t *out_max, uint8_t *out_min)
+{
+    int tx = 0;
+
+#ifdef THRESH_VEC
+    const int tiles_per_vec = THRESH_VEC / 4;
+    const tvec_t ones = tvec_set1(255);
+    uint8_t lanes_max[THRESH_VEC], lanes_min[THRESH_VEC];
+
+    for (; tx + tiles_per_vec <= tw; tx += tiles_per_vec) {
+        const uint8_t *p = &row[tx*4];
+
+        tvec_t max = tvec_load(p), min = max;
+        for (int dy = 1; dy < 4; dy++) {
+            tvec_t v = tvec_load(&p[dy*s]);
+            max = tvec_max(max, v);
+            min = tvec_min(min, v);
+        }
+
+        // fold the 4 columns of a tile (one 32 bit lane) into its lowest
+        // byte. The shifts bring in zeros, so min is folded as the max
+        // of the inverted values.
+        min = tvec_xor(min, ones);
+        max = tvec_max(max, tvec_srl32_8(max));
+        max = tvec_max(max, tvec_srl32_16(max));
+        min = tvec_max(min, tvec_srl32_8(min));
+        min = tvec_max(min, tvec_srl32_16(min));
+
+        tvec_store(lanes_max, max);
+        tvec_store(lanes_min, min);
+        for (int i = 0; i < tiles_per_vec; i++) {
+            out_max[tx+i] = lanes_max[4*i];
+            out_min[tx+i] = 255 - lanes_min[4*i];
+        }
+    }
+#endif
+
+    for (; tx < tw; tx++) {
+        uint8_t max = 0, min = 255;
+
+        for (int dy = 0; dy < 4; dy++) {
+            for (int dx = 0; dx < 4; dx++) {
+                uint8_t v = row[dy*s + tx*4 + dx];
+                if (v < min)
+                    min = v;
+                if (v > max)
+                    max = v;
+            }
+        }
+
+        out_max[tx] = max;
+        out_min[tx] = min;
+    }
+}
+
+static inline uint8_t u8_max(uint8_t a, uint8_t b) { return a > b ? a : b; }
+static inline uint8_t u8_min(uint8_t a, uint8_t b) { return a < b ? a : b; }
+
+// One pass of the separable 3x3 tile filter. Without above/below it is
+// the horizontal pass over in, with them the vertical pass over the three
+// rows. Neighbours outside the tile map are ignored, which is the same as
+// repeating the edge since max and min don't change for duplicates.
+static void filter3_row(const uint8_t *in, const uint8_t *above, const uint8_t *below, uint8_t *out, int n, int is_max)
+{
+    if (above) {
+        int x = 0;
+#ifdef THRESH_VEC
+        for (; x + THRESH_VEC <= n; x += THRESH_VEC) {
+            tvec_t a = tvec_load(&above[x]), b = tvec_load(&in[x]), c = tvec_load(&below[x]);
+            tvec_store(&out[x], is_max ? tvec_max(tvec_max(a, b), c) : tvec_min(tvec_min(a, b), c));
+        }
+#endif
+        for (; x < n; x++)
+            out[x] = is_max ? u8_max(u8_max(above[x], in[x]), below[x]) : u8_min(u8_min(above[x], in[x]), below[x]);
+        return;
+    }
+
+    if (n == 1) {
+        out[0] = in[0];
+        return;
+    }
+
+    out[0] = is_max ? u8_max(in[0], in[1]) : u8_min(in[0], in[1]);
+
+    int x = 1;
+#ifdef THRESH_VEC
+    for (; x + THRESH_VEC <= n - 1; x += THRESH_VEC) {
+        tvec_t a = tvec_load(&in[x-1]), b = tvec_load(&in[x]), c = tvec_load(&in[x+1]);
+        tvec_store(&out[x], is_max ? tvec_max(tvec_max(a, b), c) : tvec_min(tvec_min(a, b), c));
+    }
+#endif
+    for (; x < n - 1; x++)
+        out[x] = is_max ? u8_max(u8_max(in[x-1], in[x]), in[x+1]) : u8_min(u8_min(in[x-1], in[x]), in[x+1]);
+
+    out[n-1] = is_max ? u8_max(in[n-2], in[n-1]) : u8_min(in[n-2], in[n-1]);
+}
+
+// Binarizes the full tiles of one tile row: 127 for low contrast tiles,
+// otherwise 255 above and 0 at or below the middle of min and max.
+static void binarize_tile_row(const uint8_t *in, uint8_t *out, int s, int tw,
+                              const uint8_t *tile_max, const uint8_t *tile_min, int min_white_black_diff,
+                              uint8_t *thresh_row, uint8_t *low_row)
+{
+    const int n = tw*4;
+
+    // spread the per tile values over the pixels of the row
+    for (int tx = 0; tx < tw; tx++) {
+        int min = tile_min[tx];
+        int max = tile_max[tx];
+
+        // argument for biasing towards dark; specular highlights
+        // can be substantially brighter than white tag parts
+        uint8_t thresh = min + (max - min) / 2;
+        uint8_t low = max - min < min_white_black_diff ? 255 : 0;
+
+        memset(&thresh_row[tx*4], thresh, 4);
+        memset(&low_row[tx*4], low, 4);
+    }
+
+    for (int dy = 0; dy < 4; dy++) {
+        const uint8_t *src = &in[dy*s];
+        uint8_t *dst = &out[dy*s];
+
+        int x = 0;
+#ifdef THRESH_VEC
+        const tvec_t ones = tvec_set1(255);
+        const tvec_t gray = tvec_set1(127);
+        for (; x + THRESH_VEC <= n; x += THRESH_VEC) {
+            tvec_t v = tvec_load(&src[x]);
+            tvec_t thresh = tvec_load(&thresh_row[x]);
+            tvec_t low = tvec_load(&low_row[x]);
+
+            tvec_t at_most = tvec_eq(tvec_min(v, thresh), v);
+            tvec_t white = tvec_xor(tvec_or(at_most, low), ones);
+            tvec_store(&dst[x], tvec_or(white, tvec_and(low, gray)));
         }
+#endif
+        for (; x < n; x++)
+            dst[x] = low_row[x] ? 127 : (src[x] > thresh_row[x] ? 255 : 0);
     }
 }
 
+// an image that lives in the detector's scratch arena until the next
+// frame. The pixels are not initialized.
+static image_u8_t *scratch_image_u8(apriltag_detector_t *td, int width, int height, int stride)
+{
+    // const initializer
+    image_u8_t tmp = { .width = width, .height = height, .stride = stride,
+                       .buf = arena_alloc(td->scratch, (size_t) height * stride) };
+
+    image_u8_t *im = arena_alloc(td->scratch, sizeof(image_u8_t));
+    memcpy(im, &tmp, sizeof(image_u8_t));
+    return im;
+}
+
 image_u8_t *threshold(apriltag_detector_t *td, image_u8_t *im)
 {
     int w = im->width, h = im->height, s = im->stride;
     assert(w < 32768);
     assert(h < 32768);
 
-    image_u8_t *threshim = image_u8_create_alignment(w, h, s);
-    assert(threshim->stride == s);
+    image_u8_t *threshim = scratch_image_u8(td, w, h, s);
 
     // The idea is to find the maximum and minimum values in a
     // window around each pixel. If it's a contrast-free region
@@ -1128,108 +1477,43 @@ image_u8_t *threshold(apriltag_detector_t *td, image_u8_t *im)
     int tw = w / tilesz;
     int th = h / tilesz;
 
-    uint8_t *im_max = calloc(tw*th, sizeof(uint8_t));
-    uint8_t *im_min = calloc(tw*th, sizeof(uint8_t));
+    // scratch memory: tile max/min, their horizontally filtered
+    // versions, and per-pixel threshold and low-contrast rows for the
+    // binarization.
+    uint8_t *im_max = arena_alloc(td->scratch, 4 * (size_t) tw * th + 2 * (size_t) tw * tilesz);
+    uint8_t *im_min = im_max + tw*th;
+    uint8_t *im_max_tmp = im_min + tw*th;
+    uint8_t *im_min_tmp = im_max_tmp + tw*th;
+    uint8_t *thresh_row = im_min_tmp + tw*th;
+    uint8_t *low_row = thresh_row + tw*tilesz;
 
     // first, collect min/max statistics for each tile
-    for (int ty = 0; ty < th; ty++) {
-        for (int tx = 0; tx < tw; tx++) {
-            uint8_t max = 0, min = 255;
-
-            for (int dy = 0; dy < tilesz; dy++) {
-
-                for (int dx = 0; dx < tilesz; dx++) {
-
-                    uint8_t v = im->buf[(ty*tilesz+dy)*s + tx*tilesz + dx];
-                    if (v < min)
-                        min = v;
-                    if (v > max)
-                        max = v;
-                }
-            }
-
-            im_max[ty*tw+tx] = max;
-            im_min[ty*tw+tx] = min;
-        }
-    }
+    for (int ty = 0; ty < th; ty++)
+        tile_minmax_row(&im->buf[ty*tilesz*s], s, tw, &im_max[ty*tw], &im_min[ty*tw]);
 
     // second, apply 3x3 max/min convolution to "blur" these values
     // over larger areas. This reduces artifacts due to abrupt changes
-    // in the threshold value.
+    // in the threshold value. Done as a horizontal and a vertical
+    // pass, tiles outside the image are ignored.
     if (1) {
-        uint8_t *im_max_tmp = calloc(tw*th, sizeof(uint8_t));
-        uint8_t *im_min_tmp = calloc(tw*th, sizeof(uint8_t));
-
         for (int ty = 0; ty < th; ty++) {
-            for (int tx = 0; tx < tw; tx++) {
-                uint8_t max = 0, min = 255;
+            filter3_row(&im_max[ty*tw], NULL, NULL, &im_max_tmp[ty*tw], tw, 1);
+            filter3_row(&im_min[ty*tw], NULL, NULL, &im_min_tmp[ty*tw], tw, 0);
+        }
 
-                for (int dy = -1; dy <= 1; dy++) {
-                    if (ty+dy < 0 || ty+dy >= th)
-                        continue;
-                    for (int dx = -1; dx <= 1; dx++) {
-                        if (tx+dx < 0 || tx+dx >= tw)
-                            continue;
-
-                        uint8_t m = im_max[(ty+dy)*tw+tx+dx];
-                        if (m > max)
-                            max = m;
-                        m = im_min[(ty+dy)*tw+tx+dx];
-                        if (m < min)
-                            min = m;
-                    }
-                }
+        for (int ty = 0; ty < th; ty++) {
+            int above = ty > 0 ? ty - 1 : ty;
+            int below = ty + 1 < th ? ty + 1 : ty;
 
-                im_max_tmp[ty*tw + tx] = max;
-                im_min_tmp[ty*tw + tx] = min;
-            }
+            filter3_row(&im_max_tmp[ty*tw], &im_max_tmp[above*tw], &im_max_tmp[below*tw], &im_max[ty*tw], tw, 1);
+            filter3_row(&im_min_tmp[ty*tw], &im_min_tmp[above*tw], &im_min_tmp[below*tw], &im_min[ty*tw], tw, 0);
         }
-        free(im_max);
-        free(im_min);
-        im_max = im_max_tmp;
-        im_min = im_min_tmp;
     }
 
     for (int ty = 0; ty < th; ty++) {
-        for (int tx = 0; tx < tw; tx++) {
-
-            int min = im_min[ty*tw + tx];
-            int max = im_max[ty*tw + tx];
-
-            // low contrast region? (no edges)
-            if (max - min < td->qtp.min_white_black_diff) {
-                for (int dy = 0; dy < tilesz; dy++) {
-                    int y = ty*tilesz + dy;
-
-                    for (int dx = 0; dx < tilesz; dx++) {
-                        int x = tx*tilesz + dx;
-
-                        threshim->buf[y*s+x] = 127;
-                    }
-                }
-                continue;
-            }
-
-            // otherwise, actually threshold this tile.
-
-            // argument for biasing towards dark; specular highlights
-            // can be substantially brighter than white tag parts
-            uint8_t thresh = min + (max - min) / 2;
-
-            for (int dy = 0; dy < tilesz; dy++) {
-                int y = ty*tilesz + dy;
-
-                for (int dx = 0; dx < tilesz; dx++) {
-                    int x = tx*tilesz + dx;
-
-                    uint8_t v = im->buf[y*s+x];
-                    if (v > thresh)
-                        threshim->buf[y*s+x] = 255;
-                    else
-                        threshim->buf[y*s+x] = 0;
-                }
-            }
-        }
+        binarize_tile_row(&im->buf[ty*tilesz*s], &threshim->buf[ty*tilesz*s], s, tw,
+                          &im_max[ty*tw], &im_min[ty*tw], td->qtp.min_white_black_diff,
+                          thresh_row, low_row);
     }
 
     // we skipped over the non-full-sized tiles above. Fix those now.
@@ -1269,13 +1553,11 @@ image_u8_t *threshold(apriltag_detector_t *td, image_u8_t *im)
         }
     }
 
-    free(im_min);
-    free(im_max);
-
     // this is a dilate/erode deglitching scheme that does not improve
     // anything as far as I can tell.
     if (td->qtp.deglitch) {
-        image_u8_t *tmp = image_u8_create(w, h);
+        image_u8_t *tmp = scratch_image_u8(td, w, h, s);
+        memset(tmp->buf, 0, (size_t) h * s);
 
         for (int y = 1; y + 1 < h; y++) {
             for (int x = 1; x + 1 < w; x++) {
@@ -1304,8 +1586,6 @@ image_u8_t *threshold(apriltag_detector_t *td, image_u8_t *im)
                 threshim->buf[y*s+x] = min;
             }
         }
-
-        image_u8_destroy(tmp);
     }
 
     timeprofile_stamp(td->tp, "threshold");
@@ -1432,246 +1712,335 @@ image_u8_t *threshold_bayer(apriltag_detector_t *td, image_u8_t *im)
     return threshim;
 }
 
-unionfind_t* connected_components(apriltag_detector_t *td, image_u8_t* threshim, int w, int h, int ts) {
-    unionfind_t *uf = unionfind_create(w * h);
+struct run_segmentation* connected_components(apriltag_detector_t *td, image_u8_t* threshim, int w, int h, int ts) {
+    struct run_segmentation *seg = arena_alloc(td->scratch, sizeof(struct run_segmentation));
+    seg->row_start = arena_alloc(td->scratch, (h + 1) * sizeof(uint32_t));
 
-    if (td->nthreads <= 1) {
-        do_unionfind_first_line(uf, threshim, h, w, ts);
-        for (int y = 1; y < h; y++) {
-            do_unionfind_line2(uf, threshim, h, w, ts, y);
-        }
-    } else {
-        do_unionfind_first_line(uf, threshim, h, w, ts);
-
-        int sz = h;
-        int chunksize = 1 + sz / (APRILTAG_TASKS_PER_THREAD_TARGET * td->nthreads);
-        struct unionfind_task *tasks = malloc(sizeof(struct unionfind_task)*(sz / chunksize + 1));
-
-        int ntasks = 0;
-
-        for (int i = 1; i < sz; i += chunksize) {
-            // each task will process [y0, y1). Note that this attaches
-            // each cell to the right and down, so row y1 *is* potentially modified.
-            //
-            // for parallelization, make sure that each task doesn't touch rows
-            // used by another thread.
-            tasks[ntasks].y0 = i;
-            tasks[ntasks].y1 = imin(sz, i + chunksize - 1);
-            tasks[ntasks].h = h;
-            tasks[ntasks].w = w;
-            tasks[ntasks].s = ts;
-            tasks[ntasks].uf = uf;
-            tasks[ntasks].im = threshim;
-
-            workerpool_add_task(td->wp, do_unionfind_task2, &tasks[ntasks]);
-            ntasks++;
-        }
+    int sz = h;
+    int chunksize = 1 + sz / (APRILTAG_TASKS_PER_THREAD_TARGET * td->nthreads);
 
-        workerpool_run(td->wp);
+    struct unionfind_task task;
+    task.h = h;
+    task.w = w;
+    task.s = ts;
+    task.seg = seg;
+    task.im = threshim;
 
-        // XXX stitch together the different chunks.
-        for (int i = 1; i < ntasks; i++) {
-            do_unionfind_line2(uf, threshim, h, w, ts, tasks[i].y0 - 1);
-        }
+    // the runs are stored in one array, so count them first to know
+    // where every row starts.
+    workerpool_parallel_for(td->wp, sz, chunksize, do_count_runs_task, &task);
+
+    seg->row_start[0] = 0;
+    for (int y = 0; y < h; y++)
+        seg->row_start[y+1] += seg->row_start[y];
+
+    uint32_t nruns = seg->row_start[h];
+    seg->runs = arena_alloc(td->scratch, nruns * sizeof(struct run));
+    seg->uf.maxid = nruns - 1;
+    seg->uf.data = arena_alloc(td->scratch, nruns * sizeof(struct ufrec));
+
+    workerpool_parallel_for(td->wp, sz, chunksize, do_fill_runs_task, &task);
+
+    // each chunk joins its rows with the row above, except for its first
+    // row. Those are stitched together afterwards so that no two tasks
+    // touch the same runs.
+    workerpool_parallel_for(td->wp, sz, chunksize, do_unionfind_task2, &task);
 
-        free(tasks);
+    for (int y = chunksize; y < sz; y += chunksize) {
+        do_unionfind_runs(seg, w, y);
     }
-    return uf;
+
+    return seg;
+}
+
+// representative of the pixel at column x of row y. cursor is the index
+// of a run of that row close to x, it is moved to the run containing x.
+static inline uint32_t run_representative(struct run_segmentation *seg, int y, int x, int *cursor)
+{
+    const struct run *runs = &seg->runs[seg->row_start[y]];
+
+    int k = *cursor;
+    while (runs[k].x1 < x)
+        k++;
+    while (runs[k].x0 > x)
+        k--;
+    *cursor = k;
+
+    return unionfind_get_representative(&seg->uf, seg->row_start[y] + k);
 }
 
-zarray_t* do_gradient_clusters(image_u8_t* threshim, int ts, int y0, int y1, int w, int nclustermap, unionfind_t* uf, zarray_t* clusters) {
-    struct uint64_zarray_entry **clustermap = calloc(nclustermap, sizeof(struct uint64_zarray_entry*));
+// appends the boundary points of rows [task->y0, task->y1) to the
+// task's block list.
+static void do_gradient_clusters(struct cluster_task *task) {
+    image_u8_t *threshim = task->im;
+    struct run_segmentation *seg = task->seg;
+    int ts = task->s, w = task->w;
+    int y0 = task->y0, y1 = task->y1;
 
-    int mem_chunk_size = 2048;
-    struct uint64_zarray_entry** mem_pools = malloc(sizeof(struct uint64_zarray_entry *)*(1 + 2 * nclustermap / mem_chunk_size)); // SmodeTech: avoid memory corruption when nclustermap < mem_chunk_size
-    int mem_pool_idx = 0;
-    int mem_pool_loc = 0;
-    mem_pools[mem_pool_idx] = calloc(mem_chunk_size, sizeof(struct uint64_zarray_entry));
+    struct cluster_block *block = arena_alloc(task->scratch, sizeof(struct cluster_block));
+    block->next = NULL;
+    block->n = 0;
+    task->first = block;
+    task->npoints = 0;
 
     for (int y = y0; y < y1; y++) {
-        for (int x = 1; x < w-1; x++) {
+        uint32_t row0 = seg->row_start[y];
+        const struct run *row = &seg->runs[row0];
+        int nrow = seg->row_start[y+1] - row0;
+
+        uint32_t below0 = seg->row_start[y+1];
+        const struct run *below = &seg->runs[below0];
+        int nbelow = seg->row_start[y+2] - below0;
+
+        int first_below = 0;
+        int cursor1 = 0;
 
-            uint8_t v0 = threshim->buf[y*ts + x];
+        for (int r = 0; r < nrow; r++) {
+            uint8_t v0 = row[r].v;
             if (v0 == 127)
                 continue;
 
-            // XXX don't query this until we know we need it?
-            uint64_t rep0 = unionfind_get_representative(uf, y*w + x);
-            if (unionfind_get_set_size(uf, rep0) < 25) {
+            int xs = imax(row[r].x0, 1);
+            int xe = imin(row[r].x1, w - 2);
+            if (xs > xe)
+                continue;
+
+            uint32_t rep0 = unionfind_get_representative(&seg->uf, row0 + r);
+            if (seg->uf.data[rep0].size < 25) {
                 continue;
             }
 
-            // whenever we find two adjacent pixels such that one is
-            // white and the other black, we add the point half-way
-            // between them to a cluster associated with the unique
-            // ids of the white and black regions.
-            //
-            // We additionally compute the gradient direction (i.e., which
-            // direction was the white pixel?) Note: if (v1-v0) == 255, then
-            // (dx,dy) points towards the white pixel. if (v1-v0) == -255, then
-            // (dx,dy) points towards the black pixel. p.gx and p.gy will thus
-            // be -255, 0, or 255.
-            //
-            // Note that any given pixel might be added to multiple
-            // different clusters. But in the common case, a given
-            // pixel will be added multiple times to the same cluster,
-            // which increases the size of the cluster and thus the
-            // computational costs.
-            //
-            // A possible optimization would be to combine entries
-            // within the same cluster.
-
-#define DO_CONN(dx, dy)                                                 \
-            if (1) {                                                    \
-                uint8_t v1 = threshim->buf[(y + dy)*ts + x + dx];       \
-                                                                        \
-                if (v0 + v1 == 255) {                                   \
-                    uint64_t rep1 = unionfind_get_representative(uf, (y + dy)*w + x + dx); \
-                    if (unionfind_get_set_size(uf, rep1) > 24) {        \
-                        uint64_t clusterid;                                 \
-                        if (rep0 < rep1)                                    \
-                            clusterid = (rep1 << 32) + rep0;                \
-                        else                                                \
-                            clusterid = (rep0 << 32) + rep1;                \
+            // only pixels next to a large region of the other colour
+            // can add points: the last one of the run, and the ones
+            // above or diagonally above such a run in the next row.
+            // Visit just those, in the same order as a full scan.
+            while (first_below < nbelow && below[first_below].x1 < xs - 1)
+                first_below++;
+
+            int k = first_below;
+            int cursor0 = r;
+            int next = xs;
+
+            while (next <= xe) {
+                while (k < nbelow && below[k].x0 <= xe + 1 &&
+                       !(below[k].v + v0 == 255 && unionfind_get_set_size(&seg->uf, below0 + k) > 24))
+                    k++;
+
+                int c0, c1;
+                if (k < nbelow && below[k].x0 <= xe + 1) {
+                    c0 = imax(below[k].x0 - 1, next);
+                    c1 = imin(below[k].x1 + 1, xe);
+                    k++;
+                } else {
+                    // nothing left below, only the right neighbour
+                    c0 = c1 = xe;
+                }
+
+                for (int x = c0; x <= c1; x++) {
+                    // whenever we find two adjacent pixels such that one is
+                    // white and the other black, we add the point half-way
+                    // between them to a cluster associated with the unique
+                    // ids of the white and black regions.
+                    //
+                    // We additionally compute the gradient direction (i.e., which
+                    // direction was the white pixel?) Note: if (v1-v0) == 255, then
+                    // (dx,dy) points towards the white pixel. if (v1-v0) == -255, then
+                    // (dx,dy) points towards the black pixel. p.gx and p.gy will thus
+                    // be -255, 0, or 255.
+                    //
+                    // Note that any given pixel might be added to multiple
+                    // different clusters. But in the common case, a given
+                    // pixel will be added multiple times to the same cluster,
+                    // which increases the size of the cluster and thus the
+                    // computational costs.
+                    //
+                    // A possible optimization would be to combine entries
+                    // within the same cluster.
+
+#define DO_CONN(dx, dy)                                             \
+                    if (1) {                                                \
+                        uint8_t v1 = threshim->buf[(y + dy)*ts + x + dx];   \
                                                                             \
-                        /* XXX lousy hash function */                       \
-                        uint32_t clustermap_bucket = u64hash_2(clusterid) % nclustermap; \
-                        struct uint64_zarray_entry *entry = clustermap[clustermap_bucket]; \
-                        while (entry && entry->id != clusterid) {           \
-                            entry = entry->next;                            \
-                        }                                                   \
+                        if (v0 + v1 == 255) {                               \
+                            uint32_t rep1 = run_representative(seg, y + dy, x + dx, dy ? &cursor1 : &cursor0); \
+                            if (seg->uf.data[rep1].size > 24) {             \
+                                uint64_t clusterid;                         \
+                                if (rep0 < rep1)                            \
+                                    clusterid = ((uint64_t) task->label[rep1] << task->label_bits) + task->label[rep0]; \
+                                else                                        \
+                                    clusterid = ((uint64_t) task->label[rep0] << task->label_bits) + task->label[rep1]; \
                                                                             \
-                        if (!entry) {                                       \
-                            if (mem_pool_loc == mem_chunk_size) {           \
-                                mem_pool_loc = 0;                           \
-                                mem_pool_idx++;                             \
-                                mem_pools[mem_pool_idx] = calloc(mem_chunk_size, sizeof(struct uint64_zarray_entry)); \
-                            }                                               \
-                            entry = mem_pools[mem_pool_idx] + mem_pool_loc; \
-                            mem_pool_loc++;                                 \
+                                if (block->n == (int) (sizeof(block->pts) / sizeof(block->pts[0]))) { \
+                                    block->next = arena_alloc(task->scratch, sizeof(struct cluster_block)); \
+                                    block = block->next;                    \
+                                    block->next = NULL;                     \
+                                    block->n = 0;                           \
+                                }                                           \
                                                                             \
-                            entry->id = clusterid;                          \
-                            entry->cluster = zarray_create(sizeof(struct pt)); \
-                            entry->next = clustermap[clustermap_bucket];    \
-                            clustermap[clustermap_bucket] = entry;          \
+                                struct cluster_point *cp = &block->pts[block->n++]; \
+                                cp->id = clusterid;                         \
+                                cp->x = 2*x + dx;                           \
+                                cp->y = 2*y + dy;                           \
+                                cp->gx = dx*((int) v1-v0);                  \
+                                cp->gy = dy*((int) v1-v0);                  \
+                            }                                               \
                         }                                                   \
-                                                                            \
-                        struct pt p = { .x = 2*x + dx, .y = 2*y + dy, .gx = dx*((int) v1-v0), .gy = dy*((int) v1-v0)}; \
-                        zarray_add(entry->cluster, &p);                     \
-                    }                                                   \
-                }                                                       \
-            }
-
-            // do 4 connectivity. NB: Arguments must be [-1, 1] or we'll overflow .gx, .gy
-            DO_CONN(1, 0);
-            DO_CONN(0, 1);
+                    }
 
-            // do 8 connectivity
-            DO_CONN(-1, 1);
-            DO_CONN(1, 1);
-        }
-    }
-#undef DO_CONN
+                    // do 4 connectivity. NB: Arguments must be [-1, 1] or we'll overflow .gx, .gy
+                    DO_CONN(1, 0);
+                    DO_CONN(0, 1);
 
-    for (int i = 0; i < nclustermap; i++) {
-        int start = zarray_size(clusters);
-        for (struct uint64_zarray_entry *entry = clustermap[i]; entry; entry = entry->next) {
-            struct cluster_hash* cluster_hash = malloc(sizeof(struct cluster_hash));
-            cluster_hash->hash = u64hash_2(entry->id) % nclustermap;
-            cluster_hash->id = entry->id;
-            cluster_hash->data = entry->cluster;
-            zarray_add(clusters, &cluster_hash);
-        }
-        int end = zarray_size(clusters);
-
-        // Do a quick bubblesort on the secondary key.
-        int n = end - start;
-        for (int j = 0; j < n - 1; j++) {
-            for (int k = 0; k < n - j - 1; k++) {
-                struct cluster_hash* hash1;
-                struct cluster_hash* hash2;
-                zarray_get(clusters, start + k, &hash1);
-                zarray_get(clusters, start + k + 1, &hash2);
-                if (hash1->id > hash2->id) {
-                    struct cluster_hash tmp = *hash2;
-                    *hash2 = *hash1;
-                    *hash1 = tmp;
+                    // do 8 connectivity
+                    DO_CONN(-1, 1);
+                    DO_CONN(1, 1);
                 }
+
+                next = imax(next, c1 + 1);
             }
         }
     }
-    for (int i = 0; i <= mem_pool_idx; i++) {
-        free(mem_pools[i]);
-    }
-    free(mem_pools);
-    free(clustermap);
+#undef DO_CONN
 
-    return clusters;
+    for (block = task->first; block; block = block->next)
+        task->npoints += block->n;
 }
 
 static void do_cluster_task(void *p)
 {
-    struct cluster_task *task = (struct cluster_task*) p;
+    do_gradient_clusters((struct cluster_task*) p);
+}
 
-    do_gradient_clusters(task->im, task->s, task->y0, task->y1, task->w, task->nclustermap, task->uf, task->clusters);
+static inline void radix_put(struct radix_task *task, const struct cluster_point *cp)
+{
+    uint32_t pos = task->counts[(cp->id >> task->shift) & ((1u << task->bits) - 1)]++;
+
+    if (task->out) {
+        task->out[pos] = *cp;
+    } else {
+        task->out_pts[pos] = (struct pt) { .x = cp->x, .y = cp->y, .gx = cp->gx, .gy = cp->gy };
+        task->out_ids[pos] = cp->id;
+    }
 }
 
-zarray_t* merge_clusters(zarray_t* c1, zarray_t* c2) {
-    zarray_t* ret = zarray_create(sizeof(struct cluster_hash*));
-    zarray_ensure_capacity(ret, zarray_size(c1) + zarray_size(c2));
-
-    int i1 = 0;
-    int i2 = 0;
-    int l1 = zarray_size(c1);
-    int l2 = zarray_size(c2);
-
-    while (i1 < l1 && i2 < l2) {
-        struct cluster_hash* h1;
-        struct cluster_hash* h2;
-        zarray_get(c1, i1, &h1);
-        zarray_get(c2, i2, &h2);
-
-        if (h1->hash == h2->hash && h1->id == h2->id) {
-            zarray_add_all(h1->data, h2->data);
-            zarray_add(ret, &h1);
-            i1++;
-            i2++;
-            zarray_destroy(h2->data);
-            free(h2);
-        } else if (h2->hash < h1->hash || (h2->hash == h1->hash && h2->id < h1->id)) {
-            zarray_add(ret, &h2);
-            i2++;
-        } else {
-            zarray_add(ret, &h1);
-            i1++;
-        }
+static void do_radix_count_task(void *p)
+{
+    struct radix_task *task = (struct radix_task*) p;
+    uint32_t mask = (1u << task->bits) - 1;
+
+    memset(task->counts, 0, RADIX_BUCKETS * sizeof(uint32_t));
+    if (task->blocks) {
+        for (const struct cluster_block *block = task->blocks; block; block = block->next)
+            for (int i = 0; i < block->n; i++)
+                task->counts[(block->pts[i].id >> task->shift) & mask]++;
+    } else {
+        for (int i = task->i0; i < task->i1; i++)
+            task->counts[(task->in[i].id >> task->shift) & mask]++;
     }
+}
+
+static void do_radix_scatter_task(void *p)
+{
+    struct radix_task *task = (struct radix_task*) p;
 
-    for (; i1 < l1; i1++) {
-        struct cluster_hash* h1;
-        zarray_get(c1, i1, &h1);
-        zarray_add(ret, &h1);
+    if (task->blocks) {
+        for (const struct cluster_block *block = task->blocks; block; block = block->next)
+            for (int i = 0; i < block->n; i++)
+                radix_put(task, &block->pts[i]);
+    } else {
+        for (int i = task->i0; i < task->i1; i++)
+            radix_put(task, &task->in[i]);
     }
+}
 
-    for (; i2 < l2; i2++) {
-        struct cluster_hash* h2;
-        zarray_get(c2, i2, &h2);
-        zarray_add(ret, &h2);
+// Stable LSD radix sort of the points of all cluster tasks by id, with
+// one slice per task. Since the tasks cover the rows in order, the
+// points of each cluster stay in the order of a single full scan.
+static void radix_sort_points(apriltag_detector_t *td, struct cluster_task *ctasks, int ntasks, int npoints, int key_bits,
+                              struct pt *pts, uint64_t *ids)
+{
+    int npasses = (key_bits + RADIX_BITS - 1) / RADIX_BITS;
+    int bits = (key_bits + npasses - 1) / npasses;
+
+    struct cluster_point *bufs[2] = { NULL, NULL };
+    if (npasses > 1) {
+        bufs[0] = arena_alloc(td->scratch, npoints * sizeof(struct cluster_point));
+        if (npasses > 2)
+            bufs[1] = arena_alloc(td->scratch, npoints * sizeof(struct cluster_point));
     }
 
-    zarray_destroy(c1);
-    zarray_destroy(c2);
+    struct radix_task *tasks = arena_alloc(td->scratch, ntasks * sizeof(struct radix_task));
+    int offset = 0;
+    for (int t = 0; t < ntasks; t++) {
+        tasks[t].i0 = offset;
+        tasks[t].i1 = offset += ctasks[t].npoints;
+        tasks[t].bits = bits;
+        tasks[t].counts = arena_alloc(td->scratch, RADIX_BUCKETS * sizeof(uint32_t));
+    }
 
-    return ret;
+    for (int pass = 0; pass < npasses; pass++) {
+        for (int t = 0; t < ntasks; t++) {
+            tasks[t].blocks = pass == 0 ? ctasks[t].first : NULL;
+            tasks[t].in = pass == 0 ? NULL : bufs[(pass - 1) & 1];
+            tasks[t].out = pass == npasses - 1 ? NULL : bufs[pass & 1];
+            tasks[t].out_pts = pts;
+            tasks[t].out_ids = ids;
+            tasks[t].shift = pass * bits;
+            workerpool_add_task(td->wp, do_radix_count_task, &tasks[t]);
+        }
+        workerpool_run(td->wp);
+
+        // bucket by bucket, every slice gets the next range of the
+        // output, which keeps equal keys in their input order.
+        uint32_t pos = 0;
+        for (int d = 0; d < (1 << bits); d++) {
+            for (int t = 0; t < ntasks; t++) {
+                uint32_t c = tasks[t].counts[d];
+                tasks[t].counts[d] = pos;
+                pos += c;
+            }
+        }
+
+        for (int t = 0; t < ntasks; t++)
+            workerpool_add_task(td->wp, do_radix_scatter_task, &tasks[t]);
+        workerpool_run(td->wp);
+    }
 }
 
-zarray_t* gradient_clusters(apriltag_detector_t *td, image_u8_t* threshim, int w, int h, int ts, unionfind_t* uf) {
-    zarray_t* clusters;
-    int nclustermap = 0.2*w*h;
+// a zarray_t header over existing memory, so that code written for
+// zarrays can read it. It must not be grown or destroyed.
+static zarray_t *zarray_view(arena_t *scratch, void *data, size_t el_sz, int size)
+{
+    zarray_t *za = arena_alloc(scratch, sizeof(zarray_t));
+    za->el_sz = el_sz;
+    za->size = size;
+    za->alloc = size;
+    za->data = data;
+    return za;
+}
+
+// Collects the boundary points between every pair of neighbouring
+// black and white regions. The result is a zarray of clusters, each a
+// zarray of struct pt. All of it lives in the scratch arena: the points
+// of a cluster are a contiguous slice of one array sorted by region pair.
+zarray_t* gradient_clusters(apriltag_detector_t *td, image_u8_t* threshim, int w, int h, int ts, struct run_segmentation* seg) {
+    // number the regions that can form clusters, keeping their order, so
+    // that a pair of them makes a short sort key.
+    uint32_t nruns = seg->uf.maxid + 1;
+    uint32_t *label = arena_alloc(td->scratch, nruns * sizeof(uint32_t));
+    uint32_t nlabels = 0;
+    for (uint32_t i = 0; i < nruns; i++) {
+        if (seg->uf.data[i].parent == i && seg->uf.data[i].size > 24)
+            label[i] = nlabels++;
+    }
+
+    int label_bits = 1;
+    while (label_bits < 32 && (1u << label_bits) < nlabels)
+        label_bits++;
 
     int sz = h - 1;
     int chunksize = 1 + sz / td->nthreads;
-    struct cluster_task *tasks = malloc(sizeof(struct cluster_task)*(sz / chunksize + 1));
+    struct cluster_task *tasks = arena_alloc(td->scratch, sizeof(struct cluster_task)*(sz / chunksize + 1));
 
     int ntasks = 0;
 
@@ -1682,10 +2051,11 @@ zarray_t* gradient_clusters(apriltag_detector_t *td, image_u8_t* threshim, int w
         tasks[ntasks].y1 = imin(sz, i + chunksize);
         tasks[ntasks].w = w;
         tasks[ntasks].s = ts;
-        tasks[ntasks].uf = uf;
+        tasks[ntasks].seg = seg;
         tasks[ntasks].im = threshim;
-        tasks[ntasks].nclustermap = nclustermap/(sz / chunksize + 1);
-        tasks[ntasks].clusters = zarray_create(sizeof(struct cluster_hash*));
+        tasks[ntasks].scratch = td->scratch;
+        tasks[ntasks].label = label;
+        tasks[ntasks].label_bits = label_bits;
 
         workerpool_add_task(td->wp, do_cluster_task, &tasks[ntasks]);
         ntasks++;
@@ -1693,38 +2063,33 @@ zarray_t* gradient_clusters(apriltag_detector_t *td, image_u8_t* threshim, int w
 
     workerpool_run(td->wp);
 
-    zarray_t** clusters_list = malloc(sizeof(zarray_t *)*ntasks);
-    for (int i = 0; i < ntasks; i++) {
-        clusters_list[i] = tasks[i].clusters;
+    int npoints = 0;
+    for (int i = 0; i < ntasks; i++)
+        npoints += tasks[i].npoints;
+
+    struct pt *pts = arena_alloc(td->scratch, npoints * sizeof(struct pt));
+    uint64_t *ids = arena_alloc(td->scratch, npoints * sizeof(uint64_t));
+    radix_sort_points(td, tasks, ntasks, npoints, 2 * label_bits, pts, ids);
+
+    int nclusters = 0;
+    for (int i = 0; i < npoints; i++) {
+        if (i == 0 || ids[i] != ids[i-1])
+            nclusters++;
     }
 
-    int length = ntasks;
-    while (length > 1) {
-        int write = 0;
-        for (int i = 0; i < length - 1; i += 2) {
-            clusters_list[write] = merge_clusters(clusters_list[i], clusters_list[i + 1]);
-            write++;
-        }
+    zarray_t **cluster_list = arena_alloc(td->scratch, nclusters * sizeof(zarray_t*));
 
-        if (length % 2) {
-            clusters_list[write] = clusters_list[length - 1];
-        }
+    int c = 0;
+    for (int i = 0; i < npoints; ) {
+        int j = i + 1;
+        while (j < npoints && ids[j] == ids[i])
+            j++;
 
-        length = (length >> 1) + length % 2;
+        cluster_list[c++] = zarray_view(td->scratch, &pts[i], sizeof(struct pt), j - i);
+        i = j;
     }
 
-    clusters = zarray_create(sizeof(zarray_t*));
-    zarray_ensure_capacity(clusters, zarray_size(clusters_list[0]));
-    for (int i = 0; i < zarray_size(clusters_list[0]); i++) {
-        struct cluster_hash* hash;
-        zarray_get(clusters_list[0], i, &hash);
-        zarray_add(clusters, &hash->data);
-        free(hash);
-    }
-    zarray_destroy(clusters_list[0]);
-    free(clusters_list);
-    free(tasks);
-    return clusters;
+    return zarray_view(td->scratch, cluster_list, sizeof(zarray_t*), nclusters);
 }
 
 zarray_t* fit_quads(apriltag_detector_t *td, int w, int h, zarray_t* clusters, image_u8_t* im) {
@@ -1749,29 +2114,19 @@ zarray_t* fit_quads(apriltag_detector_t *td, int w, int h, zarray_t* clusters, i
 
     int sz = zarray_size(clusters);
     int chunksize = 1 + sz / (APRILTAG_TASKS_PER_THREAD_TARGET * td->nthreads);
-    struct quad_task *tasks = malloc(sizeof(struct quad_task)*(sz / chunksize + 1));
-
-    int ntasks = 0;
-    for (int i = 0; i < sz; i += chunksize) {
-        tasks[ntasks].td = td;
-        tasks[ntasks].cidx0 = i;
-        tasks[ntasks].cidx1 = imin(sz, i + chunksize);
-        tasks[ntasks].h = h;
-        tasks[ntasks].w = w;
-        tasks[ntasks].quads = quads;
-        tasks[ntasks].clusters = clusters;
-        tasks[ntasks].im = im;
-        tasks[ntasks].tag_width = min_tag_width;
-        tasks[ntasks].normal_border = normal_border;
-        tasks[ntasks].reversed_border = reversed_border;
-
-        workerpool_add_task(td->wp, do_quad_task, &tasks[ntasks]);
-        ntasks++;
-    }
 
-    workerpool_run(td->wp);
+    struct quad_task task;
+    task.td = td;
+    task.h = h;
+    task.w = w;
+    task.quads = quads;
+    task.clusters = clusters;
+    task.im = im;
+    task.tag_width = min_tag_width;
+    task.normal_border = normal_border;
+    task.reversed_border = reversed_border;
 
-    free(tasks);
+    workerpool_parallel_for(td->wp, sz, chunksize, do_quad_task, &task);
 
     return quads;
 }
@@ -1792,19 +2147,19 @@ zarray_t *apriltag_quad_thresh(apriltag_detector_t *td, image_u8_t *im)
 
     ////////////////////////////////////////////////////////
     // step 2. find connected components.
-    unionfind_t* uf = connected_components(td, threshim, w, h, ts);
+    struct run_segmentation* seg = connected_components(td, threshim, w, h, ts);
 
     // make segmentation image.
     if (td->debug) {
         image_u8x3_t *d = image_u8x3_create(w, h);
 
-        uint32_t *colors = (uint32_t*) calloc(w*h, sizeof(*colors));
+        uint32_t *colors = (uint32_t*) calloc(seg->row_start[h], sizeof(*colors));
 
         for (int y = 0; y < h; y++) {
-            for (int x = 0; x < w; x++) {
-                uint32_t v = unionfind_get_representative(uf, y*w+x);
+            for (uint32_t run = seg->row_start[y]; run < seg->row_start[y+1]; run++) {
+                uint32_t v = unionfind_get_representative(&seg->uf, run);
 
-                if (unionfind_get_set_size(uf, v) < td->qtp.min_cluster_pixels)
+                if (unionfind_get_set_size(&seg->uf, v) < td->qtp.min_cluster_pixels)
                     continue;
 
                 uint32_t color = colors[v];
@@ -1820,9 +2175,11 @@ zarray_t *apriltag_quad_thresh(apriltag_detector_t *td, image_u8_t *im)
                     colors[v] = (r << 16) | (g << 8) | b;
                 }
 
-                d->buf[y*d->stride + 3*x + 0] = r;
-                d->buf[y*d->stride + 3*x + 1] = g;
-                d->buf[y*d->stride + 3*x + 2] = b;
+                for (int x = seg->runs[run].x0; x <= seg->runs[run].x1; x++) {
+                    d->buf[y*d->stride + 3*x + 0] = r;
+                    d->buf[y*d->stride + 3*x + 1] = g;
+                    d->buf[y*d->stride + 3*x + 2] = b;
+                }
             }
         }
 
@@ -1835,7 +2192,7 @@ zarray_t *apriltag_quad_thresh(apriltag_detector_t *td, image_u8_t *im)
 
     timeprofile_stamp(td->tp, "unionfind");
 
-    zarray_t* clusters = gradient_clusters(td, threshim, w, h, ts, uf);
+    zarray_t* clusters = gradient_clusters(td, threshim, w, h, ts, seg);
 
     if (td->debug) {
         image_u8x3_t *d = image_u8x3_create(w, h);
@@ -1870,9 +2227,10 @@ zarray_t *apriltag_quad_thresh(apriltag_detector_t *td, image_u8_t *im)
     }
 
 
-    image_u8_destroy(threshim);
     timeprofile_stamp(td->tp, "make clusters");
 
+    td->nclusters += zarray_size(clusters);
+
     ////////////////////////////////////////////////////////
     // step 3. process each connected component.
 
@@ -1920,14 +2278,5 @@ zarray_t *apriltag_quad_thresh(apriltag_detector_t *td, image_u8_t *im)
 
     timeprofile_stamp(td->tp, "fit quads to clusters");
 
-    unionfind_destroy(uf);
-
-    for (int i = 0; i < zarray_size(clusters); i++) {
-        zarray_t *cluster;
-        zarray_get(clusters, i, &cluster);
-        zarray_destroy(cluster);
-    }
-    zarray_destroy(clusters);
-
     return quads;
 }
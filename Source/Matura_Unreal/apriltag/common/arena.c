@@ -0,0 +1,122 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define ARENA_ALIGN 16
+
+struct arena_block
+{
+    struct arena_block *next;
+    size_t size;
+    // followed by the payload, aligned to ARENA_ALIGN
+};
+
+static size_t align_up(size_t v)
+{
+    return (v + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+}
+
+static const size_t block_header_size = (sizeof(struct arena_block) + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+
+arena_t *arena_create(size_t initial_size)
+{
+    arena_t *arena = calloc(1, sizeof(arena_t));
+    if (arena == NULL)
+        return NULL;
+
+    pthread_mutex_init(&arena->mutex, NULL);
+
+    if (initial_size > 0) {
+        arena->buf = malloc(initial_size);
+        arena->size = arena->buf ? initial_size : 0;
+        arena->nmallocs++;
+    }
+
+    return arena;
+}
+
+static void free_overflow(arena_t *arena)
+{
+    struct arena_block *block = arena->overflow;
+    while (block) {
+        struct arena_block *next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->overflow = NULL;
+    arena->overflow_used = 0;
+}
+
+void arena_destroy(arena_t *arena)
+{
+    if (arena == NULL)
+        return;
+
+    free_overflow(arena);
+    free(arena->buf);
+    pthread_mutex_destroy(&arena->mutex);
+    free(arena);
+}
+
+void *arena_alloc(arena_t *arena, size_t size)
+{
+    size = align_up(size > 0 ? size : 1);
+
+    pthread_mutex_lock(&arena->mutex);
+
+    void *p = NULL;
+    if (arena->used + size <= arena->size) {
+        p = arena->buf + arena->used;
+        arena->used += size;
+    } else {
+        // the main block is full. Keep going in an extra block of its
+        // own; reset will make room for all of it next time.
+        struct arena_block *block = malloc(block_header_size + size);
+        arena->nmallocs++;
+        if (block) {
+            block->size = size;
+            block->next = arena->overflow;
+            arena->overflow = block;
+            arena->overflow_used += size;
+            p = (uint8_t*) block + block_header_size;
+        }
+    }
+
+    size_t total = arena->used + arena->overflow_used;
+    if (total > arena->high_water)
+        arena->high_water = total;
+
+    pthread_mutex_unlock(&arena->mutex);
+
+    return p;
+}
+
+void *arena_calloc(arena_t *arena, size_t nmemb, size_t size)
+{
+    void *p = arena_alloc(arena, nmemb * size);
+    if (p)
+        memset(p, 0, nmemb * size);
+    return p;
+}
+
+void arena_reset(arena_t *arena)
+{
+    pthread_mutex_lock(&arena->mutex);
+
+    if (arena->overflow) {
+        free_overflow(arena);
+
+        // grow to the largest frame seen so far, with some headroom so
+        // that slowly growing frames don't reallocate every time.
+        size_t size = align_up(arena->high_water + arena->high_water / 4);
+        free(arena->buf);
+        arena->buf = malloc(size);
+        arena->size = arena->buf ? size : 0;
+        arena->nmallocs++;
+    }
+
+    arena->used = 0;
+
+    pthread_mutex_unlock(&arena->mutex);
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pthreads_cross.h"
+
+// Bump allocator for per-frame scratch memory. Allocations are only
+// released all at once by arena_reset(). When a frame needs more than
+// the current block, extra blocks are malloc'd and merged into a
+// single larger block on the next reset, so after the first few frames
+// the arena stops touching the heap altogether.
+//
+// arena_alloc() may be called from several worker threads at once.
+typedef struct arena arena_t;
+
+struct arena_block;
+
+struct arena
+{
+    uint8_t *buf;
+    size_t size;
+    size_t used;
+
+    // blocks allocated because buf was full, freed on reset.
+    struct arena_block *overflow;
+    size_t overflow_used;
+
+    // largest amount of memory handed out between two resets.
+    size_t high_water;
+
+    // number of malloc calls made by the arena since creation.
+    uint64_t nmallocs;
+
+    pthread_mutex_t mutex;
+};
+
+arena_t *arena_create(size_t initial_size);
+void arena_destroy(arena_t *arena);
+
+// returns 16 byte aligned, uninitialized memory. Only returns NULL if
+// the system is out of memory.
+void *arena_alloc(arena_t *arena, size_t size);
+
+// like arena_alloc, but the memory is zeroed.
+void *arena_calloc(arena_t *arena, size_t nmemb, size_t size);
+
+// invalidates everything allocated since the last reset.
+void arena_reset(arena_t *arena);
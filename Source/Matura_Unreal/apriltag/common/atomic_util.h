@@ -0,0 +1,28 @@
+#pragma once
+
+#include "pthreads_cross.h"
+
+// Minimal atomics for state shared between detectors, and a spin lock
+// built on them for process-wide state that can't have a statically
+// initialized mutex (pthreads_cross has no PTHREAD_MUTEX_INITIALIZER).
+
+#ifdef _WIN32
+typedef volatile LONG atomic_counter_t;
+static inline long atomic_add(atomic_counter_t *p, long v) { return InterlockedExchangeAdd(p, v) + v; }
+static inline long atomic_read(atomic_counter_t *p) { return InterlockedCompareExchange(p, 0, 0); }
+static inline int atomic_try_lock(atomic_counter_t *p) { return InterlockedCompareExchange(p, 1, 0) == 0; }
+static inline void atomic_unlock(atomic_counter_t *p) { InterlockedExchange(p, 0); }
+#else
+typedef volatile long atomic_counter_t;
+static inline long atomic_add(atomic_counter_t *p, long v) { return __atomic_add_fetch(p, v, __ATOMIC_ACQ_REL); }
+static inline long atomic_read(atomic_counter_t *p) { return __atomic_load_n(p, __ATOMIC_ACQUIRE); }
+static inline int atomic_try_lock(atomic_counter_t *p) { return __atomic_exchange_n(p, 1, __ATOMIC_ACQUIRE) == 0; }
+static inline void atomic_unlock(atomic_counter_t *p) { __atomic_store_n(p, 0, __ATOMIC_RELEASE); }
+#endif
+
+// yields rather than spins, the lock may be held for a while.
+static inline void atomic_lock(atomic_counter_t *p)
+{
+    while (!atomic_try_lock(p))
+        sched_yield();
+}
@@ -31,6 +31,7 @@ either expressed or implied, of the Regents of The University of Michigan.
 #include "zarray.h"
 #include "homography.h"
 #include "math_util.h"
+#include "svd33.h"
 
 // correspondences is a list of float[4]s, consisting of the points x
 // and y concatenated. We will compute a homography such that y = Hx
@@ -280,7 +281,7 @@ matd_t *homography_compute(zarray_t *correspondences, int flags)
 // R21 = H21
 // TZ  = H22
 
-matd_t *homography_to_pose(const matd_t *H, double fx, double fy, double cx, double cy)
+void homography_to_pose_rt(const matd_t *H, double fx, double fy, double cx, double cy, double R[9], double T[3])
 {
 	// Note that every variable that we compute is proportional to the scale factor of H.
 	double R20 = MATD_EL(H, 2, 0);
@@ -326,31 +327,38 @@ matd_t *homography_to_pose(const matd_t *H, double fx, double fy, double cx, dou
 		// "proper", but probably increases the reprojection error. An
 		// iterative alignment step would be superior.
 
-		matd_t *R = matd_create_data(3, 3, (double[]){R00, R01, R02, R10, R11, R12, R20, R21, R22});
+		double A[9] = {R00, R01, R02, R10, R11, R12, R20, R21, R22};
 
-		matd_svd_t svd = matd_svd(R);
-		matd_destroy(R);
+		double U[9], S[3], V[9];
+		svd33(A, U, S, V);
 
-		R = matd_op("M*M'", svd.U, svd.V);
+		// R = U*V'
+		for (int i = 0; i < 3; i++)
+		{
+			for (int j = 0; j < 3; j++)
+			{
+				R[3 * i + j] = U[3 * i] * V[3 * j] + U[3 * i + 1] * V[3 * j + 1] + U[3 * i + 2] * V[3 * j + 2];
+			}
+		}
+	}
+	else
+	{
+		double A[9] = {R00, R01, R02, R10, R11, R12, R20, R21, R22};
+		for (int i = 0; i < 9; i++)
+			R[i] = A[i];
+	}
 
-		matd_destroy(svd.U);
-		matd_destroy(svd.S);
-		matd_destroy(svd.V);
+	T[0] = TX;
+	T[1] = TY;
+	T[2] = TZ;
+}
 
-		R00 = MATD_EL(R, 0, 0);
-		R01 = MATD_EL(R, 0, 1);
-		R02 = MATD_EL(R, 0, 2);
-		R10 = MATD_EL(R, 1, 0);
-		R11 = MATD_EL(R, 1, 1);
-		R12 = MATD_EL(R, 1, 2);
-		R20 = MATD_EL(R, 2, 0);
-		R21 = MATD_EL(R, 2, 1);
-		R22 = MATD_EL(R, 2, 2);
-
-		matd_destroy(R);
-	}
+matd_t *homography_to_pose(const matd_t *H, double fx, double fy, double cx, double cy)
+{
+	double R[9], T[3];
+	homography_to_pose_rt(H, fx, fy, cx, cy, R, T);
 
-	return matd_create_data(4, 4, (double[]){R00, R01, R02, TX, R10, R11, R12, TY, R20, R21, R22, TZ, 0, 0, 0, 1});
+	return matd_create_data(4, 4, (double[]){R[0], R[1], R[2], T[0], R[3], R[4], R[5], T[1], R[6], R[7], R[8], T[2], 0, 0, 0, 1});
 }
 
 // Similar to above
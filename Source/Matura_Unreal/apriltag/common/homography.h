@@ -168,6 +168,10 @@ extern "C"
 	// TZ  = H22
 	matd_t *homography_to_pose(const matd_t *H, double fx, double fy, double cx, double cy);
 
+	// same as homography_to_pose, but writes R (row-major 3x3) and T
+	// into caller provided arrays instead of allocating a matrix.
+	void homography_to_pose_rt(const matd_t *H, double fx, double fy, double cx, double cy, double R[9], double T[3]);
+
 	// Similar to above
 	// Recover the model view matrix assuming that the projection matrix is:
 	//
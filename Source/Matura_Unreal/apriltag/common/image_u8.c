@@ -327,63 +327,272 @@ void image_u8_darken(image_u8_t *im)
 	}
 }
 
-static void convolve(const uint8_t *x, uint8_t *y, int sz, const uint8_t *k, int ksz)
+// Vector helpers for the filters and decimation, picked at compile time
+// like the ones in apriltag_quad_thresh.c. The sums are kept in 16 bit
+// lanes, which is exact as long as the kernel sums to at most 255 (true
+// for every kernel made by gaussian_kernel); the scalar code is used for
+// all other kernels and for the ends of the lines.
+#if defined(__SSE2__) || defined(_M_X64)
+#define IMAGE_U8_SSE2
+#include <emmintrin.h>
+#if defined(__AVX2__)
+#define IMAGE_U8_AVX2
+#include <immintrin.h>
+#endif
+#elif defined(__ARM_NEON)
+#define IMAGE_U8_NEON
+#include <arm_neon.h>
+#endif
+
+// dst[i] = (sum_j k[j] * src[j][i]) >> 8 for i in [0, n). Works on rows
+// (src[j] = x + j) and on columns (src[j] = row j) alike.
+static void convolve_span(const uint8_t *const *src, uint8_t *dst, int n, const uint8_t *k, int ksz, int exact16)
 {
-	assert((ksz & 1) == 1);
+	int i = 0;
 
-	for (int i = 0; i < ksz / 2 && i < sz; i++)
-		y[i] = x[i];
+	if (exact16)
+	{
+#if defined(IMAGE_U8_AVX2)
+		const __m256i zero = _mm256_setzero_si256();
+		for (; i + 32 <= n; i += 32)
+		{
+			__m256i lo = zero, hi = zero;
+			for (int j = 0; j < ksz; j++)
+			{
+				__m256i x = _mm256_loadu_si256((const __m256i *)(src[j] + i));
+				__m256i kj = _mm256_set1_epi16(k[j]);
+				lo = _mm256_add_epi16(lo, _mm256_mullo_epi16(_mm256_unpacklo_epi8(x, zero), kj));
+				hi = _mm256_add_epi16(hi, _mm256_mullo_epi16(_mm256_unpackhi_epi8(x, zero), kj));
+			}
+			// unpack and pack both work per 128 bit lane, so the order is kept
+			_mm256_storeu_si256((__m256i *)(dst + i),
+			                    _mm256_packus_epi16(_mm256_srli_epi16(lo, 8), _mm256_srli_epi16(hi, 8)));
+		}
+#endif
+#if defined(IMAGE_U8_SSE2)
+		const __m128i zero128 = _mm_setzero_si128();
+		for (; i + 16 <= n; i += 16)
+		{
+			__m128i lo = zero128, hi = zero128;
+			for (int j = 0; j < ksz; j++)
+			{
+				__m128i x = _mm_loadu_si128((const __m128i *)(src[j] + i));
+				__m128i kj = _mm_set1_epi16(k[j]);
+				lo = _mm_add_epi16(lo, _mm_mullo_epi16(_mm_unpacklo_epi8(x, zero128), kj));
+				hi = _mm_add_epi16(hi, _mm_mullo_epi16(_mm_unpackhi_epi8(x, zero128), kj));
+			}
+			_mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8)));
+		}
+#elif defined(IMAGE_U8_NEON)
+		for (; i + 16 <= n; i += 16)
+		{
+			uint16x8_t lo = vdupq_n_u16(0), hi = vdupq_n_u16(0);
+			for (int j = 0; j < ksz; j++)
+			{
+				uint8x16_t x = vld1q_u8(src[j] + i);
+				uint8x8_t kj = vdup_n_u8(k[j]);
+				lo = vmlal_u8(lo, vget_low_u8(x), kj);
+				hi = vmlal_u8(hi, vget_high_u8(x), kj);
+			}
+			vst1q_u8(dst + i, vcombine_u8(vshrn_n_u16(lo, 8), vshrn_n_u16(hi, 8)));
+		}
+#endif
+	}
 
-	for (int i = 0; i < sz - ksz; i++)
+	for (; i < n; i++)
 	{
 		uint32_t acc = 0;
 
 		for (int j = 0; j < ksz; j++)
-			acc += k[j] * x[i + j];
+			acc += k[j] * src[j][i];
+
+		dst[i] = acc >> 8;
+	}
+}
+
+// dst[i] = clamp(2 * orig[i] - blur[i], 0, 255)
+static void sharpen_span(const uint8_t *orig, const uint8_t *blur, uint8_t *dst, int n)
+{
+	int i = 0;
+
+#if defined(IMAGE_U8_SSE2)
+	const __m128i zero = _mm_setzero_si128();
+	for (; i + 16 <= n; i += 16)
+	{
+		__m128i o = _mm_loadu_si128((const __m128i *)(orig + i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(blur + i));
+		__m128i olo = _mm_unpacklo_epi8(o, zero), ohi = _mm_unpackhi_epi8(o, zero);
+		__m128i lo = _mm_sub_epi16(_mm_add_epi16(olo, olo), _mm_unpacklo_epi8(b, zero));
+		__m128i hi = _mm_sub_epi16(_mm_add_epi16(ohi, ohi), _mm_unpackhi_epi8(b, zero));
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(lo, hi)); // saturates to [0, 255]
+	}
+#elif defined(IMAGE_U8_NEON)
+	for (; i + 16 <= n; i += 16)
+	{
+		uint8x16_t o = vld1q_u8(orig + i);
+		uint8x16_t b = vld1q_u8(blur + i);
+		int16x8_t lo = vreinterpretq_s16_u16(vsubl_u8(vget_low_u8(o), vget_low_u8(b)));
+		int16x8_t hi = vreinterpretq_s16_u16(vsubl_u8(vget_high_u8(o), vget_high_u8(b)));
+		lo = vaddq_s16(lo, vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(o))));
+		hi = vaddq_s16(hi, vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(o))));
+		vst1q_u8(dst + i, vcombine_u8(vqmovun_s16(lo), vqmovun_s16(hi)));
+	}
+#endif
+
+	for (; i < n; i++)
+	{
+		int v = 2 * orig[i] - blur[i];
+		if (v < 0)
+			v = 0;
+		if (v > 255)
+			v = 255;
+		dst[i] = (uint8_t)v;
+	}
+}
+
+// dst[i] = src[i * factor] for i in [0, n)
+static void decimate_span(const uint8_t *src, uint8_t *dst, int n, int factor)
+{
+	int i = 0;
+
+#if defined(IMAGE_U8_SSE2)
+	// a vector reads up to factor - 1 bytes past its last sample, so one
+	// sample is always left to the scalar loop.
+	if (factor == 2)
+	{
+		const __m128i mask = _mm_set1_epi16(0xff);
+		for (; i + 17 <= n; i += 16)
+		{
+			__m128i a = _mm_and_si128(_mm_loadu_si128((const __m128i *)(src + 2 * i)), mask);
+			__m128i b = _mm_and_si128(_mm_loadu_si128((const __m128i *)(src + 2 * i + 16)), mask);
+			_mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(a, b));
+		}
+	}
+	else if (factor == 4)
+	{
+		const __m128i mask = _mm_set1_epi32(0xff);
+		for (; i + 17 <= n; i += 16)
+		{
+			const uint8_t *p = src + 4 * i;
+			__m128i a = _mm_and_si128(_mm_loadu_si128((const __m128i *)(p + 0)), mask);
+			__m128i b = _mm_and_si128(_mm_loadu_si128((const __m128i *)(p + 16)), mask);
+			__m128i c = _mm_and_si128(_mm_loadu_si128((const __m128i *)(p + 32)), mask);
+			__m128i d = _mm_and_si128(_mm_loadu_si128((const __m128i *)(p + 48)), mask);
+			_mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d)));
+		}
+	}
+#elif defined(IMAGE_U8_NEON)
+	if (factor == 2)
+	{
+		for (; i + 17 <= n; i += 16)
+			vst1q_u8(dst + i, vld2q_u8(src + 2 * i).val[0]);
+	}
+	else if (factor == 4)
+	{
+		for (; i + 17 <= n; i += 16)
+			vst1q_u8(dst + i, vld4q_u8(src + 4 * i).val[0]);
+	}
+#endif
+
+	for (; i < n; i++)
+		dst[i] = src[i * factor];
+}
 
-		y[ksz / 2 + i] = acc >> 8;
+// Convolves a line of sz values with an odd kernel. The first ksz/2 and
+// the last ksz/2+1 values are copied.
+static void convolve_line(const uint8_t *x, uint8_t *y, int sz, const uint8_t *k, int ksz, int exact16,
+                          const uint8_t **src)
+{
+	for (int i = 0; i < ksz / 2 && i < sz; i++)
+		y[i] = x[i];
+
+	if (sz > ksz)
+	{
+		for (int j = 0; j < ksz; j++)
+			src[j] = x + j;
+		convolve_span(src, y + ksz / 2, sz - ksz, k, ksz, exact16);
 	}
 
-	for (int i = sz - ksz + ksz / 2; i < sz; i++)
+	for (int i = imax(sz - ksz + ksz / 2, 0); i < sz; i++)
 		y[i] = x[i];
 }
 
-void image_u8_convolve_2D(image_u8_t *im, const uint8_t *k, int ksz)
+// Blurs (or sharpens) every factor'th pixel of in into out, so out may
+// be in itself for factor 1 and is in decimated otherwise. Rows are
+// filtered into a temporary image and its columns are then filtered
+// row-wise, so both passes run along memory.
+static void gaussian_filter(const image_u8_t *in, int factor, image_u8_t *out, const uint8_t *k, int ksz, int sharpen)
 {
 	assert((ksz & 1) == 1); // ksz must be odd.
 
-	for (int y = 0; y < im->height; y++)
-	{
+	int width = out->width, height = out->height;
+
+	int ksum = 0;
+	for (int j = 0; j < ksz; j++)
+		ksum += k[j];
+	int exact16 = ksum <= 255;
+
+	image_u8_t *tmp = image_u8_create(width, height);
+	uint8_t *line = malloc(2 * width);
+	uint8_t *row = line, *blur = line + width;
+	const uint8_t **src = malloc(sizeof(uint8_t *) * ksz);
 
-		uint8_t *x = malloc(sizeof(uint8_t) * im->stride);
-		memcpy(x, &im->buf[y * im->stride], im->stride);
+	for (int y = 0; y < height; y++)
+	{
+		const uint8_t *in_row = &in->buf[y * factor * in->stride];
+		if (factor > 1)
+		{
+			decimate_span(in_row, row, width, factor);
+			in_row = row;
+		}
 
-		convolve(x, &im->buf[y * im->stride], im->width, k, ksz);
-		free(x);
+		convolve_line(in_row, &tmp->buf[y * tmp->stride], width, k, ksz, exact16, src);
 	}
 
-	for (int x = 0; x < im->width; x++)
+	for (int y = 0; y < height; y++)
 	{
-		uint8_t *xb = malloc(sizeof(uint8_t) * im->height);
-		uint8_t *yb = malloc(sizeof(uint8_t) * im->height);
+		uint8_t *out_row = &out->buf[y * out->stride];
+		uint8_t *dst = sharpen ? blur : out_row;
 
-		for (int y = 0; y < im->height; y++)
-			xb[y] = im->buf[y * im->stride + x];
+		if (y < ksz / 2 || y >= height - ksz + ksz / 2)
+		{
+			memcpy(dst, &tmp->buf[y * tmp->stride], width);
+		}
+		else
+		{
+			for (int j = 0; j < ksz; j++)
+				src[j] = &tmp->buf[(y - ksz / 2 + j) * tmp->stride];
+			convolve_span(src, dst, width, k, ksz, exact16);
+		}
 
-		convolve(xb, yb, im->height, k, ksz);
-		free(xb);
+		if (sharpen)
+		{
+			// out is only written here, so for out == in the row still
+			// holds the original.
+			const uint8_t *orig = &in->buf[y * factor * in->stride];
+			if (factor > 1)
+			{
+				decimate_span(orig, row, width, factor);
+				orig = row;
+			}
 
-		for (int y = 0; y < im->height; y++)
-			im->buf[y * im->stride + x] = yb[y];
-		free(yb);
+			sharpen_span(orig, blur, out_row, width);
+		}
 	}
+
+	free(src);
+	free(line);
+	image_u8_destroy(tmp);
 }
 
-void image_u8_gaussian_blur(image_u8_t *im, double sigma, int ksz)
+void image_u8_convolve_2D(image_u8_t *im, const uint8_t *k, int ksz)
 {
-	if (sigma == 0)
-		return;
+	gaussian_filter(im, 1, im, k, ksz, 0);
+}
 
+// k must hold ksz values.
+static void gaussian_kernel(double sigma, int ksz, uint8_t *k)
+{
 	assert((ksz & 1) == 1); // ksz must be odd.
 
 	// build the kernel.
@@ -406,7 +615,6 @@ void image_u8_gaussian_blur(image_u8_t *im, double sigma, int ksz)
 	for (int i = 0; i < ksz; i++)
 		dk[i] /= acc;
 
-	uint8_t *k = malloc(sizeof(uint8_t) * ksz);
 	for (int i = 0; i < ksz; i++)
 		k[i] = dk[i] * 255;
 
@@ -416,11 +624,56 @@ void image_u8_gaussian_blur(image_u8_t *im, double sigma, int ksz)
 			printf("%d %15f %5d\n", i, dk[i], k[i]);
 	}
 	free(dk);
+}
 
-	image_u8_convolve_2D(im, k, ksz);
+void image_u8_gaussian_blur(image_u8_t *im, double sigma, int ksz)
+{
+	if (sigma == 0)
+		return;
+
+	uint8_t *k = malloc(sizeof(uint8_t) * ksz);
+	gaussian_kernel(sigma, ksz, k);
+
+	gaussian_filter(im, 1, im, k, ksz, 0);
+	free(k);
+}
+
+void image_u8_gaussian_sharpen(image_u8_t *im, double sigma, int ksz)
+{
+	if (sigma == 0)
+		return;
+
+	uint8_t *k = malloc(sizeof(uint8_t) * ksz);
+	gaussian_kernel(sigma, ksz, k);
+
+	gaussian_filter(im, 1, im, k, ksz, 1);
 	free(k);
 }
 
+image_u8_t *image_u8_decimate_gaussian(const image_u8_t *im, int factor, double sigma, int ksz)
+{
+	assert(factor >= 1);
+
+	int swidth = 1 + (im->width - 1) / factor;
+	int sheight = 1 + (im->height - 1) / factor;
+	image_u8_t *decim = image_u8_create(swidth, sheight);
+
+	if (sigma == 0 || ksz <= 1)
+	{
+		for (int sy = 0; sy < sheight; sy++)
+			decimate_span(&im->buf[sy * factor * im->stride], &decim->buf[sy * decim->stride], swidth, factor);
+		return decim;
+	}
+
+	uint8_t *k = malloc(sizeof(uint8_t) * ksz);
+	gaussian_kernel(fabs(sigma), ksz, k);
+
+	gaussian_filter(im, factor, decim, k, ksz, sigma < 0);
+	free(k);
+
+	return decim;
+}
+
 image_u8_t *image_u8_rotate(const image_u8_t *in, double rad, uint8_t pad)
 {
 	int iwidth = in->width, iheight = in->height;
@@ -484,66 +737,83 @@ image_u8_t *image_u8_decimate(image_u8_t *im, float ffactor)
 
 		image_u8_t *decim = image_u8_create(swidth, sheight);
 
-		int y = 0, sy = 0;
-		while (sy < sheight)
+		// Every 3x3 block
+		//
+		// a b c
+		// d e f
+		// g h i
+		//
+		// becomes the 2x2 block
+		//
+		// (4a + 2b + 2d + e) / 9   (4c + 2b + 2f + e) / 9
+		// (4g + 2d + 2h + e) / 9   (4i + 2f + 2h + e) / 9
+		//
+		// which is separable: 4a + 2b + 2d + e = 2 (2a + b) + (2d + e).
+		// So every row is reduced horizontally to (2a + b, 2c + b) pairs
+		// first, and three of those rows are then combined vertically.
+		uint16_t *h = malloc(sizeof(uint16_t) * 3 * swidth);
+		uint16_t *h0 = h, *h1 = h + swidth, *h2 = h + 2 * swidth;
+
+		for (int sy = 0; sy < sheight; sy += 2)
 		{
-			int x = 0, sx = 0;
-			while (sx < swidth)
+			uint16_t *hr[3] = {h0, h1, h2};
+			for (int r = 0; r < 3; r++)
 			{
-
-				// a b c
-				// d e f
-				// g h i
-				uint8_t a = im->buf[(y + 0) * im->stride + (x + 0)];
-				uint8_t b = im->buf[(y + 0) * im->stride + (x + 1)];
-				uint8_t c = im->buf[(y + 0) * im->stride + (x + 2)];
-
-				uint8_t d = im->buf[(y + 1) * im->stride + (x + 0)];
-				uint8_t e = im->buf[(y + 1) * im->stride + (x + 1)];
-				uint8_t f = im->buf[(y + 1) * im->stride + (x + 2)];
-
-				uint8_t g = im->buf[(y + 2) * im->stride + (x + 0)];
-				uint8_t h = im->buf[(y + 2) * im->stride + (x + 1)];
-				uint8_t i = im->buf[(y + 2) * im->stride + (x + 2)];
-
-				decim->buf[(sy + 0) * decim->stride + (sx + 0)] =
-					(4 * a + 2 * b + 2 * d + e) / 9;
-				decim->buf[(sy + 0) * decim->stride + (sx + 1)] =
-					(4 * c + 2 * b + 2 * f + e) / 9;
-
-				decim->buf[(sy + 1) * decim->stride + (sx + 0)] =
-					(4 * g + 2 * d + 2 * h + e) / 9;
-				decim->buf[(sy + 1) * decim->stride + (sx + 1)] =
-					(4 * i + 2 * f + 2 * h + e) / 9;
-
-				x += 3;
-				sx += 2;
+				const uint8_t *p = &im->buf[(sy / 2 * 3 + r) * im->stride];
+				for (int sx = 0; sx < swidth; sx += 2, p += 3)
+				{
+					hr[r][sx + 0] = 2 * p[0] + p[1];
+					hr[r][sx + 1] = 2 * p[2] + p[1];
+				}
 			}
 
-			y += 3;
-			sy += 2;
+			uint8_t *top = &decim->buf[sy * decim->stride];
+			uint8_t *bottom = &decim->buf[(sy + 1) * decim->stride];
+			int sx = 0;
+
+			// x / 9 == (x * 7282) >> 16 for all x <= 9 * 255
+#if defined(IMAGE_U8_SSE2)
+			const __m128i div9 = _mm_set1_epi16(7282);
+			for (; sx + 16 <= swidth; sx += 16)
+			{
+				__m128i t[2], b[2];
+				for (int v = 0; v < 2; v++)
+				{
+					__m128i v0 = _mm_loadu_si128((const __m128i *)(h0 + sx + 8 * v));
+					__m128i v1 = _mm_loadu_si128((const __m128i *)(h1 + sx + 8 * v));
+					__m128i v2 = _mm_loadu_si128((const __m128i *)(h2 + sx + 8 * v));
+					t[v] = _mm_mulhi_epu16(_mm_add_epi16(_mm_add_epi16(v0, v0), v1), div9);
+					b[v] = _mm_mulhi_epu16(_mm_add_epi16(_mm_add_epi16(v2, v2), v1), div9);
+				}
+				_mm_storeu_si128((__m128i *)(top + sx), _mm_packus_epi16(t[0], t[1]));
+				_mm_storeu_si128((__m128i *)(bottom + sx), _mm_packus_epi16(b[0], b[1]));
+			}
+#elif defined(IMAGE_U8_NEON)
+			for (; sx + 8 <= swidth; sx += 8)
+			{
+				uint16x8_t v0 = vld1q_u16(h0 + sx), v1 = vld1q_u16(h1 + sx), v2 = vld1q_u16(h2 + sx);
+				uint16x8_t t = vaddq_u16(vaddq_u16(v0, v0), v1);
+				uint16x8_t b = vaddq_u16(vaddq_u16(v2, v2), v1);
+				uint16x4_t t_lo = vshrn_n_u32(vmull_n_u16(vget_low_u16(t), 7282), 16);
+				uint16x4_t t_hi = vshrn_n_u32(vmull_n_u16(vget_high_u16(t), 7282), 16);
+				uint16x4_t b_lo = vshrn_n_u32(vmull_n_u16(vget_low_u16(b), 7282), 16);
+				uint16x4_t b_hi = vshrn_n_u32(vmull_n_u16(vget_high_u16(b), 7282), 16);
+				vst1_u8(top + sx, vmovn_u16(vcombine_u16(t_lo, t_hi)));
+				vst1_u8(bottom + sx, vmovn_u16(vcombine_u16(b_lo, b_hi)));
+			}
+#endif
+			for (; sx < swidth; sx++)
+			{
+				top[sx] = (2 * h0[sx] + h1[sx]) / 9;
+				bottom[sx] = (2 * h2[sx] + h1[sx]) / 9;
+			}
 		}
 
+		free(h);
 		return decim;
 	}
 
-	int factor = (int)ffactor;
-
-	int swidth = 1 + (width - 1) / factor;
-	int sheight = 1 + (height - 1) / factor;
-	image_u8_t *decim = image_u8_create(swidth, sheight);
-	int sy = 0;
-	for (int y = 0; y < height; y += factor)
-	{
-		int sx = 0;
-		for (int x = 0; x < width; x += factor)
-		{
-			decim->buf[sy * decim->stride + sx] = im->buf[y * im->stride + x];
-			sx++;
-		}
-		sy++;
-	}
-	return decim;
+	return image_u8_decimate_gaussian(im, (int)ffactor, 0, 1);
 }
 
 void image_u8_fill_line_max(image_u8_t *im, const image_u8_lut_t *lut, const float *xy0, const float *xy1)
@@ -69,9 +69,16 @@ extern "C"
 	void image_u8_darken(image_u8_t *im);
 	void image_u8_convolve_2D(image_u8_t *im, const uint8_t *k, int ksz);
 	void image_u8_gaussian_blur(image_u8_t *im, double sigma, int k);
+	// im = 2 * im - blur(im)
+	void image_u8_gaussian_sharpen(image_u8_t *im, double sigma, int k);
 
 	// 1.5, 2, 3, 4, ... supported
 	image_u8_t *image_u8_decimate(image_u8_t *im, float factor);
+	// Decimates by an integer factor and blurs (sigma > 0) or sharpens
+	// (sigma < 0) the result in one pass, without creating the
+	// decimated image first. Same output as image_u8_decimate followed
+	// by image_u8_gaussian_blur / _sharpen.
+	image_u8_t *image_u8_decimate_gaussian(const image_u8_t *im, int factor, double sigma, int k);
 
 	void image_u8_destroy(image_u8_t *im);
 
@@ -0,0 +1,71 @@
+#include <stdlib.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "mmap_file.h"
+
+mmap_file_t *mmap_file_open(const char *path)
+{
+    const void *data = NULL;
+    size_t size = 0;
+
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return NULL;
+
+    LARGE_INTEGER file_size;
+    if (GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0) {
+        // the view keeps the mapping (and the file) open by itself.
+        HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping != NULL) {
+            data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            size = (size_t) file_size.QuadPart;
+            CloseHandle(mapping);
+        }
+    }
+    CloseHandle(file);
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void *p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (p != MAP_FAILED) {
+            data = p;
+            size = st.st_size;
+        }
+    }
+    close(fd);
+#endif
+
+    if (data == NULL)
+        return NULL;
+
+    mmap_file_t *mf = malloc(sizeof(mmap_file_t));
+    mf->data = data;
+    mf->size = size;
+    return mf;
+}
+
+void mmap_file_close(mmap_file_t *mf)
+{
+    if (mf == NULL)
+        return;
+
+#ifdef _WIN32
+    UnmapViewOfFile(mf->data);
+#else
+    munmap((void *) mf->data, mf->size);
+#endif
+    free(mf);
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stddef.h>
+
+// A whole file mapped read-only into memory. Pages are only read from
+// disk when first touched and are shared between processes mapping the
+// same file.
+typedef struct mmap_file mmap_file_t;
+struct mmap_file
+{
+    const void *data;
+    size_t size;
+};
+
+// returns NULL if the file doesn't exist, is empty or can't be mapped.
+mmap_file_t *mmap_file_open(const char *path);
+
+void mmap_file_close(mmap_file_t *mf);
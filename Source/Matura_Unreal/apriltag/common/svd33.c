@@ -0,0 +1,143 @@
+#include <float.h>
+#include <math.h>
+
+#include "svd33.h"
+
+/** SVD 3x3.
+
+    One-sided Jacobi (Hestenes): rotate pairs of columns of W = A*V
+    until all columns are orthogonal. Each rotation is computed in
+    closed form from the 2x2 Gram matrix of its column pair, so the
+    input is never squared as a whole. A 3x3 matrix converges in 3-6
+    sweeps; the sweep count is bounded so the cost is fixed.
+
+    Afterwards the column norms of W are the singular values and the
+    normalized columns are U.
+ **/
+
+#define SVD33_MAX_SWEEPS 16
+
+static void swap_columns(double M[9], int a, int b)
+{
+    for (int i = 0; i < 3; i++) {
+        double tmp = M[3*i + a];
+        M[3*i + a] = M[3*i + b];
+        M[3*i + b] = tmp;
+    }
+}
+
+static void cross(const double a[3], const double b[3], double r[3])
+{
+    r[0] = a[1]*b[2] - a[2]*b[1];
+    r[1] = a[2]*b[0] - a[0]*b[2];
+    r[2] = a[0]*b[1] - a[1]*b[0];
+}
+
+void svd33(const double A[9], double U[9], double S[3], double V[9])
+{
+    double W[9];
+    for (int i = 0; i < 9; i++) {
+        W[i] = A[i];
+        V[i] = (i % 4 == 0) ? 1 : 0;
+    }
+
+    static const int pairs[3][2] = { { 0, 1 }, { 0, 2 }, { 1, 2 } };
+
+    for (int sweep = 0; sweep < SVD33_MAX_SWEEPS; sweep++) {
+        int rotated = 0;
+
+        for (int k = 0; k < 3; k++) {
+            int p = pairs[k][0], q = pairs[k][1];
+
+            double alpha = 0, beta = 0, gamma = 0;
+            for (int i = 0; i < 3; i++) {
+                alpha += W[3*i + p] * W[3*i + p];
+                beta += W[3*i + q] * W[3*i + q];
+                gamma += W[3*i + p] * W[3*i + q];
+            }
+
+            if (fabs(gamma) <= DBL_EPSILON * sqrt(alpha * beta))
+                continue;
+
+            // the rotation that zeros gamma, taking the smaller angle.
+            double zeta = (beta - alpha) / (2 * gamma);
+            double t = (zeta >= 0 ? 1 : -1) / (fabs(zeta) + sqrt(1 + zeta*zeta));
+            double c = 1 / sqrt(1 + t*t);
+            double s = c * t;
+
+            for (int i = 0; i < 3; i++) {
+                double wp = W[3*i + p], wq = W[3*i + q];
+                W[3*i + p] = c*wp - s*wq;
+                W[3*i + q] = s*wp + c*wq;
+
+                double vp = V[3*i + p], vq = V[3*i + q];
+                V[3*i + p] = c*vp - s*vq;
+                V[3*i + q] = s*vp + c*vq;
+            }
+            rotated = 1;
+        }
+
+        if (!rotated)
+            break;
+    }
+
+    for (int j = 0; j < 3; j++)
+        S[j] = sqrt(W[j]*W[j] + W[3 + j]*W[3 + j] + W[6 + j]*W[6 + j]);
+
+    // sort decreasing, three elements.
+    for (int a = 0; a < 2; a++) {
+        for (int b = a + 1; b < 3; b++) {
+            if (S[b] > S[a]) {
+                double tmp = S[a];
+                S[a] = S[b];
+                S[b] = tmp;
+                swap_columns(W, a, b);
+                swap_columns(V, a, b);
+            }
+        }
+    }
+
+    // columns with a (numerically) zero singular value carry no
+    // direction; complete them from the others instead.
+    double tiny = S[0] * 8 * DBL_EPSILON;
+    double u[3][3];
+    int rank = 0;
+    for (int j = 0; j < 3; j++) {
+        if (S[j] <= tiny || S[j] == 0)
+            break;
+        for (int i = 0; i < 3; i++)
+            u[j][i] = W[3*i + j] / S[j];
+        rank++;
+    }
+
+    if (rank == 0) {
+        u[0][0] = 1; u[0][1] = 0; u[0][2] = 0;
+        rank = 1;
+    }
+
+    if (rank == 1) {
+        // any unit vector orthogonal to u[0], crossing it with the axis
+        // it is least aligned with.
+        double axis[3] = { 0, 0, 0 };
+        int m = 0;
+        for (int i = 1; i < 3; i++) {
+            if (fabs(u[0][i]) < fabs(u[0][m]))
+                m = i;
+        }
+        axis[m] = 1;
+
+        cross(u[0], axis, u[1]);
+        double n = sqrt(u[1][0]*u[1][0] + u[1][1]*u[1][1] + u[1][2]*u[1][2]);
+        for (int i = 0; i < 3; i++)
+            u[1][i] /= n;
+        rank = 2;
+    }
+
+    if (rank == 2)
+        cross(u[0], u[1], u[2]);
+
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++)
+            U[3*i + j] = u[j][i];
+    }
+}
@@ -0,0 +1,7 @@
+#pragma once
+
+// SVD of a 3x3 matrix, all matrices row-major: A = U * diag(S) * V'.
+// S is sorted in decreasing order, U and V are orthonormal. If A is
+// rank deficient, the missing columns of U are completed so that U is
+// still a rotation or reflection.
+void svd33(const double A[9], double U[9], double S[3], double V[9]);
@@ -49,15 +49,22 @@ struct ufrec
     uint32_t size;
 };
 
-static inline unionfind_t *unionfind_create(uint32_t maxid)
+// sets up uf on caller provided memory for maxid+1 records, so the
+// storage can be reused between runs. Don't unionfind_destroy it.
+static inline void unionfind_init(unionfind_t *uf, uint32_t maxid, struct ufrec *data)
 {
-    unionfind_t *uf = (unionfind_t*) calloc(1, sizeof(unionfind_t));
     uf->maxid = maxid;
-    uf->data = (struct ufrec*) malloc((maxid+1) * sizeof(struct ufrec));
+    uf->data = data;
     for (uint32_t i = 0; i <= maxid; i++) {
         uf->data[i].size = 1;
         uf->data[i].parent = i;
     }
+}
+
+static inline unionfind_t *unionfind_create(uint32_t maxid)
+{
+    unionfind_t *uf = (unionfind_t*) calloc(1, sizeof(unionfind_t));
+    unionfind_init(uf, maxid, (struct ufrec*) malloc((maxid+1) * sizeof(struct ufrec)));
     return uf;
 }
 
@@ -30,8 +30,10 @@ either expressed or implied, of the Regents of The University of Michigan.
 #define __USE_GNU
 #include "pthreads_cross.h"
 #include <assert.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #ifdef _WIN32
 #include <windows.h>
 #else
@@ -39,68 +41,339 @@ either expressed or implied, of the Regents of The University of Michigan.
 #endif
 
 #include "workerpool.h"
+#include "atomic_util.h"
 #include "debug_print.h"
 
+// All workerpools with more than one thread share a single set of
+// worker threads, one less than the number of processors since the
+// thread calling workerpool_run helps out. Every worker owns a deque of
+// tasks: it takes work from the back of its own deque and, once that
+// is empty, steals from the front of the others. Each deque has its own
+// lock, so threads only contend when they touch the same deque.
+// Only the first nactive workers are handed tasks and steal, the
+// others just finish what they already have and sleep, which bounds
+// how many cores all pools together use.
+
+struct task
+{
+	void (*f)(void *p);
+
+	// set instead of f for workerpool_parallel_for chunks.
+	void (*range_f)(void *p, int i0, int i1);
+	int i0, i1;
+
+	void *p;
+	workerpool_t *wp;
+};
+
+// ring buffer of tasks, guarded by its own mutex.
+struct task_deque
+{
+	pthread_mutex_t mutex;
+	struct task *tasks;
+	int alloc;
+	int head, size;
+};
+
+struct scheduler
+{
+	int nworkers; // and deques
+	int nstarted;
+	atomic_counter_t nactive;
+	pthread_t *threads;
+	struct task_deque *deques;
+
+	// idle workers sleep on wakecond. epoch changes whenever new tasks
+	// are pushed, so a worker only goes to sleep if nothing was pushed
+	// since it last looked.
+	pthread_mutex_t mutex;
+	pthread_cond_t wakecond;
+	int nsleeping;
+	uint64_t epoch;
+	int stop;
+
+	int refcount;
+};
+
 struct workerpool
 {
 	int nthreads;
 	zarray_t *tasks;
-	int taskspos;
 
-	pthread_t *threads;
-	int *status;
+	struct scheduler *sched;
 
+	// tasks of the current run that haven't finished yet.
+	atomic_counter_t remaining;
 	pthread_mutex_t mutex;
-	pthread_cond_t startcond; // used to signal the availability of work
-	pthread_cond_t endcond;	  // used to signal completion of all work
-
-	int end_count; // how many threads are done?
+	pthread_cond_t endcond; // used to signal completion of all work
 };
 
-struct task
+static struct scheduler *shared_sched;
+static atomic_counter_t shared_sched_lock;
+// set by workerpool_set_shared_workers, negative for all of them.
+static int shared_workers_limit = -1;
+
+static void deque_push(struct task_deque *dq, const struct task *tasks, int n)
 {
-	void (*f)(void *p);
-	void *p;
+	pthread_mutex_lock(&dq->mutex);
+
+	if (dq->size + n > dq->alloc)
+	{
+		int alloc = dq->alloc ? dq->alloc : 64;
+		while (alloc < dq->size + n)
+			alloc *= 2;
+
+		struct task *grown = malloc(alloc * sizeof(struct task));
+		for (int i = 0; i < dq->size; i++)
+			grown[i] = dq->tasks[(dq->head + i) % dq->alloc];
+		free(dq->tasks);
+		dq->tasks = grown;
+		dq->alloc = alloc;
+		dq->head = 0;
+	}
+
+	for (int i = 0; i < n; i++)
+		dq->tasks[(dq->head + dq->size + i) % dq->alloc] = tasks[i];
+	dq->size += n;
+
+	pthread_mutex_unlock(&dq->mutex);
+}
+
+// takes the newest task, for the owner of the deque.
+static int deque_pop(struct task_deque *dq, struct task *task)
+{
+	int found = 0;
+
+	pthread_mutex_lock(&dq->mutex);
+	if (dq->size > 0)
+	{
+		dq->size--;
+		*task = dq->tasks[(dq->head + dq->size) % dq->alloc];
+		found = 1;
+	}
+	pthread_mutex_unlock(&dq->mutex);
+
+	return found;
+}
+
+// takes the oldest task or, if wp is not NULL, the oldest task of wp.
+static int deque_steal(struct task_deque *dq, struct task *task, const workerpool_t *wp)
+{
+	int found = 0;
+
+	pthread_mutex_lock(&dq->mutex);
+	for (int i = 0; i < dq->size; i++)
+	{
+		struct task *t = &dq->tasks[(dq->head + i) % dq->alloc];
+		if (wp != NULL && t->wp != wp)
+			continue;
+
+		// fill the hole with the front task, order doesn't matter.
+		*task = *t;
+		*t = dq->tasks[dq->head];
+		dq->head = (dq->head + 1) % dq->alloc;
+		dq->size--;
+		found = 1;
+		break;
+	}
+	pthread_mutex_unlock(&dq->mutex);
+
+	return found;
+}
+
+static void run_task(struct task *task)
+{
+	if (task->range_f)
+		task->range_f(task->p, task->i0, task->i1);
+	else
+		task->f(task->p);
+
+	// the last task may be followed by workerpool_destroy as soon as
+	// the caller sees remaining reach 0, so that only happens while
+	// holding the mutex workerpool_run takes once before returning.
+	workerpool_t *wp = task->wp;
+	pthread_mutex_lock(&wp->mutex);
+	if (atomic_add(&wp->remaining, -1) == 0)
+		pthread_cond_broadcast(&wp->endcond);
+	pthread_mutex_unlock(&wp->mutex);
+}
+
+// own deque first, then the others starting with the next one.
+static int find_task(struct scheduler *sched, int self, struct task *task)
+{
+	if (deque_pop(&sched->deques[self], task))
+		return 1;
+
+	if (self >= atomic_read(&sched->nactive))
+		return 0;
+
+	for (int i = 1; i < sched->nworkers; i++)
+	{
+		if (deque_steal(&sched->deques[(self + i) % sched->nworkers], task, NULL))
+			return 1;
+	}
+
+	return 0;
+}
+
+struct worker_arg
+{
+	struct scheduler *sched;
+	int self;
 };
 
 void *worker_thread(void *p)
 {
-	workerpool_t *wp = (workerpool_t *)p;
+	struct worker_arg arg = *(struct worker_arg *)p;
+	struct scheduler *sched = arg.sched;
+	free(p);
 
-	int cnt = 0;
+	struct task task;
 
 	while (1)
 	{
-		struct task *task;
-
-		pthread_mutex_lock(&wp->mutex);
-		while (wp->taskspos == zarray_size(wp->tasks))
+		if (find_task(sched, arg.self, &task))
 		{
-			wp->end_count++;
-			//          printf("%"PRId64" thread %d did %d\n", utime_now(), pthread_self(), cnt);
-			pthread_cond_broadcast(&wp->endcond);
-			pthread_cond_wait(&wp->startcond, &wp->mutex);
-			cnt = 0;
-			//            printf("%"PRId64" thread %d awake\n", utime_now(), pthread_self());
+			run_task(&task);
+			continue;
 		}
 
-		zarray_get_volatile(wp->tasks, wp->taskspos, &task);
-		wp->taskspos++;
-		cnt++;
-		pthread_mutex_unlock(&wp->mutex);
-		//        pthread_yield();
-		sched_yield();
+		pthread_mutex_lock(&sched->mutex);
+		uint64_t epoch = sched->epoch;
+		int stop = sched->stop;
+		pthread_mutex_unlock(&sched->mutex);
 
-		// we've been asked to exit.
-		if (task->f == NULL)
+		if (stop)
 			return NULL;
 
-		task->f(task->p);
+		// look again: anything pushed after this point bumps the epoch.
+		if (find_task(sched, arg.self, &task))
+		{
+			run_task(&task);
+			continue;
+		}
+
+		pthread_mutex_lock(&sched->mutex);
+		if (sched->epoch == epoch && !sched->stop)
+		{
+			sched->nsleeping++;
+			pthread_cond_wait(&sched->wakecond, &sched->mutex);
+			sched->nsleeping--;
+		}
+		pthread_mutex_unlock(&sched->mutex);
 	}
 
 	return NULL;
 }
 
+static void scheduler_destroy(struct scheduler *sched);
+
+static struct scheduler *scheduler_create(int nworkers)
+{
+	struct scheduler *sched = calloc(1, sizeof(struct scheduler));
+	sched->threads = calloc(nworkers, sizeof(pthread_t));
+	sched->deques = calloc(nworkers, sizeof(struct task_deque));
+
+	pthread_mutex_init(&sched->mutex, NULL);
+	pthread_cond_init(&sched->wakecond, NULL);
+
+	sched->nworkers = nworkers;
+	for (int i = 0; i < nworkers; i++)
+		pthread_mutex_init(&sched->deques[i].mutex, NULL);
+
+	for (int i = 0; i < nworkers; i++)
+	{
+		struct worker_arg *arg = malloc(sizeof(struct worker_arg));
+		arg->sched = sched;
+		arg->self = i;
+
+		int res = pthread_create(&sched->threads[i], NULL, worker_thread, arg);
+		if (res != 0)
+		{
+			debug_print("Insufficient system resources to create workerpool threads\n");
+			// errno already set to EAGAIN by pthread_create() failure
+			free(arg);
+			scheduler_destroy(sched);
+			return NULL;
+		}
+
+		sched->nstarted++;
+	}
+
+	return sched;
+}
+
+static void scheduler_destroy(struct scheduler *sched)
+{
+	pthread_mutex_lock(&sched->mutex);
+	sched->stop = 1;
+	pthread_cond_broadcast(&sched->wakecond);
+	pthread_mutex_unlock(&sched->mutex);
+
+	for (int i = 0; i < sched->nstarted; i++)
+		pthread_join(sched->threads[i], NULL);
+
+	for (int i = 0; i < sched->nworkers; i++)
+	{
+		pthread_mutex_destroy(&sched->deques[i].mutex);
+		free(sched->deques[i].tasks);
+	}
+
+	pthread_mutex_destroy(&sched->mutex);
+	pthread_cond_destroy(&sched->wakecond);
+	free(sched->deques);
+	free(sched->threads);
+	free(sched);
+}
+
+// called with shared_sched_lock held.
+static void scheduler_set_active(struct scheduler *sched, int limit)
+{
+	long nactive = limit < 0 || limit > sched->nworkers ? sched->nworkers : limit;
+	atomic_add(&sched->nactive, nactive - atomic_read(&sched->nactive));
+
+	// workers that are allowed to run again may be asleep.
+	pthread_mutex_lock(&sched->mutex);
+	sched->epoch++;
+	if (sched->nsleeping > 0)
+		pthread_cond_broadcast(&sched->wakecond);
+	pthread_mutex_unlock(&sched->mutex);
+}
+
+// the shared scheduler lives while at least one workerpool uses it.
+static struct scheduler *scheduler_acquire(void)
+{
+	atomic_lock(&shared_sched_lock);
+
+	if (shared_sched == NULL)
+	{
+		int nprocs = workerpool_get_nprocs();
+		shared_sched = scheduler_create(nprocs > 1 ? nprocs - 1 : 1);
+		if (shared_sched)
+			scheduler_set_active(shared_sched, shared_workers_limit);
+	}
+
+	struct scheduler *sched = shared_sched;
+	if (sched)
+		sched->refcount++;
+
+	atomic_unlock(&shared_sched_lock);
+	return sched;
+}
+
+static void scheduler_release(struct scheduler *sched)
+{
+	atomic_lock(&shared_sched_lock);
+
+	if (--sched->refcount == 0)
+	{
+		scheduler_destroy(sched);
+		shared_sched = NULL;
+	}
+
+	atomic_unlock(&shared_sched_lock);
+}
+
 workerpool_t *workerpool_create(int nthreads)
 {
 	assert(nthreads > 0);
@@ -111,22 +384,16 @@ workerpool_t *workerpool_create(int nthreads)
 
 	if (nthreads > 1)
 	{
-		wp->threads = calloc(wp->nthreads, sizeof(pthread_t));
+		wp->sched = scheduler_acquire();
+		if (wp->sched == NULL)
+		{
+			zarray_destroy(wp->tasks);
+			free(wp);
+			return NULL;
+		}
 
 		pthread_mutex_init(&wp->mutex, NULL);
-		pthread_cond_init(&wp->startcond, NULL);
 		pthread_cond_init(&wp->endcond, NULL);
-
-		for (int i = 0; i < nthreads; i++)
-		{
-			int res = pthread_create(&wp->threads[i], NULL, worker_thread, wp);
-			if (res != 0)
-			{
-				debug_print("Insufficient system resources to create workerpool threads\n");
-				// errno already set to EAGAIN by pthread_create() failure
-				return NULL;
-			}
-		}
 	}
 
 	return wp;
@@ -137,23 +404,11 @@ void workerpool_destroy(workerpool_t *wp)
 	if (wp == NULL)
 		return;
 
-	// force all worker threads to exit.
-	if (wp->nthreads > 1)
+	if (wp->sched)
 	{
-		for (int i = 0; i < wp->nthreads; i++)
-			workerpool_add_task(wp, NULL, NULL);
-
-		pthread_mutex_lock(&wp->mutex);
-		pthread_cond_broadcast(&wp->startcond);
-		pthread_mutex_unlock(&wp->mutex);
-
-		for (int i = 0; i < wp->nthreads; i++)
-			pthread_join(wp->threads[i], NULL);
-
+		scheduler_release(wp->sched);
 		pthread_mutex_destroy(&wp->mutex);
-		pthread_cond_destroy(&wp->startcond);
 		pthread_cond_destroy(&wp->endcond);
-		free(wp->threads);
 	}
 
 	zarray_destroy(wp->tasks);
@@ -168,6 +423,7 @@ int workerpool_get_nthreads(workerpool_t *wp)
 void workerpool_add_task(workerpool_t *wp, void (*f)(void *p), void *p)
 {
 	struct task t;
+	memset(&t, 0, sizeof(t));
 	t.f = f;
 	t.p = p;
 
@@ -180,7 +436,10 @@ void workerpool_run_single(workerpool_t *wp)
 	{
 		struct task *task;
 		zarray_get_volatile(wp->tasks, i, &task);
-		task->f(task->p);
+		if (task->range_f)
+			task->range_f(task->p, task->i0, task->i1);
+		else
+			task->f(task->p);
 	}
 
 	zarray_clear(wp->tasks);
@@ -189,29 +448,94 @@ void workerpool_run_single(workerpool_t *wp)
 // runs all added tasks, waits for them to complete.
 void workerpool_run(workerpool_t *wp)
 {
-	if (wp->nthreads > 1)
+	int ntasks = zarray_size(wp->tasks);
+	int nactive = wp->sched ? (int)atomic_read(&wp->sched->nactive) : 0;
+
+	if (nactive == 0 || ntasks <= 1)
 	{
-		wp->end_count = 0;
+		workerpool_run_single(wp);
+		return;
+	}
 
-		pthread_mutex_lock(&wp->mutex);
-		pthread_cond_broadcast(&wp->startcond);
+	struct scheduler *sched = wp->sched;
+	struct task *tasks = (struct task *)wp->tasks->data;
+
+	for (int i = 0; i < ntasks; i++)
+		tasks[i].wp = wp;
+	atomic_add(&wp->remaining, ntasks);
+
+	// hand every active worker an equal, contiguous share.
+	for (int i = 0; i < nactive; i++)
+	{
+		int i0 = (int64_t)ntasks * i / nactive;
+		int i1 = (int64_t)ntasks * (i + 1) / nactive;
+		if (i1 > i0)
+			deque_push(&sched->deques[i], &tasks[i0], i1 - i0);
+	}
+
+	pthread_mutex_lock(&sched->mutex);
+	sched->epoch++;
+	if (sched->nsleeping > 0)
+		pthread_cond_broadcast(&sched->wakecond);
+	pthread_mutex_unlock(&sched->mutex);
+
+	// help with our own tasks instead of just waiting. Tasks of other
+	// pools are left to the workers so that this call returns as soon
+	// as its own work is done.
+	struct task task;
+	while (atomic_read(&wp->remaining) > 0)
+	{
+		int found = 0;
+		for (int i = 0; i < sched->nworkers && !found; i++)
+			found = deque_steal(&sched->deques[i], &task, wp);
 
-		while (wp->end_count < wp->nthreads)
+		if (found)
 		{
-			//            printf("caught %d\n", wp->end_count);
-			pthread_cond_wait(&wp->endcond, &wp->mutex);
+			run_task(&task);
+			continue;
 		}
 
+		pthread_mutex_lock(&wp->mutex);
+		while (atomic_read(&wp->remaining) > 0)
+			pthread_cond_wait(&wp->endcond, &wp->mutex);
 		pthread_mutex_unlock(&wp->mutex);
+	}
 
-		wp->taskspos = 0;
+	// wait for the worker that ran the last task to let go of the mutex.
+	pthread_mutex_lock(&wp->mutex);
+	pthread_mutex_unlock(&wp->mutex);
 
-		zarray_clear(wp->tasks);
-	}
-	else
+	zarray_clear(wp->tasks);
+}
+
+void workerpool_parallel_for(workerpool_t *wp, int n, int chunksize, void (*f)(void *p, int i0, int i1), void *p)
+{
+	assert(chunksize > 0);
+
+	for (int i = 0; i < n; i += chunksize)
 	{
-		workerpool_run_single(wp);
+		struct task t;
+		memset(&t, 0, sizeof(t));
+		t.range_f = f;
+		t.i0 = i;
+		t.i1 = n - i > chunksize ? i + chunksize : n;
+		t.p = p;
+
+		zarray_add(wp->tasks, &t);
 	}
+
+	workerpool_run(wp);
+}
+
+void workerpool_set_shared_workers(int nworkers)
+{
+	atomic_lock(&shared_sched_lock);
+
+	shared_workers_limit = nworkers;
+	if (shared_sched)
+		scheduler_set_active(shared_sched, nworkers);
+
+	atomic_unlock(&shared_sched_lock);
 }
 
 int workerpool_get_nprocs()
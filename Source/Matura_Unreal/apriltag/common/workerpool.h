@@ -31,8 +31,14 @@ either expressed or implied, of the Regents of The University of Michigan.
 
 typedef struct workerpool workerpool_t;
 
-// as a special case, if nthreads==1, no additional threads are
-// created, and workerpool_run will run synchronously.
+// All pools with nthreads > 1 run their tasks on one set of worker
+// threads shared by the whole process, sized to the number of
+// processors. nthreads is then only a hint for how finely callers
+// should split their work. Several pools may run at the same time from
+// different threads.
+//
+// as a special case, if nthreads==1, workerpool_run will run
+// synchronously.
 workerpool_t *workerpool_create(int nthreads);
 void workerpool_destroy(workerpool_t *wp);
 
@@ -41,9 +47,19 @@ void workerpool_add_task(workerpool_t *wp, void (*f)(void *p), void *p);
 // runs all added tasks, waits for them to complete.
 void workerpool_run(workerpool_t *wp);
 
+// calls f(p, i0, i1) for consecutive chunks [i0, i1) of [0, n), each at
+// most chunksize long, together with any tasks added before. Returns
+// when all of them are done.
+void workerpool_parallel_for(workerpool_t *wp, int n, int chunksize, void (*f)(void *p, int i0, int i1), void *p);
+
 // same as workerpool_run, except always single threaded. (mostly for debugging).
 void workerpool_run_single(workerpool_t *wp);
 
 int workerpool_get_nthreads(workerpool_t *wp);
 
+// limits how many of the shared worker threads run tasks, negative for
+// all of them. The threads calling workerpool_run always help with
+// their own tasks, with 0 every pool runs synchronously.
+void workerpool_set_shared_workers(int nworkers);
+
 int workerpool_get_nprocs();
@@ -0,0 +1,380 @@
+#if defined(__linux__)
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "async_io.h"
+
+using std::deque;
+using std::lock_guard;
+using std::mutex;
+using std::string;
+using serial::AsyncIO;
+using serial::AsyncIOStats;
+using serial::IOException;
+using serial::PortNotOpenedException;
+using serial::Serial;
+
+// epoll user data of the eventfd, port handles are never negative
+static const uint64_t wake_marker = ~uint64_t (0);
+
+// Lines longer than this are handed over in pieces
+static const size_t max_line_length = 4096;
+
+AsyncIO::AsyncIO ()
+  : epoll_fd_ (-1), wake_fd_ (-1), running_ (true), next_handle_ (0)
+{
+  epoll_fd_ = epoll_create1 (EPOLL_CLOEXEC);
+  if (epoll_fd_ == -1) {
+    THROW (IOException, errno);
+  }
+
+  wake_fd_ = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (wake_fd_ == -1) {
+    int error = errno;
+    ::close (epoll_fd_);
+    THROW (IOException, error);
+  }
+
+  epoll_event event = {};
+  event.events = EPOLLIN;
+  event.data.u64 = wake_marker;
+  if (epoll_ctl (epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &event) == -1) {
+    int error = errno;
+    ::close (wake_fd_);
+    ::close (epoll_fd_);
+    THROW (IOException, error);
+  }
+
+  thread_ = std::thread (&AsyncIO::run, this);
+}
+
+AsyncIO::~AsyncIO ()
+{
+  {
+    lock_guard<mutex> lock (mutex_);
+    running_ = false;
+  }
+
+  uint64_t one = 1;
+  ssize_t r = ::write (wake_fd_, &one, sizeof (one));
+  (void) r;
+
+  if (thread_.joinable ()) {
+    thread_.join ();
+  }
+
+  ::close (wake_fd_);
+  ::close (epoll_fd_);
+}
+
+AsyncIO &
+AsyncIO::shared ()
+{
+  static AsyncIO instance;
+  return instance;
+}
+
+int
+AsyncIO::add (Serial &serial_port, LineCallback on_line)
+{
+  int fd = serial_port.getFd ();
+  if (fd == -1) {
+    throw PortNotOpenedException ("AsyncIO::add");
+  }
+
+  lock_guard<mutex> lock (mutex_);
+
+  int handle = next_handle_++;
+
+  Port &port = ports_[handle];
+  port.handle = handle;
+  port.fd = fd;
+  port.waiting_writable = false;
+  port.offset = 0;
+  port.queued_bytes = 0;
+  port.on_line = on_line;
+  port.stats = AsyncIOStats ();
+  port.latency_sum_ms = 0;
+
+  epoll_event event = {};
+  event.events = EPOLLIN;
+  event.data.u64 = handle;
+  if (epoll_ctl (epoll_fd_, EPOLL_CTL_ADD, fd, &event) == -1) {
+    int error = errno;
+    ports_.erase (handle);
+    THROW (IOException, error);
+  }
+
+  return handle;
+}
+
+void
+AsyncIO::remove (int handle)
+{
+  {
+    lock_guard<mutex> lock (mutex_);
+
+    std::map<int, Port>::iterator it = ports_.find (handle);
+    if (it == ports_.end ()) {
+      return;
+    }
+
+    if (it->second.fd != -1) {
+      epoll_ctl (epoll_fd_, EPOLL_CTL_DEL, it->second.fd, NULL);
+    }
+    ports_.erase (it);
+  }
+
+  // The I/O thread holds this for a whole batch of events, so once we get it
+  // no callback of the removed port can still be running
+  lock_guard<mutex> wait_for_callbacks (callback_mutex_);
+}
+
+bool
+AsyncIO::write (int handle, const string &data, int key)
+{
+  lock_guard<mutex> lock (mutex_);
+
+  std::map<int, Port>::iterator it = ports_.find (handle);
+  if (it == ports_.end ()) {
+    return false;
+  }
+
+  Port &port = it->second;
+  if (port.fd == -1) {
+    port.stats.errors++;
+    return false;
+  }
+
+  if (key >= 0) {
+    // The front message may already be partially on the wire, it can't be replaced anymore
+    for (size_t i = port.offset == 0 ? 0 : 1; i < port.queue.size (); i++) {
+      Message &message = port.queue[i];
+      if (message.key == key) {
+        port.queued_bytes -= message.data.size ();
+        port.queued_bytes += data.size ();
+        message.data = data;
+        message.queued = clock::now ();
+        port.stats.messages_coalesced++;
+        return true;
+      }
+    }
+  }
+
+  Message message;
+  message.data = data;
+  message.key = key;
+  message.queued = clock::now ();
+
+  port.queue.push_back (message);
+  port.queued_bytes += data.size ();
+
+  // If there was something queued before, the I/O thread is already waiting to write it
+  if (port.queue.size () == 1) {
+    drain (port);
+  }
+
+  return true;
+}
+
+size_t
+AsyncIO::pending (int handle)
+{
+  lock_guard<mutex> lock (mutex_);
+
+  std::map<int, Port>::iterator it = ports_.find (handle);
+  return it == ports_.end () ? 0 : it->second.queued_bytes;
+}
+
+AsyncIOStats
+AsyncIO::getStats (int handle)
+{
+  lock_guard<mutex> lock (mutex_);
+
+  std::map<int, Port>::iterator it = ports_.find (handle);
+  if (it == ports_.end ()) {
+    return AsyncIOStats ();
+  }
+
+  AsyncIOStats stats = it->second.stats;
+  if (stats.messages_sent > 0) {
+    stats.mean_latency_ms = it->second.latency_sum_ms / stats.messages_sent;
+  }
+  return stats;
+}
+
+void
+AsyncIO::drain (Port &port)
+{
+  while (!port.queue.empty ()) {
+    Message &message = port.queue.front ();
+
+    ssize_t written = ::write (port.fd, message.data.data () + port.offset,
+                               message.data.size () - port.offset);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        watch (port, true);
+        return;
+      }
+
+      // Whatever is queued is stale by the time the port recovers, drop it
+      port.stats.errors++;
+      port.queue.clear ();
+      port.offset = 0;
+      port.queued_bytes = 0;
+      break;
+    }
+
+    port.offset += written;
+    port.queued_bytes -= written;
+    port.stats.bytes_written += written;
+
+    if (port.offset == message.data.size ()) {
+      double latency_ms = std::chrono::duration<double, std::milli> (clock::now () - message.queued).count ();
+      port.latency_sum_ms += latency_ms;
+      if (latency_ms > port.stats.max_latency_ms) {
+        port.stats.max_latency_ms = latency_ms;
+      }
+      port.stats.messages_sent++;
+
+      port.queue.pop_front ();
+      port.offset = 0;
+    }
+  }
+
+  watch (port, false);
+}
+
+void
+AsyncIO::receive (Port &port, deque<string> &lines)
+{
+  char buffer[256];
+
+  while (true) {
+    ssize_t received = ::read (port.fd, buffer, sizeof (buffer));
+    if (received < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        port.stats.errors++;
+      }
+      return;
+    }
+    if (received == 0) {
+      return;
+    }
+
+    for (ssize_t i = 0; i < received; i++) {
+      if (buffer[i] == '\n') {
+        if (!port.line.empty () && port.line[port.line.size () - 1] == '\r') {
+          port.line.resize (port.line.size () - 1);
+        }
+        lines.push_back (port.line);
+        port.line.clear ();
+      } else {
+        port.line += buffer[i];
+        if (port.line.size () >= max_line_length) {
+          lines.push_back (port.line);
+          port.line.clear ();
+        }
+      }
+    }
+  }
+}
+
+void
+AsyncIO::watch (Port &port, bool writable)
+{
+  if (port.waiting_writable == writable || port.fd == -1) {
+    return;
+  }
+
+  epoll_event event = {};
+  event.events = EPOLLIN | (writable ? uint32_t(EPOLLOUT) : 0u);
+  event.data.u64 = port.handle;
+  if (epoll_ctl (epoll_fd_, EPOLL_CTL_MOD, port.fd, &event) == 0) {
+    port.waiting_writable = writable;
+  } else {
+    port.stats.errors++;
+  }
+}
+
+void
+AsyncIO::run ()
+{
+  const int max_events = 16;
+  epoll_event events[max_events];
+
+  while (true) {
+    int count = epoll_wait (epoll_fd_, events, max_events, -1);
+    if (count < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return;
+    }
+
+    lock_guard<mutex> callback_lock (callback_mutex_);
+
+    for (int i = 0; i < count; i++) {
+      if (events[i].data.u64 == wake_marker) {
+        uint64_t value;
+        ssize_t r = ::read (wake_fd_, &value, sizeof (value));
+        (void) r;
+
+        lock_guard<mutex> lock (mutex_);
+        if (!running_) {
+          return;
+        }
+        continue;
+      }
+
+      deque<string> lines;
+      LineCallback on_line;
+
+      {
+        lock_guard<mutex> lock (mutex_);
+
+        std::map<int, Port>::iterator it = ports_.find (int (events[i].data.u64));
+        if (it == ports_.end () || it->second.fd == -1) {
+          continue; // removed while we were waiting
+        }
+        Port &port = it->second;
+
+        if (events[i].events & EPOLLIN) {
+          receive (port, lines);
+        }
+        if (events[i].events & EPOLLOUT) {
+          drain (port);
+        }
+        if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+          // Stop watching a dead port, otherwise epoll keeps reporting it forever
+          port.stats.errors++;
+          epoll_ctl (epoll_fd_, EPOLL_CTL_DEL, port.fd, NULL);
+          port.fd = -1;
+          port.queue.clear ();
+          port.offset = 0;
+          port.queued_bytes = 0;
+        }
+
+        port.stats.lines_received += lines.size ();
+        on_line = port.on_line;
+      }
+
+      if (on_line) {
+        for (size_t j = 0; j < lines.size (); j++) {
+          on_line (lines[j]);
+        }
+      }
+    }
+  }
+}
+
+#endif // defined(__linux__)
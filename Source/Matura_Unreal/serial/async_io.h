@@ -0,0 +1,185 @@
+/*!
+ * \file serial/async_io.h
+ *
+ * \section DESCRIPTION
+ *
+ * Event driven, non-blocking I/O for already opened serial ports. A single
+ * I/O thread built on epoll services any number of ports: writes are queued
+ * and drained whenever the port becomes writable, queued messages that have
+ * been superseded by a newer one can be replaced instead of sent, and incoming
+ * data is split into lines and handed to a callback.
+ *
+ * Only available on Linux.
+ */
+
+#if defined(__linux__)
+
+#ifndef SERIAL_ASYNC_IO_H
+#define SERIAL_ASYNC_IO_H
+
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "serial.h"
+
+namespace serial {
+
+/*!
+ * Counters kept per registered port, see serial::AsyncIO::getStats.
+ */
+struct AsyncIOStats {
+  /*! Messages that were completely written to the port. */
+  uint64_t messages_sent;
+  /*! Queued messages that were replaced by a newer one before being sent. */
+  uint64_t messages_coalesced;
+  /*! Total bytes written to the port. */
+  uint64_t bytes_written;
+  /*! Lines handed to the read callback. */
+  uint64_t lines_received;
+  /*! Failed reads or writes, the pending output is dropped on a write error. */
+  uint64_t errors;
+  /*! Mean time between queuing a message and its last byte being written. */
+  double mean_latency_ms;
+  /*! Largest time between queuing a message and its last byte being written. */
+  double max_latency_ms;
+};
+
+/*!
+ * Single thread epoll reactor servicing several serial ports.
+ *
+ * The ports stay owned by the caller and have to outlive their registration,
+ * call serial::AsyncIO::remove before closing them.
+ */
+class AsyncIO {
+public:
+  /*! Called on the I/O thread for every complete line, without the line end. */
+  typedef std::function<void (const std::string &line)> LineCallback;
+
+  /*! Creates the epoll instance and starts the I/O thread.
+   *
+   * \throw serial::IOException
+   */
+  AsyncIO ();
+
+  /*! Stops the I/O thread, pending writes are discarded. */
+  virtual ~AsyncIO ();
+
+  /*! Gets an instance that is shared by everything in the process, so all
+   * ports end up on the same I/O thread.
+   */
+  static AsyncIO &
+  shared ();
+
+  /*! Registers an open port with the reactor.
+   *
+   * \param port The port to service, it has to be open.
+   * \param on_line Optional callback for every line received from the port.
+   *
+   * \return A handle for the other calls.
+   *
+   * \throw serial::PortNotOpenedException
+   * \throw serial::IOException
+   */
+  int
+  add (Serial &port, LineCallback on_line = LineCallback ());
+
+  /*! Unregisters a port and drops its pending output.
+   *
+   * Once this returns the line callback of the port is not running and will
+   * not be called again, so it must not be called from inside that callback.
+   */
+  void
+  remove (int handle);
+
+  /*! Queues data to be written without blocking.
+   *
+   * If the queue is empty the data is written right away on the calling
+   * thread as far as the port accepts it, the rest is written by the I/O
+   * thread as soon as the port becomes writable again.
+   *
+   * \param handle The handle returned by serial::AsyncIO::add.
+   * \param data The bytes to send.
+   * \param key Messages queued with the same non-negative key supersede each
+   * other: a message that has not started transmitting yet is replaced in
+   * place instead of a second one being queued. A negative key never
+   * coalesces.
+   *
+   * \return false if the handle is unknown or the port failed.
+   */
+  bool
+  write (int handle, const std::string &data, int key = -1);
+
+  /*! Gets the number of bytes still waiting to be written. */
+  size_t
+  pending (int handle);
+
+  /*! Gets the counters of a port, all zero for an unknown handle. */
+  AsyncIOStats
+  getStats (int handle);
+
+private:
+  // Disable copy constructors
+  AsyncIO (const AsyncIO &);
+  AsyncIO &operator= (const AsyncIO &);
+
+  typedef std::chrono::steady_clock clock;
+
+  struct Message {
+    std::string data;
+    int key;
+    clock::time_point queued;
+  };
+
+  struct Port {
+    int handle;
+    int fd;                      // -1 once the port reported an error
+    bool waiting_writable;
+    std::deque<Message> queue;
+    size_t offset;               // bytes of queue.front () already written
+    size_t queued_bytes;
+    std::string line;            // incomplete line received so far
+    LineCallback on_line;
+    AsyncIOStats stats;
+    double latency_sum_ms;
+  };
+
+  void
+  run ();
+
+  // Writes as much of the queue as the port accepts, needs mutex_ held
+  void
+  drain (Port &port);
+
+  // Reads everything available and collects the complete lines, needs mutex_ held
+  void
+  receive (Port &port, std::deque<std::string> &lines);
+
+  // Enables or disables waking up for writability of the port, needs mutex_ held
+  void
+  watch (Port &port, bool writable);
+
+  int epoll_fd_;
+  int wake_fd_;                  // eventfd used to stop the I/O thread
+  bool running_;
+
+  int next_handle_;
+  std::map<int, Port> ports_;
+
+  // Guards ports_ and everything inside it
+  std::mutex mutex_;
+  // Held while line callbacks run, so remove can wait for them to finish
+  std::mutex callback_mutex_;
+
+  std::thread thread_;
+};
+
+} // namespace serial
+
+#endif // SERIAL_ASYNC_IO_H
+
+#endif // defined(__linux__)
@@ -100,6 +100,13 @@ bool Serial::isOpen() const
 	return pimpl_->isOpen();
 }
 
+#if !defined(_WIN32)
+int Serial::getFd() const
+{
+	return pimpl_->getFd();
+}
+#endif
+
 size_t
 Serial::available()
 {
@@ -211,6 +211,17 @@ public:
   bool
   isOpen () const;
 
+#if !defined(_WIN32)
+  /*! Gets the file descriptor of the open port, or -1 if it is closed.
+   *
+   * The descriptor is non-blocking and stays owned by the Serial object, it
+   * is meant for registering the port with an event loop such as
+   * serial::AsyncIO.
+   */
+  int
+  getFd () const;
+#endif
+
   /*! Closes the serial port. */
   void
   close ();